@@ -0,0 +1,588 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+// Microbenchmark of a shared secret cache backend (-b, the swiss one by
+// default), reporting the memory used per entry and the time taken per
+// operation. With -p, -f or -t it rather replays a sequence of client keys
+// against every eviction policy, with and without admission, and reports
+// the hit ratios. With -a it compares random keys with keys crafted to
+// collide. With -m it looks up keys from several threads at once, sharing
+// one cache if the backend can (the concurrent one), or with a cache each
+// otherwise. With -r it checks that resizing a full cache while keys are
+// added keeps all of those, and the newest of the entries it had.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "debug.h"
+#include "misc.h"
+
+static uint64_t bench_state = 0x2545f4914f6cdd1dULL;
+
+// xorshift64*, good enough for random looking public keys:
+static uint64_t bench_random() {
+	bench_state ^= bench_state >> 12;
+	bench_state ^= bench_state << 25;
+	bench_state ^= bench_state >> 27;
+	return bench_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void bench_keys(uint8_t *keys, int n) {
+	uint64_t word;
+	int i;
+
+	for (i = 0; i < (n * CACHE_KEY_SIZE) / 8; i++) {
+		word = bench_random();
+		memcpy(keys + (i * 8), &word, 8);
+	}
+}
+
+// Keys that all have the same unkeyed hash, as a client could craft them:
+// the last 64-bit word cancels the first three, when they are folded like
+// a^(b<<<16)^(c<<<32)^(d<<<48) (which the open addressing cache did before).
+static void bench_keys_colliding(uint8_t *keys, int n) {
+	uint64_t a, b, c, d;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		a = bench_random();
+		b = bench_random();
+		c = bench_random();
+		d = a ^ ((b << 16) | (b >> 48)) ^ ((c << 32) | (c >> 32));
+		d = (d >> 48) | (d << 16);
+		memcpy(keys + ((size_t) i * CACHE_KEY_SIZE), &a, 8);
+		memcpy(keys + ((size_t) i * CACHE_KEY_SIZE) + 8, &b, 8);
+		memcpy(keys + ((size_t) i * CACHE_KEY_SIZE) + 16, &c, 8);
+		memcpy(keys + ((size_t) i * CACHE_KEY_SIZE) + 24, &d, 8);
+	}
+}
+
+static double bench_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static int bench(char *name, int entries, int operations, int colliding) {
+	struct cache_table *table = NULL;
+	uint8_t *keys = NULL, *other = NULL, value[CACHE_VALUE_SIZE];
+	int *picks = NULL;
+	int i, hits, rejected;
+	double start, set, hit, miss, churn, memory;
+
+	keys = (uint8_t *) malloc((size_t) entries * CACHE_KEY_SIZE);
+	other = (uint8_t *) malloc((size_t) operations * CACHE_KEY_SIZE);
+	picks = (int *) malloc(operations * sizeof(int));
+	if (!keys || !other || !picks)
+		goto wrong;
+	if (colliding) {
+		bench_keys_colliding(keys, entries);
+		bench_keys_colliding(other, operations);
+	} else {
+		bench_keys(keys, entries);
+		bench_keys(other, operations);
+	}
+	for (i = 0; i < operations; i++)
+		picks[i] = bench_random() % entries;
+	memset(value, 0x42, sizeof(value));
+
+	table = cache_init(entries);
+	if (!table)
+		goto wrong;
+
+	// Filling the cache:
+	start = bench_now();
+	for (i = 0; i < entries; i++)
+		cache_set(table, keys + ((size_t) i * CACHE_KEY_SIZE), value);
+	set = (bench_now() - start) / entries;
+	memory = (double) cache_memory(table) / entries;
+
+	// Lookups of cached keys:
+	hits = 0;
+	start = bench_now();
+	for (i = 0; i < operations; i++)
+		if (cache_get(table, keys + ((size_t) picks[i] * CACHE_KEY_SIZE)))
+			hits++;
+	hit = (bench_now() - start) / operations;
+	if (hits != operations)
+		fprintf(stderr, "%s: only %d of %d cached keys found\n", name, hits, operations);
+
+	// Lookups of keys that are not cached:
+	start = bench_now();
+	for (i = 0; i < operations; i++)
+		if (cache_get(table, other + ((size_t) i * CACHE_KEY_SIZE)))
+			hits++;
+	miss = (bench_now() - start) / operations;
+
+	// Adding new keys to a full cache: each one pushes an entry out, unless
+	// admission rejects it (which most of them are, as they were never seen
+	// before), so those are counted apart:
+	rejected = 0;
+	start = bench_now();
+	for (i = 0; i < operations; i++)
+		if (cache_set(table, other + ((size_t) i * CACHE_KEY_SIZE), value) == 2)
+			rejected++;
+	churn = (bench_now() - start) / operations;
+
+	printf("%s: %9d %s: %6.1f bytes per entry, set %8.1f ns, hit %8.1f ns, miss %8.1f ns, churn %8.1f ns (%5.1f%% rejected)\n",
+			name, entries, colliding ? "colliding" : "entries  ", memory, set * 1e9, hit * 1e9, miss * 1e9, churn * 1e9,
+			(100.0 * rejected) / operations);
+
+	cache_destroy(table);
+	free(keys);
+	free(other);
+	free(picks);
+	return 1;
+
+wrong:
+	fprintf(stderr, "%s: unable to set up a cache of %d entries\n", name, entries);
+	cache_destroy(table);
+	free(keys);
+	free(other);
+	free(picks);
+	return 0;
+}
+
+struct bench_thread {
+	pthread_t thread;
+	struct cache_table *table;
+	uint8_t *keys;
+	int entries, operations, hits;
+	uint64_t state;
+};
+
+// Looks up cached keys, and adds a new key every 64 lookups, as a miss
+// would. Every 1024 lookups it passes a quiescent state, like a worker
+// does every loop iteration:
+static void *bench_thread(void *arg) {
+	struct bench_thread *thread = (struct bench_thread *) arg;
+	uint8_t key[CACHE_KEY_SIZE], value[CACHE_VALUE_SIZE];
+	uint64_t r;
+	int i, j;
+
+	memset(value, 0x42, sizeof(value));
+	for (i = 0; i < thread->operations; i++) {
+		if (!(i % 1024))
+			cache_thread_online();
+		thread->state ^= thread->state >> 12;
+		thread->state ^= thread->state << 25;
+		thread->state ^= thread->state >> 27;
+		r = thread->state * 0x2545f4914f6cdd1dULL;
+		if (!(i % 64)) {
+			for (j = 0; j < CACHE_KEY_SIZE; j += 8) {
+				memcpy(key + j, &r, 8);
+				r = (r * 0x9e3779b97f4a7c15ULL) + i;
+			}
+			cache_set(thread->table, key, value);
+			continue;
+		}
+		if (cache_get(thread->table, thread->keys + ((r % thread->entries) * CACHE_KEY_SIZE)))
+			thread->hits++;
+	}
+	cache_thread_offline();
+
+	return NULL;
+}
+
+static int bench_threads(char *name, int maxthreads, int entries, int operations) {
+	struct bench_thread *threads = NULL;
+	struct cache_table *shared;
+	uint8_t *keys = NULL, value[CACHE_VALUE_SIZE];
+	int i, j, n, hits;
+	double start, elapsed, rate;
+
+	keys = (uint8_t *) malloc((size_t) entries * CACHE_KEY_SIZE);
+	threads = (struct bench_thread *) calloc(maxthreads, sizeof(struct bench_thread));
+	if (!keys || !threads)
+		goto wrong;
+	bench_keys(keys, entries);
+	memset(value, 0x42, sizeof(value));
+
+	// 1, 2, 4, ... threads, up to maxthreads:
+	for (n = 1; ; n = ((n * 2) < maxthreads) ? (n * 2) : maxthreads) {
+		shared = NULL;
+		for (i = 0; i < n; i++) {
+			threads[i].table = shared ? cache_attach(shared) : cache_init(entries);
+			if (!threads[i].table) {
+				for (j = 0; j < i; j++)
+					cache_destroy(threads[j].table);
+				goto wrong;
+			}
+			if (!shared) {
+				for (j = 0; j < entries; j++)
+					cache_set(threads[i].table, keys + ((size_t) j * CACHE_KEY_SIZE), value);
+				shared = cache_attach(threads[i].table);
+			}
+			threads[i].keys = keys;
+			threads[i].entries = entries;
+			threads[i].operations = operations;
+			threads[i].hits = 0;
+			threads[i].state = bench_random() | 1;
+		}
+		cache_thread_offline();
+
+		start = bench_now();
+		for (i = 0; i < n; i++)
+			if (pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]) != 0)
+				break;
+		for (j = 0; j < i; j++)
+			pthread_join(threads[j].thread, NULL);
+		elapsed = bench_now() - start;
+
+		hits = 0;
+		for (j = 0; j < n; j++)
+			hits += threads[j].hits;
+		rate = ((double) i * operations) / elapsed;
+		printf("%s: %9d entries, %2d threads, %s: %7.2f M operations/s (%6.2f per thread), %.1f%% hits\n",
+				name, entries, i, shared ? "one shared cache" : "a cache each  ", rate / 1e6, rate / (i * 1e6),
+				(100.0 * hits) / ((double) i * (operations - ((operations + 63) / 64))));
+
+		for (j = 0; j < n; j++)
+			cache_destroy(threads[j].table);
+		cache_destroy(shared);
+		if (i < n)
+			goto wrong;
+		if (n == maxthreads)
+			break;
+	}
+
+	free(keys);
+	free(threads);
+	return 1;
+
+wrong:
+	fprintf(stderr, "%s: unable to run %d threads on a cache of %d entries\n", name, maxthreads, entries);
+	free(keys);
+	free(threads);
+	return 0;
+}
+
+// Looks up every key of the sequence, and adds it on a miss, like
+// dnscurve_get_shared_secret() does:
+static int bench_replay(char *name, uint8_t *keys, int *picks, int n, int entries) {
+	int policies[] = { CACHE_POLICY_FIFO, CACHE_POLICY_CLOCK };
+	struct cache_table *table = NULL;
+	uint8_t value[CACHE_VALUE_SIZE], *key;
+	int i, j, hits, admission;
+
+	memset(value, 0x42, sizeof(value));
+	for (admission = 0; admission < 2; admission++) {
+		for (i = 0; i < (int) (sizeof(policies) / sizeof(int)); i++) {
+			global_cache_policy = policies[i];
+			global_cache_admission = admission;
+			table = cache_init(entries);
+			if (!table) {
+				printf("%s: %9d entries, %d lookups: %-5s%-8s not supported\n", name, entries, n,
+						(policies[i] == CACHE_POLICY_CLOCK) ? "clock" : "fifo", admission ? "+tinylfu" : "");
+				continue;
+			}
+
+			hits = 0;
+			for (j = 0; j < n; j++) {
+				key = keys + ((size_t) picks[j] * CACHE_KEY_SIZE);
+				if (cache_get(table, key))
+					hits++;
+				else
+					cache_set(table, key, value);
+			}
+
+			printf("%s: %9d entries, %d lookups: %-5s%-8s %6.2f%% hits\n", name, entries, n,
+					(policies[i] == CACHE_POLICY_CLOCK) ? "clock" : "fifo", admission ? "+tinylfu" : "", (100.0 * hits) / n);
+			cache_destroy(table);
+		}
+	}
+
+	return 1;
+}
+
+// Fills a cache and looks up all of its keys, then resizes it while added
+// keys are new ones: all of them should be kept, next to the newest of the
+// old ones that still fit:
+static int bench_resize(char *name, int entries, int to, int added) {
+	int policies[] = { CACHE_POLICY_FIFO, CACHE_POLICY_CLOCK };
+	struct cache_table *table = NULL;
+	uint8_t *keys = NULL, value[CACHE_VALUE_SIZE];
+	int i, j, kept, lost, stale, result = 1;
+
+	keys = (uint8_t *) malloc((size_t) (entries + added) * CACHE_KEY_SIZE);
+	if (!keys)
+		goto wrong;
+	memset(value, 0x42, sizeof(value));
+
+	for (i = 0; i < (int) (sizeof(policies) / sizeof(int)); i++) {
+		global_cache_policy = policies[i];
+		global_cache_admission = 0;
+		bench_keys(keys, entries + added);
+		table = cache_init(entries);
+		if (!table)
+			goto wrong;
+		for (j = 0; j < entries; j++)
+			cache_set(table, keys + ((size_t) j * CACHE_KEY_SIZE), value);
+		for (j = 0; j < entries; j++)
+			cache_get(table, keys + ((size_t) j * CACHE_KEY_SIZE));
+
+		if (!cache_resize(table, to)) {
+			printf("%s: resizing not supported\n", name);
+			cache_destroy(table);
+			free(keys);
+			return 1;
+		}
+		for (j = entries; j < (entries + added); j++) {
+			cache_set(table, keys + ((size_t) j * CACHE_KEY_SIZE), value);
+			cache_resize_step(table, 1);
+		}
+		while (cache_resize_step(table, 64));
+
+		// The old keys from kept on should be there, the ones before not:
+		kept = (entries < (to - added)) ? entries : (to - added);
+		lost = stale = 0;
+		for (j = 0; j < (entries + added); j++) {
+			if (!cache_get(table, keys + ((size_t) j * CACHE_KEY_SIZE))) {
+				if (j >= (entries - kept))
+					lost++;
+			} else if (j < (entries - kept)) {
+				stale++;
+			}
+		}
+
+		printf("%s: %d to %d entries, %d added: %-5s %d lost, %d stale\n", name, entries, to, added,
+				(policies[i] == CACHE_POLICY_CLOCK) ? "clock" : "fifo", lost, stale);
+		if (lost || stale)
+			result = 0;
+		cache_destroy(table);
+	}
+
+	free(keys);
+	return result;
+
+wrong:
+	fprintf(stderr, "%s: unable to resize a cache of %d entries\n", name, entries);
+	free(keys);
+	return 0;
+}
+
+// Clients with a Zipf-like popularity (exponent 1), ten times as many as
+// fit in the cache. With flood, every other lookup is of a new key, that
+// is never seen again:
+static int bench_zipf(char *name, int entries, int operations, int flood) {
+	uint8_t *keys = NULL;
+	double *cdf = NULL, sum = 0;
+	int *picks = NULL;
+	int clients = entries * 10, i, low, high, mid, result = 0;
+	double r;
+
+	keys = (uint8_t *) malloc(((size_t) clients + (flood ? operations : 0)) * CACHE_KEY_SIZE);
+	cdf = (double *) malloc(clients * sizeof(double));
+	picks = (int *) malloc(operations * sizeof(int));
+	if (!keys || !cdf || !picks)
+		goto wrong;
+	bench_keys(keys, clients + (flood ? operations : 0));
+
+	for (i = 0; i < clients; i++) {
+		sum += 1.0 / (i + 1);
+		cdf[i] = sum;
+	}
+	for (i = 0; i < operations; i++) {
+		if (flood && (i & 1)) {
+			picks[i] = clients + i;
+			continue;
+		}
+		r = ((bench_random() >> 11) * (1.0 / 9007199254740992.0)) * sum;
+		low = 0;
+		high = clients - 1;
+		while (low < high) {
+			mid = (low + high) / 2;
+			if (cdf[mid] < r)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		picks[i] = low;
+	}
+
+	result = bench_replay(name, keys, picks, operations, entries);
+
+wrong:
+	if (!result)
+		fprintf(stderr, "%s: unable to replay %d lookups\n", name, operations);
+	free(keys);
+	free(cdf);
+	free(picks);
+	return result;
+}
+
+// A trace has a client public key in hex on every line:
+static int bench_trace(char *name, char *path, int entries) {
+	FILE *f = NULL;
+	char line[256];
+	uint8_t *keys = NULL, *tmpkeys;
+	int *picks = NULL, *tmppicks;
+	int n = 0, size = 0, i, result = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		goto wrong;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (strlen(line) < (CACHE_KEY_SIZE * 2))
+			continue;
+		if (n == size) {
+			size = size ? (size * 2) : 65536;
+			tmpkeys = (uint8_t *) realloc(keys, (size_t) size * CACHE_KEY_SIZE);
+			if (!tmpkeys)
+				goto wrong;
+			keys = tmpkeys;
+			tmppicks = (int *) realloc(picks, size * sizeof(int));
+			if (!tmppicks)
+				goto wrong;
+			picks = tmppicks;
+		}
+		for (i = 0; i < CACHE_KEY_SIZE; i++)
+			if (sscanf(line + (i * 2), "%2hhx", &keys[((size_t) n * CACHE_KEY_SIZE) + i]) != 1)
+				break;
+		if (i < CACHE_KEY_SIZE)
+			continue;
+		picks[n] = n;
+		n++;
+	}
+
+	if (n)
+		result = bench_replay(name, keys, picks, n, entries);
+
+wrong:
+	if (!result)
+		fprintf(stderr, "%s: unable to replay trace %s\n", name, path);
+	if (f)
+		fclose(f);
+	free(keys);
+	free(picks);
+	return result;
+}
+
+int main(int argc, char *argv[]) {
+	int sizes[] = { 10000, 1000000, 10000000 };
+	int operations = 100000, entries = 5000, threads, to, added, i;
+	char *program = argv[0], *name;
+
+	if (!misc_crypto_random_init())
+		return 1;
+
+	if ((argc > 1) && !strcmp(argv[1], "-b")) {
+		if ((argc < 3) || !cache_backend_select(argv[2]))
+			goto usage;
+		argv += 2;
+		argc -= 2;
+	}
+	name = (char *) cache_backend->name;
+
+	if ((argc > 1) && !strcmp(argv[1], "-a")) {
+		if (argc > 2)
+			entries = atoi(argv[2]);
+		if (argc > 3)
+			operations = atoi(argv[3]);
+		if ((argc > 4) || (entries < 1) || (operations < 1))
+			goto usage;
+		return !(bench(name, entries, operations, 0) && bench(name, entries, operations, 1));
+	}
+
+	if ((argc > 1) && (!strcmp(argv[1], "-p") || !strcmp(argv[1], "-f"))) {
+		if (argc > 2)
+			entries = atoi(argv[2]);
+		operations = (argc > 3) ? atoi(argv[3]) : (entries * 20);
+		if ((argc > 4) || (entries < 1) || (operations < 1))
+			goto usage;
+		return !bench_zipf(name, entries, operations, argv[1][1] == 'f');
+	}
+
+	if ((argc > 1) && !strcmp(argv[1], "-m")) {
+		threads = (argc > 2) ? atoi(argv[2]) : 8;
+		entries = (argc > 3) ? atoi(argv[3]) : 100000;
+		operations = (argc > 4) ? atoi(argv[4]) : 1000000;
+		if ((argc > 5) || (threads < 1) || (entries < 1) || (operations < 1))
+			goto usage;
+		return !bench_threads(name, threads, entries, operations);
+	}
+
+	if ((argc > 1) && !strcmp(argv[1], "-r")) {
+		entries = (argc > 2) ? atoi(argv[2]) : 500;
+		to = (argc > 3) ? atoi(argv[3]) : 300;
+		added = (argc > 4) ? atoi(argv[4]) : 100;
+		if ((argc > 5) || (entries < 1) || (to < 1) || (added < 0) || (added > to))
+			goto usage;
+		return !bench_resize(name, entries, to, added);
+	}
+
+	if ((argc > 1) && !strcmp(argv[1], "-t")) {
+		if (argc > 3)
+			entries = atoi(argv[3]);
+		if ((argc < 3) || (argc > 4) || (entries < 1))
+			goto usage;
+		return !bench_trace(name, argv[2], entries);
+	}
+
+	if ((argc > 3) || ((argc > 1) && (atoi(argv[1]) < 1)) || ((argc > 2) && (atoi(argv[2]) < 1)))
+		goto usage;
+	if (argc > 2)
+		operations = atoi(argv[2]);
+
+	if (argc > 1)
+		return !bench(name, atoi(argv[1]), operations, 0);
+
+	for (i = 0; i < (int) (sizeof(sizes) / sizeof(int)); i++)
+		if (!bench(name, sizes[i], operations, 0))
+			return 1;
+
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-b <backend>] [entries [operations]]\n", program);
+	fprintf(stderr, "       %s [-b <backend>] -a [entries [operations]]\n", program);
+	fprintf(stderr, "       %s [-b <backend>] -p|-f [entries [lookups]]\n", program);
+	fprintf(stderr, "       %s [-b <backend>] -t <trace> [entries]\n", program);
+	fprintf(stderr, "       %s [-b <backend>] -m [threads [entries [operations]]]\n", program);
+	fprintf(stderr, "       %s [-b <backend>] -r [entries [to [added]]]\n", program);
+	fprintf(stderr, "Backends:");
+	for (i = 0; cache_backends[i]; i++)
+		fprintf(stderr, " %s", cache_backends[i]->name);
+	fprintf(stderr, "\n");
+	return 1;
+}
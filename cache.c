@@ -0,0 +1,127 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#include "cache.h"
+
+const struct cache_backend *cache_backends[] = {
+	&cache_backend_swiss,
+	&cache_backend_hashtable,
+	&cache_backend_concurrent,
+	&cache_backend_critbit,
+	NULL
+};
+
+const struct cache_backend *cache_backend = &cache_backend_swiss;
+int global_cache_policy = CACHE_POLICY_CLOCK;
+int global_cache_admission = 1;
+
+int cache_backend_select(const char *name) {
+	int i;
+
+	for (i = 0; cache_backends[i]; i++) {
+		if (!strcmp(cache_backends[i]->name, name)) {
+			cache_backend = cache_backends[i];
+			global_cache_policy = cache_backend->policy;
+			global_cache_admission = cache_backend->admission;
+			return 1;
+		}
+	}
+
+	debug_log(DEBUG_ERROR, "cache_backend_select(): there is no cache backend called %s\n", name);
+	return 0;
+}
+
+void cache_stats(struct cache_table *table) {
+	cache_backend->stats(table);
+}
+
+struct cache_table *cache_init(int nrentries) {
+	return cache_backend->init(nrentries);
+}
+
+uint8_t *cache_get(struct cache_table *table, uint8_t *key) {
+	return cache_backend->get(table, key);
+}
+
+int cache_set(struct cache_table *table, uint8_t *key, uint8_t *value) {
+	return cache_backend->set(table, key, value);
+}
+
+int cache_empty(struct cache_table *table) {
+	return cache_backend->empty(table);
+}
+
+int cache_destroy(struct cache_table *table) {
+	return cache_backend->destroy(table);
+}
+
+int cache_iterate(struct cache_table *table, int (*fn)(uint8_t *, uint8_t *, void *), void *arg) {
+	return cache_backend->iterate(table, fn, arg);
+}
+
+size_t cache_memory(struct cache_table *table) {
+	return cache_backend->memory(table);
+}
+
+int cache_resize(struct cache_table *table, int nrentries) {
+	if (!cache_backend->resize) {
+		debug_log(DEBUG_ERROR, "cache_resize(): resizing is not supported by the %s backend\n", cache_backend->name);
+		return 0;
+	}
+	return cache_backend->resize(table, nrentries);
+}
+
+int cache_resize_step(struct cache_table *table, int count) {
+	if (!cache_backend->resize_step)
+		return 0;
+	return cache_backend->resize_step(table, count);
+}
+
+struct cache_table *cache_attach(struct cache_table *table) {
+	if (!cache_backend->attach)
+		return NULL;
+	return cache_backend->attach(table);
+}
+
+void cache_thread_online() {
+	if (cache_backend->thread_online)
+		cache_backend->thread_online();
+}
+
+void cache_thread_offline() {
+	if (cache_backend->thread_offline)
+		cache_backend->thread_offline();
+}
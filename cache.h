@@ -0,0 +1,180 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crypto_box_curve25519xsalsa20poly1305.h"
+#include "debug.h"
+
+// The cache mechanism isn't really general, it is focused
+// on the public key client -> shared key fetching.
+//
+// Every cache backend (cache_*.c) fills in a struct cache_backend, the
+// functions below call the one selected at startup (cache_backend_select()).
+
+#define	CACHE_KEY_SIZE		crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES
+#define	CACHE_VALUE_SIZE	crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES
+
+// Which entry is pushed out when the cache is full:
+#define CACHE_POLICY_FIFO	0		// the oldest one
+#define CACHE_POLICY_CLOCK	1		// the oldest one not looked up since the last round
+
+// With admission, a new key only pushes an entry out when it was looked up
+// more often recently (TinyLFU), cache_set() returns 2 when it was not added.
+
+// Defined by the backend:
+struct cache_table;
+
+// The optional functions (resizing and sharing a table between threads)
+// are NULL when the backend does not support them:
+struct cache_backend {
+	const char *name;
+	int policy;						// default eviction policy
+	int admission;					// default admission
+	struct cache_table *(*init)(int);
+	uint8_t *(*get)(struct cache_table *, uint8_t *);
+	int (*set)(struct cache_table *, uint8_t *, uint8_t *);
+	int (*empty)(struct cache_table *);
+	int (*destroy)(struct cache_table *);
+	int (*iterate)(struct cache_table *, int (*)(uint8_t *, uint8_t *, void *), void *);
+	void (*stats)(struct cache_table *);
+	size_t (*memory)(struct cache_table *);		// bytes allocated for the table
+	int (*resize)(struct cache_table *, int);
+	int (*resize_step)(struct cache_table *, int);
+	struct cache_table *(*attach)(struct cache_table *);
+	void (*thread_online)();
+	void (*thread_offline)();
+};
+
+extern const struct cache_backend cache_backend_swiss;
+extern const struct cache_backend cache_backend_hashtable;
+extern const struct cache_backend cache_backend_concurrent;
+extern const struct cache_backend cache_backend_critbit;
+extern const struct cache_backend *cache_backends[];
+
+// The default is the swiss one, selecting another one (by name) also sets
+// global_cache_policy and global_cache_admission to its defaults. It must
+// be done before the first cache_init():
+extern const struct cache_backend *cache_backend;
+extern int cache_backend_select(const char *);
+
+extern __thread struct cache_table *dnscurve_cache;
+extern int global_cache_policy;
+extern int global_cache_admission;
+
+extern void cache_stats(struct cache_table *);
+extern struct cache_table *cache_init(int);
+extern uint8_t *cache_get(struct cache_table *, uint8_t *);
+extern int cache_set(struct cache_table *, uint8_t *, uint8_t *);
+extern int cache_empty(struct cache_table *);
+extern int cache_destroy(struct cache_table *);
+extern int cache_iterate(struct cache_table *, int (*)(uint8_t *, uint8_t *, void *), void *);
+extern size_t cache_memory(struct cache_table *);
+
+// Resizing moves the entries over a few at a time: cache_resize() starts it,
+// and cache_resize_step() should then be called until it returns 0. Lookups
+// and additions may be done in between:
+extern int cache_resize(struct cache_table *, int);
+extern int cache_resize_step(struct cache_table *, int);
+
+// Only the concurrent backend can be used by several threads at once: there
+// cache_attach() hands out another reference to a table (which is freed by
+// the last cache_destroy()), the other backends return NULL. A pointer
+// returned by cache_get() stays valid until the thread calls
+// cache_thread_online() or cache_thread_offline(); the latter tells that
+// it will not look at the cache for a while (such as before it blocks).
+extern struct cache_table *cache_attach(struct cache_table *);
+extern void cache_thread_online();
+extern void cache_thread_offline();
+
+/* snapshot stuff (cache_snapshot.c) */
+#define CACHE_SNAPSHOT_VERSION	1
+
+// A snapshot file starts with this header, followed by count entries of
+// a key and its value, oldest first:
+struct cache_snapshot_header {
+	uint8_t magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint8_t publickey[32];			// the server key the shared secrets belong to
+};
+
+// The entries of a table, as taken for a snapshot:
+struct cache_snapshot {
+	uint8_t *entries;				// count entries of a key and its value
+	uint32_t count, size;
+};
+
+extern char *global_cache_snapshot;
+extern double global_cache_snapshot_interval;
+extern int cache_snapshot_take(struct cache_table *, struct cache_snapshot *);
+extern int cache_snapshot_save(struct cache_snapshot *, const char *, const uint8_t *);
+extern void cache_snapshot_free(struct cache_snapshot *);
+extern int cache_snapshot_write(struct cache_table *, const char *, const uint8_t *);
+extern int cache_snapshot_read(struct cache_table *, const char *, const uint8_t *, int);
+
+/* shared memory stuff (cache_shm.c) */
+extern int global_cache_shm;
+extern int cache_shm_init(const uint8_t *, const uint8_t *);
+extern int cache_shm_get(uint8_t *, uint8_t *);
+extern int cache_shm_set(uint8_t *, uint8_t *);
+extern void cache_shm_stats();
+
+/* pinned stuff (cache_pinned.c) */
+#define CACHE_PINNED_VERSION	1
+
+// A table of precomputed shared secrets (see curvedns-precompute.c) starts
+// with this header, followed by count entries of a key and its value,
+// sorted by key:
+struct cache_pinned_header {
+	uint8_t magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint8_t publickey[32];			// the server key the shared secrets belong to
+};
+
+extern uint32_t cache_pinned_write(const char *, const uint8_t *, uint8_t *, uint32_t);
+extern int cache_pinned_init(const char *, const uint8_t *);
+extern uint8_t *cache_pinned_get(uint8_t *);
+extern void cache_pinned_stats(int);
+
+#endif /* CACHE_H_ */
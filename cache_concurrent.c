@@ -0,0 +1,571 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#include <pthread.h>
+
+#include "cache_concurrent.h"
+#include "misc.h"
+
+#define CACHE_MAX_ENTRIES	(1 << 28)
+
+// Every thread that uses a cache has a slot here, in which it publishes
+// the epoch it last saw (0 while it is offline). An entry that was pushed
+// out in epoch e can be freed once every thread is offline or has seen an
+// epoch after e: from then on, no thread can still be using it.
+struct cache_thread {
+	uint64_t epoch;
+	int used;
+	int nrretired;
+	struct cache_entry *retired;	// pushed out by this thread, not freed yet
+	uint8_t pad[64 - (2 * sizeof(uint64_t)) - sizeof(struct cache_entry *)];
+};
+
+static struct cache_thread cache_threads[CACHE_MAX_THREADS] __attribute__((aligned(64)));
+static int cache_nrthreads = 0;		// slots ever used
+static uint64_t cache_epoch = 1;
+static struct cache_entry *cache_orphans = NULL;	// left behind by threads that are gone
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static __thread struct cache_thread *cache_self = NULL;
+static __thread int cache_self_index = 0;
+
+// The key is a public key chosen by the client, so it is hashed with a
+// random key of the table (SipHash). The top 8 bits are the tag, the
+// lowest bits select the first set a key can be in, the bits from 24 on
+// its second set. With two choices the sets fill up far more evenly.
+static inline uint64_t cache_hash(struct cache_table *table, uint8_t *key) {
+	return misc_siphash(table->hashkey, key);
+}
+
+#define CACHE_HASH_TAG(hash)	((uint8_t) ((hash) >> 56))
+
+static inline struct cache_set *cache_set_of(struct cache_table *table, uint64_t hash, int choice) {
+	uint32_t first = hash & table->setmask, second;
+
+	if (!choice)
+		return &table->sets[first];
+	second = (hash >> 24) & table->setmask;
+	if (second == first)
+		second ^= 1;
+	return &table->sets[second];
+}
+
+// Only the thread itself writes its counters, but cache_concurrent_stats() may read
+// them at any time:
+#define CACHE_COUNT(table, counter) \
+	__atomic_store_n(&(table)->counters[cache_self_index].counter, (table)->counters[cache_self_index].counter + 1, __ATOMIC_RELAXED)
+
+static void *cache_alloc(size_t size) {
+	void *ptr = NULL;
+
+	if (posix_memalign(&ptr, 64, size))
+		return NULL;
+	return ptr;
+}
+
+static void cache_entry_free(struct cache_entry *entry) {
+	memset(entry, 0, sizeof(struct cache_entry));
+	free(entry);
+}
+
+// When a thread ends, its entries that could not be freed yet are handed
+// to the threads that are left:
+static void cache_thread_exit(void *arg) {
+	struct cache_thread *self = (struct cache_thread *) arg;
+	struct cache_entry *last;
+
+	__atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+	if (self->retired) {
+		for (last = self->retired; last->next; last = last->next);
+		do {
+			last->next = __atomic_load_n(&cache_orphans, __ATOMIC_ACQUIRE);
+		} while (!__atomic_compare_exchange_n(&cache_orphans, &last->next, self->retired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	}
+	self->retired = NULL;
+	self->nrretired = 0;
+	__atomic_store_n(&self->used, 0, __ATOMIC_RELEASE);
+}
+
+static void cache_thread_key() {
+	pthread_key_create(&cache_key, cache_thread_exit);
+}
+
+static int cache_thread_register() {
+	int i, nrthreads;
+
+	pthread_once(&cache_once, cache_thread_key);
+	for (i = 0; i < CACHE_MAX_THREADS; i++) {
+		if (__atomic_load_n(&cache_threads[i].used, __ATOMIC_RELAXED))
+			continue;
+		if (!__sync_bool_compare_and_swap(&cache_threads[i].used, 0, 1))
+			continue;
+
+		cache_self = &cache_threads[i];
+		cache_self_index = i;
+		pthread_setspecific(cache_key, cache_self);
+		do {
+			nrthreads = __atomic_load_n(&cache_nrthreads, __ATOMIC_RELAXED);
+		} while ((nrthreads <= i) && !__sync_bool_compare_and_swap(&cache_nrthreads, nrthreads, i + 1));
+		return 1;
+	}
+
+	debug_log(DEBUG_ERROR, "cache_thread_register(): more than %d threads use the cache\n", CACHE_MAX_THREADS);
+	return 0;
+}
+
+// Frees the entries this thread pushed out that no thread can be using
+// anymore (called right after it published a new epoch):
+static void cache_reclaim() {
+	struct cache_entry *entry, **prev;
+	uint64_t oldest = UINT64_MAX, epoch;
+	int i, nrthreads;
+
+	if (__atomic_load_n(&cache_orphans, __ATOMIC_RELAXED)) {
+		entry = __atomic_exchange_n(&cache_orphans, NULL, __ATOMIC_ACQ_REL);
+		for (prev = &cache_self->retired; *prev; prev = &(*prev)->next);
+		for (*prev = entry; entry; entry = entry->next)
+			cache_self->nrretired++;
+	}
+
+	nrthreads = __atomic_load_n(&cache_nrthreads, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nrthreads; i++) {
+		epoch = __atomic_load_n(&cache_threads[i].epoch, __ATOMIC_SEQ_CST);
+		if (epoch && (epoch < oldest))
+			oldest = epoch;
+	}
+
+	prev = &cache_self->retired;
+	while ((entry = *prev)) {
+		if (entry->epoch < oldest) {
+			*prev = entry->next;
+			cache_entry_free(entry);
+			cache_self->nrretired--;
+		} else {
+			prev = &entry->next;
+		}
+	}
+}
+
+// The entry was just taken out of its set by this thread:
+static void cache_retire(struct cache_entry *entry) {
+	entry->epoch = __atomic_fetch_add(&cache_epoch, 1, __ATOMIC_SEQ_CST);
+	entry->next = cache_self->retired;
+	cache_self->retired = entry;
+	cache_self->nrretired++;
+}
+
+static void cache_concurrent_thread_online() {
+	if (!cache_self && !cache_thread_register())
+		return;
+
+	// Readers must be visible before they look at any set:
+	__atomic_store_n(&cache_self->epoch, __atomic_load_n(&cache_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (cache_self->retired)
+		cache_reclaim();
+}
+
+static void cache_concurrent_thread_offline() {
+	if (cache_self)
+		__atomic_store_n(&cache_self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Threads that did not say they are online yet, are made so:
+static inline int cache_online() {
+	if (!cache_self || !__atomic_load_n(&cache_self->epoch, __ATOMIC_RELAXED))
+		cache_concurrent_thread_online();
+	return cache_self != NULL;
+}
+
+// Returns the way holding key, or -1:
+static int cache_find(struct cache_set *set, uint8_t *key, uint8_t tag, struct cache_entry **found) {
+	struct cache_entry *entry;
+	uint64_t tags, matches;
+	int way;
+
+	// Bytes of the tags that equal tag (and sometimes one above a match,
+	// which the key comparison sorts out):
+	tags = __atomic_load_n((uint64_t *) set->tags, __ATOMIC_RELAXED) ^ (0x0101010101010101ULL * tag);
+	matches = (tags - 0x0101010101010101ULL) & ~tags & 0x8080808080808080ULL;
+	while (matches) {
+		way = __builtin_ctzll(matches) / 8;
+		matches &= matches - 1;
+		if (way >= CACHE_WAYS)
+			break;
+		entry = __atomic_load_n(&set->ways[way], __ATOMIC_ACQUIRE);
+		if (entry && !memcmp(entry->key, key, CACHE_KEY_SIZE)) {
+			*found = entry;
+			return way;
+		}
+	}
+	return -1;
+}
+
+// The first free way of a set, and how many ways are free:
+static int cache_free_way(struct cache_set *set, int *nrfree) {
+	int way, first = -1;
+
+	*nrfree = 0;
+	for (way = 0; way < CACHE_WAYS; way++) {
+		if (!__atomic_load_n(&set->ways[way], __ATOMIC_RELAXED)) {
+			if (first < 0)
+				first = way;
+			(*nrfree)++;
+		}
+	}
+	return first;
+}
+
+// The way of a full set whose entry would be pushed out first. The last
+// byte of the tags, which belongs to no way, is the hand of CLOCK. Other
+// threads may change the set meanwhile, then the compare-and-swap of the
+// caller fails and it tries again:
+static int cache_victim(struct cache_table *table, struct cache_set *set, struct cache_entry **victim) {
+	struct cache_entry *entry;
+	int i, way, hand, oldest = 0;
+
+	if (table->policy == CACHE_POLICY_FIFO) {
+		*victim = __atomic_load_n(&set->ways[0], __ATOMIC_ACQUIRE);
+		for (way = 1; *victim && (way < CACHE_WAYS); way++) {
+			entry = __atomic_load_n(&set->ways[way], __ATOMIC_ACQUIRE);
+			if (!entry || (entry->added < (*victim)->added)) {
+				*victim = entry;
+				oldest = way;
+			}
+		}
+		return oldest;
+	}
+
+	hand = __atomic_load_n(&set->tags[7], __ATOMIC_RELAXED) % CACHE_WAYS;
+	for (i = 0, way = hand; i < (2 * CACHE_WAYS); i++, way = (way + 1) % CACHE_WAYS) {
+		entry = __atomic_load_n(&set->ways[way], __ATOMIC_ACQUIRE);
+		if (!entry || !__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED))
+			break;
+		__atomic_store_n(&entry->referenced, 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&set->tags[7], (way + 1) % CACHE_WAYS, __ATOMIC_RELAXED);
+	*victim = __atomic_load_n(&set->ways[way], __ATOMIC_ACQUIRE);
+	return way;
+}
+
+static void cache_concurrent_stats(struct cache_table *table) {
+	struct cache_counters total;
+	unsigned long lookups;
+	int i, way, nrused = 0;
+
+	if (!table || !cache_online())
+		return;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < CACHE_MAX_THREADS; i++) {
+		total.hits += __atomic_load_n(&table->counters[i].hits, __ATOMIC_RELAXED);
+		total.misses += __atomic_load_n(&table->counters[i].misses, __ATOMIC_RELAXED);
+		total.additions += __atomic_load_n(&table->counters[i].additions, __ATOMIC_RELAXED);
+		total.evictions += __atomic_load_n(&table->counters[i].evictions, __ATOMIC_RELAXED);
+	}
+	for (i = 0; i <= (int) table->setmask; i++)
+		for (way = 0; way < CACHE_WAYS; way++)
+			if (__atomic_load_n(&table->sets[i].ways[way], __ATOMIC_RELAXED))
+				nrused++;
+
+	lookups = total.hits + total.misses;
+	debug_log(DEBUG_FATAL, "cache_concurrent_stats(): %s (shared by %d): usage: %d/%d (for %d entries), %lu hits, %lu misses (%.1f%% hits), %lu evictions\n",
+			(table->policy == CACHE_POLICY_CLOCK) ? "clock" : "fifo", __atomic_load_n(&table->references, __ATOMIC_RELAXED),
+			nrused, table->nrentries, table->nrconfigured, total.hits, total.misses,
+			lookups ? (100.0 * total.hits) / lookups : 0.0, total.evictions);
+	debug_log(DEBUG_DEBUG, "cache_concurrent_stats(): %d sets of %d ways, %lu added, %d pushed out entries of this thread not freed yet\n",
+			table->setmask + 1, CACHE_WAYS, total.additions, cache_self->nrretired);
+}
+
+static struct cache_table *cache_concurrent_init(int nrentries) {
+	struct cache_table *table = NULL;
+	int nrsets;
+
+	if ((nrentries < 1) || (nrentries > CACHE_MAX_ENTRIES))
+		goto wrong;
+	if (global_cache_admission) {
+		debug_log(DEBUG_ERROR, "cache_concurrent_init(): the concurrent cache does not support admission\n");
+		goto wrong;
+	}
+
+	table = (struct cache_table *) cache_alloc(sizeof(struct cache_table));
+	if (!table)
+		goto wrong;
+	memset(table, 0, sizeof(struct cache_table));
+
+	// A key can only be in two of the sets, so the first ones to fill up
+	// push entries out well before all ways are in use: with half again as
+	// many ways as entries, all of those fit:
+	nrsets = 2;
+	while ((nrsets * CACHE_WAYS) < (nrentries + (nrentries / 2)))
+		nrsets <<= 1;
+
+	table->sets = (struct cache_set *) cache_alloc(nrsets * sizeof(struct cache_set));
+	if (!table->sets)
+		goto wrong;
+	memset(table->sets, 0, nrsets * sizeof(struct cache_set));
+
+	misc_randombytes((uint8_t *) table->hashkey, sizeof(table->hashkey));
+	table->setmask = nrsets - 1;
+	table->nrentries = nrsets * CACHE_WAYS;
+	table->nrconfigured = nrentries;
+	table->policy = global_cache_policy;
+	table->references = 1;
+
+	debug_log(DEBUG_INFO, "cache_concurrent_init(): %d sets of %d ways for %d entries, allocated %zd bytes for the shared secret cache structure (and %zd per entry)\n",
+			nrsets, CACHE_WAYS, nrentries, (nrsets * sizeof(struct cache_set)) + sizeof(struct cache_table), sizeof(struct cache_entry));
+
+	return table;
+
+wrong:
+	debug_log(DEBUG_ERROR, "cache_concurrent_init(): something went wrong while initializing\n");
+	if (table) {
+		if (table->sets)
+			free(table->sets);
+		free(table);
+	}
+	return NULL;
+}
+
+static struct cache_table *cache_concurrent_attach(struct cache_table *table) {
+	if (table)
+		__sync_add_and_fetch(&table->references, 1);
+	return table;
+}
+
+static uint8_t *cache_concurrent_get(struct cache_table *table, uint8_t *key) {
+	struct cache_entry *entry;
+	uint64_t hash;
+
+	if (!table || !key || !cache_online())
+		return NULL;
+
+	hash = cache_hash(table, key);
+	if ((cache_find(cache_set_of(table, hash, 0), key, CACHE_HASH_TAG(hash), &entry) >= 0) ||
+			(cache_find(cache_set_of(table, hash, 1), key, CACHE_HASH_TAG(hash), &entry) >= 0)) {
+		// Only written once per round of the hand, to keep the line clean:
+		if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED))
+			__atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+		CACHE_COUNT(table, hits);
+		return entry->value;
+	}
+
+	CACHE_COUNT(table, misses);
+	return NULL;
+}
+
+// Adds key, or replaces the entry holding it. Returns 2 when other threads
+// kept changing the set, so it was not added:
+static int cache_concurrent_set(struct cache_table *table, uint8_t *key, uint8_t *value) {
+	struct cache_entry *entry, *victim, *other;
+	struct cache_set *set, *sets[2];
+	uint64_t hash;
+	int attempt, way, otherway, replace, nrfree, othernrfree;
+
+	if (!table || !key || !value || !cache_online())
+		goto wrong;
+
+	entry = (struct cache_entry *) cache_alloc(sizeof(struct cache_entry));
+	if (!entry)
+		goto wrong;
+	memset(entry, 0, sizeof(struct cache_entry));
+	memcpy(entry->key, key, CACHE_KEY_SIZE);
+	memcpy(entry->value, value, CACHE_VALUE_SIZE);
+	if (table->policy == CACHE_POLICY_FIFO)
+		entry->added = __sync_fetch_and_add(&table->added, 1);
+
+	hash = cache_hash(table, key);
+	sets[0] = cache_set_of(table, hash, 0);
+	sets[1] = cache_set_of(table, hash, 1);
+	for (attempt = 0; attempt < CACHE_WAYS; attempt++) {
+		// The entry of the key itself, a free way, or the entry of either
+		// set that would be pushed out first:
+		victim = NULL;
+		set = sets[0];
+		replace = 1;
+		if ((way = cache_find(set, key, CACHE_HASH_TAG(hash), &victim)) < 0) {
+			set = sets[1];
+			way = cache_find(set, key, CACHE_HASH_TAG(hash), &victim);
+		}
+		// A new key goes to the set with the most free ways, which keeps
+		// the sets evenly filled:
+		if (way < 0) {
+			replace = 0;
+			victim = NULL;
+			set = sets[0];
+			way = cache_free_way(set, &nrfree);
+			otherway = cache_free_way(sets[1], &othernrfree);
+			if (othernrfree > nrfree) {
+				set = sets[1];
+				way = otherway;
+			}
+		}
+		if (way < 0) {
+			set = sets[0];
+			way = cache_victim(table, set, &victim);
+			otherway = cache_victim(table, sets[1], &other);
+			if (victim && other && ((table->policy == CACHE_POLICY_FIFO) ? (other->added < victim->added) :
+					(__atomic_load_n(&victim->referenced, __ATOMIC_RELAXED) && !__atomic_load_n(&other->referenced, __ATOMIC_RELAXED)))) {
+				set = sets[1];
+				way = otherway;
+				victim = other;
+			}
+		}
+
+		if (__atomic_compare_exchange_n(&set->ways[way], &victim, entry, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&set->tags[way], CACHE_HASH_TAG(hash), __ATOMIC_RELAXED);
+			CACHE_COUNT(table, additions);
+			if (victim) {
+				cache_retire(victim);
+				if (!replace)
+					CACHE_COUNT(table, evictions);
+			}
+			return 1;
+		}
+	}
+
+	cache_entry_free(entry);
+	return 2;
+
+wrong:
+	return 0;
+}
+
+// Entries in use by other threads are freed later on, as usual:
+static int cache_concurrent_empty(struct cache_table *table) {
+	struct cache_entry *entry;
+	int i, way;
+
+	if (!table || !cache_online())
+		goto wrong;
+
+	for (i = 0; i <= (int) table->setmask; i++) {
+		for (way = 0; way < CACHE_WAYS; way++) {
+			entry = __atomic_exchange_n(&table->sets[i].ways[way], NULL, __ATOMIC_SEQ_CST);
+			if (entry)
+				cache_retire(entry);
+		}
+	}
+
+	return 1;
+
+wrong:
+	return 0;
+}
+
+// Calls fn for every entry until it returns 0. There is no order in which
+// the entries were added, they come set by set:
+static int cache_concurrent_iterate(struct cache_table *table, int (*fn)(uint8_t *, uint8_t *, void *), void *arg) {
+	struct cache_entry *entry;
+	int i, way;
+
+	if (!table || !fn || !cache_online())
+		goto wrong;
+
+	for (i = 0; i <= (int) table->setmask; i++) {
+		for (way = 0; way < CACHE_WAYS; way++) {
+			entry = __atomic_load_n(&table->sets[i].ways[way], __ATOMIC_ACQUIRE);
+			if (entry && !fn(entry->key, entry->value, arg))
+				goto wrong;
+		}
+	}
+
+	return 1;
+
+wrong:
+	return 0;
+}
+
+
+// Bytes allocated for the table and the entries in it:
+static size_t cache_concurrent_memory(struct cache_table *table) {
+	size_t size;
+	int i, way;
+
+	if (!table)
+		return 0;
+
+	size = sizeof(struct cache_table) + ((table->setmask + 1) * sizeof(struct cache_set));
+	for (i = 0; i <= (int) table->setmask; i++)
+		for (way = 0; way < CACHE_WAYS; way++)
+			if (__atomic_load_n(&table->sets[i].ways[way], __ATOMIC_RELAXED))
+				size += sizeof(struct cache_entry);
+
+	return size;
+}
+
+// Drops a reference, the last one frees the table (no other thread can
+// look at its entries anymore by then):
+static int cache_concurrent_destroy(struct cache_table *table) {
+	struct cache_entry *entry;
+	int i, way;
+
+	if (!table || __sync_sub_and_fetch(&table->references, 1))
+		return 1;
+
+	if (table->sets) {
+		for (i = 0; i <= (int) table->setmask; i++) {
+			for (way = 0; way < CACHE_WAYS; way++) {
+				entry = table->sets[i].ways[way];
+				if (entry)
+					cache_entry_free(entry);
+			}
+		}
+		free(table->sets);
+	}
+	memset(table, 0, sizeof(struct cache_table));
+	free(table);
+	return 1;
+}
+
+// Admission is not supported, and the sets are fixed (resizing is left to
+// the swiss backend):
+const struct cache_backend cache_backend_concurrent = {
+	.name = "concurrent",
+	.policy = CACHE_POLICY_CLOCK,
+	.admission = 0,
+	.init = cache_concurrent_init,
+	.get = cache_concurrent_get,
+	.set = cache_concurrent_set,
+	.empty = cache_concurrent_empty,
+	.destroy = cache_concurrent_destroy,
+	.iterate = cache_concurrent_iterate,
+	.stats = cache_concurrent_stats,
+	.memory = cache_concurrent_memory,
+	.attach = cache_concurrent_attach,
+	.thread_online = cache_concurrent_thread_online,
+	.thread_offline = cache_concurrent_thread_offline,
+};
@@ -0,0 +1,87 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#ifndef CACHE_CONCURRENT_H_
+#define CACHE_CONCURRENT_H_
+
+#include "cache.h"
+
+// Set associative: a key can only be in one of the two sets (of one cache
+// line each) its hash selects, which hold pointers to the entries and a
+// tag (8 bits of the hash) of each. Lookups only read, so any number of threads can look
+// up keys at once; entries are added and pushed out by swapping a single
+// pointer (compare-and-swap).
+#define CACHE_WAYS			7
+
+// Entries that were pushed out are freed once every thread has passed a
+// quiescent state (see cache_thread_online()), so a thread that looked an
+// entry up can still use it. Threads get a slot of their own:
+#define CACHE_MAX_THREADS	256
+
+struct cache_entry {
+	uint8_t key[CACHE_KEY_SIZE];
+	uint8_t value[CACHE_VALUE_SIZE];
+	uint64_t added;					// FIFO: when it was added
+	uint64_t epoch;					// when it was pushed out
+	struct cache_entry *next;		// pushed out, waiting to be freed
+	uint8_t referenced;				// CLOCK: looked up since the hand passed it
+};
+
+// Exactly one cache line:
+struct cache_set {
+	struct cache_entry *ways[CACHE_WAYS];
+	uint8_t tags[8];
+};
+
+// Counted by every thread on its own cache line:
+struct cache_counters {
+	unsigned long hits, misses, additions, evictions;
+	uint8_t pad[64 - (4 * sizeof(unsigned long))];
+};
+
+struct cache_table {
+	uint64_t hashkey[2];			// random key of the hash function
+	struct cache_set *sets;			// aligned to a cache line
+	uint32_t setmask;				// number of sets - 1 (a power of two)
+	int nrentries;					// ways in all sets, what fits at most
+	int nrconfigured;				// entries asked for, which all fit
+	int policy;
+	int references;					// freed by the last cache_destroy()
+	uint64_t added;					// FIFO: number of entries added
+	struct cache_counters counters[CACHE_MAX_THREADS];
+};
+
+#endif /* CACHE_CONCURRENT_H_ */
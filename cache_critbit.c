@@ -0,0 +1,319 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#include "cache_critbit.h"
+
+#define CACHE_MAX_ENTRIES	(1 << 28)
+
+static int cache_critbit_destroy(struct cache_table *);
+
+// Walks down to the entry whose key shares the most leading bits with key.
+// As a walk never takes more steps than a key has bits, a client cannot
+// make them long by crafting keys, so the keys are not hashed:
+static uint32_t cache_critbit_find(struct cache_table *table, uint8_t *key) {
+	uint32_t p = table->root;
+	struct cache_node *node;
+
+	while (!(p & CACHE_CRITBIT_LEAF)) {
+		node = &table->nodes[p];
+		p = node->child[(1 + (node->otherbits | key[node->byte])) >> 8];
+	}
+
+	return p & ~CACHE_CRITBIT_LEAF;
+}
+
+// Takes the entry in slot out of the tree, its parent node is freed:
+static void cache_critbit_remove(struct cache_table *table, uint32_t slot) {
+	uint8_t *key = table->entries[slot].key;
+	uint32_t *where = &table->root, *whereparent = NULL, p = table->root, parent = 0;
+	struct cache_node *node;
+	int direction = 0;
+
+	while (!(p & CACHE_CRITBIT_LEAF)) {
+		whereparent = where;
+		parent = p;
+		node = &table->nodes[p];
+		direction = (1 + (node->otherbits | key[node->byte])) >> 8;
+		where = &node->child[direction];
+		p = *where;
+	}
+
+	if (!whereparent) {
+		table->root = CACHE_CRITBIT_NONE;
+	} else {
+		*whereparent = table->nodes[parent].child[1 - direction];
+		table->nodes[parent].child[0] = table->freenodes;
+		table->freenodes = parent;
+	}
+	table->nrused--;
+}
+
+// Puts the entry in slot in the tree, best is the entry the walk for its key
+// ends up in (unless the tree is empty):
+static void cache_critbit_insert(struct cache_table *table, uint32_t slot, uint32_t best) {
+	uint8_t *key = table->entries[slot].key, *bestkey, otherbits = 0;
+	uint32_t *where, p, new;
+	struct cache_node *node;
+	int byte, direction;
+
+	table->nrused++;
+	if (table->root == CACHE_CRITBIT_NONE) {
+		table->root = slot | CACHE_CRITBIT_LEAF;
+		return;
+	}
+
+	// The critical bit is the highest bit of the first byte that differs:
+	bestkey = table->entries[best].key;
+	for (byte = 0; byte < CACHE_KEY_SIZE; byte++)
+		if ((otherbits = bestkey[byte] ^ key[byte]))
+			break;
+	otherbits |= otherbits >> 1;
+	otherbits |= otherbits >> 2;
+	otherbits |= otherbits >> 4;
+	otherbits = (otherbits & ~(otherbits >> 1)) ^ 255;
+	direction = (1 + (otherbits | bestkey[byte])) >> 8;
+
+	new = table->freenodes;
+	node = &table->nodes[new];
+	table->freenodes = node->child[0];
+	node->byte = byte;
+	node->otherbits = otherbits;
+	node->child[1 - direction] = slot | CACHE_CRITBIT_LEAF;
+
+	// Nodes are ordered by their critical bit from the root down:
+	where = &table->root;
+	for (;;) {
+		p = *where;
+		if (p & CACHE_CRITBIT_LEAF)
+			break;
+		if ((table->nodes[p].byte > byte) || ((table->nodes[p].byte == byte) && (table->nodes[p].otherbits > otherbits)))
+			break;
+		where = &table->nodes[p].child[(1 + (table->nodes[p].otherbits | key[table->nodes[p].byte])) >> 8];
+	}
+	node->child[direction] = *where;
+	*where = new;
+}
+
+static void cache_critbit_stats(struct cache_table *table) {
+	unsigned long lookups;
+
+	if (!table)
+		return;
+
+	lookups = table->hits + table->misses;
+	debug_log(DEBUG_FATAL, "cache_critbit_stats(): %s: usage: %d/%d, %lu hits, %lu misses (%.1f%% hits), %lu evictions\n",
+			(table->policy == CACHE_POLICY_CLOCK) ? "clock" : "fifo",
+			table->nrused, table->nrentries, table->hits, table->misses,
+			lookups ? (100.0 * table->hits) / lookups : 0.0, table->evictions);
+}
+
+static size_t cache_critbit_memory(struct cache_table *table) {
+	if (!table)
+		return 0;
+	return sizeof(struct cache_table) + (table->nrentries * (sizeof(struct cache_entry) + sizeof(struct cache_node) + 1));
+}
+
+static int cache_critbit_empty(struct cache_table *table) {
+	int i;
+
+	if (!table)
+		goto wrong;
+
+	for (i = 0; i < table->nrentries; i++)
+		table->nodes[i].child[0] = ((i + 1) < table->nrentries) ? (uint32_t) (i + 1) : CACHE_CRITBIT_NONE;
+	memset(table->entries, 0, table->nrentries * sizeof(struct cache_entry));
+	memset(table->referenced, 0, table->nrentries);
+	table->freenodes = 0;
+	table->root = CACHE_CRITBIT_NONE;
+	table->nrused = 0;
+	table->hand = 0;
+
+	return 1;
+
+wrong:
+	return 0;
+}
+
+static struct cache_table *cache_critbit_init(int nrentries) {
+	struct cache_table *table = NULL;
+
+	if ((nrentries < 1) || (nrentries > CACHE_MAX_ENTRIES))
+		goto wrong;
+	if (global_cache_admission) {
+		debug_log(DEBUG_ERROR, "cache_critbit_init(): the critbit tree does not support admission\n");
+		goto wrong;
+	}
+
+	table = (struct cache_table *) malloc(sizeof(struct cache_table));
+	if (!table)
+		goto wrong;
+	memset(table, 0, sizeof(struct cache_table));
+
+	table->entries = (struct cache_entry *) malloc(nrentries * sizeof(struct cache_entry));
+	table->referenced = (uint8_t *) malloc(nrentries);
+	table->nodes = (struct cache_node *) malloc(nrentries * sizeof(struct cache_node));
+	if (!table->entries || !table->referenced || !table->nodes)
+		goto wrong;
+
+	table->nrentries = nrentries;
+	table->policy = global_cache_policy;
+	cache_critbit_empty(table);
+
+	debug_log(DEBUG_INFO, "cache_critbit_init(): allocated %zd bytes in total for the shared secret cache structure\n",
+			cache_critbit_memory(table));
+
+	return table;
+
+wrong:
+	debug_log(DEBUG_ERROR, "cache_critbit_init(): something went wrong while initializing\n");
+	cache_critbit_destroy(table);
+	return NULL;
+}
+
+static uint8_t *cache_critbit_get(struct cache_table *table, uint8_t *key) {
+	uint32_t slot;
+
+	if (!table || !key || !table->nrused)
+		goto wrong;
+
+	slot = cache_critbit_find(table, key);
+	if (memcmp(table->entries[slot].key, key, CACHE_KEY_SIZE) == 0) {
+		if (!table->referenced[slot])
+			table->referenced[slot] = 1;
+		table->hits++;
+		return table->entries[slot].value;
+	}
+
+wrong:
+	if (table)
+		table->misses++;
+	return NULL;
+}
+
+static int cache_critbit_set(struct cache_table *table, uint8_t *key, uint8_t *value) {
+	uint32_t slot, best = 0;
+
+	if (!table || !key || !value)
+		goto wrong;
+
+	if (table->nrused) {
+		best = cache_critbit_find(table, key);
+		if (memcmp(table->entries[best].key, key, CACHE_KEY_SIZE) == 0) {
+			memcpy(table->entries[best].value, value, CACHE_VALUE_SIZE);
+			return 1;
+		}
+	}
+
+	if (table->nrused < table->nrentries) {
+		slot = table->nrused;
+	} else {
+		// The entries fill the ring in the order they are added, so the
+		// hand is at the oldest one:
+		if (table->policy == CACHE_POLICY_CLOCK) {
+			while (table->referenced[table->hand]) {
+				table->referenced[table->hand] = 0;
+				table->hand = (table->hand + 1) % table->nrentries;
+			}
+		}
+		slot = table->hand;
+		table->hand = (table->hand + 1) % table->nrentries;
+		cache_critbit_remove(table, slot);
+		table->evictions++;
+
+		// Only the walk that ended in the removed entry is changed by it:
+		if ((best == slot) && table->nrused)
+			best = cache_critbit_find(table, key);
+	}
+
+	memcpy(table->entries[slot].key, key, CACHE_KEY_SIZE);
+	memcpy(table->entries[slot].value, value, CACHE_VALUE_SIZE);
+	table->referenced[slot] = 0;
+	cache_critbit_insert(table, slot, best);
+
+	return 1;
+
+wrong:
+	return 0;
+}
+
+// Calls fn for every entry, oldest first, until it returns 0:
+static int cache_critbit_iterate(struct cache_table *table, int (*fn)(uint8_t *, uint8_t *, void *), void *arg) {
+	struct cache_entry *entry;
+	int i;
+
+	if (!table || !fn)
+		goto wrong;
+
+	for (i = 0; i < table->nrused; i++) {
+		entry = &table->entries[(table->hand + i) % table->nrentries];
+		if (!fn(entry->key, entry->value, arg))
+			goto wrong;
+	}
+
+	return 1;
+
+wrong:
+	return 0;
+}
+
+static int cache_critbit_destroy(struct cache_table *table) {
+	if (table) {
+		if (table->entries) {
+			memset(table->entries, 0, table->nrentries * sizeof(struct cache_entry));
+			free(table->entries);
+		}
+		free(table->referenced);
+		free(table->nodes);
+		free(table);
+	}
+	return 1;
+}
+
+// Admission is not supported, and the arrays are fixed (resizing is left to
+// the swiss backend), every thread has its own table:
+const struct cache_backend cache_backend_critbit = {
+	.name = "critbit",
+	.policy = CACHE_POLICY_CLOCK,
+	.admission = 0,
+	.init = cache_critbit_init,
+	.get = cache_critbit_get,
+	.set = cache_critbit_set,
+	.empty = cache_critbit_empty,
+	.destroy = cache_critbit_destroy,
+	.iterate = cache_critbit_iterate,
+	.stats = cache_critbit_stats,
+	.memory = cache_critbit_memory,
+};
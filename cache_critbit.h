@@ -0,0 +1,73 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#ifndef CACHE_CRITBIT_H_
+#define CACHE_CRITBIT_H_
+
+#include "cache.h"
+
+// Crit-bit tree (see https://cr.yp.to/critbit.html): every internal node
+// holds the first bit in which the keys below it differ, so a lookup walks
+// down by those bits of its key and only compares the key of the leaf it
+// ends up in. The nodes and the entries (the leaves) are kept in arrays and
+// refer to each other by index, which keeps a node at 12 bytes.
+#define CACHE_CRITBIT_LEAF	0x80000000		// index of an entry, not of a node
+#define CACHE_CRITBIT_NONE	0xffffffff
+
+struct cache_node {
+	uint32_t child[2];				// the next free node in child[0] when unused
+	uint8_t byte;					// the critical bit: the byte it is in,
+	uint8_t otherbits;				// and every other bit of that byte set
+};
+
+struct cache_entry {
+	uint8_t key[CACHE_KEY_SIZE];
+	uint8_t value[CACHE_VALUE_SIZE];
+};
+
+struct cache_table {
+	struct cache_entry *entries;	// ring of nrentries, filled in the order they are added
+	uint8_t *referenced;			// CLOCK: entry was looked up since the hand passed it
+	struct cache_node *nodes;		// one less than the entries in use at most
+	uint32_t root;
+	uint32_t freenodes;				// list of unused nodes
+	int nrentries, nrused;
+	int hand;						// the oldest entry, once the ring is full
+	int policy;
+	unsigned long hits, misses, evictions;
+};
+
+#endif /* CACHE_CRITBIT_H_ */
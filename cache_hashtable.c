@@ -35,30 +35,23 @@
  */
 
 #include "cache_hashtable.h"
+#include "misc.h"
 
-struct cache_table *dnscurve_cache = NULL;
+static int cache_hashtable_destroy(struct cache_table *);
 
-static unsigned int cache_hash(uint8_t *key) {
-	unsigned int hash = 5381;
-	uint8_t i;
-
-	// djb's hash function
-	for (i = 0; i < CACHE_KEY_SIZE; i++)
-		hash = ((hash << 5) + hash) + key[i];
-
-	return hash;
+// Keyed with a random key of the table, so clients cannot craft public keys
+// that all end up in the same bucket:
+static unsigned int cache_hash(struct cache_table *table, uint8_t *key) {
+	return (unsigned int) misc_siphash(table->hashkey, key);
 }
 
-void cache_stats(struct cache_table *table) {
+static void cache_buckets(struct cache_table *table) {
 	struct cache_entry *entry;
 	int i, j;
 
-	if (!table)
-		return;
-
 	if (debug_level >= DEBUG_DEBUG) {
 
-		debug_log(DEBUG_DEBUG, "cache_stats(): usage: %d/%d, ", table->nrused, table->nrentries);
+		debug_log(DEBUG_DEBUG, "cache_buckets(): usage: %d/%d, ", table->nrused, table->nrentries);
 		for (i = 0; i < table->nrbuckets; i++) {
 			j = 0;
 			entry = table->buckets[i];
@@ -73,11 +66,48 @@ void cache_stats(struct cache_table *table) {
 	}
 }
 
-struct cache_table *cache_init(int nrbuckets, int nrentries) {
+static void cache_hashtable_stats(struct cache_table *table) {
+	unsigned long lookups;
+
+	if (!table)
+		return;
+
+	lookups = table->hits + table->misses;
+	debug_log(DEBUG_FATAL, "cache_hashtable_stats(): fifo: usage: %d/%d, %lu hits, %lu misses (%.1f%% hits), %lu evictions\n",
+			table->nrused, table->nrentries, table->hits, table->misses,
+			lookups ? (100.0 * table->hits) / lookups : 0.0, table->evictions);
+	cache_buckets(table);
+}
+
+static struct cache_entry *cache_find(struct cache_table *table, uint8_t *key) {
+	struct cache_entry *entry = NULL;
+
+	entry = table->buckets[cache_hash(table, key) % table->nrbuckets];
+	while (entry) {
+		if (memcmp(entry->key, key, CACHE_KEY_SIZE) == 0)
+			return entry;
+		entry = entry->next;
+	}
+
+	return NULL;
+}
+
+static struct cache_table *cache_hashtable_init(int nrentries) {
 	struct cache_table *table = NULL;
-	int i;
-	if ((nrbuckets < 1) || (nrentries < 1) || (nrentries < nrbuckets))
+	int nrbuckets, i;
+
+	nrbuckets = (int) (nrentries / 25);
+	if (nrbuckets < 5) {
+		nrbuckets = 5;
+	} else if (nrbuckets > 500) {
+		nrbuckets = 500;
+	}
+	if ((nrentries < 1) || (nrentries < nrbuckets))
 		goto wrong;
+	if ((global_cache_policy != CACHE_POLICY_FIFO) || global_cache_admission) {
+		debug_log(DEBUG_ERROR, "cache_hashtable_init(): the hashtable only supports FIFO eviction, without admission\n");
+		goto wrong;
+	}
 
 	table = (struct cache_table *) malloc(sizeof(struct cache_table));
 	if (!table)
@@ -102,65 +132,72 @@ struct cache_table *cache_init(int nrbuckets, int nrentries) {
 		i++;
 	}
 
+	misc_randombytes((uint8_t *) table->hashkey, sizeof(table->hashkey));
+
 	table->nrbuckets = nrbuckets;
 	table->nrentries = nrentries;
 	table->nrused = 0;
 	table->headused = NULL;
 	table->lastused = NULL;
 
-	debug_log(DEBUG_INFO, "cache_init(): allocated %zd bytes in total for the shared secret cache structure\n",
+	debug_log(DEBUG_INFO, "cache_hashtable_init(): %d buckets, allocated %zd bytes in total for the shared secret cache structure\n", nrbuckets,
 			(nrbuckets * sizeof(struct cache_entry *)) + (nrentries * sizeof(struct cache_entry)) + sizeof(struct cache_table));
 
 	return table;
 
 wrong:
-	debug_log(DEBUG_ERROR, "cache_init(): something went wrong while initializing\n");
-	cache_destroy(table);
+	debug_log(DEBUG_ERROR, "cache_hashtable_init(): something went wrong while initializing\n");
+	cache_hashtable_destroy(table);
 	return NULL;
 }
 
-struct cache_entry *cache_get(struct cache_table *table, uint8_t *key) {
+static uint8_t *cache_hashtable_get(struct cache_table *table, uint8_t *key) {
 	struct cache_entry *entry = NULL;
-	unsigned int hash;
 
 	if (!table || !key || !table->nrused)
 		goto wrong;
 
-	hash = (cache_hash(key) % table->nrbuckets);
-	entry = table->buckets[hash];
-	while (entry) {
-		if (memcmp(entry->key, key, CACHE_KEY_SIZE) == 0)
-			return entry;
-		entry = entry->next;
+	entry = cache_find(table, key);
+	if (entry) {
+		table->hits++;
+		return entry->value;
 	}
 
 wrong:
+	if (table)
+		table->misses++;
 	return NULL;
 }
 
-struct cache_entry *cache_set(struct cache_table *table, uint8_t *key, uint8_t *value) {
+static int cache_hashtable_set(struct cache_table *table, uint8_t *key, uint8_t *value) {
 	struct cache_entry *entry = NULL;
 	unsigned int hash;
 
 	if (!table || !key || !value)
 		goto wrong;
 
-	cache_stats(table);
+	if (table->nrused && (entry = cache_find(table, key))) {
+		memcpy(entry->value, value, CACHE_VALUE_SIZE);
+		return 1;
+	}
+
+	cache_buckets(table);
 	if (table->nrused >= table->nrentries) {
-		debug_log(DEBUG_DEBUG, "cache_set(): hashtable full - forcing oldest one out\n");
+		debug_log(DEBUG_DEBUG, "cache_hashtable_set(): hashtable full - forcing oldest one out\n");
 
 		if (table->headunused) {
-			debug_log(DEBUG_ERROR, "cache_set(): unused  headunused != NULL\n");
+			debug_log(DEBUG_ERROR, "cache_hashtable_set(): unused  headunused != NULL\n");
 			goto wrong;
 		}
 
 		entry = table->headused;
 		table->headused = table->headused->nexttable;
+		table->evictions++;
 
 		if (entry->prev)
 			entry->prev->next = NULL;
 		else {
-			hash = (cache_hash(entry->key) % table->nrbuckets);
+			hash = (cache_hash(table, entry->key) % table->nrbuckets);
 			table->buckets[hash] = NULL;
 		}
 
@@ -183,20 +220,20 @@ struct cache_entry *cache_set(struct cache_table *table, uint8_t *key, uint8_t *
 		table->lastused->nexttable = entry;
 	table->lastused = entry;
 
-	hash = (cache_hash(entry->key) % table->nrbuckets);
+	hash = (cache_hash(table, entry->key) % table->nrbuckets);
 	if (table->buckets[hash]) {
 		table->buckets[hash]->prev = entry;
 		entry->next = table->buckets[hash];
 	}
 	table->buckets[hash] = entry;
 
-	return entry;
+	return 1;
 
 wrong:
-	return NULL;
+	return 0;
 }
 
-int cache_empty(struct cache_table *table) {
+static int cache_hashtable_empty(struct cache_table *table) {
 	struct cache_entry *entry = NULL, *tmpentry = NULL;
 	int i;
 	if (!table)
@@ -225,17 +262,55 @@ wrong:
 	return 0;
 }
 
-int cache_destroy(struct cache_table *table) {
+// Calls fn for every entry, oldest first, until it returns 0:
+static int cache_hashtable_iterate(struct cache_table *table, int (*fn)(uint8_t *, uint8_t *, void *), void *arg) {
+	struct cache_entry *entry;
+
+	if (!table || !fn)
+		goto wrong;
+
+	for (entry = table->headused; entry; entry = entry->nexttable)
+		if (!fn(entry->key, entry->value, arg))
+			goto wrong;
+
+	return 1;
+
+wrong:
+	return 0;
+}
+
+
+
+static size_t cache_hashtable_memory(struct cache_table *table) {
+	if (!table)
+		return 0;
+	return sizeof(struct cache_table) + (table->nrbuckets * sizeof(struct cache_entry *)) + (table->nrentries * sizeof(struct cache_entry));
+}
+
+static int cache_hashtable_destroy(struct cache_table *table) {
 	if (table) {
 		if (table->entries)
 			free(table->entries);
+		if (table->buckets)
+			free(table->buckets);
+		memset(table, 0, sizeof(struct cache_table));
 		free(table);
-		table->headused = NULL;
-		table->headunused = NULL;
-		table->lastused = NULL;
-		table->nrbuckets = -1;
-		table->nrentries = -1;
-		table->nrused = -1;
 	}
 	return 1;
 }
+
+// Only FIFO, without admission, is supported. Resizing is left to the swiss
+// backend, every thread has its own table:
+const struct cache_backend cache_backend_hashtable = {
+	.name = "hashtable",
+	.policy = CACHE_POLICY_FIFO,
+	.admission = 0,
+	.init = cache_hashtable_init,
+	.get = cache_hashtable_get,
+	.set = cache_hashtable_set,
+	.empty = cache_hashtable_empty,
+	.destroy = cache_hashtable_destroy,
+	.iterate = cache_hashtable_iterate,
+	.stats = cache_hashtable_stats,
+	.memory = cache_hashtable_memory,
+};
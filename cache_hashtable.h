@@ -37,27 +37,17 @@
 #ifndef CACHE_HASHTABLE_H_
 #define CACHE_HASHTABLE_H_
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-
-#include <ev.h>
-#include "crypto_box_curve25519xsalsa20poly1305.h"
-#include "debug.h"
-
-// The cache mechanism isn't really general, it is focused
-// on the public key client -> shared key fetching.
-
-#define	CACHE_KEY_SIZE		crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES
-#define	CACHE_VALUE_SIZE	crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES
+#include "cache.h"
 
+// Chained hashtable, with a fixed number of buckets:
 struct cache_table {
+	uint64_t hashkey[2];
 	struct cache_entry **buckets;
 	struct cache_entry *entries;
 	struct cache_entry *headunused;
 	struct cache_entry *headused, *lastused;
 	int nrbuckets, nrentries, nrused;
+	unsigned long hits, misses, evictions;
 };
 
 struct cache_entry {
@@ -66,13 +56,4 @@ struct cache_entry {
 	uint8_t value[CACHE_VALUE_SIZE];
 };
 
-extern struct cache_table *dnscurve_cache;
-
-extern void cache_stats(struct cache_table *);
-extern struct cache_table *cache_init(int, int);
-extern struct cache_entry *cache_get(struct cache_table *, uint8_t *);
-extern struct cache_entry *cache_set(struct cache_table *, uint8_t *, uint8_t *);
-extern int cache_empty(struct cache_table *);
-extern int cache_destroy(struct cache_table *);
-
-#endif /* CACHE_H_ */
+#endif /* CACHE_HASHTABLE_H_ */
@@ -0,0 +1,261 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+/*
+ * Shared secrets of clients that are known in advance (such as the big
+ * resolvers), precomputed by curvedns-precompute into a table that is
+ * mapped read-only at startup. They are looked up before the cache of the
+ * worker, so they are never pushed out, and no query of such a client
+ * waits for a computation, not even right after a restart.
+ *
+ * The table is a header followed by the entries (a key and its shared
+ * secret), sorted by key. When mapping it, an index is built of the first
+ * entry of every value of the top bits of the keys, about one entry each,
+ * so a lookup hardly compares more than a single key.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+#define CACHE_PINNED_ENTRY		(CACHE_KEY_SIZE + CACHE_VALUE_SIZE)
+#define CACHE_PINNED_MAX_BITS	24
+
+static const uint8_t cache_pinned_magic[8] = { 'C', 'D', 'N', 'S', 'P', 'I', 'N', 'S' };
+
+static uint8_t *cache_pinned_entries = NULL;
+static uint32_t cache_pinned_count = 0;
+static uint32_t *cache_pinned_index = NULL;		// (1 << bits) + 1 positions in the entries
+static int cache_pinned_bits = 1;
+static __thread unsigned long cache_pinned_hits = 0, cache_pinned_misses = 0;
+
+static inline uint32_t cache_pinned_prefix(const uint8_t *key) {
+	return (((uint32_t) key[0] << 24) | ((uint32_t) key[1] << 16) | ((uint32_t) key[2] << 8) | key[3]) >> (32 - cache_pinned_bits);
+}
+
+static int cache_pinned_compare(const void *a, const void *b) {
+	return memcmp(a, b, CACHE_KEY_SIZE);
+}
+
+// Sorts the count entries (which it may reorder), and writes them to a fresh
+// file next to path, that replaces path once it is complete. A key that is
+// in there more than once is written once. Returns the number of entries
+// written, 0 on failure:
+uint32_t cache_pinned_write(const char *path, const uint8_t *publickey, uint8_t *entries, uint32_t count) {
+	struct cache_pinned_header header;
+	char tmppath[1024];
+	FILE *f = NULL;
+	uint32_t i;
+	int fd = -1, created = 0;
+
+	if (!path || !entries || !count)
+		goto wrong;
+	if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= (int) sizeof(tmppath))
+		goto wrong;
+
+	qsort(entries, count, CACHE_PINNED_ENTRY, cache_pinned_compare);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, cache_pinned_magic, sizeof(header.magic));
+	header.version = CACHE_PINNED_VERSION;
+	memcpy(header.publickey, publickey, sizeof(header.publickey));
+	for (i = 0; i < count; i++)
+		if (!i || cache_pinned_compare(entries + ((size_t) (i - 1) * CACHE_PINNED_ENTRY), entries + ((size_t) i * CACHE_PINNED_ENTRY)))
+			header.count++;
+
+	// The file holds shared secrets, so only its owner may read it:
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		goto wrong;
+	created = 1;
+	f = fdopen(fd, "w");
+	if (!f)
+		goto wrong;
+	fd = -1;
+
+	if (fwrite(&header, sizeof(header), 1, f) != 1)
+		goto wrong;
+	for (i = 0; i < count; i++) {
+		if (i && !cache_pinned_compare(entries + ((size_t) (i - 1) * CACHE_PINNED_ENTRY), entries + ((size_t) i * CACHE_PINNED_ENTRY)))
+			continue;
+		if (fwrite(entries + ((size_t) i * CACHE_PINNED_ENTRY), CACHE_PINNED_ENTRY, 1, f) != 1)
+			goto wrong;
+	}
+	if (fflush(f) || fsync(fileno(f)))
+		goto wrong;
+	if (fclose(f)) {
+		f = NULL;
+		goto wrong;
+	}
+	f = NULL;
+
+	if (rename(tmppath, path))
+		goto wrong;
+
+	return header.count;
+
+wrong:
+	debug_log(DEBUG_ERROR, "cache_pinned_write(): unable to write %s\n", path ? path : "(none)");
+	if (f)
+		fclose(f);
+	if (fd >= 0)
+		close(fd);
+	if (created)
+		unlink(tmppath);
+	return 0;
+}
+
+// Maps the table at path, when it was written for the same server key, and
+// builds its index:
+int cache_pinned_init(const char *path, const uint8_t *publickey) {
+	struct cache_pinned_header *header;
+	struct stat st;
+	uint8_t *map = MAP_FAILED, *entries;
+	uint32_t *index = NULL, prefix, i, j;
+	int fd = -1, bits;
+
+	if (!path)
+		goto wrong;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		debug_log(DEBUG_ERROR, "cache_pinned_init(): unable to open %s: %s\n", path, strerror(errno));
+		goto wrong;
+	}
+	if (fstat(fd, &st) || (st.st_size < (off_t) sizeof(struct cache_pinned_header)))
+		goto invalid;
+
+	map = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto wrong;
+	close(fd);
+	fd = -1;
+
+	header = (struct cache_pinned_header *) map;
+	if (memcmp(header->magic, cache_pinned_magic, sizeof(header->magic)) || (header->version != CACHE_PINNED_VERSION))
+		goto invalid;
+	if ((uint64_t) st.st_size != sizeof(struct cache_pinned_header) + ((uint64_t) header->count * CACHE_PINNED_ENTRY))
+		goto invalid;
+	if (memcmp(header->publickey, publickey, sizeof(header->publickey))) {
+		debug_log(DEBUG_ERROR, "cache_pinned_init(): %s belongs to another server key\n", path);
+		goto wrong;
+	}
+	entries = map + sizeof(struct cache_pinned_header);
+	madvise(map, st.st_size, MADV_WILLNEED);
+
+	bits = 1;
+	while ((bits < CACHE_PINNED_MAX_BITS) && ((1U << bits) < header->count))
+		bits++;
+	index = (uint32_t *) malloc(((1U << bits) + 1) * sizeof(uint32_t));
+	if (!index)
+		goto wrong;
+
+	// The keys must be in order, for the index and the lookups within a
+	// range of it:
+	cache_pinned_bits = bits;
+	for (i = 1; i < header->count; i++)
+		if (cache_pinned_compare(entries + ((size_t) (i - 1) * CACHE_PINNED_ENTRY), entries + ((size_t) i * CACHE_PINNED_ENTRY)) >= 0)
+			goto invalid;
+	for (prefix = 0, j = 0; prefix < (1U << bits); prefix++) {
+		while ((j < header->count) && (cache_pinned_prefix(entries + ((size_t) j * CACHE_PINNED_ENTRY)) < prefix))
+			j++;
+		index[prefix] = j;
+	}
+	index[1U << bits] = header->count;
+
+	cache_pinned_entries = entries;
+	cache_pinned_index = index;
+	cache_pinned_count = header->count;
+
+	debug_log(DEBUG_INFO, "cache_pinned_init(): mapped %u precomputed shared secrets from %s\n", cache_pinned_count, path);
+	return 1;
+
+invalid:
+	debug_log(DEBUG_ERROR, "cache_pinned_init(): %s is not a valid table of precomputed shared secrets\n", path);
+wrong:
+	if (index)
+		free(index);
+	if (map != MAP_FAILED)
+		munmap(map, st.st_size);
+	if (fd >= 0)
+		close(fd);
+	return 0;
+}
+
+// Returns the precomputed shared secret of key, NULL if there is none:
+uint8_t *cache_pinned_get(uint8_t *key) {
+	uint32_t low, high, middle;
+	uint8_t *entry;
+	int c;
+
+	if (!cache_pinned_count)
+		return NULL;
+
+	low = cache_pinned_index[cache_pinned_prefix(key)];
+	high = cache_pinned_index[cache_pinned_prefix(key) + 1];
+	while (low < high) {
+		middle = low + ((high - low) / 2);
+		entry = cache_pinned_entries + ((size_t) middle * CACHE_PINNED_ENTRY);
+		c = memcmp(entry, key, CACHE_KEY_SIZE);
+		if (!c) {
+			cache_pinned_hits++;
+			return entry + CACHE_KEY_SIZE;
+		}
+		if (c < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	cache_pinned_misses++;
+	return NULL;
+}
+
+void cache_pinned_stats(int id) {
+	unsigned long lookups;
+
+	if (!cache_pinned_count)
+		return;
+
+	lookups = cache_pinned_hits + cache_pinned_misses;
+	debug_log(DEBUG_FATAL, "cache_pinned_stats(): worker %d: %u precomputed shared secrets, %lu hits, %lu misses (%.1f%% hits)\n",
+			id, cache_pinned_count, cache_pinned_hits, cache_pinned_misses,
+			lookups ? (100.0 * cache_pinned_hits) / lookups : 0.0);
+}
@@ -0,0 +1,367 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+/*
+ * Second level of the shared secret cache, in a named POSIX shared memory
+ * segment: every CurveDNS process running with the same private key (such
+ * as one per listening address) maps the same segment, so a shared secret
+ * computed by one of them is a hit for all of them. It is consulted when
+ * the cache of the worker misses, and filled whenever a shared secret is
+ * computed.
+ *
+ * The segment holds sets of a few entries, each protected by a sequence
+ * counter: readers copy an entry and check that the counter did not change
+ * meanwhile (and was even), so they never wait. Writers take the lock of
+ * the set, which holds the pid of the writing process; the lock of a
+ * process that died while writing is taken over, and its set emptied.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "misc.h"
+
+// Number of shared secrets in the shared memory segment (0: no segment):
+int global_cache_shm = 0;
+
+#define CACHE_SHM_VERSION	1
+#define CACHE_SHM_WAYS		4
+#define CACHE_SHM_HEADER	128			/* the sets start at this offset */
+#define CACHE_SHM_RETRIES	4
+
+static const uint8_t cache_shm_magic[8] = { 'C', 'D', 'N', 'S', 'S', 'H', 'M', 'C' };
+
+struct cache_shm_header {
+	uint8_t magic[8];
+	uint32_t version;
+	uint32_t nrsets;				// a power of two
+	uint64_t hashkey[2];			// random key of the hash function, the same for everyone
+	uint8_t publickey[32];			// the server key the shared secrets belong to
+	uint32_t ready;					// set last, by the process that created the segment
+};
+
+struct cache_shm_entry {
+	uint64_t key[CACHE_KEY_SIZE / 8];
+	uint64_t value[CACHE_VALUE_SIZE / 8];
+};
+
+// One cache line of bookkeeping, followed by the entries:
+struct cache_shm_set {
+	uint32_t seq;					// odd while the set is written
+	int32_t lock;					// pid of the writing process, 0 if none
+	uint8_t tags[CACHE_SHM_WAYS];	// 8 bits of the hash of every key
+	uint8_t used;					// bit per way that holds an entry
+	uint8_t referenced;				// CLOCK: bit per way that was looked up since the hand passed it
+	uint8_t hand;
+	uint8_t pad[64 - 8 - CACHE_SHM_WAYS - 3];
+	struct cache_shm_entry entries[CACHE_SHM_WAYS];
+};
+
+static struct cache_shm_header *cache_shm = NULL;
+static struct cache_shm_set *cache_shm_sets = NULL;
+static size_t cache_shm_size = 0;
+static int32_t cache_shm_pid = 0;
+static unsigned long cache_shm_hits = 0, cache_shm_misses = 0, cache_shm_additions = 0, cache_shm_busy = 0;
+
+static inline uint64_t cache_shm_hash(uint8_t *key) {
+	return misc_siphash(cache_shm->hashkey, key);
+}
+
+static inline struct cache_shm_set *cache_shm_set_of(uint64_t hash) {
+	return &cache_shm_sets[hash & (cache_shm->nrsets - 1)];
+}
+
+// Reads and writes of entries may race with a writer in another process,
+// so they go word by word (the sequence counter tells whether it did):
+static void cache_shm_copy_from(uint64_t *to, uint64_t *from, int words) {
+	int i;
+
+	for (i = 0; i < words; i++)
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+static void cache_shm_copy_to(uint64_t *to, const uint8_t *from, int words) {
+	uint64_t word;
+	int i;
+
+	for (i = 0; i < words; i++) {
+		memcpy(&word, from + (i * 8), 8);
+		__atomic_store_n(&to[i], word, __ATOMIC_RELAXED);
+	}
+}
+
+static int cache_shm_lock(struct cache_shm_set *set) {
+	int32_t owner = 0;
+	uint32_t seq;
+
+	if (__atomic_compare_exchange_n(&set->lock, &owner, cache_shm_pid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		goto locked;
+
+	// The writer died halfway, take over its lock and forget what it wrote:
+	if ((owner != cache_shm_pid) && (kill(owner, 0) == -1) && (errno == ESRCH) &&
+			__atomic_compare_exchange_n(&set->lock, &owner, cache_shm_pid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		debug_log(DEBUG_WARN, "cache_shm_lock(): process %d died while writing, emptying its set\n", owner);
+		seq = __atomic_load_n(&set->seq, __ATOMIC_RELAXED);
+		if (seq & 1)
+			__atomic_store_n(&set->seq, seq + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&set->used, 0, __ATOMIC_RELAXED);
+		goto locked;
+	}
+
+	__sync_fetch_and_add(&cache_shm_busy, 1);
+	return 0;
+
+locked:
+	// Readers see an odd counter from now on:
+	seq = __atomic_load_n(&set->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&set->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return 1;
+}
+
+static void cache_shm_unlock(struct cache_shm_set *set) {
+	__atomic_store_n(&set->seq, __atomic_load_n(&set->seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&set->lock, 0, __ATOMIC_RELEASE);
+}
+
+// Creates the segment of this server key, or maps the one another process
+// created. It is named after id, which is derived from the secret key, so
+// a user without the key cannot know the name and create it first:
+int cache_shm_init(const uint8_t *publickey, const uint8_t *id) {
+	struct cache_shm_header *header = MAP_FAILED;
+	struct stat st;
+	char name[48], hex[33];
+	size_t size;
+	uint32_t nrsets;
+	int fd, created = 0, i;
+
+	if (global_cache_shm <= 0)
+		return 1;
+
+	nrsets = 16;
+	while (((int64_t) nrsets * CACHE_SHM_WAYS) < global_cache_shm)
+		nrsets <<= 1;
+	size = CACHE_SHM_HEADER + ((size_t) nrsets * sizeof(struct cache_shm_set));
+
+	misc_hex_encode(id, 16, hex, 32);
+	hex[32] = '\0';
+	snprintf(name, sizeof(name), "/curvedns-%s", hex);
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd >= 0) {
+		created = 1;
+		if (ftruncate(fd, size) != 0) {
+			debug_log(DEBUG_ERROR, "cache_shm_init(): unable to size shared memory segment %s: %s\n", name, strerror(errno));
+			goto wrong;
+		}
+	} else if (errno == EEXIST) {
+		fd = shm_open(name, O_RDWR, 0);
+		if (fd < 0) {
+			debug_log(DEBUG_ERROR, "cache_shm_init(): unable to open shared memory segment %s: %s\n", name, strerror(errno));
+			goto wrong;
+		}
+		// It holds the shared secrets, so it has to be ours, and ours only:
+		if (fstat(fd, &st) || (st.st_uid != geteuid()) || (st.st_mode & 077)) {
+			debug_log(DEBUG_ERROR, "cache_shm_init(): shared memory segment %s is not private to this user, remove it (/dev/shm%s on Linux)\n", name, name);
+			goto wrong;
+		}
+		// Its creator may not have sized it yet:
+		for (i = 0; !fstat(fd, &st) && !st.st_size && (i < 100); i++)
+			usleep(10000);
+		if (fstat(fd, &st) || (st.st_size < CACHE_SHM_HEADER)) {
+			debug_log(DEBUG_ERROR, "cache_shm_init(): shared memory segment %s is not set up, remove it (/dev/shm%s on Linux)\n", name, name);
+			goto wrong;
+		}
+		size = st.st_size;
+	} else {
+		debug_log(DEBUG_ERROR, "cache_shm_init(): unable to create shared memory segment %s: %s\n", name, strerror(errno));
+		goto wrong;
+	}
+
+	header = (struct cache_shm_header *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		debug_log(DEBUG_ERROR, "cache_shm_init(): unable to map shared memory segment %s: %s\n", name, strerror(errno));
+		goto wrong;
+	}
+
+	if (created) {
+		memcpy(header->magic, cache_shm_magic, sizeof(cache_shm_magic));
+		header->version = CACHE_SHM_VERSION;
+		header->nrsets = nrsets;
+		misc_randombytes((uint8_t *) header->hashkey, sizeof(header->hashkey));
+		memcpy(header->publickey, publickey, sizeof(header->publickey));
+		__atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+	} else {
+		for (i = 0; !__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE) && (i < 100); i++)
+			usleep(10000);
+		nrsets = header->nrsets;
+		if (!header->ready || memcmp(header->magic, cache_shm_magic, sizeof(cache_shm_magic)) ||
+				(header->version != CACHE_SHM_VERSION) || memcmp(header->publickey, publickey, sizeof(header->publickey)) ||
+				!nrsets || (nrsets & (nrsets - 1)) || (size != CACHE_SHM_HEADER + ((size_t) nrsets * sizeof(struct cache_shm_set)))) {
+			debug_log(DEBUG_ERROR, "cache_shm_init(): shared memory segment %s is not usable, remove it (/dev/shm%s on Linux)\n", name, name);
+			goto wrong;
+		}
+	}
+	close(fd);
+
+	cache_shm = header;
+	cache_shm_sets = (struct cache_shm_set *) ((uint8_t *) header + CACHE_SHM_HEADER);
+	cache_shm_size = size;
+	cache_shm_pid = (int32_t) getpid();
+
+	debug_log(DEBUG_INFO, "cache_shm_init(): %s shared memory segment %s of %u shared secrets (%zd bytes)\n",
+			created ? "created" : "attached to", name, nrsets * CACHE_SHM_WAYS, size);
+	return 1;
+
+wrong:
+	if (header != MAP_FAILED)
+		munmap(header, size);
+	if (fd >= 0)
+		close(fd);
+	if (created)
+		shm_unlink(name);
+	return 0;
+}
+
+// Copies the shared secret of key into value, returns 0 if there is none:
+int cache_shm_get(uint8_t *key, uint8_t *value) {
+	struct cache_shm_set *set;
+	struct cache_shm_entry entry;
+	uint64_t hash;
+	uint32_t seq;
+	uint8_t used, tag;
+	int attempt, way;
+
+	if (!cache_shm)
+		return 0;
+
+	hash = cache_shm_hash(key);
+	set = cache_shm_set_of(hash);
+	tag = (uint8_t) (hash >> 56);
+	for (attempt = 0; attempt < CACHE_SHM_RETRIES; attempt++) {
+		seq = __atomic_load_n(&set->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		used = __atomic_load_n(&set->used, __ATOMIC_RELAXED);
+		for (way = 0; way < CACHE_SHM_WAYS; way++) {
+			if (!(used & (1 << way)) || (__atomic_load_n(&set->tags[way], __ATOMIC_RELAXED) != tag))
+				continue;
+			cache_shm_copy_from((uint64_t *) &entry, (uint64_t *) &set->entries[way], sizeof(entry) / 8);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&set->seq, __ATOMIC_RELAXED) != seq)
+				break;
+			if (!memcmp(entry.key, key, CACHE_KEY_SIZE)) {
+				memcpy(value, entry.value, CACHE_VALUE_SIZE);
+				memset(&entry, 0, sizeof(entry));
+				if (!(__atomic_load_n(&set->referenced, __ATOMIC_RELAXED) & (1 << way)))
+					__atomic_fetch_or(&set->referenced, 1 << way, __ATOMIC_RELAXED);
+				__sync_fetch_and_add(&cache_shm_hits, 1);
+				return 1;
+			}
+		}
+		if (way == CACHE_SHM_WAYS)
+			break;
+	}
+
+	memset(&entry, 0, sizeof(entry));
+	__sync_fetch_and_add(&cache_shm_misses, 1);
+	return 0;
+}
+
+// Adds key with its shared secret, unless another writer has its set (it
+// is only a cache):
+int cache_shm_set(uint8_t *key, uint8_t *value) {
+	struct cache_shm_set *set;
+	uint64_t hash;
+	uint8_t tag, used, referenced;
+	int i, way;
+
+	if (!cache_shm)
+		return 0;
+
+	hash = cache_shm_hash(key);
+	set = cache_shm_set_of(hash);
+	tag = (uint8_t) (hash >> 56);
+	if (!cache_shm_lock(set))
+		return 0;
+
+	used = set->used;
+	for (way = 0; way < CACHE_SHM_WAYS; way++)
+		if ((used & (1 << way)) && (set->tags[way] == tag) && !memcmp(set->entries[way].key, key, CACHE_KEY_SIZE))
+			break;
+	if (way == CACHE_SHM_WAYS) {
+		for (way = 0; (way < CACHE_SHM_WAYS) && (used & (1 << way)); way++);
+	}
+	if (way == CACHE_SHM_WAYS) {
+		// Full: the hand skips (and clears) the ways that were looked up:
+		way = set->hand % CACHE_SHM_WAYS;
+		for (i = 0; i < CACHE_SHM_WAYS; i++, way = (way + 1) % CACHE_SHM_WAYS) {
+			referenced = __atomic_load_n(&set->referenced, __ATOMIC_RELAXED);
+			if (!(referenced & (1 << way)))
+				break;
+			__atomic_fetch_and(&set->referenced, ~(1 << way), __ATOMIC_RELAXED);
+		}
+		set->hand = (way + 1) % CACHE_SHM_WAYS;
+	}
+
+	cache_shm_copy_to(set->entries[way].key, key, CACHE_KEY_SIZE / 8);
+	cache_shm_copy_to(set->entries[way].value, value, CACHE_VALUE_SIZE / 8);
+	__atomic_store_n(&set->tags[way], tag, __ATOMIC_RELAXED);
+	__atomic_fetch_and(&set->referenced, ~(1 << way), __ATOMIC_RELAXED);
+	__atomic_store_n(&set->used, used | (1 << way), __ATOMIC_RELAXED);
+	cache_shm_unlock(set);
+
+	__sync_fetch_and_add(&cache_shm_additions, 1);
+	return 1;
+}
+
+void cache_shm_stats() {
+	unsigned long lookups;
+
+	if (!cache_shm)
+		return;
+
+	lookups = cache_shm_hits + cache_shm_misses;
+	debug_log(DEBUG_FATAL, "cache_shm_stats(): shared memory: %u positions, %lu hits, %lu misses (%.1f%% hits), %lu added, %lu not added while another process wrote\n",
+			cache_shm->nrsets * CACHE_SHM_WAYS, cache_shm_hits, cache_shm_misses,
+			lookups ? (100.0 * cache_shm_hits) / lookups : 0.0, cache_shm_additions, cache_shm_busy);
+}
@@ -0,0 +1,225 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+// Where snapshots of the shared secret caches are kept (NULL: nowhere),
+// and how often they are written (0: only when quitting):
+char *global_cache_snapshot = NULL;
+double global_cache_snapshot_interval = 600;
+
+static const uint8_t cache_snapshot_magic[8] = { 'C', 'D', 'N', 'S', 'C', 'A', 'C', 'H' };
+
+static int cache_snapshot_entry(uint8_t *key, uint8_t *value, void *arg) {
+	struct cache_snapshot *snapshot = (struct cache_snapshot *) arg;
+	uint8_t *entries;
+	uint32_t size;
+
+	if (snapshot->count == snapshot->size) {
+		size = snapshot->size ? (snapshot->size * 2) : 1024;
+		entries = (uint8_t *) realloc(snapshot->entries, (size_t) size * (CACHE_KEY_SIZE + CACHE_VALUE_SIZE));
+		if (!entries)
+			return 0;
+		snapshot->entries = entries;
+		snapshot->size = size;
+	}
+
+	entries = snapshot->entries + ((size_t) snapshot->count * (CACHE_KEY_SIZE + CACHE_VALUE_SIZE));
+	memcpy(entries, key, CACHE_KEY_SIZE);
+	memcpy(entries + CACHE_KEY_SIZE, value, CACHE_VALUE_SIZE);
+	snapshot->count++;
+	return 1;
+}
+
+// Copies all entries in a single pass over the table, so the count is
+// that of the entries taken, even when other threads add to it meanwhile:
+int cache_snapshot_take(struct cache_table *table, struct cache_snapshot *snapshot) {
+	snapshot->entries = NULL;
+	snapshot->count = snapshot->size = 0;
+
+	if (!table || !cache_iterate(table, cache_snapshot_entry, snapshot)) {
+		debug_log(DEBUG_ERROR, "cache_snapshot_take(): unable to copy the entries of the cache\n");
+		cache_snapshot_free(snapshot);
+		return 0;
+	}
+	return 1;
+}
+
+void cache_snapshot_free(struct cache_snapshot *snapshot) {
+	if (snapshot->entries)
+		free(snapshot->entries);
+	snapshot->entries = NULL;
+	snapshot->count = snapshot->size = 0;
+}
+
+// Writes the entries taken to a fresh file next to path, that replaces path
+// once it is complete, so a crash halfway never leaves a broken snapshot.
+// It does not touch the cache, so any thread can do it:
+int cache_snapshot_save(struct cache_snapshot *snapshot, const char *path, const uint8_t *publickey) {
+	struct cache_snapshot_header header;
+	char tmppath[1024];
+	FILE *f = NULL;
+	int fd = -1, created = 0;
+
+	if (!path)
+		goto wrong;
+	if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= (int) sizeof(tmppath))
+		goto wrong;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, cache_snapshot_magic, sizeof(header.magic));
+	header.version = CACHE_SNAPSHOT_VERSION;
+	memcpy(header.publickey, publickey, sizeof(header.publickey));
+	header.count = snapshot->count;
+
+	// The file holds shared secrets, so only we may read it:
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		goto wrong;
+	created = 1;
+	f = fdopen(fd, "w");
+	if (!f)
+		goto wrong;
+	fd = -1;
+
+	if (fwrite(&header, sizeof(header), 1, f) != 1)
+		goto wrong;
+	if (snapshot->count && (fwrite(snapshot->entries, CACHE_KEY_SIZE + CACHE_VALUE_SIZE, snapshot->count, f) != snapshot->count))
+		goto wrong;
+	if (fflush(f) || fsync(fileno(f)))
+		goto wrong;
+	if (fclose(f)) {
+		f = NULL;
+		goto wrong;
+	}
+	f = NULL;
+
+	if (rename(tmppath, path))
+		goto wrong;
+
+	debug_log(DEBUG_INFO, "cache_snapshot_save(): wrote %u shared secrets to %s\n", header.count, path);
+	return 1;
+
+wrong:
+	debug_log(DEBUG_ERROR, "cache_snapshot_save(): unable to write snapshot %s\n", path ? path : "(none)");
+	if (f)
+		fclose(f);
+	if (fd >= 0)
+		close(fd);
+	if (created)
+		unlink(tmppath);
+	return 0;
+}
+
+// Takes and saves a snapshot in one go:
+int cache_snapshot_write(struct cache_table *table, const char *path, const uint8_t *publickey) {
+	struct cache_snapshot snapshot;
+	int result;
+
+	if (!cache_snapshot_take(table, &snapshot))
+		return 0;
+	result = cache_snapshot_save(&snapshot, path, publickey);
+	cache_snapshot_free(&snapshot);
+	return result;
+}
+
+// Maps the snapshot at path, and adds its entries to the cache, when it was
+// written for the same server key. Of a snapshot larger than the cache,
+// only the newest nrentries entries are added:
+int cache_snapshot_read(struct cache_table *table, const char *path, const uint8_t *publickey, int nrentries) {
+	struct cache_snapshot_header *header;
+	struct stat st;
+	uint8_t *map = MAP_FAILED, *entry;
+	uint32_t i, first;
+	int fd = -1;
+
+	if (!table || !path)
+		goto wrong;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		debug_log(DEBUG_INFO, "cache_snapshot_read(): no snapshot at %s\n", path);
+		return 0;
+	}
+	if (fstat(fd, &st) || (st.st_size < (off_t) sizeof(struct cache_snapshot_header)))
+		goto invalid;
+
+	map = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto wrong;
+	close(fd);
+	fd = -1;
+
+	header = (struct cache_snapshot_header *) map;
+	if (memcmp(header->magic, cache_snapshot_magic, sizeof(header->magic)) || (header->version != CACHE_SNAPSHOT_VERSION))
+		goto invalid;
+	if ((uint64_t) st.st_size != sizeof(struct cache_snapshot_header) + ((uint64_t) header->count * (CACHE_KEY_SIZE + CACHE_VALUE_SIZE)))
+		goto invalid;
+	if (memcmp(header->publickey, publickey, sizeof(header->publickey))) {
+		debug_log(DEBUG_WARN, "cache_snapshot_read(): snapshot %s belongs to another server key, ignoring it\n", path);
+		goto done;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	first = (header->count > (uint32_t) nrentries) ? (header->count - nrentries) : 0;
+	for (i = first; i < header->count; i++) {
+		entry = map + sizeof(struct cache_snapshot_header) + ((size_t) i * (CACHE_KEY_SIZE + CACHE_VALUE_SIZE));
+		if (!cache_set(table, entry, entry + CACHE_KEY_SIZE))
+			goto wrong;
+	}
+
+	debug_log(DEBUG_INFO, "cache_snapshot_read(): restored %u shared secrets from %s\n", header->count - first, path);
+	munmap(map, st.st_size);
+	return 1;
+
+invalid:
+	debug_log(DEBUG_WARN, "cache_snapshot_read(): %s is not a valid snapshot, ignoring it\n", path);
+	goto done;
+
+wrong:
+	debug_log(DEBUG_ERROR, "cache_snapshot_read(): unable to read snapshot %s\n", path ? path : "(none)");
+done:
+	if (map != MAP_FAILED)
+		munmap(map, st.st_size);
+	if (fd >= 0)
+		close(fd);
+	return 0;
+}
@@ -0,0 +1,663 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#include "cache_swiss.h"
+#include "misc.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// A larger cache would not fit the slot numbers anyway:
+#define CACHE_MAX_ENTRIES	(1 << 28)
+
+static int cache_swiss_resize_step(struct cache_table *, int);
+static int cache_swiss_destroy(struct cache_table *);
+
+// The key is a public key chosen by the client, so it is hashed with a
+// random key of the table (SipHash), otherwise keys could be crafted that
+// all end up in the same group. The top 7 bits of the hash are the tag,
+// the bits below that select the first group to probe.
+static inline uint64_t cache_hash(struct cache_table *table, uint8_t *key) {
+	return misc_siphash(table->hashkey, key);
+}
+
+#define CACHE_HASH_TAG(hash)		((uint8_t) ((hash) >> 57))
+#define CACHE_HASH_GROUP(hash)		((uint32_t) ((hash) >> 20))
+
+// Bit i of the result is set when control byte i of the group equals ctrl:
+static inline uint32_t cache_match(const uint8_t *group, uint8_t ctrl) {
+#if defined(__AVX2__)
+	__m256i bytes = _mm256_load_si256((const __m256i *) group);
+	return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8((char) ctrl)));
+#elif defined(__SSE2__)
+	__m128i bytes = _mm_load_si128((const __m128i *) group);
+	return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char) ctrl)));
+#else
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < CACHE_GROUP_SIZE; i++)
+		if (group[i] == ctrl)
+			mask |= (1U << i);
+	return mask;
+#endif
+}
+
+// Same, for the slots that are free (empty or deleted, the high bit is set):
+static inline uint32_t cache_match_free(const uint8_t *group) {
+#if defined(__AVX2__)
+	return (uint32_t) _mm256_movemask_epi8(_mm256_load_si256((const __m256i *) group));
+#elif defined(__SSE2__)
+	return (uint32_t) _mm_movemask_epi8(_mm_load_si128((const __m128i *) group));
+#else
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < CACHE_GROUP_SIZE; i++)
+		if (group[i] & 0x80)
+			mask |= (1U << i);
+	return mask;
+#endif
+}
+
+// Groups are probed triangularly (1, 2, 3, ... groups further), which
+// visits every group once, as the number of groups is a power of two.
+// A key is absent as soon as a group with an empty slot was probed.
+static int cache_find(struct cache_table *table, uint8_t *key, uint64_t hash) {
+	uint32_t group = CACHE_HASH_GROUP(hash) & table->groupmask, step, match;
+	uint8_t tag = CACHE_HASH_TAG(hash);
+	uint8_t *ctrl;
+	int slot;
+
+	for (step = 1; step <= table->groupmask + 1; step++) {
+		ctrl = table->ctrl + (group * CACHE_GROUP_SIZE);
+		match = cache_match(ctrl, tag);
+		while (match) {
+			slot = (group * CACHE_GROUP_SIZE) + __builtin_ctz(match);
+			if (memcmp(table->slots[slot].key, key, CACHE_KEY_SIZE) == 0)
+				return slot;
+			match &= match - 1;
+		}
+		if (cache_match(ctrl, CACHE_CTRL_EMPTY))
+			break;
+		group = (group + step) & table->groupmask;
+	}
+
+	return -1;
+}
+
+// Claims the first free slot on the probe sequence of hash, there is always
+// one, as the table is at most 7/8 full:
+static int cache_claim(struct cache_table *table, uint64_t hash) {
+	uint32_t group = CACHE_HASH_GROUP(hash) & table->groupmask, step, match;
+	int slot;
+
+	for (step = 1; ; step++) {
+		match = cache_match_free(table->ctrl + (group * CACHE_GROUP_SIZE));
+		if (match)
+			break;
+		group = (group + step) & table->groupmask;
+	}
+
+	slot = (group * CACHE_GROUP_SIZE) + __builtin_ctz(match);
+	if (table->ctrl[slot] == CACHE_CTRL_DELETED)
+		table->nrdeleted--;
+	table->ctrl[slot] = CACHE_HASH_TAG(hash);
+	table->nrused++;
+
+	return slot;
+}
+
+// A slot can only become empty again when its group has an empty slot left:
+// in that case the group was never full, so no probe sequence went past it.
+// Otherwise it becomes deleted, so lookups continue with the next group.
+static void cache_release(struct cache_table *table, int slot) {
+	uint8_t *ctrl = table->ctrl + ((slot / CACHE_GROUP_SIZE) * CACHE_GROUP_SIZE);
+
+	if (cache_match(ctrl, CACHE_CTRL_EMPTY)) {
+		table->ctrl[slot] = CACHE_CTRL_EMPTY;
+	} else {
+		table->ctrl[slot] = CACHE_CTRL_DELETED;
+		table->nrdeleted++;
+	}
+	table->nrused--;
+}
+
+static uint8_t *cache_sketch_block(struct cache_table *table, uint64_t hash, uint64_t *bits) {
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	*bits = hash >> 40;
+	return table->sketch + ((hash & table->sketchmask) * CACHE_SKETCH_BLOCK);
+}
+
+// Halving all counters makes the keys that were busy a while ago make room
+// for the ones that are busy now:
+static void cache_sketch_age(struct cache_table *table) {
+	uint64_t *words = (uint64_t *) table->sketch;
+	size_t i;
+
+	for (i = 0; i < (((size_t) table->sketchmask + 1) * CACHE_SKETCH_BLOCK) / 8; i++)
+		words[i] = (words[i] >> 1) & 0x7f7f7f7f7f7f7f7fULL;
+	table->additions /= 2;
+}
+
+static void cache_sketch_add(struct cache_table *table, uint64_t hash) {
+	uint64_t bits;
+	uint8_t *block = cache_sketch_block(table, hash, &bits), *counter;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		counter = block + (i * (CACHE_SKETCH_BLOCK / 4)) + ((bits >> (i * 4)) & 15);
+		if (*counter < CACHE_SKETCH_MAX)
+			(*counter)++;
+	}
+
+	if (++table->additions >= table->sample)
+		cache_sketch_age(table);
+}
+
+static int cache_sketch_estimate(struct cache_table *table, uint64_t hash) {
+	uint64_t bits;
+	uint8_t *block = cache_sketch_block(table, hash, &bits), counter;
+	int i, estimate = CACHE_SKETCH_MAX;
+
+	for (i = 0; i < 4; i++) {
+		counter = block[(i * (CACHE_SKETCH_BLOCK / 4)) + ((bits >> (i * 4)) & 15)];
+		if (counter < estimate)
+			estimate = counter;
+	}
+
+	return estimate;
+}
+
+static void *cache_alloc(size_t size) {
+	void *ptr = NULL;
+
+	if (posix_memalign(&ptr, 64, size))
+		return NULL;
+	return ptr;
+}
+
+// Moves all entries to fresh arrays, which gets rid of the deleted slots,
+// and keeps the order in which they were added:
+static int cache_rehash(struct cache_table *table) {
+	uint8_t *oldctrl = table->ctrl, *oldreferenced = table->referenced;
+	struct cache_slot *oldslots = table->slots;
+	uint8_t *ctrl = NULL, *referenced = NULL;
+	struct cache_slot *slots = NULL;
+	int i, nrused, pos, slot;
+
+	ctrl = (uint8_t *) cache_alloc(table->nrslots);
+	slots = (struct cache_slot *) cache_alloc(table->nrslots * sizeof(struct cache_slot));
+	referenced = (uint8_t *) cache_alloc(table->nrslots);
+	if (!ctrl || !slots || !referenced)
+		goto wrong;
+	memset(ctrl, CACHE_CTRL_EMPTY, table->nrslots);
+
+	table->ctrl = ctrl;
+	table->slots = slots;
+	table->referenced = referenced;
+	nrused = table->nrused;
+	table->nrused = 0;
+	table->nrdeleted = 0;
+
+	for (i = 0; i < nrused; i++) {
+		pos = (table->oldest + i) % table->nrentries;
+		slot = cache_claim(table, cache_hash(table, oldslots[table->order[pos]].key));
+		memcpy(&slots[slot], &oldslots[table->order[pos]], sizeof(struct cache_slot));
+		referenced[slot] = oldreferenced[table->order[pos]];
+		table->order[pos] = slot;
+	}
+
+	memset(oldslots, 0, table->nrslots * sizeof(struct cache_slot));
+	free(oldslots);
+	free(oldctrl);
+	free(oldreferenced);
+	table->rehashes++;
+
+	return 1;
+
+wrong:
+	free(ctrl);
+	free(slots);
+	free(referenced);
+	return 0;
+}
+
+static void cache_swiss_stats(struct cache_table *table) {
+	unsigned long lookups;
+
+	if (!table)
+		return;
+
+	lookups = table->hits + table->misses;
+	debug_log(DEBUG_FATAL, "cache_swiss_stats(): %s%s: usage: %d/%d, %lu hits, %lu misses (%.1f%% hits), %lu evictions, %lu not admitted\n",
+			(table->policy == CACHE_POLICY_CLOCK) ? "clock" : "fifo", table->sketch ? "+tinylfu" : "",
+			table->nrused, table->nrentries, table->hits, table->misses,
+			lookups ? (100.0 * table->hits) / lookups : 0.0, table->evictions, table->rejections);
+	debug_log(DEBUG_DEBUG, "cache_swiss_stats(): %d slots in groups of %d, %d deleted, %lu rehashes\n",
+			table->nrslots, CACHE_GROUP_SIZE, table->nrdeleted, table->rehashes);
+	if (table->old)
+		debug_log(DEBUG_FATAL, "cache_swiss_stats(): resizing from %d entries, %d left to move\n", table->old->nrentries, table->old->nrused);
+}
+
+// Frees the arrays of a table:
+static void cache_free(struct cache_table *table) {
+	if (table->slots) {
+		memset(table->slots, 0, table->nrslots * sizeof(struct cache_slot));
+		free(table->slots);
+	}
+	free(table->ctrl);
+	free(table->referenced);
+	free(table->sketch);
+	free(table->order);
+	table->slots = NULL;
+	table->ctrl = table->referenced = table->sketch = NULL;
+	table->order = NULL;
+}
+
+// Allocates fresh (empty) arrays for nrentries entries, and a sketch of their
+// frequencies when admission is set:
+static int cache_allocate(struct cache_table *table, int nrentries, int admission) {
+	int nrslots, nrblocks;
+
+	table->ctrl = table->referenced = table->sketch = NULL;
+	table->slots = NULL;
+	table->order = NULL;
+
+	// At most 3/4 of the slots are used, so lookups stop after a group or
+	// two, and there is room for deleted slots before a rehash is needed:
+	nrslots = CACHE_GROUP_SIZE;
+	while (((int64_t) nrslots * 3) < ((int64_t) nrentries * 4))
+		nrslots <<= 1;
+	table->nrslots = nrslots;
+
+	table->ctrl = (uint8_t *) cache_alloc(nrslots);
+	if (!table->ctrl)
+		goto wrong;
+	memset(table->ctrl, CACHE_CTRL_EMPTY, nrslots);
+
+	table->slots = (struct cache_slot *) cache_alloc(nrslots * sizeof(struct cache_slot));
+	if (!table->slots)
+		goto wrong;
+	memset(table->slots, 0, nrslots * sizeof(struct cache_slot));
+
+	table->referenced = (uint8_t *) cache_alloc(nrslots);
+	if (!table->referenced)
+		goto wrong;
+	memset(table->referenced, 0, nrslots);
+
+	table->order = (uint32_t *) malloc(nrentries * sizeof(uint32_t));
+	if (!table->order)
+		goto wrong;
+
+	// About four counters per entry, aged every ten times as many lookups
+	// as there are entries:
+	if (admission) {
+		nrblocks = 1;
+		while ((nrblocks * (CACHE_SKETCH_BLOCK / 4)) < nrentries)
+			nrblocks <<= 1;
+		table->sketch = (uint8_t *) cache_alloc(nrblocks * CACHE_SKETCH_BLOCK);
+		if (!table->sketch)
+			goto wrong;
+		memset(table->sketch, 0, nrblocks * CACHE_SKETCH_BLOCK);
+		table->sketchmask = nrblocks - 1;
+		table->sample = (unsigned long) nrentries * 10;
+		table->additions = 0;
+	}
+
+	table->groupmask = (nrslots / CACHE_GROUP_SIZE) - 1;
+	table->nrentries = nrentries;
+	table->nrused = 0;
+	table->nrdeleted = 0;
+	table->oldest = 0;
+	table->growth = nrslots - (nrslots / 8);
+
+	debug_log(DEBUG_INFO, "cache_allocate(): %d slots, allocated %zd bytes in total for the shared secret cache structure\n", nrslots,
+			(nrslots * (2 + sizeof(struct cache_slot))) + (nrentries * sizeof(uint32_t)) + sizeof(struct cache_table)
+			+ (table->sketch ? ((table->sketchmask + 1) * CACHE_SKETCH_BLOCK) : 0));
+
+	return 1;
+
+wrong:
+	cache_free(table);
+	return 0;
+}
+
+static struct cache_table *cache_swiss_init(int nrentries) {
+	struct cache_table *table = NULL;
+
+	if ((nrentries < 1) || (nrentries > CACHE_MAX_ENTRIES))
+		goto wrong;
+
+	table = (struct cache_table *) malloc(sizeof(struct cache_table));
+	if (!table)
+		goto wrong;
+	memset(table, 0, sizeof(struct cache_table));
+
+	if (!cache_allocate(table, nrentries, global_cache_admission))
+		goto wrong;
+
+	misc_randombytes((uint8_t *) table->hashkey, sizeof(table->hashkey));
+	table->policy = global_cache_policy;
+
+	return table;
+
+wrong:
+	debug_log(DEBUG_ERROR, "cache_swiss_init(): something went wrong while initializing\n");
+	cache_swiss_destroy(table);
+	return NULL;
+}
+
+static uint8_t *cache_swiss_get(struct cache_table *table, uint8_t *key) {
+	uint64_t hash;
+	int slot;
+
+	if (!table || !key)
+		goto wrong;
+
+	hash = cache_hash(table, key);
+	if (table->sketch)
+		cache_sketch_add(table, hash);
+	if (!table->nrused && !table->old)
+		goto wrong;
+
+	slot = cache_find(table, key, hash);
+	if (slot >= 0) {
+		// Only written once per round of the hand, to keep the line clean:
+		if (!table->referenced[slot])
+			table->referenced[slot] = 1;
+		table->hits++;
+		return table->slots[slot].value;
+	}
+
+	// While resizing, entries that were not moved yet are still in the old
+	// arrays (they are moved along with their reference):
+	if (table->old && table->old->nrused && ((slot = cache_find(table->old, key, hash)) >= 0)) {
+		table->old->referenced[slot] = 1;
+		table->hits++;
+		return table->old->slots[slot].value;
+	}
+
+wrong:
+	if (table)
+		table->misses++;
+	return NULL;
+}
+
+// Adds key, or replaces its value. Entries moved from the old arrays while
+// resizing (moving is set) are not subject to admission, do not replace a
+// value that was set since, and become the oldest entry (there is always
+// room for them, see cache_swiss_resize_step()):
+static int cache_add(struct cache_table *table, uint8_t *key, uint8_t *value, uint64_t hash, int moving) {
+	int slot;
+
+	slot = cache_find(table, key, hash);
+	if (slot >= 0) {
+		if (!moving)
+			memcpy(table->slots[slot].value, value, CACHE_VALUE_SIZE);
+		return 1;
+	}
+
+	// While resizing, the entries left in the old arrays are the oldest ones
+	// and count against the new size, so they are pushed out first:
+	if (!moving && table->old && table->old->nrused
+			&& ((table->nrused + table->old->nrused) >= table->nrentries)) {
+		if (table->sketch && (cache_sketch_estimate(table, hash)
+				<= cache_sketch_estimate(table, cache_hash(table, table->old->slots[table->old->order[table->old->oldest]].key)))) {
+			table->rejections++;
+			return 2;
+		}
+		cache_release(table->old, table->old->order[table->old->oldest]);
+		table->old->oldest = (table->old->oldest + 1) % table->old->nrentries;
+		table->evictions++;
+	} else if (table->nrused >= table->nrentries) {
+		// All positions of the ring are in use, so moving the hand past an
+		// entry gives it a second chance, as it is now the newest one:
+		if (table->policy == CACHE_POLICY_CLOCK) {
+			while (table->referenced[table->order[table->oldest]]) {
+				table->referenced[table->order[table->oldest]] = 0;
+				table->oldest = (table->oldest + 1) % table->nrentries;
+			}
+		}
+		// TinyLFU: a new key has to have been looked up more often than
+		// the one it would push out, so keys seen only once (like those of
+		// a flood of new keys) cannot push the busy ones out:
+		if (!moving && table->sketch && (cache_sketch_estimate(table, hash)
+				<= cache_sketch_estimate(table, cache_hash(table, table->slots[table->order[table->oldest]].key)))) {
+			table->rejections++;
+			return 2;
+		}
+		debug_log(DEBUG_DEBUG, "cache_swiss_set(): cache full - forcing oldest one out\n");
+		cache_release(table, table->order[table->oldest]);
+		table->oldest = (table->oldest + 1) % table->nrentries;
+		table->evictions++;
+	}
+
+	if ((table->nrused + table->nrdeleted) >= table->growth) {
+		debug_log(DEBUG_DEBUG, "cache_swiss_set(): rehashing, %d used and %d deleted slots\n", table->nrused, table->nrdeleted);
+		if (!cache_rehash(table))
+			debug_log(DEBUG_WARN, "cache_swiss_set(): unable to rehash, continuing with deleted slots\n");
+	}
+
+	slot = cache_claim(table, hash);
+	table->referenced[slot] = 0;
+	memcpy(table->slots[slot].key, key, CACHE_KEY_SIZE);
+	memcpy(table->slots[slot].value, value, CACHE_VALUE_SIZE);
+	if (moving) {
+		table->oldest = (table->oldest + table->nrentries - 1) % table->nrentries;
+		table->order[table->oldest] = slot;
+	} else {
+		table->order[(table->oldest + table->nrused - 1) % table->nrentries] = slot;
+	}
+
+	return 1;
+}
+
+static int cache_swiss_set(struct cache_table *table, uint8_t *key, uint8_t *value) {
+	if (!table || !key || !value)
+		goto wrong;
+
+	return cache_add(table, key, value, cache_hash(table, key), 0);
+
+wrong:
+	return 0;
+}
+
+// Starts moving the entries to arrays for nrentries entries, a few at a time
+// (see cache_swiss_resize_step()), so lookups and additions go on in the
+// meantime. The oldest entries that do not fit are pushed out:
+static int cache_swiss_resize(struct cache_table *table, int nrentries) {
+	struct cache_table *old = NULL;
+
+	if (!table || (nrentries < 1) || (nrentries > CACHE_MAX_ENTRIES))
+		goto wrong;
+
+	// Only one resize at a time:
+	while (cache_swiss_resize_step(table, table->old ? table->old->nrused : 0));
+
+	old = (struct cache_table *) malloc(sizeof(struct cache_table));
+	if (!old)
+		goto wrong;
+	memcpy(old, table, sizeof(struct cache_table));
+
+	if (!cache_allocate(table, nrentries, old->sketch != NULL)) {
+		memcpy(table, old, sizeof(struct cache_table));
+		free(old);
+		goto wrong;
+	}
+	table->old = old;
+
+	debug_log(DEBUG_INFO, "cache_swiss_resize(): resizing from %d to %d entries, %d to move\n", old->nrentries, nrentries, old->nrused);
+	return 1;
+
+wrong:
+	debug_log(DEBUG_ERROR, "cache_swiss_resize(): unable to resize to %d entries\n", nrentries);
+	return 0;
+}
+
+// Moves at most count entries to the new arrays, returns 1 as long as
+// there are entries left to move:
+static int cache_swiss_resize_step(struct cache_table *table, int count) {
+	struct cache_table *old;
+	uint64_t hash;
+	int i, slot, moved;
+
+	if (!table || !table->old)
+		return 0;
+
+	// The newest entry left is moved in front of the ones moved before, so
+	// the order stays the same, and the entries added since the resize
+	// started stay the newest ones. When shrinking, the oldest entries that
+	// do not fit next to all of those are pushed out right away:
+	old = table->old;
+	for (i = 0; (i < count) && old->nrused; i++) {
+		if (old->nrused + table->nrused > table->nrentries) {
+			cache_release(old, old->order[old->oldest]);
+			old->oldest = (old->oldest + 1) % old->nrentries;
+			table->evictions++;
+			continue;
+		}
+		slot = old->order[(old->oldest + old->nrused - 1) % old->nrentries];
+		hash = cache_hash(table, old->slots[slot].key);
+		cache_add(table, old->slots[slot].key, old->slots[slot].value, hash, 1);
+		if (old->referenced[slot] && ((moved = cache_find(table, old->slots[slot].key, hash)) >= 0))
+			table->referenced[moved] = 1;
+		cache_release(old, slot);
+	}
+	if (old->nrused)
+		return 1;
+
+	debug_log(DEBUG_INFO, "cache_swiss_resize_step(): done resizing to %d entries\n", table->nrentries);
+	cache_free(old);
+	free(old);
+	table->old = NULL;
+	return 0;
+}
+
+static int cache_swiss_empty(struct cache_table *table) {
+	if (!table)
+		goto wrong;
+
+	if (table->old) {
+		cache_free(table->old);
+		free(table->old);
+		table->old = NULL;
+	}
+
+	memset(table->ctrl, CACHE_CTRL_EMPTY, table->nrslots);
+	memset(table->slots, 0, table->nrslots * sizeof(struct cache_slot));
+	memset(table->referenced, 0, table->nrslots);
+	table->nrused = 0;
+	table->nrdeleted = 0;
+	table->oldest = 0;
+
+	return 1;
+
+wrong:
+	return 0;
+}
+
+// Calls fn for every entry, oldest first, until it returns 0:
+static int cache_swiss_iterate(struct cache_table *table, int (*fn)(uint8_t *, uint8_t *, void *), void *arg) {
+	struct cache_slot *slot;
+	int i;
+
+	if (!table || !fn)
+		goto wrong;
+
+	// Entries that were not moved yet are older than the ones that were,
+	// which are in turn older than the ones added since the resize started:
+	if (table->old && !cache_swiss_iterate(table->old, fn, arg))
+		goto wrong;
+
+	for (i = 0; i < table->nrused; i++) {
+		slot = &table->slots[table->order[(table->oldest + i) % table->nrentries]];
+		if (!fn(slot->key, slot->value, arg))
+			goto wrong;
+	}
+
+	return 1;
+
+wrong:
+	return 0;
+}
+
+
+// Bytes allocated for the table (and the one it is resizing from):
+static size_t cache_swiss_memory(struct cache_table *table) {
+	size_t size;
+
+	if (!table)
+		return 0;
+
+	size = sizeof(struct cache_table) + (table->nrslots * (2 + sizeof(struct cache_slot))) + (table->nrentries * sizeof(uint32_t))
+			+ (table->sketch ? ((table->sketchmask + 1) * CACHE_SKETCH_BLOCK) : 0);
+	if (table->old)
+		size += cache_swiss_memory(table->old);
+
+	return size;
+}
+
+static int cache_swiss_destroy(struct cache_table *table) {
+	if (table) {
+		if (table->old) {
+			cache_free(table->old);
+			free(table->old);
+		}
+		cache_free(table);
+		free(table);
+	}
+	return 1;
+}
+
+// Every thread has its own table, see the concurrent backend for a shared one:
+const struct cache_backend cache_backend_swiss = {
+	.name = "swiss",
+	.policy = CACHE_POLICY_CLOCK,
+	.admission = 1,
+	.init = cache_swiss_init,
+	.get = cache_swiss_get,
+	.set = cache_swiss_set,
+	.empty = cache_swiss_empty,
+	.destroy = cache_swiss_destroy,
+	.iterate = cache_swiss_iterate,
+	.stats = cache_swiss_stats,
+	.memory = cache_swiss_memory,
+	.resize = cache_swiss_resize,
+	.resize_step = cache_swiss_resize_step,
+};
@@ -0,0 +1,86 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#ifndef CACHE_SWISS_H_
+#define CACHE_SWISS_H_
+
+#include "cache.h"
+
+// Open addressing, in the style of Google's SwissTable: next to the slots
+// there is one control byte per slot, which is either empty, deleted or
+// holds 7 bits of the hash of the key in that slot (its tag). A lookup
+// compares the tag with a whole group of control bytes at once, and only
+// compares keys of the slots whose tags match.
+#ifdef __AVX2__
+#define CACHE_GROUP_SIZE	32
+#else
+#define CACHE_GROUP_SIZE	16
+#endif
+
+// Count-min sketch: a key has one counter (up to 15) in each quarter of a
+// 64-byte block, the estimate of its frequency is the smallest of those:
+#define CACHE_SKETCH_BLOCK	64
+#define CACHE_SKETCH_MAX	15
+
+#define CACHE_CTRL_EMPTY	0x80
+#define CACHE_CTRL_DELETED	0xfe
+
+// Exactly one cache line:
+struct cache_slot {
+	uint8_t key[CACHE_KEY_SIZE];
+	uint8_t value[CACHE_VALUE_SIZE];
+};
+
+struct cache_table {
+	uint64_t hashkey[2];			// random key of the hash function
+	uint8_t *ctrl;					// control bytes, aligned to a cache line
+	struct cache_slot *slots;		// aligned to a cache line
+	uint32_t *order;				// used slots, oldest first (ring of nrentries)
+	uint8_t *referenced;			// CLOCK: slot was looked up since the hand passed it
+	uint32_t groupmask;				// number of groups - 1 (a power of two)
+	int nrslots, nrentries, nrused, nrdeleted;
+	int oldest;						// position of the oldest slot in order (the hand of CLOCK)
+	int growth;						// rehash when nrused + nrdeleted reaches this
+	int policy;
+	uint8_t *sketch;				// TinyLFU: counters of lookups, in blocks of a cache line
+	uint32_t sketchmask;			// number of blocks - 1 (a power of two)
+	unsigned long additions;		// lookups counted since the counters were last halved
+	unsigned long sample;			// halve the counters after this many lookups
+	unsigned long hits, misses, evictions, rejections, rehashes;
+	struct cache_table *old;		// while resizing: the entries still to be moved
+};
+
+#endif /* CACHE_SWISS_H_ */
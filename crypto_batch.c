@@ -0,0 +1,698 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#include "crypto_batch.h"
+#include "crypto_box_curve25519xsalsa20poly1305.h"
+#include "crypto_core_hsalsa20.h"
+#include "crypto_scalarmult_curve25519.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRYPTO_BATCH_X86
+#include <immintrin.h>
+#endif
+
+static const uint8_t crypto_batch_sigma[16] = "expand 32-byte k";
+static const uint8_t crypto_batch_zero[16] = { 0 };
+
+// The bit offsets of the limbs of a field element in both radixes:
+static const int crypto_batch_radix25[10] = { 0, 26, 51, 77, 102, 128, 153, 179, 204, 230 };
+static const int crypto_batch_radix51[5] = { 0, 51, 102, 153, 204 };
+
+// Splits the u-coordinate p into limbs, ignoring its top bit like NaCl does:
+static void crypto_batch_unpack(uint64_t *limbs, const uint8_t *p, const int *offsets, int count) {
+	uint64_t w[5] = { 0 };
+	int i, end;
+
+	for (i = 0; i < 32; i++)
+		w[i / 8] |= ((uint64_t) p[i]) << (8 * (i % 8));
+	w[3] &= 0x7fffffffffffffffULL;
+
+	for (i = 0; i < count; i++) {
+		end = (i + 1 < count) ? offsets[i + 1] : 255;
+		limbs[i] = w[offsets[i] / 64] >> (offsets[i] % 64);
+		if (offsets[i] % 64)
+			limbs[i] |= w[offsets[i] / 64 + 1] << (64 - (offsets[i] % 64));
+		limbs[i] &= (1ULL << (end - offsets[i])) - 1;
+	}
+}
+
+// Adds up limbs of up to 61 bits, and reduces the sum to its unique
+// representation modulo 2^255 - 19, without branching on it:
+static void crypto_batch_pack(uint8_t *q, const uint64_t *limbs, const int *offsets, int count) {
+	uint64_t w[6] = { 0 }, hi, mask, t[4];
+	unsigned __int128 c, x;
+	int i, j, round;
+
+	for (i = 0; i < count; i++) {
+		x = ((unsigned __int128) limbs[i]) << (offsets[i] % 64);
+		j = offsets[i] / 64;
+		c = (unsigned __int128) w[j] + (uint64_t) x;
+		w[j] = (uint64_t) c;
+		c = (c >> 64) + w[j + 1] + (uint64_t) (x >> 64);
+		w[j + 1] = (uint64_t) c;
+		for (j += 2; j < 6; j++) {
+			c = (c >> 64) + w[j];
+			w[j] = (uint64_t) c;
+		}
+	}
+
+	// 2^255 = 19, twice gets it below 2^255:
+	for (round = 0; round < 2; round++) {
+		hi = (w[3] >> 63) | (w[4] << 1);
+		w[3] &= 0x7fffffffffffffffULL;
+		w[4] = w[5] = 0;
+		c = (unsigned __int128) hi * 19;
+		for (j = 0; j < 4; j++) {
+			c += w[j];
+			w[j] = (uint64_t) c;
+			c >>= 64;
+		}
+		w[4] = (uint64_t) c;
+	}
+
+	// Subtract 2^255 - 19 when adding 19 reaches 2^255:
+	c = 19;
+	for (j = 0; j < 4; j++) {
+		c += w[j];
+		t[j] = (uint64_t) c;
+		c >>= 64;
+	}
+	mask = 0 - (t[3] >> 63);
+	t[3] &= 0x7fffffffffffffffULL;
+	for (j = 0; j < 4; j++)
+		w[j] = (t[j] & mask) | (w[j] & ~mask);
+
+	for (i = 0; i < 32; i++)
+		q[i] = (uint8_t) (w[i / 8] >> (8 * (i % 8)));
+}
+
+static void crypto_batch_clamp(uint8_t *e, const uint8_t *n) {
+	memcpy(e, n, 32);
+	e[0] &= 248;
+	e[31] &= 127;
+	e[31] |= 64;
+}
+
+static int crypto_batch_scalar_supported() {
+	return 1;
+}
+
+// Not used, crypto_batch_beforenm() hands the keys to NaCl one by one:
+static void crypto_batch_scalar_scalarmult(uint8_t **q, const uint8_t *n, uint8_t **p, int count) {
+	int i;
+
+	for (i = 0; i < count; i++)
+		crypto_scalarmult_curve25519(q[i], n, p[i]);
+}
+
+#ifdef CRYPTO_BATCH_X86
+
+#define CRYPTO_BATCH_AVX2	__attribute__((target("avx2")))
+
+// AVX2: 4 lanes of 64 bits, every limb of 25 or 26 bits in a lane of its own
+// register, multiplied with the 32x32 bit multiplication of the lanes. The
+// limbs are kept unsigned: a carried element has limbs of at most about
+// 2^26, a sum or a difference (plus 2p) at most 3 * 2^26, which keeps the
+// (at most 10) products of a limb of a product below 2^64.
+typedef __m256i fe4[10];
+
+static int crypto_batch_avx2_supported() {
+	return __builtin_cpu_supports("avx2");
+}
+
+static inline CRYPTO_BATCH_AVX2 __m256i fe4_mul19(__m256i c) {
+	return _mm256_add_epi64(c, _mm256_add_epi64(_mm256_slli_epi64(c, 1), _mm256_slli_epi64(c, 4)));
+}
+
+static inline CRYPTO_BATCH_AVX2 void fe4_carry(fe4 h, __m256i *t) {
+	const __m256i m26 = _mm256_set1_epi64x(0x3ffffff), m25 = _mm256_set1_epi64x(0x1ffffff);
+	static const int order[10] = { 0, 4, 1, 5, 2, 6, 3, 7, 4, 8 };
+	__m256i c;
+	int i, j;
+
+#pragma GCC unroll 10
+	for (j = 0; j < 10; j++) {
+		i = order[j];
+		c = _mm256_srli_epi64(t[i], (i & 1) ? 25 : 26);
+		t[i + 1] = _mm256_add_epi64(t[i + 1], c);
+		t[i] = _mm256_and_si256(t[i], (i & 1) ? m25 : m26);
+	}
+	c = _mm256_srli_epi64(t[9], 25);
+	t[9] = _mm256_and_si256(t[9], m25);
+	t[0] = _mm256_add_epi64(t[0], fe4_mul19(c));
+	c = _mm256_srli_epi64(t[0], 26);
+	t[0] = _mm256_and_si256(t[0], m26);
+	t[1] = _mm256_add_epi64(t[1], c);
+
+	for (i = 0; i < 10; i++)
+		h[i] = t[i];
+}
+
+static inline CRYPTO_BATCH_AVX2 void fe4_add(fe4 h, const fe4 f, const fe4 g) {
+	int i;
+
+	for (i = 0; i < 10; i++)
+		h[i] = _mm256_add_epi64(f[i], g[i]);
+}
+
+// f + 2p - g, which does not go below zero for a carried g:
+static inline CRYPTO_BATCH_AVX2 void fe4_sub(fe4 h, const fe4 f, const fe4 g) {
+	const __m256i p0 = _mm256_set1_epi64x(0x7ffffda), p25 = _mm256_set1_epi64x(0x3fffffe), p26 = _mm256_set1_epi64x(0x7fffffe);
+	int i;
+
+	for (i = 0; i < 10; i++)
+		h[i] = _mm256_sub_epi64(_mm256_add_epi64(f[i], i ? ((i & 1) ? p25 : p26) : p0), g[i]);
+}
+
+static inline CRYPTO_BATCH_AVX2 void fe4_mul(fe4 h, const fe4 f, const fe4 g) {
+	const __m256i nineteen = _mm256_set1_epi64x(19);
+	__m256i f2[10], g19[10], t[10];
+	int i, j;
+
+	for (i = 0; i < 10; i++) {
+		f2[i] = _mm256_add_epi64(f[i], f[i]);
+		g19[i] = _mm256_mul_epu32(g[i], nineteen);
+		t[i] = _mm256_setzero_si256();
+	}
+
+	// The product of two odd limbs counts twice, as their offsets are both
+	// half a bit below 25.5 times their index; what goes beyond the 10th
+	// limb comes back 19 times:
+#pragma GCC unroll 10
+	for (i = 0; i < 10; i++) {
+#pragma GCC unroll 10
+		for (j = 0; j < 10; j++) {
+			if (i + j < 10)
+				t[i + j] = _mm256_add_epi64(t[i + j], _mm256_mul_epu32((i & j & 1) ? f2[i] : f[i], g[j]));
+			else
+				t[i + j - 10] = _mm256_add_epi64(t[i + j - 10], _mm256_mul_epu32((i & j & 1) ? f2[i] : f[i], g19[j]));
+		}
+	}
+
+	fe4_carry(h, t);
+}
+
+static inline CRYPTO_BATCH_AVX2 void fe4_sq(fe4 h, const fe4 f) {
+	const __m256i nineteen = _mm256_set1_epi64x(19);
+	__m256i f2[10], f4[10], f19[10], t[10], a;
+	int i, j;
+
+	for (i = 0; i < 10; i++) {
+		f2[i] = _mm256_add_epi64(f[i], f[i]);
+		f4[i] = _mm256_add_epi64(f2[i], f2[i]);
+		f19[i] = _mm256_mul_epu32(f[i], nineteen);
+		t[i] = _mm256_setzero_si256();
+	}
+
+	// Like fe4_mul(), with f[i] * f[j] and f[j] * f[i] taken together:
+#pragma GCC unroll 10
+	for (i = 0; i < 10; i++) {
+#pragma GCC unroll 10
+		for (j = i; j < 10; j++) {
+			if (i == j)
+				a = (i & 1) ? f2[i] : f[i];
+			else
+				a = (i & j & 1) ? f4[i] : f2[i];
+			if (i + j < 10)
+				t[i + j] = _mm256_add_epi64(t[i + j], _mm256_mul_epu32(a, f[j]));
+			else
+				t[i + j - 10] = _mm256_add_epi64(t[i + j - 10], _mm256_mul_epu32(a, f19[j]));
+		}
+	}
+
+	fe4_carry(h, t);
+}
+
+static inline CRYPTO_BATCH_AVX2 void fe4_sqn(fe4 h, const fe4 f, int n) {
+	fe4_sq(h, f);
+	while (--n > 0)
+		fe4_sq(h, h);
+}
+
+// h = 121665 * f + g, with f a difference:
+static inline CRYPTO_BATCH_AVX2 void fe4_mul121665_add(fe4 h, const fe4 f, const fe4 g) {
+	const __m256i a24 = _mm256_set1_epi64x(121665);
+	__m256i t[10];
+	int i;
+
+	for (i = 0; i < 10; i++)
+		t[i] = _mm256_add_epi64(_mm256_mul_epu32(f[i], a24), g[i]);
+	fe4_carry(h, t);
+}
+
+static inline CRYPTO_BATCH_AVX2 void fe4_cswap(fe4 f, fe4 g, __m256i mask) {
+	__m256i t;
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		t = _mm256_and_si256(_mm256_xor_si256(f[i], g[i]), mask);
+		f[i] = _mm256_xor_si256(f[i], t);
+		g[i] = _mm256_xor_si256(g[i], t);
+	}
+}
+
+// z^(p - 2), the same chain as ref10:
+static CRYPTO_BATCH_AVX2 void fe4_invert(fe4 h, const fe4 z) {
+	fe4 t0, t1, t2, t3;
+
+	fe4_sq(t0, z);
+	fe4_sqn(t1, t0, 2);
+	fe4_mul(t1, z, t1);
+	fe4_mul(t0, t0, t1);
+	fe4_sq(t2, t0);
+	fe4_mul(t1, t1, t2);
+	fe4_sqn(t2, t1, 5);
+	fe4_mul(t1, t2, t1);
+	fe4_sqn(t2, t1, 10);
+	fe4_mul(t2, t2, t1);
+	fe4_sqn(t3, t2, 20);
+	fe4_mul(t2, t3, t2);
+	fe4_sqn(t2, t2, 10);
+	fe4_mul(t1, t2, t1);
+	fe4_sqn(t2, t1, 50);
+	fe4_mul(t2, t2, t1);
+	fe4_sqn(t3, t2, 100);
+	fe4_mul(t2, t3, t2);
+	fe4_sqn(t2, t2, 50);
+	fe4_mul(t1, t2, t1);
+	fe4_sqn(t1, t1, 5);
+	fe4_mul(h, t1, t0);
+}
+
+static CRYPTO_BATCH_AVX2 void crypto_batch_avx2_scalarmult(uint8_t **q, const uint8_t *n, uint8_t **p, int count) {
+	uint64_t limbs[4][10] __attribute__((aligned(32)));
+	uint64_t lanes[10][4] __attribute__((aligned(32)));
+	fe4 x1, x2, z2, x3, z3, a, aa, b, bb, e, c, d, da, cb;
+	uint8_t scalar[32];
+	__m256i mask;
+	int i, l, pos, bit, swap = 0;
+
+	crypto_batch_clamp(scalar, n);
+
+	// Lanes without a key of their own compute the first one again:
+	for (l = 0; l < 4; l++)
+		crypto_batch_unpack(limbs[l], p[(l < count) ? l : 0], crypto_batch_radix25, 10);
+	for (i = 0; i < 10; i++) {
+		x1[i] = _mm256_set_epi64x(limbs[3][i], limbs[2][i], limbs[1][i], limbs[0][i]);
+		x3[i] = x1[i];
+		x2[i] = _mm256_set1_epi64x(i == 0);
+		z3[i] = x2[i];
+		z2[i] = _mm256_setzero_si256();
+	}
+
+	// RFC 7748, section 5. Every lane takes the same bits of the scalar:
+	for (pos = 254; pos >= 0; pos--) {
+		bit = (scalar[pos >> 3] >> (pos & 7)) & 1;
+		swap ^= bit;
+		mask = _mm256_set1_epi64x(-(int64_t) swap);
+		fe4_cswap(x2, x3, mask);
+		fe4_cswap(z2, z3, mask);
+		swap = bit;
+
+		fe4_add(a, x2, z2);
+		fe4_sq(aa, a);
+		fe4_sub(b, x2, z2);
+		fe4_sq(bb, b);
+		fe4_sub(e, aa, bb);
+		fe4_add(c, x3, z3);
+		fe4_sub(d, x3, z3);
+		fe4_mul(da, d, a);
+		fe4_mul(cb, c, b);
+		fe4_add(x3, da, cb);
+		fe4_sq(x3, x3);
+		fe4_sub(z3, da, cb);
+		fe4_sq(z3, z3);
+		fe4_mul(z3, z3, x1);
+		fe4_mul(x2, aa, bb);
+		fe4_mul121665_add(z2, e, aa);
+		fe4_mul(z2, z2, e);
+	}
+	mask = _mm256_set1_epi64x(-(int64_t) swap);
+	fe4_cswap(x2, x3, mask);
+	fe4_cswap(z2, z3, mask);
+
+	fe4_invert(z2, z2);
+	fe4_mul(x2, x2, z2);
+
+	for (i = 0; i < 10; i++)
+		_mm256_store_si256((__m256i *) lanes[i], x2[i]);
+	for (l = 0; l < count; l++) {
+		for (i = 0; i < 10; i++)
+			limbs[l][i] = lanes[i][l];
+		crypto_batch_pack(q[l], limbs[l], crypto_batch_radix25, 10);
+	}
+}
+
+#define CRYPTO_BATCH_IFMA	__attribute__((target("avx512f,avx512ifma")))
+
+// AVX-512 IFMA: 8 lanes of 64 bits, every limb of 51 bits in a lane of its
+// own register. The multiply-adds take the low and the high 52 bits of the
+// 104 bit products, and only look at the low 52 bits of their operands, so
+// every element is carried after every operation, to limbs below 2^52.
+typedef __m512i fe8[5];
+
+static int crypto_batch_ifma_supported() {
+	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512ifma");
+}
+
+static inline CRYPTO_BATCH_IFMA __m512i fe8_mul19(__m512i c) {
+	return _mm512_add_epi64(c, _mm512_add_epi64(_mm512_slli_epi64(c, 1), _mm512_slli_epi64(c, 4)));
+}
+
+// All limbs at once, from at most 2^61 to at most 2^51 + 2^15:
+static inline CRYPTO_BATCH_IFMA void fe8_carry(fe8 h, __m512i *t) {
+	const __m512i m51 = _mm512_set1_epi64(0x7ffffffffffffULL);
+	__m512i c[5];
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		c[i] = _mm512_srli_epi64(t[i], 51);
+		t[i] = _mm512_and_si512(t[i], m51);
+	}
+	h[0] = _mm512_add_epi64(t[0], fe8_mul19(c[4]));
+	for (i = 1; i < 5; i++)
+		h[i] = _mm512_add_epi64(t[i], c[i - 1]);
+}
+
+static inline CRYPTO_BATCH_IFMA void fe8_add(fe8 h, const fe8 f, const fe8 g) {
+	__m512i t[5];
+	int i;
+
+	for (i = 0; i < 5; i++)
+		t[i] = _mm512_add_epi64(f[i], g[i]);
+	fe8_carry(h, t);
+}
+
+static inline CRYPTO_BATCH_IFMA void fe8_sub(fe8 h, const fe8 f, const fe8 g) {
+	const __m512i p0 = _mm512_set1_epi64(0xfffffffffffdaULL), p51 = _mm512_set1_epi64(0xffffffffffffeULL);
+	__m512i t[5];
+	int i;
+
+	for (i = 0; i < 5; i++)
+		t[i] = _mm512_sub_epi64(_mm512_add_epi64(f[i], i ? p51 : p0), g[i]);
+	fe8_carry(h, t);
+}
+
+static inline CRYPTO_BATCH_IFMA void fe8_mul(fe8 h, const fe8 f, const fe8 g) {
+	__m512i lo[9], hi[9], t[5];
+	int i, j;
+
+	for (i = 0; i < 9; i++)
+		lo[i] = hi[i] = _mm512_setzero_si512();
+
+#pragma GCC unroll 5
+	for (i = 0; i < 5; i++) {
+#pragma GCC unroll 5
+		for (j = 0; j < 5; j++) {
+			lo[i + j] = _mm512_madd52lo_epu64(lo[i + j], f[i], g[j]);
+			hi[i + j] = _mm512_madd52hi_epu64(hi[i + j], f[i], g[j]);
+		}
+	}
+
+	// The high halves are at 2^52, twice the next limb; the limbs from 2^255
+	// on come back 19 times:
+	for (i = 0; i < 5; i++) {
+		t[i] = i ? _mm512_add_epi64(lo[i], _mm512_add_epi64(hi[i - 1], hi[i - 1])) : lo[0];
+		t[i] = _mm512_add_epi64(t[i], fe8_mul19(_mm512_add_epi64(i < 4 ? lo[i + 5] : _mm512_setzero_si512(), _mm512_add_epi64(hi[i + 4], hi[i + 4]))));
+	}
+
+	fe8_carry(h, t);
+}
+
+static inline CRYPTO_BATCH_IFMA void fe8_sqn(fe8 h, const fe8 f, int n) {
+	fe8_mul(h, f, f);
+	while (--n > 0)
+		fe8_mul(h, h, h);
+}
+
+static inline CRYPTO_BATCH_IFMA void fe8_mul121665_add(fe8 h, const fe8 f, const fe8 g) {
+	const __m512i a24 = _mm512_set1_epi64(121665);
+	__m512i lo[5], hi[5], t[5];
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		lo[i] = _mm512_madd52lo_epu64(g[i], f[i], a24);
+		hi[i] = _mm512_madd52hi_epu64(_mm512_setzero_si512(), f[i], a24);
+		hi[i] = _mm512_add_epi64(hi[i], hi[i]);
+	}
+	t[0] = _mm512_add_epi64(lo[0], fe8_mul19(hi[4]));
+	for (i = 1; i < 5; i++)
+		t[i] = _mm512_add_epi64(lo[i], hi[i - 1]);
+	fe8_carry(h, t);
+}
+
+static inline CRYPTO_BATCH_IFMA void fe8_cswap(fe8 f, fe8 g, __m512i mask) {
+	__m512i t;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		t = _mm512_and_si512(_mm512_xor_si512(f[i], g[i]), mask);
+		f[i] = _mm512_xor_si512(f[i], t);
+		g[i] = _mm512_xor_si512(g[i], t);
+	}
+}
+
+static CRYPTO_BATCH_IFMA void fe8_invert(fe8 h, const fe8 z) {
+	fe8 t0, t1, t2, t3;
+
+	fe8_sqn(t0, z, 1);
+	fe8_sqn(t1, t0, 2);
+	fe8_mul(t1, z, t1);
+	fe8_mul(t0, t0, t1);
+	fe8_sqn(t2, t0, 1);
+	fe8_mul(t1, t1, t2);
+	fe8_sqn(t2, t1, 5);
+	fe8_mul(t1, t2, t1);
+	fe8_sqn(t2, t1, 10);
+	fe8_mul(t2, t2, t1);
+	fe8_sqn(t3, t2, 20);
+	fe8_mul(t2, t3, t2);
+	fe8_sqn(t2, t2, 10);
+	fe8_mul(t1, t2, t1);
+	fe8_sqn(t2, t1, 50);
+	fe8_mul(t2, t2, t1);
+	fe8_sqn(t3, t2, 100);
+	fe8_mul(t2, t3, t2);
+	fe8_sqn(t2, t2, 50);
+	fe8_mul(t1, t2, t1);
+	fe8_sqn(t1, t1, 5);
+	fe8_mul(h, t1, t0);
+}
+
+static CRYPTO_BATCH_IFMA void crypto_batch_ifma_scalarmult(uint8_t **q, const uint8_t *n, uint8_t **p, int count) {
+	uint64_t limbs[8][5] __attribute__((aligned(64)));
+	uint64_t lanes[5][8] __attribute__((aligned(64)));
+	fe8 x1, x2, z2, x3, z3, a, aa, b, bb, e, c, d, da, cb;
+	uint8_t scalar[32];
+	__m512i mask;
+	int i, l, pos, bit, swap = 0;
+
+	crypto_batch_clamp(scalar, n);
+
+	for (l = 0; l < 8; l++)
+		crypto_batch_unpack(limbs[l], p[(l < count) ? l : 0], crypto_batch_radix51, 5);
+	for (i = 0; i < 5; i++) {
+		for (l = 0; l < 8; l++)
+			lanes[i][l] = limbs[l][i];
+		x1[i] = _mm512_load_si512(lanes[i]);
+		x3[i] = x1[i];
+		x2[i] = _mm512_set1_epi64(i == 0);
+		z3[i] = x2[i];
+		z2[i] = _mm512_setzero_si512();
+	}
+
+	for (pos = 254; pos >= 0; pos--) {
+		bit = (scalar[pos >> 3] >> (pos & 7)) & 1;
+		swap ^= bit;
+		mask = _mm512_set1_epi64(-(int64_t) swap);
+		fe8_cswap(x2, x3, mask);
+		fe8_cswap(z2, z3, mask);
+		swap = bit;
+
+		fe8_add(a, x2, z2);
+		fe8_mul(aa, a, a);
+		fe8_sub(b, x2, z2);
+		fe8_mul(bb, b, b);
+		fe8_sub(e, aa, bb);
+		fe8_add(c, x3, z3);
+		fe8_sub(d, x3, z3);
+		fe8_mul(da, d, a);
+		fe8_mul(cb, c, b);
+		fe8_add(x3, da, cb);
+		fe8_mul(x3, x3, x3);
+		fe8_sub(z3, da, cb);
+		fe8_mul(z3, z3, z3);
+		fe8_mul(z3, z3, x1);
+		fe8_mul(x2, aa, bb);
+		fe8_mul121665_add(z2, e, aa);
+		fe8_mul(z2, z2, e);
+	}
+	mask = _mm512_set1_epi64(-(int64_t) swap);
+	fe8_cswap(x2, x3, mask);
+	fe8_cswap(z2, z3, mask);
+
+	fe8_invert(z2, z2);
+	fe8_mul(x2, x2, z2);
+
+	for (i = 0; i < 5; i++)
+		_mm512_store_si512(lanes[i], x2[i]);
+	for (l = 0; l < count; l++) {
+		for (i = 0; i < 5; i++)
+			limbs[l][i] = lanes[i][l];
+		crypto_batch_pack(q[l], limbs[l], crypto_batch_radix51, 5);
+	}
+}
+
+static const struct crypto_batch crypto_batch_ifma = {
+	.name = "avx512ifma",
+	.min = 1,
+	.lanes = 8,
+	.supported = crypto_batch_ifma_supported,
+	.scalarmult = crypto_batch_ifma_scalarmult,
+};
+
+static const struct crypto_batch crypto_batch_avx2 = {
+	.name = "avx2",
+	.min = 2,
+	.lanes = 4,
+	.supported = crypto_batch_avx2_supported,
+	.scalarmult = crypto_batch_avx2_scalarmult,
+};
+
+#endif /* CRYPTO_BATCH_X86 */
+
+static const struct crypto_batch crypto_batch_scalar = {
+	.name = "scalar",
+	.min = 2,
+	.lanes = 1,
+	.supported = crypto_batch_scalar_supported,
+	.scalarmult = crypto_batch_scalar_scalarmult,
+};
+
+// Fastest first:
+static const struct crypto_batch *crypto_batches[] = {
+#ifdef CRYPTO_BATCH_X86
+	&crypto_batch_ifma,
+	&crypto_batch_avx2,
+#endif
+	&crypto_batch_scalar,
+	NULL
+};
+
+// The implementation in use, NULL picks the fastest one the CPU supports
+// (see CURVEDNS_CRYPTO_BATCH):
+const struct crypto_batch *crypto_batch = NULL;
+
+int crypto_batch_select(const char *name) {
+	int i;
+
+	for (i = 0; crypto_batches[i]; i++) {
+		if (!strcmp(crypto_batches[i]->name, name)) {
+			if (!crypto_batches[i]->supported()) {
+				debug_log(DEBUG_ERROR, "crypto_batch_select(): this CPU does not support %s\n", name);
+				return 0;
+			}
+			crypto_batch = crypto_batches[i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Picks the implementation, and checks it against NaCl on a few keys (some
+// of them with their top bit set), falling back to NaCl itself when it
+// differs:
+int crypto_batch_init() {
+	uint8_t secretkey[32], publickeys[CRYPTO_BATCH_MAX][32], expected[32], results[CRYPTO_BATCH_MAX][32];
+	uint8_t *p[CRYPTO_BATCH_MAX], *q[CRYPTO_BATCH_MAX];
+	int i;
+
+	if (!crypto_batch) {
+		for (i = 0; !crypto_batches[i]->supported(); i++);
+		crypto_batch = crypto_batches[i];
+	}
+	if (crypto_batch->lanes == 1)
+		goto done;
+
+	for (i = 0; i < 32; i++)
+		secretkey[i] = (uint8_t) (i * 101 + 7);
+	for (i = 0; i < CRYPTO_BATCH_MAX * 32; i++)
+		publickeys[i / 32][i % 32] = (uint8_t) (i * 167 + 13);
+	for (i = 0; i < CRYPTO_BATCH_MAX; i++) {
+		p[i] = publickeys[i];
+		q[i] = results[i];
+	}
+	crypto_batch->scalarmult(q, secretkey, p, crypto_batch->lanes);
+
+	for (i = 0; i < crypto_batch->lanes; i++) {
+		crypto_scalarmult_curve25519(expected, secretkey, publickeys[i]);
+		if (memcmp(expected, results[i], 32)) {
+			debug_log(DEBUG_ERROR, "crypto_batch_init(): %s differs from NaCl, computing shared secrets one at a time\n", crypto_batch->name);
+			crypto_batch = &crypto_batch_scalar;
+			break;
+		}
+	}
+
+done:
+	debug_log(DEBUG_INFO, "crypto_batch_init(): computing shared secrets with %s, %d at a time\n", crypto_batch->name, crypto_batch->lanes);
+	return 1;
+}
+
+// Like crypto_box_beforenm(), for count public keys at once:
+int crypto_batch_beforenm(uint8_t **k, uint8_t **p, int count, const uint8_t *n) {
+	uint8_t s[CRYPTO_BATCH_MAX][32], *q[CRYPTO_BATCH_MAX];
+	int i, j, lanes;
+
+	for (i = 0; i < count; i += lanes) {
+		lanes = count - i;
+		if (lanes > crypto_batch->lanes)
+			lanes = crypto_batch->lanes;
+
+		if (lanes < crypto_batch->min) {
+			for (j = i; j < i + lanes; j++)
+				crypto_box_curve25519xsalsa20poly1305_beforenm(k[j], p[j], n);
+			continue;
+		}
+
+		for (j = 0; j < lanes; j++)
+			q[j] = s[j];
+		crypto_batch->scalarmult(q, n, p + i, lanes);
+		for (j = 0; j < lanes; j++)
+			crypto_core_hsalsa20(k[i + j], crypto_batch_zero, s[j], crypto_batch_sigma);
+	}
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#ifndef CRYPTO_BATCH_H_
+#define CRYPTO_BATCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "debug.h"
+
+// Computes the shared secrets of several client public keys at once. With
+// the same secret key for all of them, the Montgomery ladders of all keys
+// take the same steps, so every lane of a SIMD register can run one of them:
+// 4 lanes of 2^25.5 radix limbs with AVX2, or 8 lanes of 2^51 radix limbs
+// with the 52-bit multiply-adds of AVX-512 IFMA. The lanes without a key
+// compute one of the others again, so a batch costs the same whether it is
+// full or not.
+#define CRYPTO_BATCH_MAX	8				// the most lanes of any implementation
+
+struct crypto_batch {
+	const char *name;
+	int min;						// fewer keys are left to NaCl, one at a time
+	int lanes;
+	int (*supported)();
+	void (*scalarmult)(uint8_t **, const uint8_t *, uint8_t **, int);
+};
+
+extern const struct crypto_batch *crypto_batch;
+
+extern int crypto_batch_select(const char *);
+extern int crypto_batch_init();
+extern int crypto_batch_beforenm(uint8_t **, uint8_t **, int, const uint8_t *);
+
+#endif /* CRYPTO_BATCH_H_ */
@@ -0,0 +1,814 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#include "crypto_multibox.h"
+#include "crypto_box_curve25519xsalsa20poly1305.h"
+#include "crypto_verify_16.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRYPTO_MULTIBOX_X86
+#include <immintrin.h>
+#endif
+
+static const uint8_t crypto_multibox_sigma[16] = "expand 32-byte k";
+static const uint8_t crypto_multibox_zero[16] = { 0 };
+
+// The words of HSalsa20 that make up the subkey:
+static const int crypto_multibox_hsalsa20_words[8] = { 0, 5, 10, 15, 6, 7, 8, 9 };
+
+// For what the SIMD implementations call, so it is compiled along with them
+// (leaving the upper halves of their registers alone):
+#define CRYPTO_MULTIBOX_INLINE	inline __attribute__((always_inline))
+
+static CRYPTO_MULTIBOX_INLINE uint32_t crypto_multibox_load32(const uint8_t *p) {
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// r of a Poly1305 key, clamped, in limbs of 26 bits:
+static CRYPTO_MULTIBOX_INLINE void crypto_multibox_poly1305_clamp(uint64_t *r, const uint8_t *key) {
+	uint32_t t0 = crypto_multibox_load32(key), t1 = crypto_multibox_load32(key + 4);
+	uint32_t t2 = crypto_multibox_load32(key + 8), t3 = crypto_multibox_load32(key + 12);
+
+	r[0] = t0 & 0x3ffffff;
+	r[1] = ((t0 >> 26) | (t1 << 6)) & 0x3ffff03;
+	r[2] = ((t1 >> 20) | (t2 << 12)) & 0x3ffc0ff;
+	r[3] = ((t2 >> 14) | (t3 << 18)) & 0x3f03fff;
+	r[4] = (t3 >> 8) & 0x00fffff;
+}
+
+// The blocks of all lanes at a step. The shorter messages start with zero
+// blocks (which leave h at zero), so that the last blocks of all of them
+// come at the same step: p[l] is the block of lane l (a partial one padded
+// in pad[l]), hibit[l] the bit above it:
+static CRYPTO_MULTIBOX_INLINE void crypto_multibox_poly1305_step(uint8_t **p, uint64_t *hibit, uint8_t (*pad)[16], uint8_t **m, const size_t *mlen, const size_t *first, size_t step, int lanes) {
+	size_t pos;
+	int l;
+
+	for (l = 0; l < lanes; l++) {
+		if (step < first[l]) {
+			p[l] = (uint8_t *) crypto_multibox_zero;
+			hibit[l] = 0;
+			continue;
+		}
+		pos = 16 * (step - first[l]);
+		if (mlen[l] - pos >= 16) {
+			p[l] = m[l] + pos;
+			hibit[l] = 1 << 24;
+		} else {
+			memset(pad[l], 0, 16);
+			memcpy(pad[l], m[l] + pos, mlen[l] - pos);
+			pad[l][mlen[l] - pos] = 1;
+			p[l] = pad[l];
+			hibit[l] = 0;
+		}
+	}
+}
+
+// Reduces h modulo 2^130 - 5, and adds s:
+static CRYPTO_MULTIBOX_INLINE void crypto_multibox_poly1305_finish(uint8_t *out, uint64_t *h, const uint8_t *key) {
+	uint64_t g[5], c, mask, w0, w1;
+	unsigned __int128 t;
+	int i;
+
+	c = h[1] >> 26; h[1] &= 0x3ffffff; h[2] += c;
+	c = h[2] >> 26; h[2] &= 0x3ffffff; h[3] += c;
+	c = h[3] >> 26; h[3] &= 0x3ffffff; h[4] += c;
+	c = h[4] >> 26; h[4] &= 0x3ffffff; h[0] += c * 5;
+	c = h[0] >> 26; h[0] &= 0x3ffffff; h[1] += c;
+
+	// h - p, when it does not go below zero:
+	g[0] = h[0] + 5; c = g[0] >> 26; g[0] &= 0x3ffffff;
+	g[1] = h[1] + c; c = g[1] >> 26; g[1] &= 0x3ffffff;
+	g[2] = h[2] + c; c = g[2] >> 26; g[2] &= 0x3ffffff;
+	g[3] = h[3] + c; c = g[3] >> 26; g[3] &= 0x3ffffff;
+	g[4] = h[4] + c - (1ULL << 26);
+	mask = (g[4] >> 63) - 1;
+	for (i = 0; i < 5; i++)
+		h[i] = (h[i] & ~mask) | (g[i] & mask);
+
+	w0 = h[0] | (h[1] << 26) | (h[2] << 52);
+	w1 = (h[2] >> 12) | (h[3] << 14) | (h[4] << 40);
+	t = (unsigned __int128) w0 + crypto_multibox_load32(key + 16) + ((uint64_t) crypto_multibox_load32(key + 20) << 32);
+	w0 = (uint64_t) t;
+	w1 += (uint64_t) (t >> 64) + crypto_multibox_load32(key + 24) + ((uint64_t) crypto_multibox_load32(key + 28) << 32);
+
+	for (i = 0; i < 8; i++) {
+		out[i] = (uint8_t) (w0 >> (8 * i));
+		out[8 + i] = (uint8_t) (w1 >> (8 * i));
+	}
+}
+
+static int crypto_multibox_scalar_supported() {
+	return 1;
+}
+
+#ifdef CRYPTO_MULTIBOX_X86
+
+// The rounds of Salsa20, x[i] being word i of all lanes:
+#define CRYPTO_MULTIBOX_ROUNDS(x, quarterround) \
+	for (i = 0; i < 20; i += 2) { \
+		quarterround(x[0], x[4], x[8], x[12]) \
+		quarterround(x[5], x[9], x[13], x[1]) \
+		quarterround(x[10], x[14], x[2], x[6]) \
+		quarterround(x[15], x[3], x[7], x[11]) \
+		quarterround(x[0], x[1], x[2], x[3]) \
+		quarterround(x[5], x[6], x[7], x[4]) \
+		quarterround(x[10], x[11], x[8], x[9]) \
+		quarterround(x[15], x[12], x[13], x[14]) \
+	}
+
+// c = m ^ block, of which only the first len bytes:
+static CRYPTO_MULTIBOX_INLINE void crypto_multibox_partial(uint8_t *c, const uint8_t *m, size_t len, const uint8_t *block) {
+	size_t i;
+
+	if (m)
+		for (i = 0; i < len; i++)
+			c[i] = m[i] ^ block[i];
+	else
+		memcpy(c, block, len);
+}
+
+#define CRYPTO_MULTIBOX_AVX2	__attribute__((target("avx2")))
+
+#define CRYPTO_MULTIBOX_ROTATE256(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define CRYPTO_MULTIBOX_QUARTERROUND256(a, b, c, d) \
+	b = _mm256_xor_si256(b, CRYPTO_MULTIBOX_ROTATE256(_mm256_add_epi32(a, d), 7)); \
+	c = _mm256_xor_si256(c, CRYPTO_MULTIBOX_ROTATE256(_mm256_add_epi32(b, a), 9)); \
+	d = _mm256_xor_si256(d, CRYPTO_MULTIBOX_ROTATE256(_mm256_add_epi32(c, b), 13)); \
+	a = _mm256_xor_si256(a, CRYPTO_MULTIBOX_ROTATE256(_mm256_add_epi32(d, c), 18));
+
+// AVX2: 8 Salsa20 cores at once, every word in a register of its own, and 4
+// Poly1305 states in limbs of 26 bits, in lanes of 64 bits.
+static int crypto_multibox_avx2_supported() {
+	return __builtin_cpu_supports("avx2");
+}
+
+// Transposes 8 rows of 8 words, from words of 8 lanes to lanes of 8 words
+// and back:
+static inline CRYPTO_MULTIBOX_AVX2 void crypto_multibox_avx2_transpose(__m256i *a) {
+	__m256i t[8], u[8];
+	int i;
+
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(a[i], a[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(a[i], a[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; i++) {
+		a[i] = _mm256_permute2x128_si256(u[i], u[4 + i], 0x20);
+		a[4 + i] = _mm256_permute2x128_si256(u[i], u[4 + i], 0x31);
+	}
+}
+
+// The rounds of 8 cores, words 0..7 of lane l in a[l] and words 8..15 in
+// a[8 + l]:
+static inline CRYPTO_MULTIBOX_AVX2 void crypto_multibox_avx2_core(__m256i *a) {
+	int i;
+
+	crypto_multibox_avx2_transpose(a);
+	crypto_multibox_avx2_transpose(a + 8);
+	CRYPTO_MULTIBOX_ROUNDS(a, CRYPTO_MULTIBOX_QUARTERROUND256)
+	crypto_multibox_avx2_transpose(a);
+	crypto_multibox_avx2_transpose(a + 8);
+}
+
+static CRYPTO_MULTIBOX_AVX2 void crypto_multibox_avx2_hsalsa20(uint32_t *y, const uint32_t *x) {
+	__m256i a[16];
+	int l;
+
+	for (l = 0; l < 8; l++) {
+		a[l] = _mm256_loadu_si256((const __m256i *) (x + 16 * l));
+		a[8 + l] = _mm256_loadu_si256((const __m256i *) (x + 16 * l + 8));
+	}
+	crypto_multibox_avx2_core(a);
+	for (l = 0; l < 8; l++) {
+		_mm256_storeu_si256((__m256i *) (y + 16 * l), a[l]);
+		_mm256_storeu_si256((__m256i *) (y + 16 * l + 8), a[8 + l]);
+	}
+}
+
+static CRYPTO_MULTIBOX_AVX2 void crypto_multibox_avx2_salsa20(uint8_t **c, uint8_t **m, const size_t *len, const uint32_t *x) {
+	__m256i s[16], a[16], lo, hi;
+	uint8_t block[64];
+	int l;
+
+	for (l = 0; l < 8; l++) {
+		a[l] = s[l] = _mm256_loadu_si256((const __m256i *) (x + 16 * l));
+		a[8 + l] = s[8 + l] = _mm256_loadu_si256((const __m256i *) (x + 16 * l + 8));
+	}
+	crypto_multibox_avx2_core(a);
+
+	for (l = 0; l < 8; l++) {
+		if (!len[l])
+			continue;
+		lo = _mm256_add_epi32(a[l], s[l]);
+		hi = _mm256_add_epi32(a[8 + l], s[8 + l]);
+		if (len[l] < 64) {
+			_mm256_storeu_si256((__m256i *) block, lo);
+			_mm256_storeu_si256((__m256i *) (block + 32), hi);
+			crypto_multibox_partial(c[l], m ? m[l] : NULL, len[l], block);
+			continue;
+		}
+		if (m && m[l]) {
+			lo = _mm256_xor_si256(lo, _mm256_loadu_si256((const __m256i *) m[l]));
+			hi = _mm256_xor_si256(hi, _mm256_loadu_si256((const __m256i *) (m[l] + 32)));
+		}
+		_mm256_storeu_si256((__m256i *) c[l], lo);
+		_mm256_storeu_si256((__m256i *) (c[l] + 32), hi);
+	}
+}
+
+static CRYPTO_MULTIBOX_AVX2 void crypto_multibox_avx2_poly1305(uint8_t **out, uint8_t **m, const size_t *mlen, uint8_t **key, int count) {
+	const __m256i mask = _mm256_set1_epi64x(0x3ffffff);
+	uint64_t limbs[5][4] __attribute__((aligned(32))), r[4][5], hibit[4] __attribute__((aligned(32)));
+	uint8_t pad[4][16], *p[4];
+	size_t first[4], steps = 0, step;
+	__m256i rr[5], r5[5], h[5], d[5], z0, z1, lo, hi, c;
+	int i, l;
+
+	for (l = 0; l < 4; l++) {
+		crypto_multibox_poly1305_clamp(r[l], key[(l < count) ? l : 0]);
+		first[l] = (l < count) ? (mlen[l] + 15) / 16 : 0;
+		if (first[l] > steps)
+			steps = first[l];
+	}
+	for (l = 0; l < 4; l++)
+		first[l] = steps - first[l];
+	for (i = 0; i < 5; i++) {
+		rr[i] = _mm256_set_epi64x(r[3][i], r[2][i], r[1][i], r[0][i]);
+		r5[i] = _mm256_add_epi64(rr[i], _mm256_slli_epi64(rr[i], 2));
+		h[i] = _mm256_setzero_si256();
+	}
+
+	for (step = 0; step < steps; step++) {
+		crypto_multibox_poly1305_step(p, hibit, pad, m, mlen, first, step, 4);
+
+		// The blocks of lanes 0 and 2, and of 1 and 3, into the low and the
+		// high 64 bits of lanes 0 to 3:
+		z0 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) p[0])), _mm_loadu_si128((const __m128i *) p[2]), 1);
+		z1 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) p[1])), _mm_loadu_si128((const __m128i *) p[3]), 1);
+		lo = _mm256_unpacklo_epi64(z0, z1);
+		hi = _mm256_unpackhi_epi64(z0, z1);
+
+		h[0] = _mm256_add_epi64(h[0], _mm256_and_si256(lo, mask));
+		h[1] = _mm256_add_epi64(h[1], _mm256_and_si256(_mm256_srli_epi64(lo, 26), mask));
+		h[2] = _mm256_add_epi64(h[2], _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo, 52), _mm256_slli_epi64(hi, 12)), mask));
+		h[3] = _mm256_add_epi64(h[3], _mm256_and_si256(_mm256_srli_epi64(hi, 14), mask));
+		h[4] = _mm256_add_epi64(h[4], _mm256_or_si256(_mm256_srli_epi64(hi, 40), _mm256_load_si256((const __m256i *) hibit)));
+
+		// h * r, what goes beyond 2^130 coming back 5 times:
+#pragma GCC unroll 5
+		for (i = 0; i < 5; i++) {
+			d[i] = _mm256_setzero_si256();
+#pragma GCC unroll 5
+			for (l = 0; l < 5; l++)
+				d[i] = _mm256_add_epi64(d[i], _mm256_mul_epu32(h[l], (l <= i) ? rr[i - l] : r5[i + 5 - l]));
+		}
+
+		for (i = 0; i < 4; i++) {
+			c = _mm256_srli_epi64(d[i], 26);
+			h[i] = _mm256_and_si256(d[i], mask);
+			d[i + 1] = _mm256_add_epi64(d[i + 1], c);
+		}
+		c = _mm256_srli_epi64(d[4], 26);
+		h[4] = _mm256_and_si256(d[4], mask);
+		h[0] = _mm256_add_epi64(h[0], _mm256_add_epi64(c, _mm256_slli_epi64(c, 2)));
+		c = _mm256_srli_epi64(h[0], 26);
+		h[0] = _mm256_and_si256(h[0], mask);
+		h[1] = _mm256_add_epi64(h[1], c);
+	}
+
+	for (i = 0; i < 5; i++)
+		_mm256_store_si256((__m256i *) limbs[i], h[i]);
+	for (l = 0; l < count; l++) {
+		for (i = 0; i < 5; i++)
+			r[l][i] = limbs[i][l];
+		crypto_multibox_poly1305_finish(out[l], r[l], key[l]);
+	}
+}
+
+#define CRYPTO_MULTIBOX_AVX512	__attribute__((target("avx512f")))
+
+#define CRYPTO_MULTIBOX_QUARTERROUND512(a, b, c, d) \
+	b = _mm512_xor_si512(b, _mm512_rol_epi32(_mm512_add_epi32(a, d), 7)); \
+	c = _mm512_xor_si512(c, _mm512_rol_epi32(_mm512_add_epi32(b, a), 9)); \
+	d = _mm512_xor_si512(d, _mm512_rol_epi32(_mm512_add_epi32(c, b), 13)); \
+	a = _mm512_xor_si512(a, _mm512_rol_epi32(_mm512_add_epi32(d, c), 18));
+
+// AVX-512: 16 Salsa20 cores at once, with the rotations in one instruction,
+// and 8 Poly1305 states.
+static int crypto_multibox_avx512_supported() {
+	return __builtin_cpu_supports("avx512f");
+}
+
+// Transposes 16 rows of 16 words, from words of 16 lanes to lanes of 16
+// words and back:
+static inline CRYPTO_MULTIBOX_AVX512 void crypto_multibox_avx512_transpose(__m512i *a) {
+	__m512i t[16], u0, u1, u2, u3;
+	int i;
+
+	for (i = 0; i < 16; i += 2) {
+		t[i] = _mm512_unpacklo_epi32(a[i], a[i + 1]);
+		t[i + 1] = _mm512_unpackhi_epi32(a[i], a[i + 1]);
+	}
+
+	// Columns 4c + i of rows j..j+3 in the 128 bits c of a[j + i]:
+	for (i = 0; i < 16; i += 4) {
+		a[i] = _mm512_unpacklo_epi64(t[i], t[i + 2]);
+		a[i + 1] = _mm512_unpackhi_epi64(t[i], t[i + 2]);
+		a[i + 2] = _mm512_unpacklo_epi64(t[i + 1], t[i + 3]);
+		a[i + 3] = _mm512_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+
+	for (i = 0; i < 4; i++) {
+		u0 = _mm512_shuffle_i32x4(a[i], a[4 + i], 0x44);
+		u1 = _mm512_shuffle_i32x4(a[i], a[4 + i], 0xee);
+		u2 = _mm512_shuffle_i32x4(a[8 + i], a[12 + i], 0x44);
+		u3 = _mm512_shuffle_i32x4(a[8 + i], a[12 + i], 0xee);
+		a[i] = _mm512_shuffle_i32x4(u0, u2, 0x88);
+		a[4 + i] = _mm512_shuffle_i32x4(u0, u2, 0xdd);
+		a[8 + i] = _mm512_shuffle_i32x4(u1, u3, 0x88);
+		a[12 + i] = _mm512_shuffle_i32x4(u1, u3, 0xdd);
+	}
+}
+
+// The rounds of 16 cores, lane l in a[l]:
+static inline CRYPTO_MULTIBOX_AVX512 void crypto_multibox_avx512_core(__m512i *a) {
+	int i;
+
+	crypto_multibox_avx512_transpose(a);
+	CRYPTO_MULTIBOX_ROUNDS(a, CRYPTO_MULTIBOX_QUARTERROUND512)
+	crypto_multibox_avx512_transpose(a);
+}
+
+static CRYPTO_MULTIBOX_AVX512 void crypto_multibox_avx512_hsalsa20(uint32_t *y, const uint32_t *x) {
+	__m512i a[16];
+	int l;
+
+	for (l = 0; l < 16; l++)
+		a[l] = _mm512_loadu_si512((const void *) (x + 16 * l));
+	crypto_multibox_avx512_core(a);
+	for (l = 0; l < 16; l++)
+		_mm512_storeu_si512((void *) (y + 16 * l), a[l]);
+}
+
+static CRYPTO_MULTIBOX_AVX512 void crypto_multibox_avx512_salsa20(uint8_t **c, uint8_t **m, const size_t *len, const uint32_t *x) {
+	__m512i s[16], a[16];
+	uint8_t block[64];
+	int l;
+
+	for (l = 0; l < 16; l++)
+		a[l] = s[l] = _mm512_loadu_si512((const void *) (x + 16 * l));
+	crypto_multibox_avx512_core(a);
+
+	for (l = 0; l < 16; l++) {
+		if (!len[l])
+			continue;
+		a[l] = _mm512_add_epi32(a[l], s[l]);
+		if (len[l] < 64) {
+			_mm512_storeu_si512((void *) block, a[l]);
+			crypto_multibox_partial(c[l], m ? m[l] : NULL, len[l], block);
+			continue;
+		}
+		if (m && m[l])
+			a[l] = _mm512_xor_si512(a[l], _mm512_loadu_si512((const void *) m[l]));
+		_mm512_storeu_si512((void *) c[l], a[l]);
+	}
+}
+
+static CRYPTO_MULTIBOX_AVX512 void crypto_multibox_avx512_poly1305(uint8_t **out, uint8_t **m, const size_t *mlen, uint8_t **key, int count) {
+	const __m512i mask = _mm512_set1_epi64(0x3ffffff);
+	uint64_t limbs[5][8] __attribute__((aligned(64))), r[8][5], hibit[8] __attribute__((aligned(64)));
+	uint8_t pad[8][16], *p[8];
+	size_t first[8], steps = 0, step;
+	__m512i rr[5], r5[5], h[5], d[5], z0, z1, lo, hi, c;
+	int i, l;
+
+	for (l = 0; l < 8; l++) {
+		crypto_multibox_poly1305_clamp(r[l], key[(l < count) ? l : 0]);
+		first[l] = (l < count) ? (mlen[l] + 15) / 16 : 0;
+		if (first[l] > steps)
+			steps = first[l];
+	}
+	for (l = 0; l < 8; l++)
+		first[l] = steps - first[l];
+	for (i = 0; i < 5; i++) {
+		rr[i] = _mm512_set_epi64(r[7][i], r[6][i], r[5][i], r[4][i], r[3][i], r[2][i], r[1][i], r[0][i]);
+		r5[i] = _mm512_add_epi64(rr[i], _mm512_slli_epi64(rr[i], 2));
+		h[i] = _mm512_setzero_si512();
+	}
+
+	for (step = 0; step < steps; step++) {
+		crypto_multibox_poly1305_step(p, hibit, pad, m, mlen, first, step, 8);
+
+		// The blocks of the even lanes, and of the odd ones, into the low and
+		// the high 64 bits of lanes 0 to 7:
+		z0 = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *) p[0]));
+		z0 = _mm512_inserti32x4(z0, _mm_loadu_si128((const __m128i *) p[2]), 1);
+		z0 = _mm512_inserti32x4(z0, _mm_loadu_si128((const __m128i *) p[4]), 2);
+		z0 = _mm512_inserti32x4(z0, _mm_loadu_si128((const __m128i *) p[6]), 3);
+		z1 = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *) p[1]));
+		z1 = _mm512_inserti32x4(z1, _mm_loadu_si128((const __m128i *) p[3]), 1);
+		z1 = _mm512_inserti32x4(z1, _mm_loadu_si128((const __m128i *) p[5]), 2);
+		z1 = _mm512_inserti32x4(z1, _mm_loadu_si128((const __m128i *) p[7]), 3);
+		lo = _mm512_unpacklo_epi64(z0, z1);
+		hi = _mm512_unpackhi_epi64(z0, z1);
+
+		h[0] = _mm512_add_epi64(h[0], _mm512_and_si512(lo, mask));
+		h[1] = _mm512_add_epi64(h[1], _mm512_and_si512(_mm512_srli_epi64(lo, 26), mask));
+		h[2] = _mm512_add_epi64(h[2], _mm512_and_si512(_mm512_or_si512(_mm512_srli_epi64(lo, 52), _mm512_slli_epi64(hi, 12)), mask));
+		h[3] = _mm512_add_epi64(h[3], _mm512_and_si512(_mm512_srli_epi64(hi, 14), mask));
+		h[4] = _mm512_add_epi64(h[4], _mm512_or_si512(_mm512_srli_epi64(hi, 40), _mm512_load_si512(hibit)));
+
+#pragma GCC unroll 5
+		for (i = 0; i < 5; i++) {
+			d[i] = _mm512_setzero_si512();
+#pragma GCC unroll 5
+			for (l = 0; l < 5; l++)
+				d[i] = _mm512_add_epi64(d[i], _mm512_mul_epu32(h[l], (l <= i) ? rr[i - l] : r5[i + 5 - l]));
+		}
+
+		for (i = 0; i < 4; i++) {
+			c = _mm512_srli_epi64(d[i], 26);
+			h[i] = _mm512_and_si512(d[i], mask);
+			d[i + 1] = _mm512_add_epi64(d[i + 1], c);
+		}
+		c = _mm512_srli_epi64(d[4], 26);
+		h[4] = _mm512_and_si512(d[4], mask);
+		h[0] = _mm512_add_epi64(h[0], _mm512_add_epi64(c, _mm512_slli_epi64(c, 2)));
+		c = _mm512_srli_epi64(h[0], 26);
+		h[0] = _mm512_and_si512(h[0], mask);
+		h[1] = _mm512_add_epi64(h[1], c);
+	}
+
+	for (i = 0; i < 5; i++)
+		_mm512_store_si512(limbs[i], h[i]);
+	for (l = 0; l < count; l++) {
+		for (i = 0; i < 5; i++)
+			r[l][i] = limbs[i][l];
+		crypto_multibox_poly1305_finish(out[l], r[l], key[l]);
+	}
+}
+
+static const struct crypto_multibox crypto_multibox_avx512 = {
+	.name = "avx512",
+	.min = 3,
+	.lanes = 16,
+	.authlanes = 8,
+	.supported = crypto_multibox_avx512_supported,
+	.hsalsa20 = crypto_multibox_avx512_hsalsa20,
+	.salsa20 = crypto_multibox_avx512_salsa20,
+	.poly1305 = crypto_multibox_avx512_poly1305,
+};
+
+static const struct crypto_multibox crypto_multibox_avx2 = {
+	.name = "avx2",
+	.min = 3,
+	.lanes = 8,
+	.authlanes = 4,
+	.supported = crypto_multibox_avx2_supported,
+	.hsalsa20 = crypto_multibox_avx2_hsalsa20,
+	.salsa20 = crypto_multibox_avx2_salsa20,
+	.poly1305 = crypto_multibox_avx2_poly1305,
+};
+
+#endif /* CRYPTO_MULTIBOX_X86 */
+
+// Not used, with more boxes than ever go together they are all handed to
+// NaCl one by one:
+static const struct crypto_multibox crypto_multibox_scalar = {
+	.name = "scalar",
+	.min = CRYPTO_MULTIBOX_BOXES + 1,
+	.lanes = 1,
+	.authlanes = 1,
+	.supported = crypto_multibox_scalar_supported,
+};
+
+// Fastest first:
+static const struct crypto_multibox *crypto_multiboxes[] = {
+#ifdef CRYPTO_MULTIBOX_X86
+	&crypto_multibox_avx512,
+	&crypto_multibox_avx2,
+#endif
+	&crypto_multibox_scalar,
+	NULL
+};
+
+// The implementation in use, NULL picks the fastest one the CPU supports
+// (see CURVEDNS_CRYPTO_MULTIBOX):
+const struct crypto_multibox *crypto_multibox = NULL;
+
+// The Salsa20 states of count boxes (with a zero block counter), their keys
+// being HSalsa20 of their shared secrets and the first 16 bytes of their
+// nonces. The cores of all lanes are given to the implementations one after
+// another, 16 words each:
+static void crypto_multibox_subkeys(uint32_t (*state)[16], uint8_t **n, uint8_t **k, int count) {
+	uint32_t x[16 * CRYPTO_MULTIBOX_LANES], y[16 * CRYPTO_MULTIBOX_LANES];
+	int lanes = crypto_multibox->lanes;
+	int i, j, l, b;
+
+	for (i = 0; i < count; i += lanes) {
+		// Lanes without a box of their own compute the first one again:
+		for (l = 0; l < lanes; l++) {
+			b = (i + l < count) ? i + l : i;
+			for (j = 0; j < 4; j++) {
+				x[16 * l + 5 * j] = crypto_multibox_load32(crypto_multibox_sigma + 4 * j);
+				x[16 * l + 1 + j] = crypto_multibox_load32(k[b] + 4 * j);
+				x[16 * l + 11 + j] = crypto_multibox_load32(k[b] + 16 + 4 * j);
+				x[16 * l + 6 + j] = crypto_multibox_load32(n[b] + 4 * j);
+			}
+		}
+		crypto_multibox->hsalsa20(y, x);
+
+		for (l = 0; (l < lanes) && (i + l < count); l++) {
+			for (j = 0; j < 4; j++) {
+				state[i + l][5 * j] = crypto_multibox_load32(crypto_multibox_sigma + 4 * j);
+				state[i + l][1 + j] = y[16 * l + crypto_multibox_hsalsa20_words[j]];
+				state[i + l][11 + j] = y[16 * l + crypto_multibox_hsalsa20_words[4 + j]];
+			}
+			state[i + l][6] = crypto_multibox_load32(n[i + l] + 16);
+			state[i + l][7] = crypto_multibox_load32(n[i + l] + 20);
+			state[i + l][8] = state[i + l][9] = 0;
+		}
+	}
+}
+
+// c = m ^ the stream of count boxes, from block first on, their blocks
+// spread over the lanes (m NULL gives the stream itself):
+static void crypto_multibox_stream(uint8_t **c, uint8_t **m, const size_t *len, uint32_t (*state)[16], int count, uint64_t first) {
+	uint32_t x[16 * CRYPTO_MULTIBOX_LANES];
+	uint8_t *lc[CRYPTO_MULTIBOX_LANES], *lm[CRYPTO_MULTIBOX_LANES];
+	size_t ll[CRYPTO_MULTIBOX_LANES], pos;
+	uint64_t block;
+	int lanes = crypto_multibox->lanes;
+	int i, j, l = 0;
+
+	memset(x, 0, sizeof(x));
+	for (i = 0; i < count; i++) {
+		for (block = first, pos = 64 * first; pos < len[i]; block++, pos += 64) {
+			memcpy(x + 16 * l, state[i], 64);
+			x[16 * l + 8] = (uint32_t) block;
+			x[16 * l + 9] = (uint32_t) (block >> 32);
+			lc[l] = c[i] + pos;
+			lm[l] = m ? m[i] + pos : NULL;
+			ll[l] = (len[i] - pos < 64) ? len[i] - pos : 64;
+
+			if (++l == lanes) {
+				crypto_multibox->salsa20(lc, lm, ll, x);
+				l = 0;
+			}
+		}
+	}
+
+	if (l) {
+		for (j = l; j < lanes; j++)
+			ll[j] = 0;
+		crypto_multibox->salsa20(lc, lm, ll, x);
+	}
+}
+
+// The tags of count boxes: Poly1305 of what follows the first 32 bytes of
+// c, under key. Boxes of about the same length go together, so that few
+// zero blocks are needed:
+static void crypto_multibox_auth(uint8_t **tag, uint8_t **c, const size_t *len, uint8_t **key, int count) {
+	uint8_t *lt[CRYPTO_MULTIBOX_AUTH], *lc[CRYPTO_MULTIBOX_AUTH], *lk[CRYPTO_MULTIBOX_AUTH];
+	size_t ll[CRYPTO_MULTIBOX_AUTH];
+	int order[CRYPTO_MULTIBOX_BOXES];
+	int lanes = crypto_multibox->authlanes;
+	int i, j, t;
+
+	for (i = 0; i < count; i++) {
+		for (j = i; (j > 0) && (len[order[j - 1]] > len[i]); j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	for (i = 0; i < count; i += lanes) {
+		for (j = 0; (j < lanes) && (i + j < count); j++) {
+			t = order[i + j];
+			lt[j] = tag[t];
+			lc[j] = c[t] + 32;
+			ll[j] = len[t] - 32;
+			lk[j] = key[t];
+		}
+		crypto_multibox->poly1305(lt, lc, ll, lk, j);
+	}
+}
+
+int crypto_multibox_select(const char *name) {
+	int i;
+
+	for (i = 0; crypto_multiboxes[i]; i++) {
+		if (!strcmp(crypto_multiboxes[i]->name, name)) {
+			if (!crypto_multiboxes[i]->supported()) {
+				debug_log(DEBUG_ERROR, "crypto_multibox_select(): this CPU does not support %s\n", name);
+				return 0;
+			}
+			crypto_multibox = crypto_multiboxes[i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Picks the implementation, and checks it against NaCl on boxes of all
+// sizes up to a few blocks (opening them again, one of them tampered with),
+// falling back to NaCl itself when it differs:
+int crypto_multibox_init() {
+	uint8_t keys[CRYPTO_MULTIBOX_BOXES][32], nonces[CRYPTO_MULTIBOX_BOXES][24];
+	uint8_t messages[CRYPTO_MULTIBOX_BOXES][256], boxes[CRYPTO_MULTIBOX_BOXES][256], expected[256];
+	uint8_t *k[CRYPTO_MULTIBOX_BOXES], *n[CRYPTO_MULTIBOX_BOXES], *m[CRYPTO_MULTIBOX_BOXES], *c[CRYPTO_MULTIBOX_BOXES];
+	size_t len[CRYPTO_MULTIBOX_BOXES];
+	int results[CRYPTO_MULTIBOX_BOXES];
+	int i, j, round;
+
+	if (!crypto_multibox) {
+		for (i = 0; !crypto_multiboxes[i]->supported(); i++);
+		crypto_multibox = crypto_multiboxes[i];
+	}
+	if (crypto_multibox->lanes == 1)
+		goto done;
+
+	for (round = 0; round < 16; round++) {
+		for (i = 0; i < CRYPTO_MULTIBOX_BOXES; i++) {
+			for (j = 0; j < 32; j++)
+				keys[i][j] = (uint8_t) (i * 101 + j * 7 + round);
+			for (j = 0; j < 24; j++)
+				nonces[i][j] = (uint8_t) (i * 59 + j * 13 + round);
+			memset(messages[i], 0, 32);
+			for (j = 32; j < 256; j++)
+				messages[i][j] = (uint8_t) (i * 31 + j * 17 + round);
+			len[i] = 32 + (round * CRYPTO_MULTIBOX_BOXES + i) * 7 % 225;
+			k[i] = keys[i];
+			n[i] = nonces[i];
+			m[i] = messages[i];
+			c[i] = boxes[i];
+		}
+		crypto_multibox_afternm(c, m, len, n, k, CRYPTO_MULTIBOX_BOXES);
+
+		for (i = 0; i < CRYPTO_MULTIBOX_BOXES; i++) {
+			crypto_box_curve25519xsalsa20poly1305_afternm(expected, messages[i], len[i], nonces[i], keys[i]);
+			if (memcmp(expected, boxes[i], len[i]))
+				goto wrong;
+		}
+
+		// Opened in place, with one of them tampered with:
+		boxes[round % CRYPTO_MULTIBOX_BOXES][len[round % CRYPTO_MULTIBOX_BOXES] - 1] ^= 1;
+		crypto_multibox_open_afternm(c, c, len, n, k, results, CRYPTO_MULTIBOX_BOXES);
+		for (i = 0; i < CRYPTO_MULTIBOX_BOXES; i++) {
+			if (i == round % CRYPTO_MULTIBOX_BOXES) {
+				if (results[i] != -1)
+					goto wrong;
+			} else if (results[i] || memcmp(messages[i], boxes[i], len[i])) {
+				goto wrong;
+			}
+		}
+	}
+
+done:
+	debug_log(DEBUG_INFO, "crypto_multibox_init(): sealing the replies of a loop iteration with %s, %d blocks at a time\n", crypto_multibox->name, crypto_multibox->lanes);
+	return 1;
+
+wrong:
+	debug_log(DEBUG_ERROR, "crypto_multibox_init(): %s differs from NaCl, sealing the replies one at a time\n", crypto_multibox->name);
+	crypto_multibox = &crypto_multibox_scalar;
+	goto done;
+}
+
+// Like crypto_box_afternm(), for count boxes at once:
+int crypto_multibox_afternm(uint8_t **c, uint8_t **m, const size_t *mlen, uint8_t **n, uint8_t **k, int count) {
+	uint32_t state[CRYPTO_MULTIBOX_BOXES][16];
+	uint8_t keys[CRYPTO_MULTIBOX_BOXES][32], *key[CRYPTO_MULTIBOX_BOXES], *tag[CRYPTO_MULTIBOX_BOXES];
+	int i, j, boxes;
+
+	for (i = 0; i < count; i++)
+		if (mlen[i] < 32)
+			return -1;
+
+	for (i = 0; i < count; i += boxes) {
+		boxes = count - i;
+		if (boxes > CRYPTO_MULTIBOX_BOXES)
+			boxes = CRYPTO_MULTIBOX_BOXES;
+
+		if (boxes < crypto_multibox->min) {
+			for (j = i; j < i + boxes; j++)
+				crypto_box_curve25519xsalsa20poly1305_afternm(c[j], m[j], mlen[j], n[j], k[j]);
+			continue;
+		}
+
+		// With 32 zero bytes in front of m, the stream starts with the key of
+		// Poly1305, where the tag goes afterwards:
+		crypto_multibox_subkeys(state, n + i, k + i, boxes);
+		crypto_multibox_stream(c + i, m + i, mlen + i, state, boxes, 0);
+		for (j = 0; j < boxes; j++) {
+			memcpy(keys[j], c[i + j], 32);
+			key[j] = keys[j];
+			tag[j] = c[i + j] + 16;
+		}
+		crypto_multibox_auth(tag, c + i, mlen + i, key, boxes);
+		for (j = 0; j < boxes; j++)
+			memset(c[i + j], 0, 16);
+	}
+
+	return 0;
+}
+
+// Like crypto_box_open_afternm(), for count boxes at once. The result of
+// every box is in results, the boxes that are not opened are left alone:
+int crypto_multibox_open_afternm(uint8_t **m, uint8_t **c, const size_t *clen, uint8_t **n, uint8_t **k, int *results, int count) {
+	uint32_t state[CRYPTO_MULTIBOX_BOXES][16];
+	uint8_t blocks[CRYPTO_MULTIBOX_BOXES][64], tags[CRYPTO_MULTIBOX_BOXES][16];
+	uint8_t *block[CRYPTO_MULTIBOX_BOXES], *tag[CRYPTO_MULTIBOX_BOXES], *om[CRYPTO_MULTIBOX_BOXES], *oc[CRYPTO_MULTIBOX_BOXES];
+	size_t blocklen[CRYPTO_MULTIBOX_BOXES], olen[CRYPTO_MULTIBOX_BOXES], pos;
+	int i, j, boxes, opened, result = 0;
+
+	for (i = 0; i < count; i += boxes) {
+		boxes = count - i;
+		if (boxes > CRYPTO_MULTIBOX_BOXES)
+			boxes = CRYPTO_MULTIBOX_BOXES;
+
+		for (j = i; j < i + boxes; j++)
+			if (clen[j] < 32)
+				break;
+		if ((boxes < crypto_multibox->min) || (j < i + boxes)) {
+			for (j = i; j < i + boxes; j++) {
+				results[j] = crypto_box_curve25519xsalsa20poly1305_open_afternm(m[j], c[j], clen[j], n[j], k[j]);
+				if (results[j])
+					result = -1;
+			}
+			continue;
+		}
+
+		// The first block of every stream, for the key of Poly1305, is needed
+		// before anything is opened (in place):
+		crypto_multibox_subkeys(state, n + i, k + i, boxes);
+		for (j = 0; j < boxes; j++) {
+			block[j] = blocks[j];
+			blocklen[j] = 64;
+			tag[j] = tags[j];
+		}
+		crypto_multibox_stream(block, NULL, blocklen, state, boxes, 0);
+		crypto_multibox_auth(tag, c + i, clen + i, block, boxes);
+
+		opened = 0;
+		for (j = 0; j < boxes; j++) {
+			if (crypto_verify_16(tags[j], c[i + j] + 16)) {
+				results[i + j] = result = -1;
+				continue;
+			}
+			results[i + j] = 0;
+
+			for (pos = 32; (pos < 64) && (pos < clen[i + j]); pos++)
+				m[i + j][pos] = c[i + j][pos] ^ blocks[j][pos];
+			memcpy(state[opened], state[j], sizeof(state[j]));
+			om[opened] = m[i + j];
+			oc[opened] = c[i + j];
+			olen[opened] = clen[i + j];
+			opened++;
+		}
+
+		crypto_multibox_stream(om, oc, olen, state, opened, 1);
+		for (j = 0; j < opened; j++)
+			memset(om[j], 0, 32);
+	}
+
+	return result;
+}
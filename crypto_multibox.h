@@ -0,0 +1,76 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#ifndef CRYPTO_MULTIBOX_H_
+#define CRYPTO_MULTIBOX_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "debug.h"
+
+// Seals (or opens) several boxes at once, each with a key and a nonce of its
+// own, like crypto_box_afternm() (and crypto_box_open_afternm()) would one by
+// one. The Salsa20 blocks of all boxes are spread over the lanes of a SIMD
+// register, every lane running the core on a state of its own: 16 blocks at
+// a time with AVX-512, 8 with AVX2. Poly1305 runs on 8 (or 4) boxes at a
+// time, one in every 64-bit lane, the shorter ones starting with zero blocks
+// so that all of them end at the same block.
+#define CRYPTO_MULTIBOX_LANES	16				// the most Salsa20 lanes of any implementation
+#define CRYPTO_MULTIBOX_AUTH	8				// the most Poly1305 lanes of any implementation
+#define CRYPTO_MULTIBOX_BOXES	16				// boxes whose subkeys are kept at a time
+
+struct crypto_multibox {
+	const char *name;
+	int min;						// fewer boxes are left to NaCl, one at a time
+	int lanes;
+	int authlanes;
+	int (*supported)();
+	void (*hsalsa20)(uint32_t *, const uint32_t *);
+	void (*salsa20)(uint8_t **, uint8_t **, const size_t *, const uint32_t *);
+	void (*poly1305)(uint8_t **, uint8_t **, const size_t *, uint8_t **, int);
+};
+
+extern const struct crypto_multibox *crypto_multibox;
+
+extern int crypto_multibox_select(const char *);
+extern int crypto_multibox_init();
+extern int crypto_multibox_afternm(uint8_t **, uint8_t **, const size_t *, uint8_t **, uint8_t **, int);
+extern int crypto_multibox_open_afternm(uint8_t **, uint8_t **, const size_t *, uint8_t **, uint8_t **, int *, int);
+
+#endif /* CRYPTO_MULTIBOX_H_ */
@@ -0,0 +1,440 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#include <pthread.h>
+
+#include "crypto_pool.h"
+#include "crypto_batch.h"
+#include "curvedns.h"
+#include "dnscurve.h"
+
+// Number of crypto threads, 0 computes the shared secrets on the event loop
+// itself (see CURVEDNS_CRYPTO_THREADS):
+int global_crypto_pool_threads = 2;
+
+// Maximum number of shared secrets a worker waits for, queries with yet
+// another new key are dropped (see CURVEDNS_CRYPTO_QUEUE):
+int global_crypto_pool_queue = 512;
+
+// Without crypto threads, the number of shared secrets a worker computes per
+// loop iteration, after it handled everything else (see CURVEDNS_CRYPTO_BUDGET):
+int global_crypto_pool_budget = 16;
+
+// The jobs of all workers, in order of submission:
+static pthread_mutex_t crypto_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t crypto_pool_cond = PTHREAD_COND_INITIALIZER;
+static struct crypto_pool_job *crypto_pool_head = NULL;
+static struct crypto_pool_job *crypto_pool_tail = NULL;
+static int crypto_pool_queued = 0, crypto_pool_queued_peak = 0;
+static int crypto_pool_running = 0;
+
+// Every worker collects its finished jobs, and is woken up to resume them.
+// It lives in the thread local storage of the worker, so a worker waits for
+// the jobs the crypto threads are still busy with before it ends:
+struct crypto_pool_worker {
+	struct ev_loop *loop;
+	ev_async done_watcher;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;					// signalled when inflight drops to 0
+	int inflight;							// jobs handed to the crypto threads, not done yet
+	struct crypto_pool_job *done;
+	struct crypto_pool_job *head, *tail;	// jobs computed by the worker itself, or not yet queued
+	ev_check budget_watcher;
+	ev_prepare flush_watcher;
+	ev_idle idle_watcher;
+	int pending, pending_peak;
+	unsigned long submitted, coalesced, completed, dropped;
+};
+
+static __thread struct crypto_pool_worker crypto_worker;
+
+// Jobs of this worker still being computed, by public key:
+#define CRYPTO_POOL_PENDING		1024
+static __thread struct crypto_pool_job **crypto_pending = NULL;
+
+// Computes the shared secrets of up to CRYPTO_BATCH_MAX jobs at once:
+static void crypto_pool_compute(struct crypto_pool_job **jobs, int count) {
+	uint8_t *sharedsecrets[CRYPTO_BATCH_MAX], *publickeys[CRYPTO_BATCH_MAX];
+	int i, result;
+
+	for (i = 0; i < count; i++) {
+		sharedsecrets[i] = jobs[i]->sharedsecret;
+		publickeys[i] = jobs[i]->publickey;
+	}
+	result = crypto_batch_beforenm(sharedsecrets, publickeys, count, global_secret_key);
+	for (i = 0; i < count; i++)
+		jobs[i]->result = result;
+}
+
+static void *crypto_pool_thread(void *arg) {
+	struct crypto_pool_job *jobs[CRYPTO_BATCH_MAX], *job;
+	struct crypto_pool_worker *worker;
+	int i, count;
+
+	for (;;) {
+		pthread_mutex_lock(&crypto_pool_lock);
+		while (!crypto_pool_head)
+			pthread_cond_wait(&crypto_pool_cond, &crypto_pool_lock);
+		for (count = 0; crypto_pool_head && (count < crypto_batch->lanes); count++) {
+			jobs[count] = crypto_pool_head;
+			crypto_pool_head = crypto_pool_head->next;
+		}
+		if (!crypto_pool_head)
+			crypto_pool_tail = NULL;
+		crypto_pool_queued -= count;
+		pthread_mutex_unlock(&crypto_pool_lock);
+
+		crypto_pool_compute(jobs, count);
+
+		for (i = 0; i < count; i++) {
+			job = jobs[i];
+			worker = job->worker;
+			// Still holding the lock, as the worker may end once it is released:
+			pthread_mutex_lock(&worker->lock);
+			job->next = worker->done;
+			worker->done = job;
+			ev_async_send(worker->loop, &worker->done_watcher);
+			if (--worker->inflight == 0)
+				pthread_cond_signal(&worker->cond);
+			pthread_mutex_unlock(&worker->lock);
+		}
+	}
+
+	return NULL;
+}
+
+static unsigned int crypto_pool_bucket(const uint8_t *publickey) {
+	return (publickey[0] | (publickey[1] << 8)) & (CRYPTO_POOL_PENDING - 1);
+}
+
+// Resumes the queries waiting for a job, and gets rid of it:
+static void crypto_pool_finish(struct ev_loop *loop, struct crypto_pool_job *job) {
+	struct crypto_pool_job **ptr;
+
+	for (ptr = &crypto_pending[crypto_pool_bucket(job->publickey)]; *ptr; ptr = &(*ptr)->pendingnext) {
+		if (*ptr == job) {
+			*ptr = job->pendingnext;
+			break;
+		}
+	}
+	crypto_worker.pending--;
+	crypto_worker.completed++;
+
+	dnscurve_resume(loop, job);
+
+	free(job->waiters);
+	free(job);
+}
+
+static void crypto_pool_done_cb(struct ev_loop *loop, ev_async *w, int revent) {
+	struct crypto_pool_job *job, *jobs = NULL, *next;
+
+	if (!(revent & EV_ASYNC))
+		return;
+
+	pthread_mutex_lock(&crypto_worker.lock);
+	job = crypto_worker.done;
+	crypto_worker.done = NULL;
+	pthread_mutex_unlock(&crypto_worker.lock);
+
+	// The done list is in reverse order of completion:
+	while (job) {
+		next = job->next;
+		job->next = jobs;
+		jobs = job;
+		job = next;
+	}
+
+	for (job = jobs; job; job = next) {
+		next = job->next;
+		crypto_pool_finish(loop, job);
+	}
+}
+
+// Without crypto threads, the worker computes a limited number of shared
+// secrets once all other events of this iteration (among which the queries
+// with a cached key) have been handled:
+static void crypto_pool_budget_cb(struct ev_loop *loop, ev_check *w, int revent) {
+	struct crypto_pool_job *jobs[CRYPTO_BATCH_MAX];
+	int i, j, count;
+
+	for (i = 0; (i < global_crypto_pool_budget) && crypto_worker.head; i += count) {
+		for (count = 0; crypto_worker.head && (count < crypto_batch->lanes) && (i + count < global_crypto_pool_budget); count++) {
+			jobs[count] = crypto_worker.head;
+			crypto_worker.head = crypto_worker.head->next;
+		}
+		if (!crypto_worker.head)
+			crypto_worker.tail = NULL;
+
+		crypto_pool_compute(jobs, count);
+		for (j = 0; j < count; j++)
+			crypto_pool_finish(loop, jobs[j]);
+	}
+
+	// Do not let the loop wait for new events while there is work left:
+	if (crypto_worker.head) {
+		if (!ev_is_active(&crypto_worker.idle_watcher))
+			ev_idle_start(loop, &crypto_worker.idle_watcher);
+	} else {
+		ev_idle_stop(loop, &crypto_worker.idle_watcher);
+		ev_check_stop(loop, &crypto_worker.budget_watcher);
+	}
+}
+
+static void crypto_pool_idle_cb(struct ev_loop *loop, ev_idle *w, int revent) {
+}
+
+// The new keys of one loop iteration are queued for the crypto threads at
+// once, before the loop waits for new events, so they take them a batch at
+// a time:
+static void crypto_pool_flush_cb(struct ev_loop *loop, ev_prepare *w, int revent) {
+	int count = 0;
+	struct crypto_pool_job *job;
+
+	ev_prepare_stop(loop, &crypto_worker.flush_watcher);
+	if (!crypto_worker.head)
+		return;
+
+	for (job = crypto_worker.head; job; job = job->next)
+		count++;
+
+	pthread_mutex_lock(&crypto_worker.lock);
+	crypto_worker.inflight += count;
+	pthread_mutex_unlock(&crypto_worker.lock);
+
+	pthread_mutex_lock(&crypto_pool_lock);
+	if (crypto_pool_tail)
+		crypto_pool_tail->next = crypto_worker.head;
+	else
+		crypto_pool_head = crypto_worker.head;
+	crypto_pool_tail = crypto_worker.tail;
+	crypto_pool_queued += count;
+	if (crypto_pool_queued > crypto_pool_queued_peak)
+		crypto_pool_queued_peak = crypto_pool_queued;
+	if (count > crypto_batch->lanes)
+		pthread_cond_broadcast(&crypto_pool_cond);
+	else
+		pthread_cond_signal(&crypto_pool_cond);
+	pthread_mutex_unlock(&crypto_pool_lock);
+
+	crypto_worker.head = crypto_worker.tail = NULL;
+}
+
+// Starts the crypto threads, they are shared by all workers:
+int crypto_pool_start() {
+	pthread_t thread;
+	int i;
+
+	crypto_batch_init();
+
+	for (i = 0; i < global_crypto_pool_threads; i++) {
+		if (pthread_create(&thread, NULL, crypto_pool_thread, NULL) != 0) {
+			debug_log(DEBUG_ERROR, "crypto_pool_start(): unable to start crypto thread %d\n", i);
+			break;
+		}
+		pthread_detach(thread);
+	}
+	crypto_pool_running = i;
+
+	debug_log(DEBUG_INFO, "crypto_pool_start(): %d crypto threads running\n", crypto_pool_running);
+	return 1;
+}
+
+int crypto_pool_worker_init(struct ev_loop *loop) {
+	memset(&crypto_worker, 0, sizeof(crypto_worker));
+	if ((global_crypto_pool_threads <= 0) && (global_crypto_pool_budget <= 0))
+		return 1;
+
+	crypto_pending = (struct crypto_pool_job **) calloc(CRYPTO_POOL_PENDING, sizeof(struct crypto_pool_job *));
+	if (!crypto_pending) {
+		debug_log(DEBUG_ERROR, "crypto_pool_worker_init(): unable to allocate memory\n");
+		return 0;
+	}
+
+	pthread_mutex_init(&crypto_worker.lock, NULL);
+	pthread_cond_init(&crypto_worker.cond, NULL);
+	crypto_worker.loop = loop;
+	ev_async_init(&crypto_worker.done_watcher, crypto_pool_done_cb);
+	ev_async_start(loop, &crypto_worker.done_watcher);
+	ev_check_init(&crypto_worker.budget_watcher, crypto_pool_budget_cb);
+	ev_set_priority(&crypto_worker.budget_watcher, EV_MINPRI);
+	ev_idle_init(&crypto_worker.idle_watcher, crypto_pool_idle_cb);
+	ev_prepare_init(&crypto_worker.flush_watcher, crypto_pool_flush_cb);
+
+	return 1;
+}
+
+// Called by a worker whose loop ended: its jobs still queued are taken back,
+// those being computed are waited for, and all of them are thrown away (the
+// queries waiting for them are not answered anymore):
+void crypto_pool_worker_stop() {
+	struct crypto_pool_job *job, **ptr;
+	int i, taken = 0;
+
+	if (!crypto_worker.loop)
+		return;
+
+	pthread_mutex_lock(&crypto_pool_lock);
+	crypto_pool_tail = NULL;
+	for (ptr = &crypto_pool_head; (job = *ptr); ) {
+		if (job->worker == &crypto_worker) {
+			*ptr = job->next;
+			taken++;
+		} else {
+			crypto_pool_tail = job;
+			ptr = &job->next;
+		}
+	}
+	crypto_pool_queued -= taken;
+	pthread_mutex_unlock(&crypto_pool_lock);
+
+	pthread_mutex_lock(&crypto_worker.lock);
+	crypto_worker.inflight -= taken;
+	while (crypto_worker.inflight)
+		pthread_cond_wait(&crypto_worker.cond, &crypto_worker.lock);
+	pthread_mutex_unlock(&crypto_worker.lock);
+
+	// Every job that did not finish is still pending:
+	for (i = 0; i < CRYPTO_POOL_PENDING; i++) {
+		while ((job = crypto_pending[i])) {
+			crypto_pending[i] = job->pendingnext;
+			free(job->waiters);
+			free(job);
+		}
+	}
+	free(crypto_pending);
+	crypto_pending = NULL;
+
+	ev_async_stop(crypto_worker.loop, &crypto_worker.done_watcher);
+	ev_check_stop(crypto_worker.loop, &crypto_worker.budget_watcher);
+	ev_prepare_stop(crypto_worker.loop, &crypto_worker.flush_watcher);
+	ev_idle_stop(crypto_worker.loop, &crypto_worker.idle_watcher);
+	pthread_cond_destroy(&crypto_worker.cond);
+	pthread_mutex_destroy(&crypto_worker.lock);
+	memset(&crypto_worker, 0, sizeof(crypto_worker));
+}
+
+static int crypto_pool_add_waiter(struct crypto_pool_job *job, event_entry_t *general_entry) {
+	event_entry_t **waiters;
+
+	if (job->waiters_count == job->waiters_size) {
+		waiters = (event_entry_t **) realloc(job->waiters, (job->waiters_size ? job->waiters_size * 2 : 4) * sizeof(event_entry_t *));
+		if (!waiters)
+			return 0;
+		job->waiters = waiters;
+		job->waiters_size = job->waiters_size ? job->waiters_size * 2 : 4;
+	}
+	job->waiters[job->waiters_count++] = general_entry;
+	return 1;
+}
+
+// Hands the computation of the shared secret with publickey to the crypto
+// threads (or to the worker itself, later on), general_entry is resumed once
+// it is done. Returns 0 when the caller has to compute it right away, and -1
+// when the query has to be dropped.
+int crypto_pool_submit(event_entry_t *general_entry, const uint8_t *publickey) {
+	struct crypto_pool_job *job;
+	unsigned int bucket;
+
+	if (!crypto_worker.loop)
+		return 0;
+
+	// Someone else already asked for this one:
+	bucket = crypto_pool_bucket(publickey);
+	for (job = crypto_pending[bucket]; job; job = job->pendingnext) {
+		if (!memcmp(job->publickey, publickey, 32)) {
+			if (!crypto_pool_add_waiter(job, general_entry))
+				return 0;
+			crypto_worker.coalesced++;
+			return 1;
+		}
+	}
+
+	// Under a flood of new keys, the queries of known clients go first:
+	if (crypto_worker.pending >= global_crypto_pool_queue) {
+		crypto_worker.dropped++;
+		return -1;
+	}
+
+	job = (struct crypto_pool_job *) malloc(sizeof(struct crypto_pool_job));
+	if (!job)
+		return 0;
+	memset(job, 0, sizeof(struct crypto_pool_job));
+	memcpy(job->publickey, publickey, 32);
+	job->worker = &crypto_worker;
+	if (!crypto_pool_add_waiter(job, general_entry)) {
+		free(job);
+		return 0;
+	}
+
+	job->pendingnext = crypto_pending[bucket];
+	crypto_pending[bucket] = job;
+	crypto_worker.submitted++;
+	if (++crypto_worker.pending > crypto_worker.pending_peak)
+		crypto_worker.pending_peak = crypto_worker.pending;
+
+	if (crypto_worker.tail)
+		crypto_worker.tail->next = job;
+	else
+		crypto_worker.head = job;
+	crypto_worker.tail = job;
+
+	if (!crypto_pool_running) {
+		ev_check_start(crypto_worker.loop, &crypto_worker.budget_watcher);
+		ev_idle_start(crypto_worker.loop, &crypto_worker.idle_watcher);
+	} else {
+		ev_prepare_start(crypto_worker.loop, &crypto_worker.flush_watcher);
+	}
+
+	return 1;
+}
+
+void crypto_pool_stats(int worker) {
+	int queued, peak;
+
+	if (!crypto_worker.loop)
+		return;
+
+	pthread_mutex_lock(&crypto_pool_lock);
+	queued = crypto_pool_queued;
+	peak = crypto_pool_queued_peak;
+	pthread_mutex_unlock(&crypto_pool_lock);
+
+	debug_log(DEBUG_FATAL, "crypto_pool_stats(): worker %d: %lu shared secrets computed by %d threads, %lu queries coalesced, %d jobs queued for all workers (peak %d)\n",
+			worker, crypto_worker.completed, crypto_pool_running, crypto_worker.coalesced, queued, peak);
+	debug_log(DEBUG_FATAL, "crypto_pool_stats(): worker %d: waiting for %d shared secrets (peak %d, limit %d), %lu queries with a new key dropped\n",
+			worker, crypto_worker.pending, crypto_worker.pending_peak, global_crypto_pool_queue, crypto_worker.dropped);
+}
@@ -0,0 +1,78 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#ifndef CRYPTO_POOL_H_
+#define CRYPTO_POOL_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "debug.h"
+#include "event.h"
+
+// Shared secrets that are not in the cache are computed by a pool of crypto
+// threads, so a burst of new client keys does not stall the event loops.
+// Queries of one worker that wait for the same public key share one job, and
+// are resumed by that worker once the shared secret is there. Without crypto
+// threads, the worker computes them itself after handling its other events,
+// a limited number per loop iteration. Either way, the new keys are taken
+// several at a time (see crypto_batch.h), and the number of shared secrets a
+// worker waits for is bounded.
+
+struct crypto_pool_job {
+	uint8_t publickey[32];
+	uint8_t sharedsecret[32];
+	int result;						// as returned by crypto_box_beforenm()
+	event_entry_t **waiters;		// queries waiting for this shared secret
+	int waiters_count, waiters_size;
+	struct crypto_pool_worker *worker;
+	struct crypto_pool_job *next;	// in the job queue, or in the done list of the worker
+	struct crypto_pool_job *pendingnext;
+};
+
+extern int global_crypto_pool_threads;
+extern int global_crypto_pool_queue;
+extern int global_crypto_pool_budget;
+
+extern int crypto_pool_start();
+extern int crypto_pool_worker_init(struct ev_loop *);
+extern void crypto_pool_worker_stop();
+extern int crypto_pool_submit(event_entry_t *, const uint8_t *);
+extern void crypto_pool_stats(int);
+
+#endif /* CRYPTO_POOL_H_ */
@@ -0,0 +1,140 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+// Precomputes the shared secrets of client public keys that are known in
+// advance (such as those of the big resolvers), read from standard input one
+// per line, either in hex or in the DNSCurve form (uz5...). The table it
+// writes can be mapped by CurveDNS at startup (CURVEDNS_CACHE_PINNED), see
+// cache_pinned.c. The private key is taken from $CURVEDNS_PRIVATE_KEY, as
+// CurveDNS does, so it can be run with the envdir of the installation.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "crypto_scalarmult_curve25519.h"
+#include "crypto_batch.h"
+#include "cache.h"
+#include "debug.h"
+#include "misc.h"
+
+uint8_t public[32], private[32];
+
+// Parses a line into a client public key, returns 0 if it is not one:
+static int precompute_key(char *line, uint8_t *key) {
+	unsigned int keylen = CACHE_KEY_SIZE;
+	size_t len;
+
+	len = strcspn(line, " \t\r\n");
+	line[len] = '\0';
+
+	if ((len == 54) && !strncasecmp(line, "uz5", 3))
+		return misc_base32_decode(key, &keylen, (uint8_t *) line + 3, 51, 1) && (keylen == CACHE_KEY_SIZE);
+	if (len == (CACHE_KEY_SIZE * 2))
+		return misc_hex_decode(line, key);
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	uint8_t *entries = NULL, *tmpentries, *entry;
+	uint8_t *sharedsecrets[CRYPTO_BATCH_MAX], *publickeys[CRYPTO_BATCH_MAX];
+	char line[256];
+	uint32_t count = 0, size = 0, written, i;
+	int linenr = 0, j;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <table> < <file with a client public key per line>\n", argv[0]);
+		return 1;
+	}
+
+	// Fetch the secret key from environment (as CurveDNS does):
+	if (!misc_getenv_key("CURVEDNS_PRIVATE_KEY", 1, private))
+		return 1;
+	crypto_scalarmult_curve25519_base(public, private);
+
+	while (fgets(line, sizeof(line), stdin)) {
+		linenr++;
+		if ((line[0] == '#') || (line[strspn(line, " \t\r\n")] == '\0'))
+			continue;
+
+		if (count == size) {
+			size = size ? (size * 2) : 4096;
+			tmpentries = (uint8_t *) realloc(entries, (size_t) size * (CACHE_KEY_SIZE + CACHE_VALUE_SIZE));
+			if (!tmpentries) {
+				fprintf(stderr, "Unable to allocate memory for %u keys.\n", size);
+				return 1;
+			}
+			entries = tmpentries;
+		}
+
+		entry = entries + ((size_t) count * (CACHE_KEY_SIZE + CACHE_VALUE_SIZE));
+		if (!precompute_key(line, entry)) {
+			fprintf(stderr, "Line %d is not a public key in hex or DNSCurve (uz5...) form.\n", linenr);
+			return 1;
+		}
+		count++;
+	}
+
+	if (!count) {
+		fprintf(stderr, "No public keys given.\n");
+		return 1;
+	}
+
+	// As many at a time as the CPU allows:
+	crypto_batch_init();
+	for (i = 0; i < count; i += j) {
+		for (j = 0; (j < CRYPTO_BATCH_MAX) && (i + j < count); j++) {
+			entry = entries + ((size_t) (i + j) * (CACHE_KEY_SIZE + CACHE_VALUE_SIZE));
+			publickeys[j] = entry;
+			sharedsecrets[j] = entry + CACHE_KEY_SIZE;
+		}
+		crypto_batch_beforenm(sharedsecrets, publickeys, j, private);
+	}
+
+	written = cache_pinned_write(argv[1], public, entries, count);
+	memset(entries, 0, (size_t) size * (CACHE_KEY_SIZE + CACHE_VALUE_SIZE));
+	free(entries);
+	if (!written) {
+		fprintf(stderr, "Unable to write %s.\n", argv[1]);
+		return 1;
+	}
+
+	printf("Wrote the shared secrets of %u client public keys to %s.\n", written, argv[1]);
+	return 0;
+}
@@ -41,6 +41,12 @@
 #include "ip.h"
 #include "event.h"
 #include "dnscurve.h"
+#include "crypto_pool.h"
+#include "crypto_batch.h"
+#include "crypto_multibox.h"
+#include "crypto_scalarmult_curve25519.h"
+#include "crypto_stream_salsa20.h"
+#include "crypto_onetimeauth_poly1305.h"
 
 // The server's private key
 uint8_t global_secret_key[32];
@@ -62,7 +68,33 @@ static int usage(const char *argv0) {
 	debug_log(DEBUG_FATAL, " [CURVEDNS_UDP_TRIES]\n\tWhen timeout to target server, how many tries in total (default: 2)\n");
 	debug_log(DEBUG_FATAL, " [CURVEDNS_TCP_NUMBER]\n\tNumber of simultaneous TCP connections allowed (default: 25)\n");
 	debug_log(DEBUG_FATAL, " [CURVEDNS_TCP_TIMEOUT]\n\tNumber of seconds before TCP session to client times out (default: 60.0)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_TCP_INFLIGHT]\n\tNumber of queries of one TCP client that are handled at the same time (default: 32)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_TCP_UPSTREAM]\n\tMaximum number of kept-alive TCP connections towards the target server, per worker (default: 4)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_TCP_PIPELINE]\n\tNumber of queries in flight on such a connection before another one is opened (default: 16)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_TCP_IDLE]\n\tNumber of seconds before an idle connection towards the target server is closed (default: 10.0)\n");
 	debug_log(DEBUG_FATAL, " [CURVEDNS_SHARED_SECRETS]\n\tNumber of shared secrets that can be cached (default: 5000)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CACHE_BACKEND]\n\tShared secret cache: swiss, hashtable, concurrent (one shared by all workers) or critbit (default: swiss)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CACHE_POLICY]\n\tWhich shared secret is pushed out of a full cache, fifo (oldest) or clock (oldest not recently used) (default: clock, fifo for hashtable)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CACHE_ADMISSION]\n\tWhether a new shared secret only pushes another out when its client was seen more often (TinyLFU) (default: 1 for swiss, 0 otherwise)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CACHE_SNAPSHOT]\n\tFile (one per worker, with .<worker> appended) the shared secret cache is saved to and restored from (default: none)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CACHE_SNAPSHOT_INTERVAL]\n\tSeconds between snapshots of the shared secret cache, 0 only saves it when quitting (default: 600)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CACHE_SHM]\n\tNumber of shared secrets in a shared memory cache, shared by all processes with the same private key (default: 0, none)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CACHE_PINNED]\n\tTable of precomputed shared secrets of known clients, written by curvedns-precompute (default: none)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CACHE_SIZE_FILE]\n\tFile with the number of shared secrets to resize the cache to on SIGUSR2 (default: none)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_UDP_BATCH]\n\tMaximum number of UDP datagrams received or sent in one system call (default: 32)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_UDP_SOCKETS]\n\tNumber of (randomly bound) UDP sockets towards the target server, per worker (default: 16)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_UDP_ROTATE]\n\tNumber of seconds after which all of these sockets have been replaced, 0 disables (default: 60.0)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_POOL_ENTRIES]\n\tNumber of queries (and UDP buffers) preallocated per worker (default: 1024)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_POOL_TCP]\n\tNumber of TCP buffers preallocated per worker (default: 64)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_ENGINE]\n\tI/O engine for UDP, libev or uring (Linux io_uring, falls back to libev) (default: libev)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CRYPTO_THREADS]\n\tNumber of threads computing the shared secrets of new client keys, 0 computes them in the workers (default: 2)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CRYPTO_QUEUE]\n\tMaximum number of new client keys a worker computes shared secrets for at a time, queries with more are dropped (default: 512)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CRYPTO_BUDGET]\n\tWithout crypto threads, number of shared secrets a worker computes per loop iteration, 0 computes them right away (default: 16)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CRYPTO_BATCH]\n\tHow the shared secrets of several new client keys are computed at once, avx512ifma (8 at a time), avx2 (4) or scalar (default: the fastest this CPU supports)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_CRYPTO_MULTIBOX]\n\tHow the UDP replies of a loop iteration are sealed at once, avx512 (16 Salsa20 blocks at a time), avx2 (8) or scalar (default: the fastest this CPU supports)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_PIPELINE]\n\tNumber of crypto stage threads per worker opening and sealing DNSCurve packets, 0 disables (default: 0)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_PIPELINE_RING]\n\tNumber of packets on their way to (and back from) a crypto stage (default: 1024)\n");
+	debug_log(DEBUG_FATAL, " [CURVEDNS_WORKERS]\n\tNumber of worker threads, each with its own sockets and cache (default: 1)\n");
 	debug_log(DEBUG_FATAL, " [CURVEDNS_DEBUG]\n\tDebug level, 1: fatal, 2: error, 3: warning, 4: info, 5: debug (default: 2)\n");
 	return 1;
 }
@@ -71,6 +103,7 @@ static int getenvoptions() {
 	int tmpi;
 	double tmpd;
 	char ip[INET6_ADDRSTRLEN];
+	char *engine, *policy, *backend, *batch, *multibox;
 
 	global_source_address.sa.sa_family = AF_UNSPEC;
 	tmpi = misc_getenv_ip("CURVEDNS_SOURCE_IP", 0, &global_source_address);
@@ -125,6 +158,167 @@ static int getenvoptions() {
 		debug_log(DEBUG_INFO, "TCP client timeout: %.2f seconds\n", global_ip_tcp_external_timeout);
 	}
 
+	if (misc_getenv_int("CURVEDNS_TCP_INFLIGHT", 0, &tmpi)) {
+		if (tmpi > 1024) tmpi = 1024;
+		else if (tmpi < 1) tmpi = 1;
+		global_event_tcp_client_inflight = tmpi;
+		debug_log(DEBUG_FATAL, "number of queries in flight per TCP client set to %d\n", global_event_tcp_client_inflight);
+	} else {
+		debug_log(DEBUG_INFO, "number of queries in flight per TCP client: %d\n", global_event_tcp_client_inflight);
+	}
+
+	if (misc_getenv_int("CURVEDNS_TCP_UPSTREAM", 0, &tmpi)) {
+		if (tmpi > 500) tmpi = 500;
+		else if (tmpi < 1) tmpi = 1;
+		global_event_tcp_int_connections = tmpi;
+		debug_log(DEBUG_FATAL, "number of TCP connections towards target server set to %d\n", global_event_tcp_int_connections);
+	} else {
+		debug_log(DEBUG_INFO, "number of TCP connections towards target server: %d\n", global_event_tcp_int_connections);
+	}
+
+	if (misc_getenv_int("CURVEDNS_TCP_PIPELINE", 0, &tmpi)) {
+		if (tmpi > 1024) tmpi = 1024;
+		else if (tmpi < 1) tmpi = 1;
+		global_event_tcp_int_pipeline = tmpi;
+		debug_log(DEBUG_FATAL, "TCP pipeline depth towards target server set to %d\n", global_event_tcp_int_pipeline);
+	} else {
+		debug_log(DEBUG_INFO, "TCP pipeline depth towards target server: %d\n", global_event_tcp_int_pipeline);
+	}
+
+	if (misc_getenv_double("CURVEDNS_TCP_IDLE", 0, &tmpd)) {
+		if (tmpd > 3600.) tmpd = 3600.;
+		else if (tmpd < 0.1) tmpd = 0.1;
+		global_event_tcp_int_idle = (ev_tstamp) tmpd;
+		debug_log(DEBUG_FATAL, "TCP idle timeout towards target server set to %.2f seconds\n", global_event_tcp_int_idle);
+	} else {
+		debug_log(DEBUG_INFO, "TCP idle timeout towards target server: %.2f seconds\n", global_event_tcp_int_idle);
+	}
+
+	if (misc_getenv_int("CURVEDNS_UDP_BATCH", 0, &tmpi)) {
+		if (tmpi > 1024) tmpi = 1024;
+		else if (tmpi < 1) tmpi = 1;
+		global_event_udp_batch = tmpi;
+		debug_log(DEBUG_FATAL, "UDP batch size set to %d datagrams\n", global_event_udp_batch);
+	} else {
+		debug_log(DEBUG_INFO, "UDP batch size: %d datagrams\n", global_event_udp_batch);
+	}
+
+	if (misc_getenv_int("CURVEDNS_UDP_SOCKETS", 0, &tmpi)) {
+		if (tmpi > 1024) tmpi = 1024;
+		else if (tmpi < 1) tmpi = 1;
+		global_event_udp_sockets = tmpi;
+		debug_log(DEBUG_FATAL, "number of UDP sockets towards target server set to %d\n", global_event_udp_sockets);
+	} else {
+		debug_log(DEBUG_INFO, "number of UDP sockets towards target server: %d\n", global_event_udp_sockets);
+	}
+
+	if (misc_getenv_double("CURVEDNS_UDP_ROTATE", 0, &tmpd)) {
+		if (tmpd > 86400.) tmpd = 86400.;
+		else if (tmpd < 0.) tmpd = 0.;
+		global_event_udp_rotate = (ev_tstamp) tmpd;
+		debug_log(DEBUG_FATAL, "UDP socket rotation set to %.2f seconds\n", global_event_udp_rotate);
+	} else {
+		debug_log(DEBUG_INFO, "UDP socket rotation: %.2f seconds\n", global_event_udp_rotate);
+	}
+
+	if (misc_getenv_int("CURVEDNS_POOL_ENTRIES", 0, &tmpi)) {
+		if (tmpi > 1000000) tmpi = 1000000;
+		else if (tmpi < 0) tmpi = 0;
+		global_event_pool_entries = tmpi;
+		debug_log(DEBUG_FATAL, "number of preallocated entries set to %d\n", global_event_pool_entries);
+	} else {
+		debug_log(DEBUG_INFO, "number of preallocated entries: %d\n", global_event_pool_entries);
+	}
+
+	if (misc_getenv_int("CURVEDNS_POOL_TCP", 0, &tmpi)) {
+		if (tmpi > 100000) tmpi = 100000;
+		else if (tmpi < 0) tmpi = 0;
+		global_event_pool_tcp = tmpi;
+		debug_log(DEBUG_FATAL, "number of preallocated TCP buffers set to %d\n", global_event_pool_tcp);
+	} else {
+		debug_log(DEBUG_INFO, "number of preallocated TCP buffers: %d\n", global_event_pool_tcp);
+	}
+
+	engine = getenv("CURVEDNS_ENGINE");
+	if (engine) {
+		if (!strcmp(engine, "uring")) {
+			global_event_engine = EVENT_ENGINE_URING;
+		} else if (strcmp(engine, "libev")) {
+			debug_log(DEBUG_FATAL, "$CURVEDNS_ENGINE must be either libev or uring\n");
+			return 0;
+		}
+		debug_log(DEBUG_FATAL, "I/O engine set to %s\n", engine);
+	} else {
+		debug_log(DEBUG_INFO, "I/O engine: libev\n");
+	}
+
+	if (misc_getenv_int("CURVEDNS_CRYPTO_THREADS", 0, &tmpi)) {
+		if (tmpi > 128) tmpi = 128;
+		else if (tmpi < 0) tmpi = 0;
+		global_crypto_pool_threads = tmpi;
+		debug_log(DEBUG_FATAL, "number of crypto threads set to %d\n", global_crypto_pool_threads);
+	} else {
+		debug_log(DEBUG_INFO, "number of crypto threads: %d\n", global_crypto_pool_threads);
+	}
+
+	if (misc_getenv_int("CURVEDNS_CRYPTO_QUEUE", 0, &tmpi)) {
+		if (tmpi > 1000000) tmpi = 1000000;
+		else if (tmpi < 1) tmpi = 1;
+		global_crypto_pool_queue = tmpi;
+		debug_log(DEBUG_FATAL, "crypto queue limit set to %d\n", global_crypto_pool_queue);
+	} else {
+		debug_log(DEBUG_INFO, "crypto queue limit: %d\n", global_crypto_pool_queue);
+	}
+
+	if (misc_getenv_int("CURVEDNS_CRYPTO_BUDGET", 0, &tmpi)) {
+		if (tmpi > 10000) tmpi = 10000;
+		else if (tmpi < 0) tmpi = 0;
+		global_crypto_pool_budget = tmpi;
+		debug_log(DEBUG_FATAL, "crypto budget set to %d shared secrets per loop iteration\n", global_crypto_pool_budget);
+	} else {
+		debug_log(DEBUG_INFO, "crypto budget: %d shared secrets per loop iteration\n", global_crypto_pool_budget);
+	}
+
+	batch = getenv("CURVEDNS_CRYPTO_BATCH");
+	if (batch) {
+		if (!crypto_batch_select(batch)) {
+			debug_log(DEBUG_FATAL, "$CURVEDNS_CRYPTO_BATCH must be either avx512ifma, avx2 or scalar, and supported by this CPU\n");
+			return 0;
+		}
+		debug_log(DEBUG_FATAL, "shared secret computation set to %s\n", batch);
+	} else {
+		debug_log(DEBUG_INFO, "shared secret computation: the fastest this CPU supports\n");
+	}
+
+	multibox = getenv("CURVEDNS_CRYPTO_MULTIBOX");
+	if (multibox) {
+		if (!crypto_multibox_select(multibox)) {
+			debug_log(DEBUG_FATAL, "$CURVEDNS_CRYPTO_MULTIBOX must be either avx512, avx2 or scalar, and supported by this CPU\n");
+			return 0;
+		}
+		debug_log(DEBUG_FATAL, "reply sealing set to %s\n", multibox);
+	} else {
+		debug_log(DEBUG_INFO, "reply sealing: the fastest this CPU supports\n");
+	}
+
+	if (misc_getenv_int("CURVEDNS_PIPELINE", 0, &tmpi)) {
+		if (tmpi > 64) tmpi = 64;
+		else if (tmpi < 0) tmpi = 0;
+		global_event_pipeline_stages = tmpi;
+		debug_log(DEBUG_FATAL, "number of crypto stages per worker set to %d\n", global_event_pipeline_stages);
+	} else {
+		debug_log(DEBUG_INFO, "number of crypto stages per worker: %d\n", global_event_pipeline_stages);
+	}
+
+	if (misc_getenv_int("CURVEDNS_PIPELINE_RING", 0, &tmpi)) {
+		if (tmpi > 1048576) tmpi = 1048576;
+		else if (tmpi < 16) tmpi = 16;
+		global_event_pipeline_ring = tmpi;
+		debug_log(DEBUG_FATAL, "crypto stage ring size set to %d\n", global_event_pipeline_ring);
+	} else {
+		debug_log(DEBUG_INFO, "crypto stage ring size: %d\n", global_event_pipeline_ring);
+	}
+
 	if (misc_getenv_int("CURVEDNS_SHARED_SECRETS", 0, &tmpi)) {
 		if (tmpi > 50)
 			global_shared_secrets = tmpi;
@@ -133,10 +327,82 @@ static int getenvoptions() {
 		debug_log(DEBUG_INFO, "shared secret cache: %d positions\n", global_shared_secrets);
 	}
 
+	// Before the policy and admission, as it sets their defaults:
+	backend = getenv("CURVEDNS_CACHE_BACKEND");
+	if (backend) {
+		if (!cache_backend_select(backend)) {
+			debug_log(DEBUG_FATAL, "$CURVEDNS_CACHE_BACKEND must be either swiss, hashtable, concurrent or critbit\n");
+			return 0;
+		}
+		debug_log(DEBUG_FATAL, "shared secret cache backend set to %s\n", backend);
+	} else {
+		debug_log(DEBUG_INFO, "shared secret cache backend: %s\n", cache_backend->name);
+	}
+
+	policy = getenv("CURVEDNS_CACHE_POLICY");
+	if (policy) {
+		if (!strcmp(policy, "fifo")) {
+			global_cache_policy = CACHE_POLICY_FIFO;
+		} else if (!strcmp(policy, "clock")) {
+			global_cache_policy = CACHE_POLICY_CLOCK;
+		} else {
+			debug_log(DEBUG_FATAL, "$CURVEDNS_CACHE_POLICY must be either fifo or clock\n");
+			return 0;
+		}
+		debug_log(DEBUG_FATAL, "shared secret cache policy set to %s\n", policy);
+	} else {
+		debug_log(DEBUG_INFO, "shared secret cache policy: %s\n", (global_cache_policy == CACHE_POLICY_CLOCK) ? "clock" : "fifo");
+	}
+
+	if (misc_getenv_int("CURVEDNS_CACHE_ADMISSION", 0, &tmpi)) {
+		global_cache_admission = tmpi ? 1 : 0;
+		debug_log(DEBUG_FATAL, "shared secret cache admission set to %d\n", global_cache_admission);
+	} else {
+		debug_log(DEBUG_INFO, "shared secret cache admission: %d\n", global_cache_admission);
+	}
+
+	global_cache_snapshot = getenv("CURVEDNS_CACHE_SNAPSHOT");
+	if (global_cache_snapshot) {
+		if (!*global_cache_snapshot) {
+			global_cache_snapshot = NULL;
+		} else {
+			debug_log(DEBUG_FATAL, "shared secret cache snapshots set to %s.<worker>\n", global_cache_snapshot);
+		}
+	}
+
+	if (misc_getenv_double("CURVEDNS_CACHE_SNAPSHOT_INTERVAL", 0, &tmpd)) {
+		if (tmpd < 0)
+			tmpd = 0;
+		global_cache_snapshot_interval = tmpd;
+		debug_log(DEBUG_FATAL, "shared secret cache snapshot interval set to %.0f seconds\n", global_cache_snapshot_interval);
+	} else {
+		debug_log(DEBUG_INFO, "shared secret cache snapshot interval: %.0f seconds\n", global_cache_snapshot_interval);
+	}
+
+	if (misc_getenv_int("CURVEDNS_CACHE_SHM", 0, &tmpi)) {
+		if (tmpi < 0)
+			tmpi = 0;
+		global_cache_shm = tmpi;
+		debug_log(DEBUG_FATAL, "shared memory cache set to %d shared secrets\n", global_cache_shm);
+	} else {
+		debug_log(DEBUG_INFO, "shared memory cache: %d shared secrets\n", global_cache_shm);
+	}
+
+	global_event_cache_size_file = getenv("CURVEDNS_CACHE_SIZE_FILE");
+	if (global_event_cache_size_file) {
+		if (!*global_event_cache_size_file) {
+			global_event_cache_size_file = NULL;
+		} else {
+			debug_log(DEBUG_FATAL, "shared secret cache size file set to %s\n", global_event_cache_size_file);
+		}
+	}
+
 	return 1;
 }
 
 int main(int argc, char *argv[]) {
+	uint8_t publickey[32], shmid[16];
+	char *pinned;
 	int uid, gid, tmp;
 
 	if (argc != 5)
@@ -149,6 +415,18 @@ int main(int argc, char *argv[]) {
 	}
 	debug_log(DEBUG_FATAL, "starting %s version %s (debug level %d)\n", argv[0], CURVEDNS_VERSION, debug_level);
 
+	// NaCl picked the fastest implementations this CPU supports at startup:
+	debug_log(DEBUG_INFO, "main(): NaCl uses %s, %s and %s\n", crypto_scalarmult_curve25519_SELECTED,
+			crypto_stream_salsa20_SELECTED, crypto_onetimeauth_poly1305_SELECTED);
+
+	// The number of workers determines the number of sockets we open:
+	if (misc_getenv_int("CURVEDNS_WORKERS", 0, &tmp)) {
+		if (tmp > 128) tmp = 128;
+		else if (tmp < 1) tmp = 1;
+		global_event_workers = tmp;
+		debug_log(DEBUG_FATAL, "number of workers set to %d\n", global_event_workers);
+	}
+
 	// Parse the listening IP addresses:
 	local_addresses = ip_multiple_parse(&local_addresses_count, argv[1], argv[2]);
 	if (!local_addresses) {
@@ -177,6 +455,17 @@ int main(int argc, char *argv[]) {
 	if (!misc_getenv_key("CURVEDNS_PRIVATE_KEY", 1, global_secret_key))
 		return 1;
 
+	crypto_scalarmult_curve25519_base(publickey, global_secret_key);
+
+	// Map the precomputed shared secrets of known clients (before throwing
+	// away root privileges, so the table can be as private as the key):
+	pinned = getenv("CURVEDNS_CACHE_PINNED");
+	if (pinned && *pinned) {
+		debug_log(DEBUG_FATAL, "precomputed shared secrets set to %s\n", pinned);
+		if (!cache_pinned_init(pinned, publickey))
+			debug_log(DEBUG_ERROR, "cache_pinned_init(): failed, continuing without precomputed shared secrets\n");
+	}
+
 	// Fetch group id:
 	if (!misc_getenv_int("GID", 1, &gid))
 		return 1;
@@ -186,7 +475,7 @@ int main(int argc, char *argv[]) {
 		return 1;
 
 	// Open UDP and TCP sockets on local address(es):
-	if (!ip_init(local_addresses, local_addresses_count)) {
+	if (!ip_init(local_addresses, local_addresses_count, global_event_workers)) {
 		debug_log(DEBUG_FATAL, "ip_init(): failed, are you root?\n");
 		return 1;
 	}
@@ -206,13 +495,23 @@ int main(int argc, char *argv[]) {
 	if (!getenvoptions())
 		return 1;
 
+	// Map the cache shared with the other processes using the same key (after
+	// throwing away root privileges, so they can all open it). Its name is
+	// the Salsa20 stream of the secret key, under a nonce of its own:
+	if (global_cache_shm) {
+		crypto_stream_salsa20(shmid, sizeof(shmid), (const uint8_t *) "curvshm0", global_secret_key);
+		if (!cache_shm_init(publickey, shmid))
+			debug_log(DEBUG_ERROR, "cache_shm_init(): failed, continuing without the shared memory cache\n");
+	}
+
 	// Initialize the event handler, the core of CurveDNS:
 	if (!event_init()) {
 		debug_log(DEBUG_FATAL, "event_init(): failed\n");
 		return 1;
 	}
 
-	// Initialize the DNSCurve part (such as the shared secret cache):
+	// Initialize the DNSCurve part (such as the shared secret cache) of the
+	// first worker, the other workers do this themselves once started:
 	if (!dnscurve_init()) {
 		debug_log(DEBUG_FATAL, "dnscurve_init(): failed\n");
 		return 1;
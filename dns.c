@@ -90,42 +90,30 @@ int dns_analyze_query(event_entry_t *general_entry) {
 }
 
 int dns_forward_query_udp(event_entry_t *general_entry) {
-	int sock, n;
+	int n;
 	struct event_udp_entry *entry = &general_entry->udp;
 
-	if (!ip_udp_open(&sock, &global_target_address)) {
-		debug_log(DEBUG_ERROR, "dns_forward_query_udp(): unable to open a UDP socket to forward query to authoritative server\n");
+	// Pick one of the (randomly bound) sockets and generate a new TXID to forecome any poisoning:
+	if (!event_udp_int_attach(event_default_loop, general_entry)) {
+		debug_log(DEBUG_ERROR, "dns_forward_query_udp(): unable to find a UDP socket to forward query to authoritative server\n");
 		goto wrong;
 	}
 
-	// randomize the outgoing source port and set the source IP address, if needed
-	if (!ip_bind_random(sock)) {
-		// if this fails, let the kernel handle it (would mean source IP address is not guaranteed...)
-		debug_log(DEBUG_WARN, "dns_forward_query_udp(): unable to bind to source IP address and/or random port\n");
-	}
-
 	entry->state = EVENT_UDP_INT_WRITING;
-	entry->read_int_watcher.data = general_entry;
 	entry->timeout_int_watcher.data = general_entry;
 	entry->retries++;
 
-	// Now generate a new TXID to forecome any poisoning:
-	entry->buffer[0] = misc_crypto_random(256);
-	entry->buffer[1] = misc_crypto_random(256);
-	// XXX: do this platform safe (i.e. ntoh)
-	entry->dns.dsttxid = (entry->buffer[0] << 8) + entry->buffer[1];
+	entry->buffer[0] = entry->dns.dsttxid >> 8;
+	entry->buffer[1] = entry->dns.dsttxid & 0xff;
 
-	ev_io_init(&entry->read_int_watcher, event_udp_int_cb, sock, EV_READ);
 	ev_timer_init(&entry->timeout_int_watcher, event_udp_timeout_cb, 0., global_ip_internal_timeout);
-
-	ev_io_start(event_default_loop, &entry->read_int_watcher);
 	ev_timer_again(event_default_loop, &entry->timeout_int_watcher);
 
 	debug_log(DEBUG_INFO, "dns_forward_query_udp(): forwarding query to authoritative name server (prev id = %d, new id = %d)\n",
 			(entry->dns.type == DNS_DNSCURVE_STREAMLINED || entry->dns.type == DNS_NON_DNSCURVE) ? entry->dns.srctxid : entry->dns.srcinsidetxid,
 			entry->dns.dsttxid);
 
-	n = sendto(sock, entry->buffer, entry->packetsize, MSG_DONTWAIT,
+	n = sendto(entry->intsock->watcher.fd, entry->buffer, entry->packetsize, MSG_DONTWAIT,
 			(struct sockaddr *) &global_target_address.sa, global_target_address_len);
 	if (n == -1) {
 		debug_log(DEBUG_ERROR, "dns_forward_query_udp(): unable to forward the query to authoritative name server (%s)\n", strerror(errno));
@@ -141,28 +129,11 @@ wrong:
 int dns_forward_query_tcp(event_entry_t *general_entry) {
 	struct event_tcp_entry *entry = &general_entry->tcp;
 
-	if (!ip_tcp_open(&entry->intsock, &global_target_address)) {
-		debug_log(DEBUG_ERROR, "dns_forward_query_tcp(): unable to open TCP socket\n");
+	// Queue it on one of the kept-alive connections, which generates a new TXID as well:
+	if (!event_tcp_int_send(event_default_loop, general_entry)) {
+		debug_log(DEBUG_ERROR, "dns_forward_query_tcp(): unable to queue query towards authoritative server\n");
 		goto wrong;
 	}
-	
-	// randomizing port is not really necessary, as TCP is invulnerable to cache poisoning
-	// however, the source IP address is set in ip_bind_random...
-	if (!ip_bind_random(entry->intsock)) {
-		// if this fails, let the kernel handle it (would mean source IP address is not guaranteed...)
-		debug_log(DEBUG_WARN, "dns_forward_query_tcp(): unable to bind to source IP address and/or random port\n");
-	}
-
-	if (!ip_connect(entry->intsock, &global_target_address)) {
-		debug_log(DEBUG_ERROR, "dns_forward_query_tcp(): unable to connect to authoritative name server (%s)\n", strerror(errno));
-		goto wrong;
-	}
-
-	// Now generate a new TXID to forecome any poisoning:
-	entry->buffer[0] = misc_crypto_random(256);
-	entry->buffer[1] = misc_crypto_random(256);
-	// XXX: do this platform safe (i.e. ntoh)
-	entry->dns.dsttxid = (entry->buffer[0] << 8) + entry->buffer[1];
 
 	debug_log(DEBUG_INFO, "dns_forward_query_tcp(): forwarding query to authoritative name server (prev id = %d, new id = %d)\n",
 			entry->dns.srctxid, entry->dns.dsttxid);
@@ -173,6 +144,42 @@ wrong:
 	return 0;
 }
 
+// Checks whether the response carries the same question section as the
+// query (the name being compared case insensitively), returns 1 if so:
+int dns_packet_question_equal(const uint8_t *query, size_t querylen, const uint8_t *response, size_t responselen) {
+	size_t pos = 12, end;
+	uint8_t a, b;
+
+	if ((querylen < 12) || (responselen < 12))
+		return 0;
+	if ((query[4] != response[4]) || (query[5] != response[5]))
+		return 0;
+	if (!query[4] && !query[5])
+		return 1;
+
+	// Find the end of the first question (our queries are never compressed):
+	while ((pos < querylen) && query[pos]) {
+		if (query[pos] > 63)
+			return 0;
+		pos += query[pos] + 1;
+	}
+	end = pos + 1 + 4;
+	if ((end > querylen) || (end > responselen))
+		return 0;
+
+	for (pos = 12; pos < end - 4; pos++) {
+		a = query[pos];
+		b = response[pos];
+		if ((a >= 'A') && (a <= 'Z')) a += 'a' - 'A';
+		if ((b >= 'A') && (b <= 'Z')) b += 'a' - 'A';
+		if (a != b)
+			return 0;
+	}
+
+	// Type and class:
+	return !memcmp(query + end - 4, response + end - 4, 4);
+}
+
 int dns_analyze_reply_query(event_entry_t *general_entry) {
 	struct event_general_entry *entry = &general_entry->general;
 	uint16_t recvtxid;
@@ -204,68 +211,57 @@ wrong:
 	return 0;
 }
 
-int dns_reply_query_udp(event_entry_t *general_entry) {
-	struct event_udp_entry *entry = &general_entry->udp;
-	socklen_t addresslen;
-	int n;
+// Puts the response in the format the query came in (sealing it, in case of
+// DNSCurve), which does not depend on the protocol:
+int dns_reply_query_encode(event_entry_t *general_entry) {
+	struct event_general_entry *entry = &general_entry->general;
 
 	if (entry->dns.type == DNS_NON_DNSCURVE) {
-		debug_log(DEBUG_INFO, "dns_reply_query_udp(): sending DNS response in regular format\n");
+		debug_log(DEBUG_INFO, "dns_reply_query_encode(): sending DNS response in regular format\n");
 	} else if (entry->dns.type == DNS_DNSCURVE_STREAMLINED) {
-		debug_log(DEBUG_INFO, "dns_reply_query_udp(): sending DNS response in streamlined DNSCurve format\n");
+		debug_log(DEBUG_INFO, "dns_reply_query_encode(): sending DNS response in streamlined DNSCurve format\n");
 
 		if (!dnscurve_reply_streamlined_query(general_entry)) {
-			debug_log(DEBUG_WARN, "dns_reply_query_udp(): failed to reply in streamlined format\n");
+			debug_log(DEBUG_WARN, "dns_reply_query_encode(): failed to reply in streamlined format\n");
 			goto wrong;
 		}
 	} else if ((entry->dns.type == DNS_DNSCURVE_TXT_RD_SET) || (entry->dns.type == DNS_DNSCURVE_TXT_RD_UNSET)) {
-		debug_log(DEBUG_INFO, "dns_reply_query_udp(): sending DNS response in DNSCurve TXT format\n");
+		debug_log(DEBUG_INFO, "dns_reply_query_encode(): sending DNS response in DNSCurve TXT format\n");
 
 		if (!dnscurve_reply_txt_query(general_entry)) {
-			debug_log(DEBUG_WARN, "dns_reply_query_udp(): failed to reply in TXT format\n");
+			debug_log(DEBUG_WARN, "dns_reply_query_encode(): failed to reply in TXT format\n");
 			goto wrong;
 		}
 	}
 
-	entry->state = EVENT_UDP_EXT_WRITING;
-
-	if (entry->address.sa.sa_family == AF_INET) {
-		addresslen = sizeof(struct sockaddr_in);
-	} else {
-		addresslen = sizeof(struct sockaddr_in6);
-	}
-
-	n = sendto(entry->sock->fd, entry->buffer, entry->packetsize, MSG_DONTWAIT,
-			(struct sockaddr *) &entry->address.sa, addresslen);
-	if (n == -1) {
-		debug_log(DEBUG_ERROR, "dns_reply_query_udp(): unable to send the response to the client (%s)\n", strerror(errno));
-		goto wrong;
-	}
-
 	return 1;
 
 wrong:
 	return 0;
 }
 
-int dns_reply_query_tcp(event_entry_t *general_entry) {
-	struct event_tcp_entry *entry = &general_entry->tcp;
+int dns_reply_query_udp(event_entry_t *general_entry) {
+	struct event_udp_entry *entry = &general_entry->udp;
 
+	// DNSCurve replies are sealed along with the others of this loop
+	// iteration, right before they are sent (see event_udp_flush()):
 	if (entry->dns.type == DNS_NON_DNSCURVE) {
-		debug_log(DEBUG_INFO, "dns_reply_query_tcp(): sending DNS response in regular format\n");
-	} else if (entry->dns.type == DNS_DNSCURVE_STREAMLINED) {
-		debug_log(DEBUG_INFO, "dns_reply_query_tcp(): sending DNS response in streamlined DNSCurve format\n");
-
-		if (!dnscurve_reply_streamlined_query(general_entry)) {
-			debug_log(DEBUG_INFO, "dns_reply_query_tcp(): failed to reply in streamlined format\n");
+		if (!dns_reply_query_encode(general_entry))
 			goto wrong;
-		}
-	} else if ((entry->dns.type == DNS_DNSCURVE_TXT_RD_SET) || (entry->dns.type == DNS_DNSCURVE_TXT_RD_UNSET)) {
-		debug_log(DEBUG_INFO, "dns_reply_query_tcp(): doing reply in TXT format\n");
-		if (!dnscurve_reply_txt_query(general_entry)) {
-			debug_log(DEBUG_INFO, "dns_reply_query_tcp(): failed to reply in TXT format\n");
+		entry->state = EVENT_UDP_EXT_WRITING;
+	} else {
+		debug_log(DEBUG_INFO, "dns_reply_query_udp(): sealing DNS response along with the others\n");
+		if (!dnscurve_reply_prepare(general_entry)) {
+			debug_log(DEBUG_WARN, "dns_reply_query_udp(): failed to prepare the DNSCurve response\n");
 			goto wrong;
 		}
+		entry->state = EVENT_UDP_EXT_SEALING;
+	}
+
+	// The reply is sent along with the others of this loop iteration:
+	if (!event_udp_queue_reply(event_default_loop, general_entry)) {
+		debug_log(DEBUG_ERROR, "dns_reply_query_udp(): unable to queue the response to the client\n");
+		goto wrong;
 	}
 
 	return 1;
@@ -273,3 +269,7 @@ int dns_reply_query_tcp(event_entry_t *general_entry) {
 wrong:
 	return 0;
 }
+
+int dns_reply_query_tcp(event_entry_t *general_entry) {
+	return dns_reply_query_encode(general_entry);
+}
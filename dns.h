@@ -49,10 +49,12 @@ extern unsigned int dns_packet_getname(uint8_t *, unsigned int, const uint8_t *,
 
 extern int dns_analyze_query(event_entry_t *);
 extern int dns_analyze_reply_query(event_entry_t *);
+extern int dns_packet_question_equal(const uint8_t *, size_t, const uint8_t *, size_t);
 
 extern int dns_forward_query_udp(event_entry_t *);
 extern int dns_forward_query_tcp(event_entry_t *);
 
+extern int dns_reply_query_encode(event_entry_t *);
 extern int dns_reply_query_udp(event_entry_t *);
 extern int dns_reply_nxdomain_query_udp(event_entry_t *);
 extern int dns_reply_query_tcp(event_entry_t *);
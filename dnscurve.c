@@ -34,38 +34,85 @@
  * $Revision$
  */
 
+#include <pthread.h>
+
 #include "dnscurve.h"
 #include "misc.h"
 #include "curvedns.h"
 #include "dns.h"
-#include "cache_hashtable.h"
+#include "cache.h"
+#include "crypto_pool.h"
+#include "crypto_multibox.h"
+
+// Every worker has a cache of its own, unless the backend can be shared
+// (see cache_attach()): then they all use the first one, so the shared
+// secret of a client is computed once, whichever worker gets its queries:
+__thread struct cache_table *dnscurve_cache = NULL;
+static struct cache_table *dnscurve_shared_cache = NULL;
+int dnscurve_cache_shared = 0;
+static pthread_mutex_t dnscurve_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Shared secret just computed by the crypto threads, while resuming the
+// queries that waited for it (see dnscurve_resume()):
+static __thread struct crypto_pool_job *dnscurve_computed = NULL;
 
 // return values:
+// -2 -> too many new keys already waiting for a shared secret, drop the query
 // -1 -> unable to generate shared secret
+// 0 -> handed to the crypto pool, general_entry is resumed once it is there
 // 1 -> plugged from packet info
 // 2 -> plugged from cache
 // 3 -> generated, and plugged in cache
-static int dnscurve_get_shared_secret(struct dns_packet_t *packet) {
-	struct cache_entry *cache_entry = NULL;
+static int dnscurve_get_shared_secret(struct dns_packet_t *packet, event_entry_t *general_entry) {
+	uint8_t *cached = NULL;
 	uint8_t sharedsecret[32];
+	int result;
 
 	if (!packet)
 		goto wrong;
 
 	if (packet->ispublic) {
-		cache_entry = cache_get(dnscurve_cache, (uint8_t *) packet->publicsharedkey);
-		if (cache_entry) {
-			memcpy(packet->publicsharedkey, cache_entry->value, 32);
+		// Checked first, so the waiting queries do not count as cache hits
+		// (and also used when the cache had no room for it). Precomputed
+		// shared secrets are never computed, nor cached:
+		if ((cached = cache_pinned_get(packet->publicsharedkey))) {
+			memcpy(packet->publicsharedkey, cached, 32);
+			packet->ispublic = 0;
+			debug_log(DEBUG_INFO, "dnscurve_get_shared_secret(): shared secret plugged from the precomputed ones\n");
+			return 2;
+		} else if (dnscurve_computed && !memcmp(dnscurve_computed->publickey, packet->publicsharedkey, 32)) {
+			if (dnscurve_computed->result == -1)
+				goto wrong;
+			memcpy(packet->publicsharedkey, dnscurve_computed->sharedsecret, 32);
+			packet->ispublic = 0;
+			debug_log(DEBUG_INFO, "dnscurve_get_shared_secret(): shared secret generated by the crypto threads\n");
+			return 3;
+		} else if ((cached = cache_get(dnscurve_cache, (uint8_t *) packet->publicsharedkey))) {
+			memcpy(packet->publicsharedkey, cached, 32);
 			packet->ispublic = 0;
 			debug_log(DEBUG_INFO, "dnscurve_get_shared_secret(): shared secret plugged from the cache\n");
 			return 2;
+		} else if (cache_shm_get(packet->publicsharedkey, sharedsecret)) {
+			// Computed by another process (or worker), keep it close by:
+			cache_set(dnscurve_cache, packet->publicsharedkey, sharedsecret);
+			memcpy(packet->publicsharedkey, sharedsecret, 32);
+			packet->ispublic = 0;
+			debug_log(DEBUG_INFO, "dnscurve_get_shared_secret(): shared secret plugged from the shared memory cache\n");
+			return 2;
+		} else if (general_entry && (result = crypto_pool_submit(general_entry, packet->publicsharedkey))) {
+			if (result < 0) {
+				debug_log(DEBUG_INFO, "dnscurve_get_shared_secret(): too many shared secrets being computed, dropping query\n");
+				return -2;
+			}
+			debug_log(DEBUG_INFO, "dnscurve_get_shared_secret(): shared secret handed to the crypto pool\n");
+			return 0;
 		} else {
 			memset(sharedsecret, 0, sizeof(sharedsecret));
 			if (crypto_box_curve25519xsalsa20poly1305_beforenm(sharedsecret, packet->publicsharedkey, global_secret_key) == -1)
 				goto wrong;
-			cache_entry = cache_set(dnscurve_cache, packet->publicsharedkey, sharedsecret);
-			if (!cache_entry)
+			if (!cache_set(dnscurve_cache, packet->publicsharedkey, sharedsecret))
 				goto wrong;
+			cache_shm_set(packet->publicsharedkey, sharedsecret);
 			memcpy(packet->publicsharedkey, sharedsecret, 32);
 			packet->ispublic = 0;
 			debug_log(DEBUG_INFO, "dnscurve_get_shared_secret(): generated a shared secret and added to cache\n");
@@ -78,17 +125,38 @@ wrong:
 	return -1;
 }
 
+// Stores a shared secret computed by the crypto threads in the cache, and
+// continues with the queries that were waiting for it:
+void dnscurve_resume(struct ev_loop *loop, struct crypto_pool_job *job) {
+	int i;
+
+	if ((job->result == 0) && !cache_set(dnscurve_cache, job->publickey, job->sharedsecret))
+		debug_log(DEBUG_WARN, "dnscurve_resume(): unable to add shared secret to cache\n");
+	if (job->result == 0)
+		cache_shm_set(job->publickey, job->sharedsecret);
+
+	dnscurve_computed = job;
+	for (i = 0; i < job->waiters_count; i++)
+		event_query_resume(loop, job->waiters[i]);
+	dnscurve_computed = NULL;
+}
+
 int dnscurve_init() {
-	int slots;
-	slots = (int) (global_shared_secrets / 25);
-	if (slots < 5) {
-		slots = 5;
-	} else if (slots > 500) {
-		slots = 500;
+	pthread_mutex_lock(&dnscurve_shared_lock);
+	if (dnscurve_shared_cache) {
+		dnscurve_cache = cache_attach(dnscurve_shared_cache);
+	} else {
+		dnscurve_cache = cache_init(global_shared_secrets);
+		// The extra reference is never dropped, others may attach later on:
+		if (dnscurve_cache && cache_attach(dnscurve_cache)) {
+			dnscurve_shared_cache = dnscurve_cache;
+			dnscurve_cache_shared = 1;
+			debug_log(DEBUG_INFO, "dnscurve_init(): the shared secret cache is shared by all workers\n");
+		}
 	}
-	dnscurve_cache = cache_init(slots, global_shared_secrets);
+	pthread_mutex_unlock(&dnscurve_shared_lock);
 
-	debug_log(DEBUG_INFO, "dnscurve_init(): able to store %d shared secrets, spread between %d buckets\n", global_shared_secrets, slots);
+	debug_log(DEBUG_INFO, "dnscurve_init(): able to store %d shared secrets\n", global_shared_secrets);
 
 	if (!dnscurve_cache) {
 		debug_log(DEBUG_ERROR, "dnscurve_init(): unable to initiate cache structure\n");
@@ -152,6 +220,10 @@ NAMETOOLONG:
 	return 0;
 }
 
+// return values:
+// 0 -> malformed query (or no room to compute its shared secret), drop it
+// 1 -> analyzed (and opened, when it is a DNSCurve query)
+// 2 -> waiting for its shared secret, resumed through event_query_resume()
 int dnscurve_analyze_query(event_entry_t *general_entry) {
 	uint8_t sandbox[4096], fullnonce[24], queryname[4096];
 	int result;
@@ -184,7 +256,11 @@ int dnscurve_analyze_query(event_entry_t *general_entry) {
 		memcpy(sandbox + 16, entry->buffer + 52, entry->packetsize - 52);
 		sandboxlen = entry->packetsize - 36; // 36 = 52 - 16 bytes at front
 
-		result = dnscurve_get_shared_secret(packet);
+		result = dnscurve_get_shared_secret(packet, general_entry);
+		if (!result)
+			return 2;
+		if (result == -2)
+			goto wrong;
 		if ((result < 0) || packet->ispublic) {
 			debug_log(DEBUG_INFO, "dnscurve_analyze_query(): DNSCurve streamlined query unable to get shared secret (code = %d)\n", result);
 			return 1;
@@ -281,7 +357,11 @@ int dnscurve_analyze_query(event_entry_t *general_entry) {
 	// The BOXZERO offset:
 	memset(sandbox, 0, 16);
 
-	result = dnscurve_get_shared_secret(packet);
+	result = dnscurve_get_shared_secret(packet, general_entry);
+	if (!result)
+		return 2;
+	if (result == -2)
+		goto wrong;
 	if ((result < 0) || packet->ispublic) {
 		debug_log(DEBUG_INFO, "dnscurve_analyze_query(): DNSCurve TXT query unable to get shared secret (code = %d)\n", result);
 		return 1;
@@ -318,11 +398,10 @@ int dnscurve_analyze_query(event_entry_t *general_entry) {
 	else
 		packet->type = DNS_DNSCURVE_TXT_RD_UNSET;
 
-	// Allocate memory to store the query name:
+	// Store the query name (which fits, unless the packet is malformed):
 	packet->qnamelen = pos - 12;
-	packet->qname = (uint8_t *) malloc(packet->qnamelen * sizeof(uint8_t));
-	if (!packet->qname) {
-		debug_log(DEBUG_ERROR, "dnscurve_analyze_query(): no memory for qname\n");
+	if (packet->qnamelen > sizeof(packet->qname)) {
+		debug_log(DEBUG_WARN, "dnscurve_analyze_query(): query name too long\n");
 		goto wrong;
 	}
 	memcpy(packet->qname, entry->buffer + 12, packet->qnamelen);
@@ -343,70 +422,53 @@ wrong:
 	return 0;
 }
 
-int dnscurve_reply_streamlined_query(event_entry_t *general_entry) {
+// Gets a reply ready to be sealed (see dnscurve_reply_seal()): the packet
+// moves 32 bytes up in its buffer, behind the zero bytes NaCl wants in front
+// of it, so that it is sealed in place:
+int dnscurve_reply_prepare(event_entry_t *general_entry) {
 	struct event_general_entry *entry = &general_entry->general;
 	struct dns_packet_t *packet = &entry->dns;
-	uint8_t fullnonce[24], sandbox[4096];
-	ev_tstamp time;
+	uint16_t tmpshort;
 	int result;
-	size_t sandboxlen = sizeof(sandbox);
-
-	if (packet->type != DNS_DNSCURVE_STREAMLINED)
-		goto wrong;
 
-	if (sandboxlen < entry->packetsize + 32) {
-		debug_log(DEBUG_ERROR, "dnscurve_reply_streamlined_query(): sandboxlen (%zd) < entry->packetsize (%zd)\n",
-				sandboxlen, entry->packetsize + 32);
-		goto wrong;
-	}
+	if (packet->type == DNS_DNSCURVE_STREAMLINED) {
+		// To apply the streamline format header, we need 48 bytes extra, let's
+		// see if there is space for that:
+		if (entry->packetsize + 48 > entry->bufferlen) {
+			debug_log(DEBUG_ERROR, "dnscurve_reply_prepare(): buffer is not big enough\n");
+			goto wrong;
+		}
+	} else if ((packet->type == DNS_DNSCURVE_TXT_RD_SET) || (packet->type == DNS_DNSCURVE_TXT_RD_UNSET)) {
+		if (entry->packetsize + 32 > entry->bufferlen) {
+			debug_log(DEBUG_ERROR, "dnscurve_reply_prepare(): buffer is not big enough\n");
+			goto wrong;
+		}
 
-	// To apply the streamline format header, we need 32 bytes extra, let's
-	// see if there is space for that:
-	if (entry->packetsize + 32 > entry->bufferlen) {
-		debug_log(DEBUG_ERROR, "dnscurve_reply_streamlined_query(): buffer is not big enough\n");
+		memcpy(&tmpshort, entry->buffer, 2);
+		tmpshort = ntohs(tmpshort);
+		if (tmpshort != packet->srcinsidetxid) {
+			debug_log(DEBUG_ERROR, "dnscurve_reply_prepare(): received inner txid differs!\n");
+			goto wrong;
+		}
+	} else {
 		goto wrong;
 	}
 
-	// Copy the entire packet into the sandbox, clear however the first 32 bytes:
-	memset(sandbox, 0, 32);
-	memcpy(sandbox + 32, entry->buffer, entry->packetsize);
-
-	// Set everything for the encryption step:
-	memcpy(fullnonce, packet->nonce, 12);
-	time = ev_now(event_default_loop);
-	misc_crypto_nonce(fullnonce + 12, &time, sizeof(time));
-
-	result = dnscurve_get_shared_secret(packet);
+	result = dnscurve_get_shared_secret(packet, NULL);
 	if ((result < 0) || packet->ispublic) {
-		debug_log(DEBUG_ERROR, "dnscurve_reply_streamlined_query(): DNSCurve streamlined response unable to get shared secret (code = %d)\n",
-				result);
-		return 1;
+		debug_log(DEBUG_ERROR, "dnscurve_reply_prepare(): DNSCurve response unable to get shared secret (code = %d)\n", result);
+		goto wrong;
 	}
 
 	if (debug_level >= DEBUG_DEBUG) {
 		char tmp[65];
 		misc_hex_encode(packet->publicsharedkey, 32, tmp, 64);
 		tmp[64] = '\0';
-		debug_log(DEBUG_DEBUG, "dnscurve_reply_streamlined_query(): DNSCurve shared secret: '%s'\n", tmp);
+		debug_log(DEBUG_DEBUG, "dnscurve_reply_prepare(): DNSCurve shared secret: '%s'\n", tmp);
 	}
 
-	if (crypto_box_curve25519xsalsa20poly1305_afternm(	sandbox,
-														sandbox,
-														entry->packetsize + 32,
-														fullnonce,
-														packet->publicsharedkey) != 0) {
-		debug_log(DEBUG_ERROR, "dnscurve_reply_streamlined_query(): encryption failed\n");
-		goto wrong;
-	}
-
-	// And finally make the streamlined packet:
-	memcpy(entry->buffer, "R6fnvWJ8", 8);
-	memcpy(entry->buffer + 8, fullnonce, 24);
-	memcpy(entry->buffer + 32, sandbox + 16, entry->packetsize + 16);
-
-	entry->packetsize += 48;
-
-	debug_log(DEBUG_INFO, "dnscurve_reply_streamlined_query(): done encryption, ready to send (%zd bytes)\n", entry->packetsize);
+	memmove(entry->buffer + 32, entry->buffer, entry->packetsize);
+	memset(entry->buffer, 0, 32);
 
 	return 1;
 
@@ -414,67 +476,68 @@ wrong:
 	return 0;
 }
 
-
-int dnscurve_reply_txt_query(event_entry_t *general_entry) {
-	struct event_general_entry *entry = &general_entry->general;
-	struct dns_packet_t *packet = &entry->dns;
-	uint8_t fullnonce[24], sandbox[4096];
-	uint16_t tmpshort;
+// Seals count prepared replies at once, each with a nonce of its own. The
+// server nonce goes in front of the box, in the bytes NaCl leaves zero:
+void dnscurve_reply_seal(event_entry_t **general_entries, int count) {
+	struct event_general_entry *entry;
+	uint8_t fullnonces[CRYPTO_MULTIBOX_BOXES][24];
+	uint8_t *boxes[CRYPTO_MULTIBOX_BOXES], *nonces[CRYPTO_MULTIBOX_BOXES], *keys[CRYPTO_MULTIBOX_BOXES];
+	size_t boxlens[CRYPTO_MULTIBOX_BOXES];
 	ev_tstamp time;
-	size_t sandboxlen = sizeof(sandbox), pos, rrdatalen;
-	int result;
+	int i, j, n;
+
+	// (the crypto stages of pipeline mode have no loop of their own)
+	time = event_default_loop ? ev_now(event_default_loop) : ev_time();
+
+	for (i = 0; i < count; i += n) {
+		n = count - i;
+		if (n > CRYPTO_MULTIBOX_BOXES)
+			n = CRYPTO_MULTIBOX_BOXES;
+
+		for (j = 0; j < n; j++) {
+			entry = &general_entries[i + j]->general;
+			memcpy(fullnonces[j], entry->dns.nonce, 12);
+			misc_crypto_nonce(fullnonces[j] + 12, &time, sizeof(time));
+			boxes[j] = entry->buffer;
+			boxlens[j] = entry->packetsize + 32;
+			nonces[j] = fullnonces[j];
+			keys[j] = entry->dns.publicsharedkey;
+		}
 
-	if ((packet->type != DNS_DNSCURVE_TXT_RD_SET) && (packet->type != DNS_DNSCURVE_TXT_RD_UNSET))
-		goto wrong;
+		crypto_multibox_afternm(boxes, boxes, boxlens, nonces, keys, n);
 
-	if (sandboxlen < entry->packetsize + 32) {
-		debug_log(DEBUG_ERROR, "dnscurve_reply_txt_query(): sandboxlen (%zd) < entry->packetsize (%zd)\n",
-				sandboxlen, entry->packetsize + 32);
-		goto wrong;
+		for (j = 0; j < n; j++)
+			memcpy(general_entries[i + j]->general.buffer + 4, fullnonces[j] + 12, 12);
 	}
+}
 
-	memcpy(&tmpshort, entry->buffer, 2);
-	tmpshort = ntohs(tmpshort);
-	if (tmpshort != packet->srcinsidetxid) {
-		debug_log(DEBUG_ERROR, "dnscurve_reply_txt_query(): received inner txid differs!\n");
-		goto wrong;
-	}
+// Now we have in buffer[4..32+packetsize-1] the server nonce and the box,
+// make the response in the format the query came in:
+int dnscurve_reply_finish(event_entry_t *general_entry) {
+	struct event_general_entry *entry = &general_entry->general;
+	struct dns_packet_t *packet = &entry->dns;
+	uint8_t sandbox[4096];
+	uint16_t tmpshort;
+	size_t pos, rrdatalen;
 
-	// Copy the entire packet into the sandbox, clear however the first 32 bytes:
-	memset(sandbox, 0, 32);
-	memcpy(sandbox + 32, entry->buffer, entry->packetsize);
+	if (packet->type == DNS_DNSCURVE_STREAMLINED) {
+		// And finally make the streamlined packet:
+		memmove(entry->buffer + 20, entry->buffer + 4, entry->packetsize + 28);
+		memcpy(entry->buffer, "R6fnvWJ8", 8);
+		memcpy(entry->buffer + 8, packet->nonce, 12);
 
-	// Now write the streamline header:
-	memcpy(fullnonce, packet->nonce, 12);
-	time = ev_now(event_default_loop);
-	misc_crypto_nonce(fullnonce + 12, &time, sizeof(time));
+		entry->packetsize += 48;
 
-	result = dnscurve_get_shared_secret(packet);
-	if ((result < 0) || packet->ispublic) {
-		debug_log(DEBUG_ERROR, "dnscurve_reply_txt_query(): DNSCurve streamlined response unable to get shared secret\n");
+		debug_log(DEBUG_INFO, "dnscurve_reply_finish(): done encryption, ready to send (%zd bytes)\n", entry->packetsize);
 		return 1;
 	}
 
-	if (debug_level >= DEBUG_DEBUG) {
-		char tmp[65];
-		misc_hex_encode(packet->publicsharedkey, 32, tmp, 64);
-		tmp[64] = '\0';
-		debug_log(DEBUG_DEBUG, "dnscurve_reply_txt_query(): DNSCurve shared secret: '%s'\n", tmp);
-	}
-
-	if (crypto_box_curve25519xsalsa20poly1305_afternm(	sandbox,
-														sandbox,
-														entry->packetsize + 32,
-														fullnonce,
-														packet->publicsharedkey) != 0) {
-		debug_log(DEBUG_ERROR, "dnscurve_reply_txt_query(): encryption failed\n");
-		goto wrong;
-	}
-
-	// Now we have in sandbox[16..16+entry->packetsize-1] the encrypted packet.
-	// Set the server nonce in sandbox[4..16-1]:
-	memcpy(sandbox + 4, fullnonce + 12, 12);
+	// The TXT packet is built inside buffer, out of a copy of the server
+	// nonce and the box:
 	entry->packetsize += 16 + 12; // 16 = offset encryption, 12 = server nonce
+	if (entry->packetsize > sizeof(sandbox))
+		goto wrong;
+	memcpy(sandbox, entry->buffer + 4, entry->packetsize);
 
 	// Let's build a response TXT packet inside buffer:
 	tmpshort = htons(packet->srctxid);
@@ -511,7 +574,7 @@ int dnscurve_reply_txt_query(event_entry_t *general_entry) {
 	// Now start the RDATA field, by first specifying the size, that includes all the size tokens:
 	rrdatalen = entry->packetsize + ((entry->packetsize + 254) / 255);
 	if (entry->bufferlen < pos + 2 + rrdatalen) {
-		debug_log(DEBUG_ERROR, "dnscurve_reply_txt_query(): buffer too small (before doing rrdata split)\n");
+		debug_log(DEBUG_ERROR, "dnscurve_reply_finish(): buffer too small (before doing rrdata split)\n");
 		goto wrong;
 	}
 	tmpshort = htons(rrdatalen);
@@ -519,7 +582,7 @@ int dnscurve_reply_txt_query(event_entry_t *general_entry) {
 	pos += 2;
 
 	// Start the split-up of RDATA in 255 byte parts (the server nonce + the crypto box):
-	unsigned int todo = entry->packetsize, last = 4; // 4 is the offset of the sandbox
+	unsigned int todo = entry->packetsize, last = 0;
 	uint8_t labelsize;
 
 	while (todo) {
@@ -535,11 +598,32 @@ int dnscurve_reply_txt_query(event_entry_t *general_entry) {
 	}
 	entry->packetsize = pos;
 
-	debug_log(DEBUG_INFO,  "dnscurve_reply_txt_query(): done encryption, ready to send (%zd bytes)\n", entry->packetsize);
+	debug_log(DEBUG_INFO,  "dnscurve_reply_finish(): done encryption, ready to send (%zd bytes)\n", entry->packetsize);
 
 	return 1;
 
 wrong:
-	debug_log(DEBUG_ERROR, "dnscurve_reply_txt_query(): bailed out, probably due to memory errors\n");
+	debug_log(DEBUG_ERROR, "dnscurve_reply_finish(): bailed out, probably due to memory errors\n");
 	return 0;
 }
+
+// Seals a single reply right away (TCP, and the crypto stages of pipeline
+// mode), UDP replies are sealed together (see event_udp_flush()):
+static int dnscurve_reply_query(event_entry_t *general_entry) {
+	if (!dnscurve_reply_prepare(general_entry))
+		return 0;
+	dnscurve_reply_seal(&general_entry, 1);
+	return dnscurve_reply_finish(general_entry);
+}
+
+int dnscurve_reply_streamlined_query(event_entry_t *general_entry) {
+	if (general_entry->general.dns.type != DNS_DNSCURVE_STREAMLINED)
+		return 0;
+	return dnscurve_reply_query(general_entry);
+}
+
+int dnscurve_reply_txt_query(event_entry_t *general_entry) {
+	if ((general_entry->general.dns.type != DNS_DNSCURVE_TXT_RD_SET) && (general_entry->general.dns.type != DNS_DNSCURVE_TXT_RD_UNSET))
+		return 0;
+	return dnscurve_reply_query(general_entry);
+}
@@ -46,9 +46,15 @@
 #include "crypto_box_curve25519xsalsa20poly1305.h"
 #include "debug.h"
 #include "event.h"
+#include "crypto_pool.h"
 
+extern int dnscurve_cache_shared;
 extern int dnscurve_init();
 extern int dnscurve_analyze_query(event_entry_t *);
+extern void dnscurve_resume(struct ev_loop *, struct crypto_pool_job *);
+extern int dnscurve_reply_prepare(event_entry_t *);
+extern void dnscurve_reply_seal(event_entry_t **, int);
+extern int dnscurve_reply_finish(event_entry_t *);
 extern int dnscurve_reply_streamlined_query(event_entry_t *);
 extern int dnscurve_reply_txt_query(event_entry_t *);
 
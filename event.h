@@ -44,11 +44,13 @@
 
 #include <ev.h>
 #include "ip.h"
-#include "cache_hashtable.h"
+#include "cache.h"
+#include "pool.h"
 
 typedef enum {
 	EVENT_UDP_EXT_READING = 0,
 	EVENT_UDP_EXT_WRITING,
+	EVENT_UDP_EXT_SEALING,
 	EVENT_UDP_INT_READING,
 	EVENT_UDP_INT_WRITING,
 } event_udp_state_t;
@@ -83,7 +85,7 @@ struct dns_packet_t {
 	uint8_t publicsharedkey[33];	// 32-byte public key OR shared key + 0-byte (needed for critbit
 	uint8_t nonce[12];
 	uint16_t qnamelen;
-	uint8_t *qname;
+	uint8_t qname[255];			// query name of a TXT query (as it was on the wire)
 };
 
 struct event_general_entry {
@@ -95,6 +97,15 @@ struct event_general_entry {
 	struct dns_packet_t dns;
 };
 
+// Long-lived socket towards the authoritative server, shared by many queries:
+struct event_udp_int_socket {
+	ev_io watcher;
+	int inflight;				// number of queries waiting for a response on it
+	int retired;				// replaced by a fresh socket, closed when inflight drops to 0
+	int closing;				// io_uring engine: waiting for the receive to be cancelled
+	struct event_udp_int_socket *cancelnext;	// io_uring engine: next one whose cancellation did not fit yet
+};
+
 struct event_udp_entry {
 	ip_protocol_t protocol;
 	anysin_t address;
@@ -105,9 +116,45 @@ struct event_udp_entry {
 	/* TILL HERE EVENT_UDP_ENTRY == EVENT_TCP_ENTRY == EVENT_GENERAL_ENTRY ALIGNED */
 	struct ip_socket_t *sock;
 	uint8_t retries;
-	ev_io read_int_watcher;
+	struct event_udp_int_socket *intsock;	// socket the query was forwarded on (while in flight)
+	struct event_udp_entry *inflightnext;	// next entry in the same in-flight bucket
 	ev_timer timeout_int_watcher;
 	event_udp_state_t state;
+	struct msghdr msg;			// io_uring engine: the reply being sent
+	struct iovec iov;
+};
+
+// Kept-alive connection towards the authoritative server, on which the
+// queries of several clients are pipelined:
+struct event_tcp_int_conn {
+	ev_io read_watcher;
+	ev_io write_watcher;
+	ev_timer timeout_watcher;		// response timeout of the oldest query while busy, idle timeout otherwise
+	uint8_t *outbuf;				// length prefixed queries still to be sent
+	size_t outsize, outlen, outat;
+	uint8_t *inbuf;					// (partial) length prefixed responses
+	size_t insize, inat;
+	int inflight;
+	ev_tstamp lastread;				// when the server sent anything last
+	struct event_tcp_entry *queries;	// queries waiting for a response on this connection
+	struct event_tcp_int_conn *next;
+};
+
+// Connection of a TCP client, which may have several queries in flight:
+struct event_tcp_client {
+	int sock;						// -1 once closed (freed when nothing is in flight anymore)
+	anysin_t address;
+	ev_io read_watcher;
+	ev_io write_watcher;
+	ev_timer timeout_watcher;
+	uint8_t *inbuf;					// (partial) length prefixed queries
+	size_t insize, inat;
+	struct event_tcp_entry *writehead;	// answers waiting to be written, in order of completion
+	struct event_tcp_entry *writetail;
+	size_t writeat;					// bytes of the first answer (length included) already written
+	int inflight;					// queries read, but not yet answered
+	uint8_t eof;					// client closed its side, close once everything is written
+	uint8_t failed;					// a query failed, close once nothing is in flight anymore
 };
 
 struct event_tcp_entry {
@@ -118,12 +165,13 @@ struct event_tcp_entry {
 	size_t packetsize;
 	struct dns_packet_t dns;
 	/* TILL HERE EVENT_UDP_ENTRY == EVENT_TCP_ENTRY == EVENT_GENERAL_ENTRY ALIGNED */
-	size_t bufferat;
-	int intsock;
-	int extsock;
-	ev_io write_watcher;
-	ev_io read_watcher;
-	ev_timer timeout_watcher;
+	struct event_tcp_client *client;
+	struct event_tcp_int_conn *intconn;	// connection the query is pipelined on (while in flight)
+	struct event_tcp_entry *intnext;	// next query on the same connection
+	ev_tstamp intsent;				// when it was queued on that connection
+	struct event_tcp_entry *writenext;	// next answer to write to the client
+	uint8_t lenbuf[2];
+	uint8_t redispatched;
 	event_tcp_state_t state;
 };
 
@@ -133,13 +181,27 @@ typedef union {
 	struct event_tcp_entry tcp;
 } event_entry_t;
 
-extern struct ev_loop *event_default_loop;
+#define EVENT_COMMAND_QUIT			1
+#define EVENT_COMMAND_CACHE_EMPTY	2
+#define EVENT_COMMAND_STATS			4
+#define EVENT_COMMAND_CACHE_RESIZE	8
+
+extern __thread struct ev_loop *event_default_loop;
+extern int global_event_workers;
+extern int global_event_pool_entries;
+extern int global_event_pool_tcp;
+extern char *global_event_cache_size_file;
+extern __thread struct pool event_entry_pool;
+extern __thread struct pool event_udp_buffer_pool;
+extern __thread struct pool event_tcp_buffer_pool;
 
 extern int event_init();
 extern void event_worker();
+extern void event_command_broadcast(int);
 
 /* general stuff */
 extern void event_cleanup_entry(struct ev_loop *, event_entry_t *);
+extern void event_query_resume(struct ev_loop *, event_entry_t *);
 
 /* TCP stuff */
 extern void event_tcp_startstop_watchers(struct ev_loop *, int);
@@ -148,11 +210,57 @@ extern void event_tcp_accept_cb(struct ev_loop *, ev_io *, int);
 extern void event_tcp_read_cb(struct ev_loop *, ev_io *, int);
 extern void event_tcp_write_cb(struct ev_loop *, ev_io *, int);
 extern void event_tcp_timeout_cb(struct ev_loop *, ev_timer *, int);
+extern int global_event_tcp_client_inflight;
+extern int global_event_tcp_int_connections;
+extern int global_event_tcp_int_pipeline;
+extern ev_tstamp global_event_tcp_int_idle;
+extern int event_tcp_int_send(struct ev_loop *, event_entry_t *);
+extern void event_tcp_client_forward(struct ev_loop *, event_entry_t *);
+extern void event_tcp_client_analyzed(struct ev_loop *, event_entry_t *, int);
+extern void event_tcp_int_sealed(struct ev_loop *, event_entry_t *, int);
+extern void event_tcp_stats(int);
+
+/* io_uring stuff */
+#define EVENT_ENGINE_LIBEV		0
+#define EVENT_ENGINE_URING		1
+
+extern int global_event_engine;
+extern __thread int event_uring_enabled;
+extern int event_uring_init(struct ev_loop *);
+extern int event_uring_recv_ext(struct ip_socket_t *);
+extern int event_uring_recv_int(struct event_udp_int_socket *);
+extern int event_uring_cancel_int(struct event_udp_int_socket *);
+extern int event_uring_send(event_entry_t *);
+extern void event_uring_submit();
+extern void event_uring_stats(int);
+
+/* pipeline stuff */
+#define EVENT_PIPELINE_OPEN		0
+#define EVENT_PIPELINE_SEAL		1
+
+extern int global_event_pipeline_stages;
+extern int global_event_pipeline_ring;
+extern int event_pipeline_init(struct ev_loop *);
+extern int event_pipeline_submit(event_entry_t *, int);
+extern void event_pipeline_stats(int);
 
 /* UDP stuff */
+extern int global_event_udp_batch;
+extern int global_event_udp_sockets;
+extern ev_tstamp global_event_udp_rotate;
+extern int event_udp_init(struct ev_loop *);
+extern void event_udp_stats(int);
+extern int event_udp_queue_reply(struct ev_loop *, event_entry_t *);
 extern void event_cleanup_udp_entry(struct ev_loop *, struct event_udp_entry *);
+extern int event_udp_int_attach(struct ev_loop *, event_entry_t *);
 extern void event_udp_ext_cb(struct ev_loop *, ev_io *, int);
+extern void event_udp_ext_forward(struct ev_loop *, event_entry_t *);
+extern void event_udp_ext_analyzed(struct ev_loop *, event_entry_t *, int);
+extern void event_udp_int_sealed(struct ev_loop *, event_entry_t *, int);
 extern void event_udp_int_cb(struct ev_loop *, ev_io *, int);
+extern void event_udp_ext_datagram(struct ev_loop *, struct ip_socket_t *, uint8_t *, size_t, anysin_t *, socklen_t);
+extern void event_udp_int_datagram(struct ev_loop *, struct event_udp_int_socket *, uint8_t *, size_t, anysin_t *);
+extern void event_udp_int_closed(struct ev_loop *, struct event_udp_int_socket *);
 extern void event_udp_timeout_cb(struct ev_loop *, ev_timer *, int);
 
 #endif /* EVENT_H_ */
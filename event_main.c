@@ -34,38 +34,95 @@
  * $Revision$
  */
 
+#include <pthread.h>
+#include <signal.h>
+
+#include "curvedns.h"
 #include "event.h"
-#include "cache_hashtable.h"
+#include "cache.h"
+#include "dnscurve.h"
+#include "crypto_pool.h"
+#include "crypto_multibox.h"
+#include "misc.h"
+#include "crypto_scalarmult_curve25519.h"
+
+// The loop of the calling worker (the default loop for worker 0):
+__thread struct ev_loop *event_default_loop = NULL;
+
+// Number of workers, each running its own loop on its own sockets:
+int global_event_workers = 1;
+
+struct event_worker_t {
+	int id;
+	pthread_t thread;
+	struct ev_loop *loop;
+	struct ip_socket_t *sockets;
+	int sockets_count;
+	ev_async command_watcher;
+	volatile int commands;
+	ev_timer snapshot_watcher;
+	char snapshot[1024];			// snapshot file of its shared secret cache (when enabled)
+	uint8_t publickey[32];			// the snapshot belongs to
+	struct cache_snapshot snapshot_taken;	// being saved by snapshot_thread
+	pthread_t snapshot_thread;
+	int snapshot_started;
+	volatile int snapshot_busy;
+	ev_check resize_watcher;		// moves entries of its cache while resizing
+	ev_idle resize_idle_watcher;
+};
+
+static struct event_worker_t *event_workers = NULL;
 
-struct ev_loop *event_default_loop = NULL;
+// Entries and their buffers are taken from per worker pools, sized by
+// CURVEDNS_POOL_ENTRIES and CURVEDNS_POOL_TCP:
+int global_event_pool_entries = 1024;
+int global_event_pool_tcp = 64;
+__thread struct pool event_entry_pool;
+__thread struct pool event_udp_buffer_pool;
+__thread struct pool event_tcp_buffer_pool;
 
-static struct ev_io *udp_watchers = NULL;
-static struct ev_io *tcp_watchers = NULL;
-static int watchers_count; /* as udp_watchers_count = tcp_watchers_count = watchers_count */
+static __thread struct ev_io *udp_watchers = NULL;
+static __thread struct ev_io *tcp_watchers = NULL;
+static __thread int watchers_count; /* as udp_watchers_count = tcp_watchers_count = watchers_count */
+static __thread ev_prepare cache_offline_watcher;
+static __thread ev_check cache_online_watcher;
 static struct ev_signal signal_watcher_hup;
 static struct ev_signal signal_watcher_int;
 static struct ev_signal signal_watcher_term;
+static struct ev_signal signal_watcher_usr1;
+static struct ev_signal signal_watcher_usr2;
+
+// On SIGUSR2 the shared secret caches are resized to the number of entries
+// found in this file (CURVEDNS_CACHE_SIZE_FILE), a few entries per loop
+// iteration at a time:
+char *global_event_cache_size_file = NULL;
+static volatile int event_cache_size = 0;
+#define EVENT_CACHE_RESIZE_STEP	256
 
 void event_cleanup_entry(struct ev_loop *loop, event_entry_t *entry) {
 	struct event_general_entry *general_entry;
 	if (entry) {
 		general_entry = &entry->general;
-		if (general_entry->dns.qname) {
-			free(general_entry->dns.qname);
-			general_entry->dns.qname = NULL;
-		}
-		if (general_entry->buffer) {
-			free(general_entry->buffer);
-			general_entry->buffer = NULL;
-		}
 		if (general_entry->protocol == IP_PROTOCOL_UDP) {
+			pool_put(&event_udp_buffer_pool, general_entry->buffer);
+			general_entry->buffer = NULL;
 			event_cleanup_udp_entry(loop, &entry->udp);
 		} else if (general_entry->protocol == IP_PROTOCOL_TCP) {
+			pool_put(&event_tcp_buffer_pool, general_entry->buffer);
+			general_entry->buffer = NULL;
 			event_cleanup_tcp_entry(loop, &entry->tcp);
 		}
 	}
 }
 
+// Continues with a query whose shared secret was computed by the crypto threads:
+void event_query_resume(struct ev_loop *loop, event_entry_t *entry) {
+	if (entry->general.protocol == IP_PROTOCOL_UDP)
+		event_udp_ext_forward(loop, entry);
+	else if (entry->general.protocol == IP_PROTOCOL_TCP)
+		event_tcp_client_forward(loop, entry);
+}
+
 // Starts the accept watchers if startstop = 1, stops them if startstop = 0
 void event_tcp_startstop_watchers(struct ev_loop *loop, int startstop) {
 	int i;
@@ -77,44 +134,261 @@ void event_tcp_startstop_watchers(struct ev_loop *loop, int startstop) {
 	}
 }
 
+// Waits for the snapshot that is being saved, if any:
+static void event_snapshot_wait(struct event_worker_t *worker) {
+	if (!worker->snapshot_started)
+		return;
+	pthread_join(worker->snapshot_thread, NULL);
+	worker->snapshot_started = 0;
+}
+
+// The last snapshot, written once the loop of the worker ended. A cache
+// shared by all workers is only saved (by worker 0) once every other worker
+// stopped, so nothing is added to it anymore:
+static void event_snapshot_write(struct event_worker_t *worker) {
+	if (!worker->snapshot[0])
+		return;
+	event_snapshot_wait(worker);
+	cache_snapshot_write(dnscurve_cache, worker->snapshot, worker->publickey);
+}
+
+static void *event_snapshot_thread(void *arg) {
+	struct event_worker_t *worker = (struct event_worker_t *) arg;
+
+	cache_snapshot_save(&worker->snapshot_taken, worker->snapshot, worker->publickey);
+	cache_snapshot_free(&worker->snapshot_taken);
+	__sync_lock_release(&worker->snapshot_busy);
+	return NULL;
+}
+
+// The entries are copied on the loop, but written (and synced to disk) by
+// a thread of its own, so the queries of this worker do not wait for that:
+static void event_snapshot_cb(struct ev_loop *loop, ev_timer *w, int revent) {
+	struct event_worker_t *worker = (struct event_worker_t *) w->data;
+
+	if (!(revent & EV_TIMER))
+		return;
+
+	if (__sync_lock_test_and_set(&worker->snapshot_busy, 1)) {
+		debug_log(DEBUG_WARN, "event_snapshot_cb(): worker %d: previous snapshot is still being written, skipping this one\n", worker->id);
+		return;
+	}
+	event_snapshot_wait(worker);
+
+	if (!cache_snapshot_take(dnscurve_cache, &worker->snapshot_taken))
+		goto wrong;
+	if (pthread_create(&worker->snapshot_thread, NULL, event_snapshot_thread, worker) != 0) {
+		debug_log(DEBUG_ERROR, "event_snapshot_cb(): worker %d: unable to start a thread to write the snapshot\n", worker->id);
+		cache_snapshot_free(&worker->snapshot_taken);
+		goto wrong;
+	}
+	worker->snapshot_started = 1;
+	return;
+
+wrong:
+	__sync_lock_release(&worker->snapshot_busy);
+}
+
+// Warms up the cache of a worker from its snapshot (every worker has its
+// own file, as it has its own cache), and keeps writing it now and then:
+static void event_snapshot_init(struct event_worker_t *worker) {
+	// A cache shared by all workers is saved by worker 0 only:
+	if (!global_cache_snapshot || (dnscurve_cache_shared && worker->id))
+		return;
+	if (snprintf(worker->snapshot, sizeof(worker->snapshot), "%s.%d", global_cache_snapshot, worker->id) >= (int) sizeof(worker->snapshot)) {
+		debug_log(DEBUG_ERROR, "event_snapshot_init(): worker %d: snapshot path too long\n", worker->id);
+		worker->snapshot[0] = '\0';
+		return;
+	}
+
+	crypto_scalarmult_curve25519_base(worker->publickey, global_secret_key);
+	cache_snapshot_read(dnscurve_cache, worker->snapshot, worker->publickey, global_shared_secrets);
+
+	if (global_cache_snapshot_interval > 0) {
+		worker->snapshot_watcher.data = worker;
+		ev_timer_init(&worker->snapshot_watcher, event_snapshot_cb, global_cache_snapshot_interval, global_cache_snapshot_interval);
+		ev_timer_start(worker->loop, &worker->snapshot_watcher);
+	}
+}
+
+// Like the crypto budget, the entries are moved once all other events of
+// this iteration have been handled:
+static void event_resize_cb(struct ev_loop *loop, ev_check *w, int revent) {
+	struct event_worker_t *worker = (struct event_worker_t *) w->data;
+
+	if (cache_resize_step(dnscurve_cache, EVENT_CACHE_RESIZE_STEP)) {
+		if (!ev_is_active(&worker->resize_idle_watcher))
+			ev_idle_start(loop, &worker->resize_idle_watcher);
+	} else {
+		ev_idle_stop(loop, &worker->resize_idle_watcher);
+		ev_check_stop(loop, &worker->resize_watcher);
+		cache_stats(dnscurve_cache);
+	}
+}
+
+static void event_resize_idle_cb(struct ev_loop *loop, ev_idle *w, int revent) {
+}
+
+static void event_resize_start(struct event_worker_t *worker) {
+	if (!cache_resize(dnscurve_cache, event_cache_size))
+		return;
+
+	worker->resize_watcher.data = worker;
+	ev_check_init(&worker->resize_watcher, event_resize_cb);
+	ev_set_priority(&worker->resize_watcher, EV_MINPRI);
+	ev_idle_init(&worker->resize_idle_watcher, event_resize_idle_cb);
+	ev_check_start(worker->loop, &worker->resize_watcher);
+	ev_idle_start(worker->loop, &worker->resize_idle_watcher);
+}
+
+// Reads the new size of the caches, returns 0 if there is none:
+static int event_cache_size_read() {
+	FILE *f;
+	int size;
+
+	if (!global_event_cache_size_file) {
+		debug_log(DEBUG_ERROR, "event_cache_size_read(): CURVEDNS_CACHE_SIZE_FILE is not set\n");
+		return 0;
+	}
+	f = fopen(global_event_cache_size_file, "r");
+	if (!f) {
+		debug_log(DEBUG_ERROR, "event_cache_size_read(): unable to open %s\n", global_event_cache_size_file);
+		return 0;
+	}
+	if (fscanf(f, "%d", &size) != 1)
+		size = 0;
+	fclose(f);
+
+	if ((size < 1) || (size > 1000000000)) {
+		debug_log(DEBUG_ERROR, "event_cache_size_read(): %s does not contain a valid number of entries\n", global_event_cache_size_file);
+		return 0;
+	}
+	// The same lower bound as CURVEDNS_SHARED_SECRETS:
+	if (size <= 50)
+		size = 51;
+	return size;
+}
+
+static void event_command_cb(struct ev_loop *loop, ev_async *w, int revent) {
+	struct event_worker_t *worker = (struct event_worker_t *) w->data;
+	int commands;
+
+	if (!(revent & EV_ASYNC))
+		return;
+
+	// Fetch and clear the pending commands in one go:
+	commands = __sync_lock_test_and_set(&worker->commands, 0);
+
+	if (commands & EVENT_COMMAND_CACHE_EMPTY) {
+		cache_stats(dnscurve_cache);
+		cache_empty(dnscurve_cache);
+	}
+	if (commands & EVENT_COMMAND_CACHE_RESIZE) {
+		if (ev_is_active(&worker->resize_watcher)) {
+			ev_idle_stop(loop, &worker->resize_idle_watcher);
+			ev_check_stop(loop, &worker->resize_watcher);
+		}
+		event_resize_start(worker);
+	}
+	if (commands & EVENT_COMMAND_STATS) {
+		event_udp_stats(worker->id);
+		event_uring_stats(worker->id);
+		event_tcp_stats(worker->id);
+		crypto_pool_stats(worker->id);
+		event_pipeline_stats(worker->id);
+		cache_stats(dnscurve_cache);
+		if (!worker->id)
+			cache_shm_stats();
+		cache_pinned_stats(worker->id);
+		pool_stats(&event_entry_pool, "entries", worker->id);
+		pool_stats(&event_udp_buffer_pool, "UDP buffers", worker->id);
+		pool_stats(&event_tcp_buffer_pool, "TCP buffers", worker->id);
+	}
+	if (commands & EVENT_COMMAND_QUIT)
+		ev_unloop(loop, EVUNLOOP_ALL);
+}
+
+// Hands a command to every worker, which executes it inside its own loop:
+void event_command_broadcast(int command) {
+	int i;
+	for (i = 0; i < global_event_workers; i++) {
+		__sync_fetch_and_or(&event_workers[i].commands, command);
+		ev_async_send(event_workers[i].loop, &event_workers[i].command_watcher);
+	}
+}
+
 static void event_signal_cb(struct ev_loop *loop, ev_signal *w, int revent) {
+	int size;
+
 	if (!(revent & EV_SIGNAL))
 		return;
 
 	if (w->signum == SIGHUP) {
 		debug_log(DEBUG_FATAL, "event_signal_cb(): received SIGHUP - clearing cache\n");
-		cache_stats(dnscurve_cache);
-		cache_empty(dnscurve_cache);
+		event_command_broadcast(EVENT_COMMAND_CACHE_EMPTY);
 	} else if ((w->signum == SIGINT) || (w->signum == SIGTERM)) {
 		debug_log(DEBUG_FATAL, "event_signal_cb(): received %s - cleaning up nicely and quitting\n",
 				(w->signum == SIGINT) ? "SIGINT" : "SIGTERM");
-		ev_unloop(EV_DEFAULT_ EVUNLOOP_ALL);
-		cache_destroy(dnscurve_cache);
-		ip_close();
+		event_command_broadcast(EVENT_COMMAND_QUIT);
+	} else if (w->signum == SIGUSR1) {
+		debug_log(DEBUG_FATAL, "event_signal_cb(): received SIGUSR1 - logging statistics\n");
+		event_command_broadcast(EVENT_COMMAND_STATS);
+	} else if (w->signum == SIGUSR2) {
+		size = event_cache_size_read();
+		if (!size)
+			return;
+		debug_log(DEBUG_FATAL, "event_signal_cb(): received SIGUSR2 - resizing cache to %d entries\n", size);
+		event_cache_size = size;
+		event_command_broadcast(EVENT_COMMAND_CACHE_RESIZE);
 	} else {
 		debug_log(DEBUG_WARN, "event_signal_cb(): received unhandled signal\n");
 	}
 }
 
-int event_init() {
+// A shared cache (the concurrent backend) frees the entries that were pushed out
+// once every thread passed a loop iteration, or is waiting for events:
+static void event_cache_offline_cb(struct ev_loop *loop, ev_prepare *w, int revent) {
+	cache_thread_offline();
+}
+
+static void event_cache_online_cb(struct ev_loop *loop, ev_check *w, int revent) {
+	cache_thread_online();
+}
+
+// Sets up the loop of a single worker, with watchers on its own set of sockets:
+static int event_worker_init(struct event_worker_t *worker) {
 	int i, j;
+	char s[52];
 
-	// Fetch the default loop:
-	event_default_loop = ev_default_loop(0);
+	event_default_loop = worker->loop;
 
-	debug_log(DEBUG_DEBUG, "event_init(): memory size of event_entry_t: %zd\n", sizeof(event_entry_t));
-	debug_log(DEBUG_INFO, "event_init(): event backend in use: %d (1 = select, 2 = poll, 4 = epoll, 8 = kqueue, 16 = /dev/poll, 32 = port)\n", ev_backend(event_default_loop));
+	if (!pool_init(&event_entry_pool, sizeof(event_entry_t), global_event_pool_entries) ||
+			!pool_init(&event_udp_buffer_pool, global_ip_udp_buffersize, global_event_pool_entries) ||
+			!pool_init(&event_tcp_buffer_pool, global_ip_tcp_buffersize, global_event_pool_tcp))
+		return 0;
 
-	// Attaching signal handlers:
-	ev_signal_init(&signal_watcher_hup, event_signal_cb, SIGHUP);
-	ev_signal_init(&signal_watcher_int, event_signal_cb, SIGINT);
-	ev_signal_init(&signal_watcher_term, event_signal_cb, SIGTERM);
-	ev_signal_start(event_default_loop, &signal_watcher_hup);
-	ev_signal_start(event_default_loop, &signal_watcher_int);
-	ev_signal_start(event_default_loop, &signal_watcher_term);
+	// The io_uring engine takes over the UDP sockets, if it is available:
+	if ((global_event_engine == EVENT_ENGINE_URING) && !event_uring_init(worker->loop))
+		debug_log(DEBUG_WARN, "event_worker_init(): worker %d: unable to set up io_uring, falling back to libev\n", worker->id);
 
-	// Now allocate memory for each of the workers (global_sockets_count is always even):
-	watchers_count = (int) (global_ip_sockets_count / 2);
+	if (!event_udp_init(worker->loop))
+		return 0;
+
+	if (!crypto_pool_worker_init(worker->loop))
+		return 0;
+
+	if (!event_pipeline_init(worker->loop))
+		return 0;
+
+	ev_prepare_init(&cache_offline_watcher, event_cache_offline_cb);
+	ev_set_priority(&cache_offline_watcher, EV_MINPRI);
+	ev_prepare_start(worker->loop, &cache_offline_watcher);
+	ev_check_init(&cache_online_watcher, event_cache_online_cb);
+	ev_set_priority(&cache_online_watcher, EV_MAXPRI);
+	ev_check_start(worker->loop, &cache_online_watcher);
+
+	// Now allocate memory for each of the watchers (sockets_count is always even):
+	watchers_count = (int) (worker->sockets_count / 2);
 
 	udp_watchers = (struct ev_io *) calloc(watchers_count, sizeof(struct ev_io));
 	if (!udp_watchers)
@@ -125,20 +399,20 @@ int event_init() {
 		goto wrong;
 
 	// Initialize watchers and connect them to the loop:
-	char s[52];
-	for (i = 0, j = 0; i < global_ip_sockets_count; i++) {
-		ip_address_total_string(global_ip_sockets[i].address, s, sizeof(s));
-		if (global_ip_sockets[i].protocol == IP_PROTOCOL_UDP) {
+	for (i = 0, j = 0; i < worker->sockets_count; i++) {
+		ip_address_total_string(worker->sockets[i].address, s, sizeof(s));
+		if (worker->sockets[i].protocol == IP_PROTOCOL_UDP) {
 			// UDP socket
-			debug_log(DEBUG_INFO, "event_init(): udp_watchers[%d] = UDP socket on %s (fd = %d)\n", j, s, global_ip_sockets[i].fd);
-			udp_watchers[j].data = &global_ip_sockets[i];
-			ev_io_init(&udp_watchers[j], event_udp_ext_cb, global_ip_sockets[i].fd, EV_READ);
-			ev_io_start(event_default_loop, &udp_watchers[j]);
-		} else if (global_ip_sockets[i].protocol == IP_PROTOCOL_TCP) {
+			debug_log(DEBUG_INFO, "event_worker_init(): worker %d: udp_watchers[%d] = UDP socket on %s (fd = %d)\n", worker->id, j, s, worker->sockets[i].fd);
+			udp_watchers[j].data = &worker->sockets[i];
+			ev_io_init(&udp_watchers[j], event_udp_ext_cb, worker->sockets[i].fd, EV_READ);
+			if (!event_uring_recv_ext(&worker->sockets[i]))
+				ev_io_start(worker->loop, &udp_watchers[j]);
+		} else if (worker->sockets[i].protocol == IP_PROTOCOL_TCP) {
 			// TCP socket
-			debug_log(DEBUG_INFO, "event_init(): tcp_watchers[%d] = TCP socket on %s (fd = %d)\n", j, s, global_ip_sockets[i].fd);
-			ev_io_init(&tcp_watchers[j], event_tcp_accept_cb, global_ip_sockets[i].fd, EV_READ);
-			ev_io_start(event_default_loop, &tcp_watchers[j]);
+			debug_log(DEBUG_INFO, "event_worker_init(): worker %d: tcp_watchers[%d] = TCP socket on %s (fd = %d)\n", worker->id, j, s, worker->sockets[i].fd);
+			ev_io_init(&tcp_watchers[j], event_tcp_accept_cb, worker->sockets[i].fd, EV_READ);
+			ev_io_start(worker->loop, &tcp_watchers[j]);
 		}
 		if (i % 2)
 			j++;
@@ -152,10 +426,143 @@ wrong:
 		free(udp_watchers);
 	if (tcp_watchers)
 		free(tcp_watchers);
+	udp_watchers = tcp_watchers = NULL;
+	return 0;
+}
+
+static void *event_worker_thread(void *arg) {
+	struct event_worker_t *worker = (struct event_worker_t *) arg;
+
+	// Each worker has its own random state and shared secret cache:
+	if (!misc_crypto_random_init()) {
+		debug_log(DEBUG_FATAL, "event_worker_thread(): worker %d: unable to initialize randomness\n", worker->id);
+		goto wrong;
+	}
+	if (!dnscurve_init()) {
+		debug_log(DEBUG_FATAL, "event_worker_thread(): worker %d: dnscurve_init() failed\n", worker->id);
+		goto wrong;
+	}
+	if (!event_worker_init(worker)) {
+		debug_log(DEBUG_FATAL, "event_worker_thread(): worker %d: event_worker_init() failed\n", worker->id);
+		goto wrong;
+	}
+	event_snapshot_init(worker);
+
+	ev_loop(worker->loop, 0);
+
+	crypto_pool_worker_stop();
+	event_snapshot_write(worker);
+	cache_destroy(dnscurve_cache);
+	dnscurve_cache = NULL;
+	return NULL;
+
+wrong:
+	// Without this worker the rest makes no sense, so bring everything down:
+	cache_destroy(dnscurve_cache);
+	dnscurve_cache = NULL;
+	event_command_broadcast(EVENT_COMMAND_QUIT);
+	return NULL;
+}
+
+int event_init() {
+	int i, per_worker;
+
+	event_workers = (struct event_worker_t *) calloc(global_event_workers, sizeof(struct event_worker_t));
+	if (!event_workers)
+		goto wrong;
+
+	// The sockets are opened in one set per worker (see ip_init()):
+	per_worker = (int) (global_ip_sockets_count / global_event_workers);
+	for (i = 0; i < global_event_workers; i++) {
+		event_workers[i].id = i;
+		event_workers[i].sockets = &global_ip_sockets[i * per_worker];
+		event_workers[i].sockets_count = per_worker;
+	}
+
+	// Worker 0 runs on the default loop (in the main thread), the others get their own:
+	for (i = 0; i < global_event_workers; i++) {
+		event_workers[i].loop = i ? ev_loop_new(EVFLAG_AUTO) : ev_default_loop(0);
+		if (!event_workers[i].loop)
+			goto wrong;
+		// The command watcher must be active before anyone can signal it:
+		event_workers[i].command_watcher.data = &event_workers[i];
+		ev_async_init(&event_workers[i].command_watcher, event_command_cb);
+		ev_async_start(event_workers[i].loop, &event_workers[i].command_watcher);
+	}
+
+	debug_log(DEBUG_DEBUG, "event_init(): memory size of event_entry_t: %zd\n", sizeof(event_entry_t));
+	debug_log(DEBUG_INFO, "event_init(): event backend in use: %d (1 = select, 2 = poll, 4 = epoll, 8 = kqueue, 16 = /dev/poll, 32 = port)\n", ev_backend(event_workers[0].loop));
+	debug_log(DEBUG_INFO, "event_init(): number of workers: %d\n", global_event_workers);
+
+	// Attaching signal handlers:
+	ev_signal_init(&signal_watcher_hup, event_signal_cb, SIGHUP);
+	ev_signal_init(&signal_watcher_int, event_signal_cb, SIGINT);
+	ev_signal_init(&signal_watcher_term, event_signal_cb, SIGTERM);
+	ev_signal_init(&signal_watcher_usr1, event_signal_cb, SIGUSR1);
+	ev_signal_init(&signal_watcher_usr2, event_signal_cb, SIGUSR2);
+	ev_signal_start(event_workers[0].loop, &signal_watcher_hup);
+	ev_signal_start(event_workers[0].loop, &signal_watcher_int);
+	ev_signal_start(event_workers[0].loop, &signal_watcher_term);
+	ev_signal_start(event_workers[0].loop, &signal_watcher_usr1);
+	ev_signal_start(event_workers[0].loop, &signal_watcher_usr2);
+
+	if (!event_worker_init(&event_workers[0]))
+		goto wrong;
+
+	return 1;
+
+wrong:
+	if (event_workers) {
+		for (i = 1; i < global_event_workers; i++)
+			if (event_workers[i].loop)
+				ev_loop_destroy(event_workers[i].loop);
+		free(event_workers);
+		event_workers = NULL;
+	}
 	return 0;
 }
 
 void event_worker() {
+	sigset_t set, oldset;
+	int i;
+
+	// Signals are only handled by worker 0, so the other workers must not receive them:
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+	// The crypto threads are shared by all workers:
+	crypto_pool_start();
+
+	// And so is the way the replies of a loop iteration are sealed:
+	crypto_multibox_init();
+
+	for (i = 1; i < global_event_workers; i++) {
+		if (pthread_create(&event_workers[i].thread, NULL, event_worker_thread, &event_workers[i]) != 0) {
+			debug_log(DEBUG_FATAL, "event_worker(): unable to start worker %d\n", i);
+			global_event_workers = i;
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	// Worker 0 got its cache after event_init():
+	event_snapshot_init(&event_workers[0]);
+
 	debug_log(DEBUG_FATAL, "event_worker(): starting the event loop\n");
-	ev_loop(event_default_loop, 0);
+	ev_loop(event_workers[0].loop, 0);
+
+	for (i = 1; i < global_event_workers; i++)
+		pthread_join(event_workers[i].thread, NULL);
+
+	crypto_pool_worker_stop();
+	event_snapshot_write(&event_workers[0]);
+	cache_destroy(dnscurve_cache);
+	dnscurve_cache = NULL;
+	ip_close();
 }
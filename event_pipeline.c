@@ -0,0 +1,298 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+/*
+ * Pipeline mode (see CURVEDNS_PIPELINE): the worker loop keeps doing all of
+ * the socket work, while the DNSCurve work of its queries (opening the box
+ * of a query, sealing the box of its response) is done by crypto stage
+ * threads of its own. Every stage is connected to the worker by two bounded
+ * single producer, single consumer rings: one towards the stage and one
+ * back. Queries of the same client go to the same stage, which keeps its own
+ * shared secret cache.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+
+#include "event.h"
+#include "ring.h"
+#include "dns.h"
+#include "dnscurve.h"
+#include "misc.h"
+
+// Number of crypto stages per worker, 0 disables pipeline mode:
+int global_event_pipeline_stages = 0;
+
+// Number of packets that can be on their way to (or back from) a stage:
+int global_event_pipeline_ring = 1024;
+
+// Entries travel through the rings with the operation and its result in
+// the lower bits (entries are at least 16 byte aligned):
+#define EVENT_PIPELINE_OPMASK		1
+#define EVENT_PIPELINE_RESULTSHIFT	1
+#define EVENT_PIPELINE_TAGMASK		15
+
+// Number of packets a stage handles before waking up the worker:
+#define EVENT_PIPELINE_BATCH		32
+
+struct event_pipeline_stage {
+	struct ring in, out;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int sleeping;
+	struct ev_loop *loop;
+	ev_async *done_watcher;
+	unsigned long handled, wakeups;
+};
+
+static __thread struct event_pipeline_stage **pipeline_stages = NULL;
+static __thread ev_async pipeline_done_watcher;
+static __thread unsigned int pipeline_next = 0;
+static __thread unsigned long pipeline_submitted = 0, pipeline_inline = 0;
+
+static void event_pipeline_done(struct event_pipeline_stage *stage) {
+	ev_async_send(stage->loop, stage->done_watcher);
+}
+
+static void *event_pipeline_thread(void *arg) {
+	struct event_pipeline_stage *stage = (struct event_pipeline_stage *) arg;
+	event_entry_t *general_entry;
+	uintptr_t item;
+	int op, result, batch = 0;
+
+	// The stage needs its own random state and shared secret cache:
+	if (!misc_crypto_random_init() || !dnscurve_init()) {
+		debug_log(DEBUG_FATAL, "event_pipeline_thread(): unable to initialize crypto stage\n");
+		return NULL;
+	}
+
+	for (;;) {
+		// Between two packets the stage holds no entries of a shared cache:
+		cache_thread_online();
+		item = (uintptr_t) ring_pop(&stage->in);
+		if (!item) {
+			if (batch) {
+				event_pipeline_done(stage);
+				batch = 0;
+			}
+
+			// Nothing to do, wait for the worker (which checks sleeping after pushing):
+			cache_thread_offline();
+			pthread_mutex_lock(&stage->lock);
+			__atomic_store_n(&stage->sleeping, 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			while (ring_empty(&stage->in))
+				pthread_cond_wait(&stage->cond, &stage->lock);
+			__atomic_store_n(&stage->sleeping, 0, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&stage->lock);
+			continue;
+		}
+
+		general_entry = (event_entry_t *) (item & ~((uintptr_t) EVENT_PIPELINE_TAGMASK));
+		op = (int) (item & EVENT_PIPELINE_OPMASK);
+		if (op == EVENT_PIPELINE_OPEN)
+			result = dns_analyze_query(general_entry);
+		else
+			result = dns_reply_query_encode(general_entry);
+		stage->handled++;
+
+		item = (uintptr_t) general_entry | op | (result << EVENT_PIPELINE_RESULTSHIFT);
+		while (!ring_push(&stage->out, (void *) item)) {
+			// The worker is behind, make sure it knows there is work waiting:
+			event_pipeline_done(stage);
+			sched_yield();
+		}
+
+		if (++batch >= EVENT_PIPELINE_BATCH) {
+			event_pipeline_done(stage);
+			batch = 0;
+		}
+	}
+
+	return NULL;
+}
+
+static void event_pipeline_done_cb(struct ev_loop *loop, ev_async *w, int revent) {
+	event_entry_t *general_entry;
+	uintptr_t item;
+	int i, op, result;
+
+	if (!(revent & EV_ASYNC))
+		return;
+
+	for (i = 0; i < global_event_pipeline_stages; i++) {
+		while ((item = (uintptr_t) ring_pop(&pipeline_stages[i]->out))) {
+			general_entry = (event_entry_t *) (item & ~((uintptr_t) EVENT_PIPELINE_TAGMASK));
+			op = (int) (item & EVENT_PIPELINE_OPMASK);
+			result = (int) ((item & EVENT_PIPELINE_TAGMASK) >> EVENT_PIPELINE_RESULTSHIFT);
+
+			if (op == EVENT_PIPELINE_OPEN) {
+				if (general_entry->general.protocol == IP_PROTOCOL_UDP)
+					event_udp_ext_analyzed(loop, general_entry, result);
+				else
+					event_tcp_client_analyzed(loop, general_entry, result);
+			} else {
+				if (general_entry->general.protocol == IP_PROTOCOL_UDP)
+					event_udp_int_sealed(loop, general_entry, result);
+				else
+					event_tcp_int_sealed(loop, general_entry, result);
+			}
+		}
+	}
+}
+
+// Starts the crypto stages of the calling worker:
+int event_pipeline_init(struct ev_loop *loop) {
+	struct event_pipeline_stage *stage;
+	sigset_t set, oldset;
+	int i;
+
+	if (global_event_pipeline_stages <= 0)
+		return 1;
+
+	pipeline_stages = (struct event_pipeline_stage **) calloc(global_event_pipeline_stages, sizeof(struct event_pipeline_stage *));
+	if (!pipeline_stages)
+		goto wrong;
+
+	ev_async_init(&pipeline_done_watcher, event_pipeline_done_cb);
+	ev_async_start(loop, &pipeline_done_watcher);
+
+	// Signals are for worker 0 only:
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+	for (i = 0; i < global_event_pipeline_stages; i++) {
+		if (posix_memalign((void **) &stage, RING_CACHELINE, sizeof(struct event_pipeline_stage)) != 0)
+			break;
+		memset(stage, 0, sizeof(struct event_pipeline_stage));
+		if (!ring_init(&stage->in, global_event_pipeline_ring) || !ring_init(&stage->out, global_event_pipeline_ring)) {
+			free(stage);
+			break;
+		}
+		pthread_mutex_init(&stage->lock, NULL);
+		pthread_cond_init(&stage->cond, NULL);
+		stage->loop = loop;
+		stage->done_watcher = &pipeline_done_watcher;
+
+		if (pthread_create(&stage->thread, NULL, event_pipeline_thread, stage) != 0) {
+			free(stage->in.slots);
+			free(stage->out.slots);
+			free(stage);
+			break;
+		}
+		pthread_detach(stage->thread);
+		pipeline_stages[i] = stage;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (i < global_event_pipeline_stages) {
+		debug_log(DEBUG_FATAL, "event_pipeline_init(): unable to start crypto stage %d\n", i);
+		goto wrong;
+	}
+
+	debug_log(DEBUG_INFO, "event_pipeline_init(): %d crypto stages running\n", global_event_pipeline_stages);
+	return 1;
+
+wrong:
+	return 0;
+}
+
+// Hands the DNSCurve work of a query (or its response) to a crypto stage,
+// returns 0 when the caller has to do it itself:
+int event_pipeline_submit(event_entry_t *general_entry, int op) {
+	struct event_pipeline_stage *stage;
+	struct event_general_entry *entry = &general_entry->general;
+	unsigned int i;
+
+	if (!pipeline_stages)
+		return 0;
+
+	if (op == EVENT_PIPELINE_OPEN) {
+		// Regular DNS queries are not worth the trip (see dnscurve_analyze_query()):
+		if (entry->packetsize < 68)
+			return 0;
+
+		// Keep a client on one stage, so its shared secret is cached there:
+		if (!memcmp(entry->buffer, "Q6fnvWj8", 8))
+			i = (entry->buffer[8] << 8) | entry->buffer[9];
+		else if (entry->address.sa.sa_family == AF_INET)
+			i = ntohl(entry->address.sin.sin_addr.s_addr);
+		else
+			i = (entry->address.sin6.sin6_addr.s6_addr[14] << 8) | entry->address.sin6.sin6_addr.s6_addr[15];
+		i %= global_event_pipeline_stages;
+	} else {
+		if (entry->dns.type == DNS_NON_DNSCURVE)
+			return 0;
+		i = pipeline_next++ % global_event_pipeline_stages;
+	}
+
+	stage = pipeline_stages[i];
+	if (((uintptr_t) general_entry & EVENT_PIPELINE_TAGMASK) ||
+			!ring_push(&stage->in, (void *) ((uintptr_t) general_entry | op))) {
+		pipeline_inline++;
+		return 0;
+	}
+	pipeline_submitted++;
+
+	// Wake the stage up, if it went to sleep before it saw this one:
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&stage->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&stage->lock);
+		pthread_cond_signal(&stage->cond);
+		pthread_mutex_unlock(&stage->lock);
+		stage->wakeups++;
+	}
+
+	return 1;
+}
+
+void event_pipeline_stats(int worker) {
+	unsigned long handled = 0, wakeups = 0;
+	int i;
+
+	if (!pipeline_stages)
+		return;
+
+	for (i = 0; i < global_event_pipeline_stages; i++) {
+		handled += pipeline_stages[i]->handled;
+		wakeups += pipeline_stages[i]->wakeups;
+	}
+	debug_log(DEBUG_FATAL, "event_pipeline_stats(): worker %d: %lu packets handed to %d crypto stages (%lu handled, %lu wakeups), %lu done by the worker since a ring was full\n",
+			worker, pipeline_submitted, global_event_pipeline_stages, handled, wakeups, pipeline_inline);
+}
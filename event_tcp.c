@@ -36,325 +36,726 @@
 
 #include "event.h"
 #include "dns.h"
+#include "misc.h"
 
-static int event_tcp_number_connections = 0;
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
-void event_cleanup_tcp_entry(struct ev_loop *loop, struct event_tcp_entry *entry) {
-	if (entry) {
-		if (ev_is_active(&entry->timeout_watcher))
-			ev_timer_stop(loop, &entry->timeout_watcher);
-		if (ev_is_active(&entry->read_watcher))
-			ev_io_stop(loop, &entry->read_watcher);
-		if (ev_is_active(&entry->write_watcher))
-			ev_io_stop(loop, &entry->write_watcher);
-		if (entry->extsock >= 0) {
-			ip_tcp_close(entry->extsock);
-			entry->extsock = -1;
-		}
-		if (entry->intsock >= 0) {
-			ip_tcp_close(entry->intsock);
-			entry->intsock = -1;
-		}
-		if (event_tcp_number_connections-- == global_ip_tcp_max_number_connections)
-			event_tcp_startstop_watchers(loop, 1);
-		free(entry);
-	}
-}
+// Counted per worker, so the maximum applies to each worker separately:
+static __thread int event_tcp_number_connections = 0;
 
-void event_tcp_timeout_cb(struct ev_loop *loop, ev_timer *w, int revent) {
-	event_entry_t *general_entry = (event_entry_t *) w->data;
-	struct event_tcp_entry *entry = (struct event_tcp_entry *) &general_entry->tcp;
-	uint8_t internal;
+// Maximum number of queries of a single client that are handled at the same
+// time, reading from the client is paused when it is reached:
+int global_event_tcp_client_inflight = 32;
 
-	if (!(revent & EV_TIMEOUT))
-		return;
+// Maximum number of answers written to a client in one system call:
+#define EVENT_TCP_WRITE_BATCH	16
 
-	if ((entry->state == EVENT_TCP_INT_WRITING_INIT) ||
-			(entry->state == EVENT_TCP_INT_WRITING_MORE) ||
-			(entry->state == EVENT_TCP_INT_READING_INIT) ||
-			(entry->state == EVENT_TCP_INT_READING_MORE)) {
-		internal = 1;
-	} else if ((entry->state == EVENT_TCP_EXT_WRITING_INIT) ||
-			(entry->state == EVENT_TCP_EXT_WRITING_MORE) ||
-			(entry->state == EVENT_TCP_EXT_READING_INIT) ||
-			(entry->state == EVENT_TCP_EXT_READING_MORE)) {
-		internal = 0;
-	} else {
-		debug_log(DEBUG_WARN, "event_tcp_timeout_cb(): not in the right state for TCP connection\n");
+// Pool of kept-alive connections towards the authoritative name server (per
+// worker). A new connection is only opened when every connection already has
+// CURVEDNS_TCP_PIPELINE queries in flight:
+int global_event_tcp_int_connections = 4;
+int global_event_tcp_int_pipeline = 16;
+ev_tstamp global_event_tcp_int_idle = 10.;
+
+static __thread struct event_tcp_int_conn *tcp_int_conns = NULL;
+static __thread int tcp_int_conns_count = 0;
+
+struct event_tcp_counters {
+	unsigned long opened, queries, redispatched, failed;
+};
+static __thread struct event_tcp_counters tcp_counters;
+
+static void event_tcp_int_read_cb(struct ev_loop *, ev_io *, int);
+static void event_tcp_int_write_cb(struct ev_loop *, ev_io *, int);
+static void event_tcp_int_timeout_cb(struct ev_loop *, ev_timer *, int);
+static void event_tcp_client_queue(struct ev_loop *, struct event_tcp_entry *);
+
+static struct event_tcp_int_conn *event_tcp_int_open(struct ev_loop *loop) {
+	struct event_tcp_int_conn *conn = NULL;
+	int sock = -1;
+
+	conn = (struct event_tcp_int_conn *) malloc(sizeof(struct event_tcp_int_conn));
+	if (!conn)
 		goto wrong;
-	}
+	memset(conn, 0, sizeof(struct event_tcp_int_conn));
 
-	if (internal) {
+	conn->outsize = conn->insize = global_ip_tcp_buffersize + 2;
+	conn->outbuf = (uint8_t *) malloc(conn->outsize);
+	conn->inbuf = (uint8_t *) malloc(conn->insize);
+	if (!conn->outbuf || !conn->inbuf)
+		goto wrong;
 
-		if ((entry->state == EVENT_TCP_INT_READING_INIT) || (entry->state == EVENT_TCP_INT_READING_MORE)) {
-			debug_log(DEBUG_INFO, "event_tcp_timeout_cb(): timeout while waiting for internal read\n");
-		} else if ((entry->state == EVENT_TCP_INT_WRITING_INIT) || (entry->state == EVENT_TCP_INT_WRITING_MORE)) {
-			debug_log(DEBUG_INFO, "event_tcp_timeout_cb(): timeout while waiting for internal write\n");
-		} else {
-			debug_log(DEBUG_WARN, "event_tcp_timeout_cb(): received unknown timeout while being notified for internal timeout\n");
-		}
+	if (!ip_tcp_open(&sock, &global_target_address)) {
+		debug_log(DEBUG_ERROR, "event_tcp_int_open(): unable to open TCP socket\n");
+		goto wrong;
+	}
 
-	} else {
+	// randomizing port is not really necessary, as TCP is invulnerable to cache poisoning
+	// however, the source IP address is set in ip_bind_random...
+	if (!ip_bind_random(sock)) {
+		// if this fails, let the kernel handle it (would mean source IP address is not guaranteed...)
+		debug_log(DEBUG_WARN, "event_tcp_int_open(): unable to bind to source IP address and/or random port\n");
+	}
 
-		if ((entry->state == EVENT_TCP_EXT_READING_INIT) || (entry->state == EVENT_TCP_EXT_READING_MORE)) {
-			debug_log(DEBUG_INFO, "event_tcp_timeout_cb(): timeout while waiting for external read\n");
-		} else if ((entry->state == EVENT_TCP_EXT_WRITING_INIT) || (entry->state == EVENT_TCP_EXT_WRITING_MORE)) {
-			debug_log(DEBUG_INFO, "event_tcp_timeout_cb(): timeout while waiting for external write\n");
-		} else {
-			debug_log(DEBUG_WARN, "event_tcp_timeout_cb(): received unknown timeout while being notified for external timeout\n");
-		}
+	if (!ip_connect(sock, &global_target_address)) {
+		debug_log(DEBUG_ERROR, "event_tcp_int_open(): unable to connect to authoritative name server (%s)\n", strerror(errno));
+		goto wrong;
 	}
 
+	conn->read_watcher.data = conn;
+	conn->write_watcher.data = conn;
+	conn->timeout_watcher.data = conn;
+	ev_io_init(&conn->read_watcher, event_tcp_int_read_cb, sock, EV_READ);
+	ev_io_init(&conn->write_watcher, event_tcp_int_write_cb, sock, EV_WRITE);
+	ev_timer_init(&conn->timeout_watcher, event_tcp_int_timeout_cb, 0., global_ip_internal_timeout);
+	ev_io_start(loop, &conn->read_watcher);
+
+	conn->next = tcp_int_conns;
+	tcp_int_conns = conn;
+	tcp_int_conns_count++;
+	tcp_counters.opened++;
+
+	debug_log(DEBUG_INFO, "event_tcp_int_open(): opened connection %d towards authoritative name server\n", tcp_int_conns_count);
+
+	return conn;
+
 wrong:
-	event_cleanup_entry(loop, general_entry);
+	if (sock >= 0)
+		ip_tcp_close(sock);
+	if (conn) {
+		if (conn->outbuf)
+			free(conn->outbuf);
+		if (conn->inbuf)
+			free(conn->inbuf);
+		free(conn);
+	}
+	return NULL;
 }
 
-void event_tcp_write_cb(struct ev_loop *loop, ev_io *w, int revent) {
-	event_entry_t *general_entry = (event_entry_t *) w->data;
-	struct event_tcp_entry *entry = (struct event_tcp_entry *) &general_entry->tcp;
-	uint8_t *buffer, initial = 1, internal = 1, initbuf[2]; // houses the first two length bytes
-	ssize_t bufferleft, buffersent;
+static void event_tcp_int_close(struct ev_loop *loop, struct event_tcp_int_conn *conn) {
+	struct event_tcp_int_conn **p;
 
-	if (!(revent & EV_WRITE))
-		goto wrong;
-	if (!entry)
-		goto wrong;
-	if (!entry->buffer) {
-		debug_log(DEBUG_ERROR, "event_tcp_write_cb(): no buffer for TCP connection\n");
-		goto wrong;
+	for (p = &tcp_int_conns; *p; p = &(*p)->next) {
+		if (*p == conn) {
+			*p = conn->next;
+			tcp_int_conns_count--;
+			break;
+		}
 	}
-	if (entry->bufferat >= entry->bufferlen) {
-		debug_log(DEBUG_ERROR, "event_tcp_write_cb(): buffer pointer after buffer space for TCP connection\n");
-		goto wrong;
+
+	ev_io_stop(loop, &conn->read_watcher);
+	ev_io_stop(loop, &conn->write_watcher);
+	ev_timer_stop(loop, &conn->timeout_watcher);
+	ip_tcp_close(conn->read_watcher.fd);
+	free(conn->outbuf);
+	free(conn->inbuf);
+	free(conn);
+}
+
+// Hands a query that got no response to another connection (but only once
+// per query), or gives up on it:
+static void event_tcp_int_redispatch(struct ev_loop *loop, struct event_tcp_entry *entry) {
+	if (!entry->redispatched) {
+		entry->redispatched = 1;
+		tcp_counters.redispatched++;
+		if (event_tcp_int_send(loop, (event_entry_t *) entry))
+			return;
 	}
+	debug_log(DEBUG_INFO, "event_tcp_int_redispatch(): giving up on query\n");
+	event_cleanup_entry(loop, (event_entry_t *) entry);
+}
 
-	if (entry->state == EVENT_TCP_INT_WRITING_INIT) {
-		internal = 1; initial = 1;
-	} else if (entry->state == EVENT_TCP_INT_WRITING_MORE) {
-		internal = 1; initial = 0;
-	} else if (entry->state == EVENT_TCP_EXT_WRITING_INIT) {
-		internal = 0; initial = 1;
-	} else if (entry->state == EVENT_TCP_EXT_WRITING_MORE) {
-		internal = 0; initial = 0;
-	} else
-		goto wrong;
+// Closes a broken connection, its queries are handed to another connection:
+static void event_tcp_int_fail(struct ev_loop *loop, struct event_tcp_int_conn *conn) {
+	struct event_tcp_entry *entry, *next;
+
+	entry = conn->queries;
+	conn->queries = NULL;
+	conn->inflight = 0;
+	event_tcp_int_close(loop, conn);
+	tcp_counters.failed++;
+
+	for (; entry; entry = next) {
+		next = entry->intnext;
+		entry->intnext = NULL;
+		entry->intconn = NULL;
+		event_tcp_int_redispatch(loop, entry);
+	}
+}
 
-	debug_log(DEBUG_DEBUG, "event_tcp_write_cb(): received write event for %s TCP connection (bufferat = %zd, packetsize = %zd)\n",
-			internal ? "internal" : "external", entry->bufferat, entry->packetsize);
+// While queries are in flight the timer runs until the oldest of them is
+// due, otherwise until the connection has been idle for long enough:
+static void event_tcp_int_arm(struct ev_loop *loop, struct event_tcp_int_conn *conn) {
+	struct event_tcp_entry *entry;
+	ev_tstamp oldest;
 
-	if (initial) {
-		initbuf[0] = entry->packetsize >> 8;
-		initbuf[1] = entry->packetsize & 0xff;
-		buffer = initbuf + entry->bufferat;
-		bufferleft = 2 - entry->bufferat;
+	if (!conn->inflight) {
+		conn->timeout_watcher.repeat = global_event_tcp_int_idle;
 	} else {
-		buffer = entry->buffer + entry->bufferat;
-		bufferleft = entry->packetsize - entry->bufferat;
+		oldest = conn->queries->intsent;
+		for (entry = conn->queries->intnext; entry; entry = entry->intnext)
+			if (entry->intsent < oldest)
+				oldest = entry->intsent;
+		conn->timeout_watcher.repeat = oldest + global_ip_internal_timeout - ev_now(loop);
+		if (conn->timeout_watcher.repeat < 0.001)
+			conn->timeout_watcher.repeat = 0.001;
 	}
+	ev_timer_again(loop, &conn->timeout_watcher);
+}
 
-	buffersent = send(internal ? entry->intsock : entry->extsock, buffer, bufferleft, 0);
-	if (buffersent == -1) {
-		// As the socket is non-blocking, the kernel might not be ready, so stop and be notified again:
-		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
-		debug_log(DEBUG_WARN, "event_tcp_write_cb(): writing on %s TCP connection failed (%s)\n",
-				internal ? "internal" : "external", strerror(errno));
-		goto wrong;
-	}
-	entry->bufferat += buffersent;
+// Removes a query from its connection, a response that might still arrive
+// for it will be ignored:
+static void event_tcp_int_cancel(struct ev_loop *loop, struct event_tcp_entry *entry) {
+	struct event_tcp_int_conn *conn = entry->intconn;
+	struct event_tcp_entry **p;
 
-	if (initial) {
-		if (entry->bufferat == 2) {
-			entry->bufferat = 0;
-			if (internal)
-				entry->state = EVENT_TCP_INT_WRITING_MORE;
-			else
-				entry->state = EVENT_TCP_EXT_WRITING_MORE;
-		}
-		// Reset the timer:
-		ev_timer_again(loop, &entry->timeout_watcher);
+	if (!conn)
 		return;
+
+	for (p = &conn->queries; *p; p = &(*p)->intnext) {
+		if (*p == entry) {
+			*p = entry->intnext;
+			break;
+		}
 	}
+	entry->intnext = NULL;
+	entry->intconn = NULL;
 
-	if (entry->bufferat < entry->packetsize) {
-		debug_log(DEBUG_DEBUG, "event_tcp_write_cb(): buffer not full yet, so waiting for next batch\n");
-		ev_timer_again(loop, &entry->timeout_watcher);
-		return;
+	// Nothing left to wait for, so start counting down the idle time:
+	if (--conn->inflight == 0)
+		event_tcp_int_arm(loop, conn);
+}
+
+// Queues the query of an entry on one of the connections towards the
+// authoritative name server, with a TXID that is unique on that connection:
+int event_tcp_int_send(struct ev_loop *loop, event_entry_t *general_entry) {
+	struct event_tcp_entry *entry = &general_entry->tcp, *other;
+	struct event_tcp_int_conn *conn, *best = NULL;
+	unsigned int txid;
+	uint8_t *outbuf;
+	size_t needed;
+
+	for (conn = tcp_int_conns; conn; conn = conn->next)
+		if (!best || (conn->inflight < best->inflight))
+			best = conn;
+
+	if (!best || ((best->inflight >= global_event_tcp_int_pipeline) && (tcp_int_conns_count < global_event_tcp_int_connections))) {
+		conn = event_tcp_int_open(loop);
+		if (conn)
+			best = conn;
+	}
+	if (!best)
+		return 0;
+	conn = best;
+
+	do {
+		txid = misc_crypto_random(65536);
+		for (other = conn->queries; other; other = other->intnext)
+			if (other->dns.dsttxid == txid)
+				break;
+	} while (other);
+
+	entry->dns.dsttxid = txid;
+	entry->buffer[0] = txid >> 8;
+	entry->buffer[1] = txid & 0xff;
+
+	// Append the query (with its length prefixed) to the output buffer:
+	if (conn->outat) {
+		memmove(conn->outbuf, conn->outbuf + conn->outat, conn->outlen - conn->outat);
+		conn->outlen -= conn->outat;
+		conn->outat = 0;
+	}
+	needed = conn->outlen + 2 + entry->packetsize;
+	if (needed > conn->outsize) {
+		outbuf = (uint8_t *) realloc(conn->outbuf, needed * 2);
+		if (!outbuf)
+			return 0;
+		conn->outbuf = outbuf;
+		conn->outsize = needed * 2;
 	}
+	conn->outbuf[conn->outlen++] = entry->packetsize >> 8;
+	conn->outbuf[conn->outlen++] = entry->packetsize & 0xff;
+	memcpy(conn->outbuf + conn->outlen, entry->buffer, entry->packetsize);
+	conn->outlen += entry->packetsize;
 
-	// We are done sending, all the packets, clear everything up:
-	if (internal) {
-		debug_log(DEBUG_INFO, "event_tcp_write_cb(): we have sent the entire packet towards authoritative name server, packetsize = %zu\n", entry->packetsize);
+	entry->intconn = conn;
+	entry->intnext = conn->queries;
+	entry->intsent = ev_now(loop);
+	conn->queries = entry;
 
-		ev_io_stop(loop, &entry->write_watcher);
+	// The connection was idle, so now we are waiting for a response:
+	if (conn->inflight++ == 0)
+		event_tcp_int_arm(loop, conn);
+	if (!ev_is_active(&conn->write_watcher))
+		ev_io_start(loop, &conn->write_watcher);
 
-		// So we are ready for receiving, attach a watcher to the socket
-		// for reading and reset the timeout (which is still okay, as we
-		// are receiving from the authoritative server):
-		entry->state = EVENT_TCP_INT_READING_INIT;
+	tcp_counters.queries++;
 
-		entry->bufferat = 0;
-		entry->packetsize = 0;
+	debug_log(DEBUG_INFO, "event_tcp_int_send(): queued query with id %u (%d in flight on this connection)\n", txid, conn->inflight);
 
-		ev_io_start(loop, &entry->read_watcher);
-		ev_timer_again(loop, &entry->timeout_watcher);
-	} else {
-		debug_log(DEBUG_INFO, "event_tcp_write_cb(): we have sent the entire packet towards the client, packetsize = %zu, listening again\n", entry->packetsize);
+	return 1;
+}
 
-		ev_io_stop(loop, &entry->write_watcher);
+static void event_tcp_int_write_cb(struct ev_loop *loop, ev_io *w, int revent) {
+	struct event_tcp_int_conn *conn = (struct event_tcp_int_conn *) w->data;
+	ssize_t n;
 
-		// We are done sending info back to client. According to RFC, the client
-		// should close the connection, so wait for a read:
-		entry->state = EVENT_TCP_EXT_READING_INIT;
-		entry->bufferat = 0;
-		entry->packetsize = 0;
+	if (!(revent & EV_WRITE))
+		return;
 
-		ev_io_start(loop, &entry->read_watcher);
-		ev_timer_again(loop, &entry->timeout_watcher);
+	n = send(w->fd, conn->outbuf + conn->outat, conn->outlen - conn->outat, MSG_NOSIGNAL);
+	if (n == -1) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+		debug_log(DEBUG_WARN, "event_tcp_int_write_cb(): writing on internal TCP connection failed (%s)\n", strerror(errno));
+		event_tcp_int_fail(loop, conn);
+		return;
+	}
+
+	conn->outat += n;
+	if (conn->outat == conn->outlen) {
+		conn->outat = conn->outlen = 0;
+		ev_io_stop(loop, &conn->write_watcher);
+	}
+}
+
+static void event_tcp_int_reply(struct ev_loop *loop, event_entry_t *general_entry) {
+	// Let's see what kind of packet we are dealing with:
+	if (!dns_analyze_reply_query(general_entry)) {
+		debug_log(DEBUG_WARN, "event_tcp_int_reply(): analyzing of DNS response failed\n");
+		goto wrong;
 	}
 
+	// In pipeline mode, one of the crypto stages seals it:
+	if (event_pipeline_submit(general_entry, EVENT_PIPELINE_SEAL))
+		return;
+
+	// Now forward the packet towards the client:
+	event_tcp_int_sealed(loop, general_entry, dns_reply_query_tcp(general_entry));
 	return;
 
 wrong:
-	debug_log(DEBUG_WARN, "event_tcp_write_cb(): catched wrong during %s TCP connection\n", internal ? "internal" : "external");
 	event_cleanup_entry(loop, general_entry);
 	return;
 }
 
-void event_tcp_read_cb(struct ev_loop *loop, ev_io *w, int revent) {
-	event_entry_t *general_entry = (event_entry_t *) w->data;
-	struct event_tcp_entry *entry = (struct event_tcp_entry *) &general_entry->tcp;
-	uint8_t *buffer, initial, internal;
-	ssize_t bufferneeded, packetlen;
+void event_tcp_int_sealed(struct ev_loop *loop, event_entry_t *general_entry, int result) {
+	struct event_tcp_entry *entry = &general_entry->tcp;
 
-	if (!(revent & EV_READ))
-		goto wrong;
-	if (!entry)
-		goto wrong;
-	if (!entry->buffer)
-		goto wrong;
-	if (entry->bufferat >= entry->bufferlen)
+	if (!result) {
+		debug_log(DEBUG_WARN, "event_tcp_int_reply(): failed to reply the response towards the client\n");
 		goto wrong;
+	}
+
+	// Queue it behind the other answers for this client:
+	entry->state = EVENT_TCP_EXT_WRITING_INIT;
+	event_tcp_client_queue(loop, entry);
+
+	return;
+
+wrong:
+	event_cleanup_entry(loop, general_entry);
+	return;
+}
+
+// Handles a single response, matched on TXID and question:
+static void event_tcp_int_response(struct ev_loop *loop, struct event_tcp_int_conn *conn, uint8_t *response, size_t len) {
+	struct event_tcp_entry *entry;
+	unsigned int txid;
+
+	if (len < 12) {
+		debug_log(DEBUG_INFO, "event_tcp_int_response(): received response is too small (no DNS header)\n");
+		return;
+	}
 
-	if (entry->state == EVENT_TCP_INT_READING_INIT)	{
-		internal = 1; initial = 1;
-	} else if (entry->state == EVENT_TCP_INT_READING_MORE) {
-		internal = 1; initial = 0;
-	} else if (entry->state == EVENT_TCP_EXT_READING_INIT) {
-		internal = 0; initial = 1;
-	} else if (entry->state == EVENT_TCP_EXT_READING_MORE) {
-		internal = 0; initial = 0;
-	} else goto wrong;
-
-	buffer = entry->buffer + entry->bufferat;
-	bufferneeded = (initial ? 2 : entry->packetsize) - entry->bufferat;
-
-	packetlen = recv(internal ? entry->intsock : entry->extsock, buffer, bufferneeded, 0);
-	if (packetlen < 1) {
-		if (packetlen == -1) {
-			// Our non-blocking socket, could not be ready, if so, wait to be notified another time:
+	txid = (response[0] << 8) + response[1];
+	for (entry = conn->queries; entry; entry = entry->intnext)
+		if (entry->dns.dsttxid == txid)
+			break;
+	if (!entry) {
+		debug_log(DEBUG_INFO, "event_tcp_int_response(): response with unknown txid %u\n", txid);
+		return;
+	}
+	if (!dns_packet_question_equal(entry->buffer, entry->packetsize, response, len)) {
+		debug_log(DEBUG_WARN, "event_tcp_int_response(): response is not answering our question\n");
+		return;
+	}
+
+	event_tcp_int_cancel(loop, entry);
+
+	debug_log(DEBUG_INFO, "event_tcp_int_response(): received entire packet from server, packetsize = %zu\n", len);
+
+	memcpy(entry->buffer, response, len);
+	entry->packetsize = len;
+
+	event_tcp_int_reply(loop, (event_entry_t *) entry);
+}
+
+static void event_tcp_int_read_cb(struct ev_loop *loop, ev_io *w, int revent) {
+	struct event_tcp_int_conn *conn = (struct event_tcp_int_conn *) w->data;
+	size_t pos, len;
+	ssize_t n;
+
+	if (!(revent & EV_READ))
+		return;
+
+	n = recv(w->fd, conn->inbuf + conn->inat, conn->insize - conn->inat, 0);
+	if (n < 1) {
+		if (n == -1) {
 			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
-			debug_log(DEBUG_WARN, "event_tcp_read_cb(): failed to receive TCP data\n");
+			debug_log(DEBUG_WARN, "event_tcp_int_read_cb(): failed to receive TCP data (%s)\n", strerror(errno));
 		} else {
-			debug_log(DEBUG_DEBUG, "event_tcp_read_cb(): EOF with recv() on TCP data (%s closed connection)\n",
-					internal ? "authoritative server" : "client");
+			debug_log(DEBUG_DEBUG, "event_tcp_int_read_cb(): authoritative server closed connection (%d in flight)\n", conn->inflight);
 		}
-		goto wrong;
+		if (conn->inflight)
+			event_tcp_int_fail(loop, conn);
+		else
+			event_tcp_int_close(loop, conn);
+		return;
+	}
+	conn->inat += n;
+
+	// The server is still alive:
+	conn->lastread = ev_now(loop);
+
+	// Responses may come in any order, and several at once:
+	pos = 0;
+	while (conn->inat - pos >= 2) {
+		len = (conn->inbuf[pos] << 8) + conn->inbuf[pos + 1];
+		if (len > global_ip_tcp_buffersize) {
+			debug_log(DEBUG_WARN, "event_tcp_int_read_cb(): about to receive a DNS TCP packet of %zu bytes, while we arranged a buffer of only %zu bytes\n",
+					len, global_ip_tcp_buffersize);
+			event_tcp_int_fail(loop, conn);
+			return;
+		}
+		if (conn->inat - pos < 2 + len)
+			break;
+		event_tcp_int_response(loop, conn, conn->inbuf + pos + 2, len);
+		pos += 2 + len;
 	}
 
-	debug_log(DEBUG_INFO, "event_tcp_read_cb(): received response of %zd byte(s) (bufferat = %zd)\n", packetlen, entry->bufferat);
+	if (pos) {
+		memmove(conn->inbuf, conn->inbuf + pos, conn->inat - pos);
+		conn->inat -= pos;
+	}
+}
 
-	entry->bufferat += packetlen;
+// Every query has its own response timeout. When the server sent nothing
+// since the oldest query that is due, the connection is broken, otherwise
+// only the queries that are due are redispatched (or given up on):
+static void event_tcp_int_timeout_cb(struct ev_loop *loop, ev_timer *w, int revent) {
+	struct event_tcp_int_conn *conn = (struct event_tcp_int_conn *) w->data;
+	struct event_tcp_entry *entry, *next, *oldest = NULL;
+	ev_tstamp deadline = ev_now(loop) - global_ip_internal_timeout;
+
+	if (conn->inflight) {
+		for (entry = conn->queries; entry; entry = entry->intnext)
+			if ((entry->intsent <= deadline) && (!oldest || (entry->intsent < oldest->intsent)))
+				oldest = entry;
+		if (!oldest) {
+			event_tcp_int_arm(loop, conn);
+			return;
+		}
+		if (conn->lastread < oldest->intsent) {
+			debug_log(DEBUG_INFO, "event_tcp_int_timeout_cb(): timeout while waiting for internal read\n");
+			event_tcp_int_fail(loop, conn);
+			return;
+		}
 
-	if (initial) {
-		if (entry->bufferat == 2) {
-			entry->packetsize = (entry->buffer[0] << 8) + entry->buffer[1];
-			if (entry->packetsize > entry->bufferlen) {
-				debug_log(DEBUG_WARN, "event_tcp_read_cb(): about to receive a DNS TCP packet of %zu bytes, while we arranged a buffer of only %zu bytes\n",
-						entry->packetsize, entry->bufferlen);
-				goto wrong;
-			}
-			debug_log(DEBUG_INFO, "event_tcp_read_cb(): about to receive a DNS TCP packet of %zu bytes\n",
-									entry->packetsize);
-			entry->bufferat = 0;
-			if (internal)
-				entry->state = EVENT_TCP_INT_READING_MORE;
-			else
-				entry->state = EVENT_TCP_EXT_READING_MORE;
+		for (entry = conn->queries; entry; entry = next) {
+			next = entry->intnext;
+			if (entry->intsent > deadline)
+				continue;
+			debug_log(DEBUG_INFO, "event_tcp_int_timeout_cb(): no response to query with id %u\n", entry->dns.dsttxid);
+			event_tcp_int_cancel(loop, entry);
+			event_tcp_int_redispatch(loop, entry);
 		}
-		ev_timer_again(loop, &entry->timeout_watcher);
-		return;
+		if (conn->inflight)
+			event_tcp_int_arm(loop, conn);
+	} else {
+		debug_log(DEBUG_DEBUG, "event_tcp_int_timeout_cb(): closing idle connection towards authoritative name server\n");
+		event_tcp_int_close(loop, conn);
 	}
+}
 
-	if (entry->bufferat < entry->packetsize) {
-		debug_log(DEBUG_DEBUG, "event_tcp_read_cb(): %s buffer not full yet, so waiting for next batch\n", internal ? "internal" : "external");
-		ev_timer_again(loop, &entry->timeout_watcher);
+void event_tcp_stats(int worker) {
+	debug_log(DEBUG_FATAL, "event_tcp_stats(): worker %d: %d upstream TCP connections open, %lu opened, %lu failed, %lu queries forwarded (%lu redispatched)\n",
+			worker, tcp_int_conns_count, tcp_counters.opened, tcp_counters.failed, tcp_counters.queries, tcp_counters.redispatched);
+}
+
+// Frees a client, once it is closed and nothing is in flight anymore:
+static void event_tcp_client_release(struct ev_loop *, struct event_tcp_client *);
+
+static void event_tcp_client_close(struct ev_loop *loop, struct event_tcp_client *client) {
+	struct event_tcp_entry *entry;
+
+	if (client->sock < 0)
 		return;
+
+	// Hold on to the client, as the answers below are released:
+	client->inflight++;
+
+	ev_io_stop(loop, &client->read_watcher);
+	ev_io_stop(loop, &client->write_watcher);
+	ev_timer_stop(loop, &client->timeout_watcher);
+	ip_tcp_close(client->sock);
+	client->sock = -1;
+
+	// Answers that were not written yet are thrown away, queries that are
+	// still waiting for the authoritative server are thrown away when done:
+	while ((entry = client->writehead)) {
+		client->writehead = entry->writenext;
+		event_cleanup_entry(loop, (event_entry_t *) entry);
 	}
+	client->writetail = NULL;
 
-	debug_log(DEBUG_INFO, "event_tcp_read_cb(): received entire packet from %s, packetsize = %zu\n",
-			internal ? "server" : "client", entry->packetsize);
+	if (event_tcp_number_connections-- == global_ip_tcp_max_number_connections)
+		event_tcp_startstop_watchers(loop, 1);
 
-	// Done with reading, so stop the watchers involved:
-	if (internal) {
-		// Stop listening on the internal connection:
-		ev_io_stop(loop, &entry->read_watcher);
-		ev_timer_stop(loop, &entry->timeout_watcher);
+	event_tcp_client_release(loop, client);
+}
 
-		// We received the answer from the authoritative name server,
-		// so close this connection:
-		ip_tcp_close(entry->intsock);
-		entry->intsock = -1;
+// Returns 1 when a complete query is waiting in the input buffer:
+static int event_tcp_client_pending(struct event_tcp_client *client) {
+	return (client->inat >= 2) && (client->inat >= 2 + (size_t) ((client->inbuf[0] << 8) + client->inbuf[1]));
+}
+
+static void event_tcp_client_release(struct ev_loop *loop, struct event_tcp_client *client) {
+	client->inflight--;
 
-		// Let's see what kind of packet we are dealing with:
-		if (!dns_analyze_reply_query(general_entry)) {
-			debug_log(DEBUG_WARN, "event_tcp_read_cb(): analyzing of DNS response failed\n");
-			goto wrong;
+	if (client->sock < 0) {
+		if (!client->inflight) {
+			free(client->inbuf);
+			free(client);
 		}
+		return;
+	}
+
+	if (!client->inflight && (client->failed || (client->eof && !event_tcp_client_pending(client)))) {
+		event_tcp_client_close(loop, client);
+		return;
+	}
+
+	// Below the limit again, so continue with the queries that are waiting:
+	if ((client->inflight < global_event_tcp_client_inflight) && !ev_is_active(&client->read_watcher) &&
+			(!client->eof || event_tcp_client_pending(client))) {
+		ev_io_start(loop, &client->read_watcher);
+		ev_feed_event(loop, &client->read_watcher, EV_READ);
+	}
+}
+
+// A query was thrown away (and so was its answer), which means we are done
+// with the client as soon as nothing else is in flight:
+void event_cleanup_tcp_entry(struct ev_loop *loop, struct event_tcp_entry *entry) {
+	struct event_tcp_client *client;
 
-		// Now forward the packet towards the authoritative name server:
-		if (!dns_reply_query_tcp(general_entry)) {
-			debug_log(DEBUG_WARN, "event_tcp_read_cb(): failed to reply the response towards the client\n");
-			goto wrong;
+	if (entry) {
+		client = entry->client;
+		event_tcp_int_cancel(loop, entry);
+		pool_put(&event_entry_pool, entry);
+		if (client) {
+			client->failed = 1;
+			event_tcp_client_release(loop, client);
 		}
+	}
+}
+
+// Frees a query of which the answer has been written:
+static void event_tcp_entry_done(struct ev_loop *loop, struct event_tcp_entry *entry) {
+	struct event_tcp_client *client = entry->client;
 
-		// We start to send data again, back to the client:
-		entry->state = EVENT_TCP_EXT_WRITING_INIT;
-		entry->bufferat = 0;
+	pool_put(&event_tcp_buffer_pool, entry->buffer);
+	pool_put(&event_entry_pool, entry);
+	event_tcp_client_release(loop, client);
+}
+
+static void event_tcp_client_queue(struct ev_loop *loop, struct event_tcp_entry *entry) {
+	struct event_tcp_client *client = entry->client;
+
+	// The client is gone already:
+	if (client->sock < 0) {
+		event_tcp_entry_done(loop, entry);
+		return;
+	}
+
+	entry->lenbuf[0] = entry->packetsize >> 8;
+	entry->lenbuf[1] = entry->packetsize & 0xff;
+	entry->writenext = NULL;
+	if (client->writetail)
+		client->writetail->writenext = entry;
+	else
+		client->writehead = entry;
+	client->writetail = entry;
+
+	if (!ev_is_active(&client->write_watcher)) {
+		ev_io_start(loop, &client->write_watcher);
+		ev_timer_again(loop, &client->timeout_watcher);
+	}
+}
 
-		ev_timer_set(&entry->timeout_watcher, 0., global_ip_tcp_external_timeout);
-		ev_io_set(&entry->write_watcher, entry->extsock, EV_WRITE);
-		ev_io_set(&entry->read_watcher, entry->extsock, EV_READ);
+void event_tcp_timeout_cb(struct ev_loop *loop, ev_timer *w, int revent) {
+	struct event_tcp_client *client = (struct event_tcp_client *) w->data;
 
-		ev_io_start(loop, &entry->write_watcher);
-		ev_timer_again(loop, &entry->timeout_watcher);
+	if (!(revent & EV_TIMEOUT))
+		return;
 
+	if (client->writehead) {
+		debug_log(DEBUG_INFO, "event_tcp_timeout_cb(): timeout while waiting for external write\n");
 	} else {
-		// Reading from client done, stop the watchers + timeout:
-		ev_io_stop(loop, &entry->read_watcher);
-		ev_timer_stop(loop, &entry->timeout_watcher);
-
-		// Let's see what kind of packet we are dealing with:
-		if (!dns_analyze_query(general_entry)) {
-			debug_log(DEBUG_WARN, "event_tcp_read_cb(): analyzing of DNS query failed\n");
-			goto wrong;
-		}
+		debug_log(DEBUG_INFO, "event_tcp_timeout_cb(): timeout while waiting for external read\n");
+	}
+
+	event_tcp_client_close(loop, client);
+}
 
-		// Now forward the packet towards the authoritative name server:
-		if (!dns_forward_query_tcp(general_entry)) {
-			debug_log(DEBUG_WARN, "event_tcp_read_cb(): failed to forward query towards authoritative name server\n");
-			goto wrong;
+void event_tcp_write_cb(struct ev_loop *loop, ev_io *w, int revent) {
+	struct event_tcp_client *client = (struct event_tcp_client *) w->data;
+	struct event_tcp_entry *entry;
+	struct iovec iov[EVENT_TCP_WRITE_BATCH * 2];
+	struct msghdr msg;
+	size_t left;
+	ssize_t buffersent;
+	int iovcnt = 0;
+
+	if (!(revent & EV_WRITE))
+		return;
+
+	// Gather as many answers as possible (each preceded by its length):
+	for (entry = client->writehead; entry && (iovcnt < EVENT_TCP_WRITE_BATCH * 2); entry = entry->writenext) {
+		iov[iovcnt].iov_base = entry->lenbuf;
+		iov[iovcnt++].iov_len = 2;
+		iov[iovcnt].iov_base = entry->buffer;
+		iov[iovcnt++].iov_len = entry->packetsize;
+	}
+	if (!iovcnt) {
+		ev_io_stop(loop, &client->write_watcher);
+		return;
+	}
+
+	// Skip what was written of the first one already:
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	if (client->writeat >= 2) {
+		msg.msg_iov++;
+		msg.msg_iovlen--;
+		msg.msg_iov[0].iov_base = (uint8_t *) msg.msg_iov[0].iov_base + (client->writeat - 2);
+		msg.msg_iov[0].iov_len -= client->writeat - 2;
+	} else {
+		msg.msg_iov[0].iov_base = (uint8_t *) msg.msg_iov[0].iov_base + client->writeat;
+		msg.msg_iov[0].iov_len -= client->writeat;
+	}
+
+	buffersent = sendmsg(client->sock, &msg, MSG_NOSIGNAL);
+	if (buffersent == -1) {
+		// As the socket is non-blocking, the kernel might not be ready, so stop and be notified again:
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+		debug_log(DEBUG_WARN, "event_tcp_write_cb(): writing on external TCP connection failed (%s)\n", strerror(errno));
+		event_tcp_client_close(loop, client);
+		return;
+	}
+
+	ev_timer_again(loop, &client->timeout_watcher);
+
+	// Hold on to the client, while the written answers are released:
+	client->inflight++;
+
+	while ((entry = client->writehead)) {
+		left = 2 + entry->packetsize - client->writeat;
+		if ((size_t) buffersent < left) {
+			client->writeat += buffersent;
+			break;
 		}
+		buffersent -= left;
+		client->writeat = 0;
+
+		debug_log(DEBUG_INFO, "event_tcp_write_cb(): we have sent the entire packet towards the client, packetsize = %zu\n", entry->packetsize);
+
+		client->writehead = entry->writenext;
+		if (!client->writehead)
+			client->writetail = NULL;
+		event_tcp_entry_done(loop, entry);
+	}
+
+	if (!client->writehead)
+		ev_io_stop(loop, &client->write_watcher);
+
+	event_tcp_client_release(loop, client);
+}
+
+// Handles a single query of a client:
+static void event_tcp_client_query(struct ev_loop *loop, struct event_tcp_client *client, uint8_t *query, size_t len) {
+	event_entry_t *general_entry = NULL;
+	struct event_tcp_entry *entry = NULL;
+
+	general_entry = (event_entry_t *) pool_get(&event_entry_pool);
+	if (!general_entry) {
+		client->failed = 1;
+		return;
+	}
+	memset(general_entry, 0, sizeof(event_entry_t));
+
+	entry = &general_entry->tcp;
+	entry->protocol = IP_PROTOCOL_TCP;
+	entry->client = client;
+	memcpy(&entry->address, &client->address, sizeof(anysin_t));
+	client->inflight++;
+
+	entry->buffer = (uint8_t *) pool_get(&event_tcp_buffer_pool);
+	if (!entry->buffer)
+		goto wrong;
+	entry->bufferlen = global_ip_tcp_buffersize;
+	memcpy(entry->buffer, query, len);
+	entry->packetsize = len;
+
+	debug_log(DEBUG_INFO, "event_tcp_read_cb(): received entire packet from client, packetsize = %zu\n", entry->packetsize);
+
+	event_tcp_client_forward(loop, general_entry);
+	return;
+
+wrong:
+	event_cleanup_entry(loop, general_entry);
+	return;
+}
 
-		// Now get ready for sending a TCP query towards the authoritative name server:
-		entry->state = EVENT_TCP_INT_WRITING_INIT;
-		entry->bufferat = 0;
+// Analyzes a query and forwards it, also when it is resumed once the
+// crypto threads computed its shared secret (see event_query_resume()):
+void event_tcp_client_forward(struct ev_loop *loop, event_entry_t *general_entry) {
+	// No need to bother the authoritative server for a client that is gone:
+	if (general_entry->tcp.client->sock < 0) {
+		event_cleanup_entry(loop, general_entry);
+		return;
+	}
+
+	// In pipeline mode, one of the crypto stages does the analysis:
+	if (event_pipeline_submit(general_entry, EVENT_PIPELINE_OPEN))
+		return;
+
+	// Let's see what kind of packet we are dealing with:
+	event_tcp_client_analyzed(loop, general_entry, dns_analyze_query(general_entry));
+}
+
+void event_tcp_client_analyzed(struct ev_loop *loop, event_entry_t *general_entry, int result) {
+	struct event_tcp_entry *entry = &general_entry->tcp;
+
+	// The client may have gone while a crypto stage had the query:
+	if (entry->client->sock < 0)
+		goto wrong;
 
-		ev_timer_set(&entry->timeout_watcher, 0., global_ip_internal_timeout);
-		ev_io_set(&entry->write_watcher, entry->intsock, EV_WRITE);
-		ev_io_set(&entry->read_watcher, entry->intsock, EV_READ);
+	if (!result) {
+		debug_log(DEBUG_WARN, "event_tcp_read_cb(): analyzing of DNS query failed\n");
+		goto wrong;
+	}
+	if (result == 2)
+		return;
 
-		ev_io_start(loop, &entry->write_watcher);
-		ev_timer_again(loop, &entry->timeout_watcher);
+	// Now queue the packet on one of the connections towards the authoritative
+	// name server (which takes care of the timeout as well):
+	entry->state = EVENT_TCP_INT_WRITING_INIT;
+	if (!dns_forward_query_tcp(general_entry)) {
+		debug_log(DEBUG_WARN, "event_tcp_read_cb(): failed to forward query towards authoritative name server\n");
+		goto wrong;
 	}
 
 	return;
@@ -364,30 +765,90 @@ wrong:
 	return;
 }
 
+void event_tcp_read_cb(struct ev_loop *loop, ev_io *w, int revent) {
+	struct event_tcp_client *client = (struct event_tcp_client *) w->data;
+	size_t pos = 0, len;
+	ssize_t packetlen;
+
+	if (!(revent & EV_READ))
+		return;
+
+	// Hold on to the client, while its queries are handled:
+	client->inflight++;
+
+	// There might be no room, when we are continuing with queries that were read before:
+	if (client->inat < client->insize) {
+		packetlen = recv(client->sock, client->inbuf + client->inat, client->insize - client->inat, 0);
+		if (packetlen == 0) {
+			debug_log(DEBUG_DEBUG, "event_tcp_read_cb(): EOF with recv() on TCP data (client closed connection)\n");
+			client->eof = 1;
+		} else if (packetlen == -1) {
+			// Our non-blocking socket, could not be ready, if so, just handle what we have:
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				debug_log(DEBUG_WARN, "event_tcp_read_cb(): failed to receive TCP data\n");
+				event_tcp_client_close(loop, client);
+				goto done;
+			}
+		} else {
+			debug_log(DEBUG_INFO, "event_tcp_read_cb(): received %zd byte(s) (bufferat = %zu)\n", packetlen, client->inat);
+			client->inat += packetlen;
+			ev_timer_again(loop, &client->timeout_watcher);
+		}
+	}
+
+	// Handle every complete query, as long as the limit allows for it
+	// (the hold above is not counted):
+	while ((client->sock >= 0) && (client->inflight - 1 < global_event_tcp_client_inflight) && (client->inat - pos >= 2)) {
+		len = (client->inbuf[pos] << 8) + client->inbuf[pos + 1];
+		if (len > global_ip_tcp_buffersize) {
+			debug_log(DEBUG_WARN, "event_tcp_read_cb(): about to receive a DNS TCP packet of %zu bytes, while we arranged a buffer of only %zu bytes\n",
+					len, global_ip_tcp_buffersize);
+			event_tcp_client_close(loop, client);
+			goto done;
+		}
+		if (client->inat - pos < 2 + len)
+			break;
+		event_tcp_client_query(loop, client, client->inbuf + pos + 2, len);
+		pos += 2 + len;
+	}
+
+	if (client->sock < 0)
+		goto done;
+
+	if (pos) {
+		memmove(client->inbuf, client->inbuf + pos, client->inat - pos);
+		client->inat -= pos;
+	}
+
+	// Stop reading when the client is done, or when it has enough queries in flight:
+	if (client->eof || (client->inflight - 1 >= global_event_tcp_client_inflight)) {
+		debug_log(DEBUG_DEBUG, "event_tcp_read_cb(): pausing reading from client (%d queries in flight)\n", client->inflight - 1);
+		ev_io_stop(loop, &client->read_watcher);
+	}
+
+done:
+	event_tcp_client_release(loop, client);
+}
+
 void event_tcp_accept_cb(struct ev_loop *loop, ev_io *w, int revent) {
-	event_entry_t *general_entry = NULL;
-	struct event_tcp_entry *entry = NULL;
+	struct event_tcp_client *client = NULL;
 	socklen_t addresslen = sizeof(anysin_t);
 
 	// We will get notified when there is an accept available, so
-	// set up an entry:
-	general_entry = (event_entry_t *) malloc(sizeof(event_entry_t));
-	if (!general_entry)
-		goto wrong;
-	memset(general_entry, 0, sizeof(event_entry_t));
-
-	entry = &general_entry->tcp;
+	// set up a client:
+	client = (struct event_tcp_client *) malloc(sizeof(struct event_tcp_client));
+	if (!client)
+		return;
+	memset(client, 0, sizeof(struct event_tcp_client));
 
 	// Now accept the TCP connection:
 	errno = 0;
-	entry->extsock = accept(w->fd, (struct sockaddr *) &entry->address.sa, &addresslen);
-	if (entry->extsock == -1) {
-		if (errno == EAGAIN) return;
-		debug_log(DEBUG_WARN, "event_tcp_accept_cb(): unable to accept TCP connection\n");
-		goto wrong;
-	} else if (errno) {
-		debug_log(DEBUG_WARN, "event_tcp_accept_cb(): unable to accept TCP connection (%s)\n", strerror(errno));
-		goto wrong;
+	client->sock = accept(w->fd, (struct sockaddr *) &client->address.sa, &addresslen);
+	if (client->sock == -1) {
+		if (errno != EAGAIN)
+			debug_log(DEBUG_WARN, "event_tcp_accept_cb(): unable to accept TCP connection (%s)\n", strerror(errno));
+		free(client);
+		return;
 	}
 
 	if (++event_tcp_number_connections >= global_ip_tcp_max_number_connections) {
@@ -396,39 +857,38 @@ void event_tcp_accept_cb(struct ev_loop *loop, ev_io *w, int revent) {
 	}
 
 	// We have a new connection, set up the buffer:
-	entry->buffer = (uint8_t *) malloc(global_ip_tcp_buffersize);
-	if (!entry->buffer)
+	client->insize = global_ip_tcp_buffersize + 2;
+	client->inbuf = (uint8_t *) malloc(client->insize);
+	if (!client->inbuf)
 		goto wrong;
-	memset(entry->buffer, 0, global_ip_tcp_buffersize);
-	entry->bufferlen = global_ip_tcp_buffersize;
 
-	entry->protocol = IP_PROTOCOL_TCP;
-	entry->state = EVENT_TCP_EXT_READING_INIT;
-	entry->intsock = -1;
+	if (!ip_nonblock(client->sock))
+		debug_log(DEBUG_WARN, "event_tcp_accept_cb(): unable to set socket non-blocking (%s)\n", strerror(errno));
 
-	// Set the general entry pointer in the watcher's data pointer:
-	entry->read_watcher.data = general_entry;
-	entry->write_watcher.data = general_entry;
-	entry->timeout_watcher.data = general_entry;
+	// Set the client pointer in the watcher's data pointer:
+	client->read_watcher.data = client;
+	client->write_watcher.data = client;
+	client->timeout_watcher.data = client;
 
 	// Initialize the timers (for timeouts), and the i/o watchers for the external socket:
-	ev_timer_init(&entry->timeout_watcher, event_tcp_timeout_cb, 0., global_ip_tcp_external_timeout);
-	ev_io_init(&entry->write_watcher, event_tcp_write_cb, entry->extsock, EV_WRITE);
-	ev_io_init(&entry->read_watcher, event_tcp_read_cb, entry->extsock, EV_READ);
+	ev_timer_init(&client->timeout_watcher, event_tcp_timeout_cb, 0., global_ip_tcp_external_timeout);
+	ev_io_init(&client->write_watcher, event_tcp_write_cb, client->sock, EV_WRITE);
+	ev_io_init(&client->read_watcher, event_tcp_read_cb, client->sock, EV_READ);
 
 	if (debug_level >= DEBUG_INFO) {
 		char s[52];
-		ip_address_total_string(&entry->address, s, sizeof(s));
+		ip_address_total_string(&client->address, s, sizeof(s));
 		debug_log(DEBUG_INFO, "event_tcp_accept_cb(): received TCP DNS request from %s\n", s);
 	}
 
 	// Now start the read watcher and an associated timeout:
-	ev_io_start(loop, &entry->read_watcher);
-	ev_timer_again(loop, &entry->timeout_watcher);
+	ev_io_start(loop, &client->read_watcher);
+	ev_timer_again(loop, &client->timeout_watcher);
 
 	return;
 
 wrong:
-	event_cleanup_entry(loop, general_entry);
+	// Closing takes care of the connection counter, and frees the client:
+	event_tcp_client_close(loop, client);
 	return;
 }
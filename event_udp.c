@@ -34,18 +34,198 @@
  * $Revision$
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE			/* recvmmsg(), sendmmsg() */
+#define EVENT_UDP_MMSG
+#endif
+
 #include "event.h"
 #include "dns.h"
+#include "dnscurve.h"
+#include "misc.h"
+
+// Maximum number of datagrams handled in one go (see CURVEDNS_UDP_BATCH):
+int global_event_udp_batch = 32;
+
+// Replies are queued and flushed once per loop iteration (per worker):
+static __thread event_entry_t **udp_queue = NULL;
+static __thread int udp_queue_count = 0;
+static __thread ev_prepare udp_flush_watcher;
+
+// Received entries that were prepared, but not used by the last batch:
+static __thread event_entry_t **udp_spare = NULL;
+static __thread int udp_spare_count = 0;
+
+#ifdef EVENT_UDP_MMSG
+static __thread struct mmsghdr *udp_msgs = NULL;
+static __thread struct iovec *udp_iovecs = NULL;
+#endif
+
+// Batch size counters, the histograms are indexed by log2(batch size):
+#define EVENT_UDP_HISTOGRAM	11
+struct event_udp_counters {
+	unsigned long recv_calls, recv_packets;
+	unsigned long send_calls, send_packets;
+	unsigned long int_recv, int_dropped;
+	unsigned long seal_calls, seal_replies;
+	unsigned long recv_histogram[EVENT_UDP_HISTOGRAM];
+	unsigned long send_histogram[EVENT_UDP_HISTOGRAM];
+};
+static __thread struct event_udp_counters udp_counters;
+
+static int event_udp_log2(int n) {
+	int i = 0;
+	while ((n >>= 1) && (i < EVENT_UDP_HISTOGRAM - 1))
+		i++;
+	return i;
+}
+
+// Pool of long-lived, randomly bound sockets towards the authoritative name
+// server (see CURVEDNS_UDP_SOCKETS), of which one is replaced every
+// CURVEDNS_UDP_ROTATE / CURVEDNS_UDP_SOCKETS seconds:
+int global_event_udp_sockets = 16;
+ev_tstamp global_event_udp_rotate = 60.;
+
+static __thread struct event_udp_int_socket **udp_int_sockets = NULL;
+static __thread int udp_int_rotate_next = 0;
+static __thread ev_timer udp_int_rotate_watcher;
+
+// Queries in flight, indexed by TXID (which is unique per socket):
+#define EVENT_UDP_INFLIGHT	65536
+static __thread struct event_udp_entry **udp_inflight = NULL;
+
+// Responses are received in here, before the matching entry is known:
+static __thread uint8_t *udp_int_buffer = NULL;
+
+static struct event_udp_int_socket *event_udp_int_open(struct ev_loop *loop) {
+	struct event_udp_int_socket *intsock;
+	int sock;
+
+	if (!ip_udp_open(&sock, &global_target_address)) {
+		debug_log(DEBUG_ERROR, "event_udp_int_open(): unable to open a UDP socket towards authoritative server\n");
+		return NULL;
+	}
+
+	// randomize the outgoing source port and set the source IP address, if needed
+	if (!ip_bind_random(sock)) {
+		// if this fails, let the kernel handle it (would mean source IP address is not guaranteed...)
+		debug_log(DEBUG_WARN, "event_udp_int_open(): unable to bind to source IP address and/or random port\n");
+	}
+
+	intsock = (struct event_udp_int_socket *) malloc(sizeof(struct event_udp_int_socket));
+	if (!intsock) {
+		close(sock);
+		return NULL;
+	}
+	memset(intsock, 0, sizeof(struct event_udp_int_socket));
+
+	intsock->watcher.data = intsock;
+	ev_io_init(&intsock->watcher, event_udp_int_cb, sock, EV_READ);
+	if (!event_uring_enabled || !event_uring_recv_int(intsock))
+		ev_io_start(loop, &intsock->watcher);
+
+	return intsock;
+}
+
+// Closes a retired socket, once nobody is waiting on it anymore:
+static void event_udp_int_release(struct ev_loop *loop, struct event_udp_int_socket *intsock) {
+	if (!intsock->retired || intsock->inflight || intsock->closing)
+		return;
+
+	// The io_uring engine first has to get rid of the pending receive, the
+	// socket is closed once it is gone (see event_uring_complete_recv()):
+	if (event_uring_enabled && !ev_is_active(&intsock->watcher)) {
+		intsock->closing = 1;
+		event_uring_cancel_int(intsock);
+		return;
+	}
+
+	event_udp_int_closed(loop, intsock);
+}
+
+void event_udp_int_closed(struct ev_loop *loop, struct event_udp_int_socket *intsock) {
+	ev_io_stop(loop, &intsock->watcher);
+	close(intsock->watcher.fd);
+	free(intsock);
+}
+
+// Picks one of the sockets for an entry, and generates a TXID that is not
+// yet in use on that socket:
+int event_udp_int_attach(struct ev_loop *loop, event_entry_t *general_entry) {
+	struct event_udp_entry *entry = &general_entry->udp, *other;
+	struct event_udp_int_socket *intsock;
+	unsigned int txid;
+	int tries;
+
+	intsock = udp_int_sockets[misc_crypto_random(global_event_udp_sockets)];
+
+	for (tries = 0; tries < 16; tries++) {
+		txid = misc_crypto_random(EVENT_UDP_INFLIGHT);
+		for (other = udp_inflight[txid]; other; other = other->inflightnext)
+			if (other->intsock == intsock)
+				break;
+		if (!other)
+			break;
+	}
+	if (tries == 16) {
+		debug_log(DEBUG_WARN, "event_udp_int_attach(): unable to find an unused TXID\n");
+		return 0;
+	}
+
+	entry->dns.dsttxid = txid;
+	entry->intsock = intsock;
+	entry->inflightnext = udp_inflight[txid];
+	udp_inflight[txid] = entry;
+	intsock->inflight++;
+
+	return 1;
+}
+
+static void event_udp_int_detach(struct ev_loop *loop, struct event_udp_entry *entry) {
+	struct event_udp_entry **p;
+	struct event_udp_int_socket *intsock = entry->intsock;
+
+	if (!intsock)
+		return;
+
+	for (p = &udp_inflight[entry->dns.dsttxid]; *p; p = &(*p)->inflightnext) {
+		if (*p == entry) {
+			*p = entry->inflightnext;
+			break;
+		}
+	}
+	entry->inflightnext = NULL;
+	entry->intsock = NULL;
+
+	intsock->inflight--;
+	event_udp_int_release(loop, intsock);
+}
+
+static void event_udp_rotate_cb(struct ev_loop *loop, ev_timer *w, int revent) {
+	struct event_udp_int_socket *intsock, *old;
+
+	intsock = event_udp_int_open(loop);
+	if (!intsock) {
+		// Keep on using the old one, we'll try again next time:
+		debug_log(DEBUG_WARN, "event_udp_rotate_cb(): unable to open replacement socket\n");
+		return;
+	}
+
+	old = udp_int_sockets[udp_int_rotate_next];
+	udp_int_sockets[udp_int_rotate_next] = intsock;
+	udp_int_rotate_next = (udp_int_rotate_next + 1) % global_event_udp_sockets;
+
+	// Responses to queries still in flight are accepted until they are done:
+	old->retired = 1;
+	event_udp_int_release(loop, old);
+}
 
 void event_cleanup_udp_entry(struct ev_loop *loop, struct event_udp_entry *entry) {
 	if (entry) {
-		if (ev_is_active(&entry->read_int_watcher))
-			ev_io_stop(loop, &entry->read_int_watcher);
-		if (entry->read_int_watcher.fd >= 0)
-			close(entry->read_int_watcher.fd);
+		event_udp_int_detach(loop, entry);
 		if (ev_is_active(&entry->timeout_int_watcher))
 			ev_timer_stop(loop, &entry->timeout_int_watcher);
-		free(entry);
+		pool_put(&event_entry_pool, entry);
 	}
 }
 
@@ -64,14 +244,9 @@ void event_udp_timeout_cb(struct ev_loop *loop, ev_timer *w, int revent) {
 		goto wrong;
 	}
 
-	// If not, close down the socket, i/o watcher and timeout, and try to send it again:
-	ev_io_stop(loop, &entry->read_int_watcher);
+	// If not, forget about the old TXID and try to send it again (on a new socket and TXID):
 	ev_timer_stop(loop, &entry->timeout_int_watcher);
-
-	if (entry->read_int_watcher.fd >= 0) {
-		close(entry->read_int_watcher.fd);
-		entry->read_int_watcher.fd = -1;
-	}
+	event_udp_int_detach(loop, entry);
 
 	if (!dns_forward_query_udp(general_entry)) {
 		debug_log(DEBUG_WARN, "event_udp_timeout_cb(): unable to resend query to authoritative server\n");
@@ -85,123 +260,381 @@ wrong:
 	return;
 }
 
-void event_udp_int_cb(struct ev_loop *loop, ev_io *w, int revent) {
-	event_entry_t *general_entry = (event_entry_t *) w->data;
-	struct event_udp_entry *entry = (struct event_udp_entry *) &general_entry->udp;
-	int n;
-	anysin_t address;
-	socklen_t addresslen = sizeof(anysin_t);
-
-	if (!(revent & EV_READ))
-		goto wrong;
-	if (general_entry->general.protocol != IP_PROTOCOL_UDP)
+static void event_udp_int_reply(struct ev_loop *loop, event_entry_t *general_entry) {
+	// Now analyze the query (i.e. is it the right one?):
+	if (!dns_analyze_reply_query(general_entry)) {
+		debug_log(DEBUG_WARN, "event_udp_int_cb(): failed to analyze the reply\n");
 		goto wrong;
-	if (entry->state != EVENT_UDP_INT_WRITING)
+	}
+
+	// In pipeline mode, one of the crypto stages seals it:
+	if (event_pipeline_submit(general_entry, EVENT_PIPELINE_SEAL))
+		return;
+
+	// Send the reply through UDP (the entry is cleared once it has been flushed):
+	if (!dns_reply_query_udp(general_entry)) {
+		debug_log(DEBUG_WARN, "event_udp_int_cb(): failed to send the reply\n");
 		goto wrong;
+	}
 
-	// We will only receive one UDP packet, and stop the (timeout) watcher:
-	ev_timer_stop(loop, &entry->timeout_int_watcher);
-	ev_io_stop(loop, &entry->read_int_watcher);
+	return;
 
-	entry->state = EVENT_UDP_INT_READING;
+wrong:
+	event_cleanup_entry(loop, general_entry);
+	return;
+}
 
-	n = recvfrom(w->fd, entry->buffer, global_ip_udp_buffersize, MSG_DONTWAIT,
-			(struct sockaddr *) &address.sa, &addresslen);
-	if (n == -1) {
-		// The ready for reading event will again be triggered...
-		return;
+// Sends a reply that was sealed by one of the crypto stages:
+void event_udp_int_sealed(struct ev_loop *loop, event_entry_t *general_entry, int result) {
+	if (!result) {
+		debug_log(DEBUG_WARN, "event_udp_int_cb(): failed to send the reply\n");
+		goto wrong;
 	}
 
-	entry->packetsize = n;
+	general_entry->udp.state = EVENT_UDP_EXT_WRITING;
+	if (!event_udp_queue_reply(loop, general_entry))
+		goto wrong;
 
-	// We can also close the socket towards the authoritative name server, as we are done:
-	if (entry->read_int_watcher.fd >= 0) {
-		close(entry->read_int_watcher.fd);
-		entry->read_int_watcher.fd = -1;
-	}
+	return;
+
+wrong:
+	event_cleanup_entry(loop, general_entry);
+	return;
+}
+
+// Handles a single response of the authoritative name server:
+void event_udp_int_datagram(struct ev_loop *loop, struct event_udp_int_socket *intsock, uint8_t *response, size_t len, anysin_t *address) {
+	struct event_udp_entry *entry;
+	unsigned int txid;
+
+	udp_counters.int_recv++;
 
 	// Check if the response really came from our target server:
-	if (ip_compare_address(&address, &global_target_address) != 0) {
+	if (ip_compare_address(address, &global_target_address) != 0) {
 		char s[52];
-		ip_address_total_string(&address, s, sizeof(s));
+		ip_address_total_string(address, s, sizeof(s));
 		debug_log(DEBUG_WARN, "event_udp_int_cb(): response is not coming from target address, but from %s\n", s);
-		goto wrong;
+		goto drop;
 	}
 
 	// And the same goes for the port:
-	if (ip_compare_port(&address, &global_target_address) != 0) {
+	if (ip_compare_port(address, &global_target_address) != 0) {
 		debug_log(DEBUG_WARN, "event_udp_int_cb(): response is not coming from target address port\n");
-		goto wrong;
+		goto drop;
 	}
 
-	// Now analyze the query (i.e. is it the right one?):
-	if (!dns_analyze_reply_query(general_entry)) {
-		debug_log(DEBUG_WARN, "event_udp_int_cb(): failed to analyze the reply\n");
-		goto wrong;
+	if (len < 12) {
+		debug_log(DEBUG_INFO, "event_udp_int_cb(): received response is too small (no DNS header)\n");
+		goto drop;
 	}
 
-	// Send the reply through UDP:
-	if (!dns_reply_query_udp(general_entry)) {
-		debug_log(DEBUG_WARN, "event_udp_int_cb(): failed to send the reply\n");
-		goto wrong;
+	// Find the query that was sent on this socket with this TXID:
+	txid = (response[0] << 8) + response[1];
+	for (entry = udp_inflight[txid]; entry; entry = entry->inflightnext)
+		if (entry->intsock == intsock)
+			break;
+	if (!entry) {
+		debug_log(DEBUG_INFO, "event_udp_int_cb(): response with unknown txid %u\n", txid);
+		goto drop;
 	}
 
-wrong:
+	// A spoofed response is dropped, without giving up on the real one:
+	if (!dns_packet_question_equal(entry->buffer, entry->packetsize, response, len)) {
+		debug_log(DEBUG_WARN, "event_udp_int_cb(): response is not answering our question\n");
+		goto drop;
+	}
 
-	// And since we're now done, clear the memory:
-	event_cleanup_entry(loop, general_entry);
+	// Make sure a retired socket is not closed while we are still using it:
+	intsock->inflight++;
 
+	ev_timer_stop(loop, &entry->timeout_int_watcher);
+	event_udp_int_detach(loop, entry);
+
+	entry->state = EVENT_UDP_INT_READING;
+	memcpy(entry->buffer, response, len);
+	entry->packetsize = len;
+
+	event_udp_int_reply(loop, (event_entry_t *) entry);
+
+	intsock->inflight--;
+	event_udp_int_release(loop, intsock);
 	return;
+
+drop:
+	udp_counters.int_dropped++;
 }
 
-void event_udp_ext_cb(struct ev_loop *loop, ev_io *w, int revent) {
-	struct ip_socket_t *sock = (struct ip_socket_t *) w->data;
-	event_entry_t *general_entry = NULL;
-	struct event_udp_entry *entry = NULL;
-	ssize_t n;
-	socklen_t addresslen = sizeof(anysin_t);
+void event_udp_int_cb(struct ev_loop *loop, ev_io *w, int revent) {
+	struct event_udp_int_socket *intsock = (struct event_udp_int_socket *) w->data;
+	anysin_t address;
+	socklen_t addresslen;
+	int i, n;
 
 	if (!(revent & EV_READ))
 		return;
 
-	general_entry = (event_entry_t *) malloc(sizeof(event_entry_t));
+	// Make sure a retired socket is not closed while we are still reading from it:
+	intsock->inflight++;
+
+	for (i = 0; i < global_event_udp_batch; i++) {
+		addresslen = sizeof(anysin_t);
+		n = recvfrom(w->fd, udp_int_buffer, global_ip_udp_buffersize, MSG_DONTWAIT,
+				(struct sockaddr *) &address.sa, &addresslen);
+		if (n == -1)
+			break;
+		event_udp_int_datagram(loop, intsock, udp_int_buffer, n, &address);
+	}
+
+	intsock->inflight--;
+	event_udp_int_release(loop, intsock);
+}
+
+// Seals the queued DNSCurve replies all at once (see crypto_multibox.h), and
+// puts them in the format of their queries:
+static void event_udp_seal(struct ev_loop *loop) {
+	event_entry_t **sealing = udp_spare + udp_spare_count;
+	int i, count = 0;
+
+	for (i = 0; i < udp_queue_count; i++)
+		if (udp_queue[i] && (udp_queue[i]->udp.state == EVENT_UDP_EXT_SEALING))
+			sealing[count++] = udp_queue[i];
+	if (!count)
+		return;
+
+	dnscurve_reply_seal(sealing, count);
+	udp_counters.seal_calls++;
+	udp_counters.seal_replies += count;
+
+	for (i = 0; i < udp_queue_count; i++) {
+		if (!udp_queue[i] || (udp_queue[i]->udp.state != EVENT_UDP_EXT_SEALING))
+			continue;
+		if (!dnscurve_reply_finish(udp_queue[i])) {
+			debug_log(DEBUG_WARN, "event_udp_seal(): failed to finish the reply\n");
+			event_cleanup_entry(loop, udp_queue[i]);
+			udp_queue[i] = NULL;
+			continue;
+		}
+		udp_queue[i]->udp.state = EVENT_UDP_EXT_WRITING;
+	}
+}
+
+static void event_udp_flush(struct ev_loop *loop) {
+	struct event_udp_entry *entry;
+	struct ip_socket_t *sock;
+	int i, j, count, sent, n;
+	socklen_t addresslen;
+
+	event_udp_seal(loop);
+
+	// Every listening socket gets its own batch:
+	for (i = 0; i < udp_queue_count; i++) {
+		if (!udp_queue[i])
+			continue;
+		sock = udp_queue[i]->udp.sock;
+
+		count = 0;
+		for (j = i; j < udp_queue_count; j++) {
+			if (!udp_queue[j] || (udp_queue[j]->udp.sock != sock))
+				continue;
+			entry = &udp_queue[j]->udp;
+			addresslen = (entry->address.sa.sa_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+#ifdef EVENT_UDP_MMSG
+			udp_iovecs[count].iov_base = entry->buffer;
+			udp_iovecs[count].iov_len = entry->packetsize;
+			memset(&udp_msgs[count], 0, sizeof(struct mmsghdr));
+			udp_msgs[count].msg_hdr.msg_name = &entry->address.sa;
+			udp_msgs[count].msg_hdr.msg_namelen = addresslen;
+			udp_msgs[count].msg_hdr.msg_iov = &udp_iovecs[count];
+			udp_msgs[count].msg_hdr.msg_iovlen = 1;
+			udp_spare[udp_spare_count + count] = udp_queue[j];
+			if (event_uring_enabled) {
+				// The ring sends it, and cleans up the entry once it is done:
+				entry->iov = udp_iovecs[count];
+				entry->msg = udp_msgs[count].msg_hdr;
+				entry->msg.msg_iov = &entry->iov;
+				if (event_uring_send(udp_queue[j])) {
+					udp_queue[j] = NULL;
+					continue;
+				}
+			}
+#else
+			n = sendto(sock->fd, entry->buffer, entry->packetsize, MSG_DONTWAIT,
+					(struct sockaddr *) &entry->address.sa, addresslen);
+			if (n == -1)
+				debug_log(DEBUG_ERROR, "event_udp_flush(): unable to send the response to the client (%s)\n", strerror(errno));
+			event_cleanup_entry(loop, udp_queue[j]);
+#endif
+			udp_queue[j] = NULL;
+			count++;
+		}
+
+#ifdef EVENT_UDP_MMSG
+		sent = 0;
+		if (!count)
+			continue;
+		while (sent < count) {
+			n = sendmmsg(sock->fd, udp_msgs + sent, count - sent, MSG_DONTWAIT);
+			udp_counters.send_calls++;
+			if (n < 1) {
+				// Skip the message that failed, and try the rest:
+				debug_log(DEBUG_ERROR, "event_udp_flush(): unable to send the response to the client (%s)\n", strerror(errno));
+				sent++;
+				continue;
+			}
+			udp_counters.send_histogram[event_udp_log2(n)]++;
+			udp_counters.send_packets += n;
+			sent += n;
+		}
+		for (j = 0; j < count; j++)
+			event_cleanup_entry(loop, udp_spare[udp_spare_count + j]);
+#else
+		(void) sent;
+		udp_counters.send_calls += count;
+		udp_counters.send_packets += count;
+		udp_counters.send_histogram[0] += count;
+#endif
+	}
+
+	udp_queue_count = 0;
+
+	if (event_uring_enabled)
+		event_uring_submit();
+}
+
+static void event_udp_flush_cb(struct ev_loop *loop, ev_prepare *w, int revent) {
+	ev_prepare_stop(loop, w);
+	event_udp_flush(loop);
+}
+
+// Queues a reply, to be sent (together with the other replies of this loop
+// iteration) right before the loop goes waiting for new events:
+int event_udp_queue_reply(struct ev_loop *loop, event_entry_t *general_entry) {
+	if (udp_queue_count >= global_event_udp_batch)
+		event_udp_flush(loop);
+	udp_queue[udp_queue_count++] = general_entry;
+	if (!ev_is_active(&udp_flush_watcher))
+		ev_prepare_start(loop, &udp_flush_watcher);
+	return 1;
+}
+
+// Allocates the per worker queues and sockets, must be called by every worker:
+int event_udp_init(struct ev_loop *loop) {
+	int i;
+
+	// The spare array doubles as scratch space during a flush:
+	udp_spare = (event_entry_t **) calloc(global_event_udp_batch * 2, sizeof(event_entry_t *));
+	udp_queue = (event_entry_t **) calloc(global_event_udp_batch, sizeof(event_entry_t *));
+	if (!udp_spare || !udp_queue)
+		goto wrong;
+#ifdef EVENT_UDP_MMSG
+	udp_msgs = (struct mmsghdr *) calloc(global_event_udp_batch, sizeof(struct mmsghdr));
+	udp_iovecs = (struct iovec *) calloc(global_event_udp_batch, sizeof(struct iovec));
+	if (!udp_msgs || !udp_iovecs)
+		goto wrong;
+#endif
+	udp_spare_count = 0;
+	udp_queue_count = 0;
+	memset(&udp_counters, 0, sizeof(udp_counters));
+	ev_prepare_init(&udp_flush_watcher, event_udp_flush_cb);
+
+	udp_inflight = (struct event_udp_entry **) calloc(EVENT_UDP_INFLIGHT, sizeof(struct event_udp_entry *));
+	udp_int_buffer = (uint8_t *) malloc(global_ip_udp_buffersize);
+	udp_int_sockets = (struct event_udp_int_socket **) calloc(global_event_udp_sockets, sizeof(struct event_udp_int_socket *));
+	if (!udp_inflight || !udp_int_buffer || !udp_int_sockets)
+		goto wrong;
+
+	for (i = 0; i < global_event_udp_sockets; i++) {
+		udp_int_sockets[i] = event_udp_int_open(loop);
+		if (!udp_int_sockets[i]) {
+			debug_log(DEBUG_ERROR, "event_udp_init(): unable to open sockets towards authoritative server\n");
+			return 0;
+		}
+	}
+
+	// Spread the rotation, so only one socket is replaced at a time:
+	udp_int_rotate_next = 0;
+	if (global_event_udp_rotate > 0.) {
+		ev_timer_init(&udp_int_rotate_watcher, event_udp_rotate_cb,
+				global_event_udp_rotate / global_event_udp_sockets, global_event_udp_rotate / global_event_udp_sockets);
+		ev_timer_start(loop, &udp_int_rotate_watcher);
+	}
+
+	return 1;
+
+wrong:
+	debug_log(DEBUG_ERROR, "event_udp_init(): unable to allocate memory for UDP batches\n");
+	return 0;
+}
+
+void event_udp_stats(int worker) {
+	char histogram[EVENT_UDP_HISTOGRAM * 24];
+	int i, len;
+
+	debug_log(DEBUG_FATAL, "event_udp_stats(): worker %d: received %lu datagrams in %lu calls, sent %lu datagrams in %lu calls\n",
+			worker, udp_counters.recv_packets, udp_counters.recv_calls, udp_counters.send_packets, udp_counters.send_calls);
+	debug_log(DEBUG_FATAL, "event_udp_stats(): worker %d: received %lu responses on %d upstream sockets, of which %lu dropped\n",
+			worker, udp_counters.int_recv, global_event_udp_sockets, udp_counters.int_dropped);
+	debug_log(DEBUG_FATAL, "event_udp_stats(): worker %d: sealed %lu DNSCurve replies in %lu batches\n",
+			worker, udp_counters.seal_replies, udp_counters.seal_calls);
+
+	for (len = 0, i = 0; i < EVENT_UDP_HISTOGRAM; i++)
+		len += snprintf(histogram + len, sizeof(histogram) - len, " %d:%lu", 1 << i, udp_counters.recv_histogram[i]);
+	debug_log(DEBUG_FATAL, "event_udp_stats(): worker %d: receive batch sizes (>=):%s\n", worker, histogram);
+
+	for (len = 0, i = 0; i < EVENT_UDP_HISTOGRAM; i++)
+		len += snprintf(histogram + len, sizeof(histogram) - len, " %d:%lu", 1 << i, udp_counters.send_histogram[i]);
+	debug_log(DEBUG_FATAL, "event_udp_stats(): worker %d: send batch sizes (>=):%s\n", worker, histogram);
+}
+
+static event_entry_t *event_udp_new_entry(struct ip_socket_t *sock) {
+	event_entry_t *general_entry = NULL;
+	struct event_udp_entry *entry = NULL;
+
+	general_entry = (event_entry_t *) pool_get(&event_entry_pool);
 	if (!general_entry)
 		goto wrong;
 	memset(general_entry, 0, sizeof(event_entry_t));
 
+	// Only the received bytes of the buffer are ever looked at, so no need to clear it:
 	entry = &general_entry->udp;
 	entry->protocol = IP_PROTOCOL_UDP;
-	entry->buffer = (uint8_t *) malloc(global_ip_udp_buffersize);
+	entry->buffer = (uint8_t *) pool_get(&event_udp_buffer_pool);
 	if (!entry->buffer)
 		goto wrong;
 	entry->bufferlen = global_ip_udp_buffersize;
-	memset(entry->buffer, 0, entry->bufferlen);
 
 	entry->retries = 0;
 	entry->sock = sock;
 	entry->state = EVENT_UDP_EXT_READING;
-	entry->read_int_watcher.fd = -1;
-
-	n = recvfrom(w->fd, entry->buffer, entry->bufferlen, MSG_DONTWAIT,
-			(struct sockaddr *) &entry->address.sa, &addresslen);
-	if (n == -1) {
-		// YYY: maybe an overlap
-		goto wrong;
-	}
 
-	entry->packetsize = n;
+	return general_entry;
 
-	if (debug_level >= DEBUG_INFO) {
-		char s[52];
-		ip_address_total_string(&entry->address, s, sizeof(s));
-		debug_log(DEBUG_INFO, "event_udp_ext_cb(): received UDP query from %s\n", s);
+wrong:
+	if (general_entry) {
+		pool_put(&event_udp_buffer_pool, general_entry->udp.buffer);
+		pool_put(&event_entry_pool, general_entry);
 	}
+	return NULL;
+}
+
+// Analyzes a query and forwards it, also when it is resumed once the
+// crypto threads computed its shared secret (see event_query_resume()):
+void event_udp_ext_forward(struct ev_loop *loop, event_entry_t *general_entry) {
+	// In pipeline mode, one of the crypto stages does the analysis:
+	if (event_pipeline_submit(general_entry, EVENT_PIPELINE_OPEN))
+		return;
 
 	// Start analyzing the query (is it malformed, or not?):
-	if (!dns_analyze_query(general_entry)) {
+	event_udp_ext_analyzed(loop, general_entry, dns_analyze_query(general_entry));
+}
+
+void event_udp_ext_analyzed(struct ev_loop *loop, event_entry_t *general_entry, int result) {
+	if (!result) {
 		debug_log(DEBUG_WARN, "event_udp_ext_cb(): analyzing of query failed\n");
 		goto wrong;
 	}
+	if (result == 2)
+		return;
 
 	// Now forward the query (through UDP) towards the authoritative name server:
 	if (!dns_forward_query_udp(general_entry)) {
@@ -215,3 +648,105 @@ wrong:
 	event_cleanup_entry(loop, general_entry);
 	return;
 }
+
+static void event_udp_ext_query(struct ev_loop *loop, event_entry_t *general_entry) {
+	struct event_udp_entry *entry = &general_entry->udp;
+
+	if (debug_level >= DEBUG_INFO) {
+		char s[52];
+		ip_address_total_string(&entry->address, s, sizeof(s));
+		debug_log(DEBUG_INFO, "event_udp_ext_cb(): received UDP query from %s\n", s);
+	}
+
+	event_udp_ext_forward(loop, general_entry);
+}
+
+void event_udp_ext_cb(struct ev_loop *loop, ev_io *w, int revent) {
+	struct ip_socket_t *sock = (struct ip_socket_t *) w->data;
+	event_entry_t *general_entry = NULL;
+	struct event_udp_entry *entry = NULL;
+	int i, n;
+
+	if (!(revent & EV_READ))
+		return;
+
+	// Make sure there is an entry for every datagram we might receive:
+	while (udp_spare_count < global_event_udp_batch) {
+		general_entry = event_udp_new_entry(sock);
+		if (!general_entry)
+			break;
+		udp_spare[udp_spare_count++] = general_entry;
+	}
+	if (!udp_spare_count)
+		return;
+
+#ifdef EVENT_UDP_MMSG
+	// Message i goes into the i-th entry from the back (see below):
+	for (i = 0; i < udp_spare_count; i++) {
+		entry = &udp_spare[udp_spare_count - 1 - i]->udp;
+		udp_iovecs[i].iov_base = entry->buffer;
+		udp_iovecs[i].iov_len = entry->bufferlen;
+		memset(&udp_msgs[i], 0, sizeof(struct mmsghdr));
+		udp_msgs[i].msg_hdr.msg_name = &entry->address.sa;
+		udp_msgs[i].msg_hdr.msg_namelen = sizeof(anysin_t);
+		udp_msgs[i].msg_hdr.msg_iov = &udp_iovecs[i];
+		udp_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	n = recvmmsg(w->fd, udp_msgs, udp_spare_count, MSG_DONTWAIT, NULL);
+	udp_counters.recv_calls++;
+	if (n < 1) {
+		// YYY: maybe an overlap
+		return;
+	}
+	for (i = 0; i < n; i++)
+		udp_spare[udp_spare_count - 1 - i]->udp.packetsize = udp_msgs[i].msg_len;
+#else
+	for (n = 0; n < udp_spare_count; n++) {
+		socklen_t addresslen = sizeof(anysin_t);
+		ssize_t len;
+		entry = &udp_spare[udp_spare_count - 1 - n]->udp;
+		len = recvfrom(w->fd, entry->buffer, entry->bufferlen, MSG_DONTWAIT,
+				(struct sockaddr *) &entry->address.sa, &addresslen);
+		if (len == -1)
+			break;
+		entry->packetsize = len;
+	}
+	udp_counters.recv_calls++;
+	if (!n)
+		return;
+#endif
+
+	udp_counters.recv_packets += n;
+	udp_counters.recv_histogram[event_udp_log2(n)]++;
+
+	// Handle every received datagram, the entries are taken from the back:
+	for (i = 0; i < n; i++) {
+		general_entry = udp_spare[--udp_spare_count];
+		general_entry->udp.sock = sock;
+		event_udp_ext_query(loop, general_entry);
+	}
+}
+
+// Handles a single query that was received by the io_uring engine:
+void event_udp_ext_datagram(struct ev_loop *loop, struct ip_socket_t *sock, uint8_t *query, size_t len, anysin_t *address, socklen_t addresslen) {
+	event_entry_t *general_entry;
+
+	udp_counters.recv_packets++;
+	udp_counters.recv_histogram[0]++;
+
+	general_entry = event_udp_new_entry(sock);
+	if (!general_entry)
+		return;
+	if (len > general_entry->general.bufferlen)
+		len = general_entry->general.bufferlen;
+
+	memcpy(general_entry->general.buffer, query, len);
+	general_entry->general.packetsize = len;
+	if (addresslen > sizeof(anysin_t))
+		addresslen = sizeof(anysin_t);
+	memcpy(&general_entry->general.address, address, addresslen);
+	general_entry->udp.sock = sock;
+
+	event_udp_ext_query(loop, general_entry);
+}
@@ -0,0 +1,515 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+/*
+ * Alternative I/O engine for the UDP path (see CURVEDNS_ENGINE), on top of
+ * io_uring. Instead of being told a socket is readable and then fetching the
+ * datagrams ourselves, a multishot receive stays armed on every UDP socket and
+ * the kernel hands us completed datagrams in buffers of a provided ring. The
+ * replies are sent through the same ring. The completion ring is watched by
+ * libev, so TCP, timers and signals keep working the way they did.
+ */
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT			/* Linux 6.0, which also has the provided buffer rings */
+#define EVENT_URING
+#endif
+#endif
+
+#include "event.h"
+#include "misc.h"
+
+int global_event_engine = EVENT_ENGINE_LIBEV;
+__thread int event_uring_enabled = 0;
+
+#ifdef EVENT_URING
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define EVENT_URING_ENTRIES		256
+#define EVENT_URING_CQ_ENTRIES	4096
+#define EVENT_URING_BUFFERS		512			/* power of 2 */
+#define EVENT_URING_BGID		0
+
+// What a completion is about, kept in the lower bits of its user_data:
+#define EVENT_URING_EXT			1			/* receive on a listening socket */
+#define EVENT_URING_INT			2			/* receive on an upstream socket */
+#define EVENT_URING_SEND		3			/* reply towards a client */
+#define EVENT_URING_CANCEL		4			/* cancellation of an upstream receive */
+#define EVENT_URING_TAGMASK		7
+
+struct event_uring {
+	int fd;
+
+	// Submission queue:
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_local_tail;
+	struct io_uring_sqe *sqes;
+
+	// Completion queue:
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	// Provided buffers the datagrams are received in:
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	uint8_t *buffers;
+	size_t buffersize;
+	unsigned short buf_tail;
+
+	struct msghdr recvmsg;		// what the multishot receives fill in (only the lengths count)
+	struct event_udp_int_socket *cancels;	// retired sockets whose cancellation is still to be queued
+	ev_io watcher;
+	ev_prepare submit_watcher;
+
+	unsigned long enters, cqes_seen, rearms, nobufs, sends;
+};
+
+static __thread struct event_uring ring;
+
+static int event_uring_setup(unsigned entries, struct io_uring_params *params) {
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int event_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int event_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Returns a cleared submission entry, or NULL when the queue is full:
+static struct io_uring_sqe *event_uring_sqe() {
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	if (ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= EVENT_URING_ENTRIES)
+		return NULL;
+
+	index = ring.sq_local_tail & *ring.sq_mask;
+	sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring.sq_array[index] = index;
+	ring.sq_local_tail++;
+
+	return sqe;
+}
+
+static int event_uring_queue_cancel(struct event_udp_int_socket *intsock) {
+	struct io_uring_sqe *sqe;
+
+	sqe = event_uring_sqe();
+	if (!sqe)
+		return 0;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t) (uintptr_t) intsock | EVENT_URING_INT;
+	sqe->user_data = EVENT_URING_CANCEL;
+
+	return 1;
+}
+
+// Hands all queued submissions to the kernel, along with the cancellations
+// that did not fit in the queue before:
+void event_uring_submit() {
+	unsigned pending;
+	int n;
+
+	if (!event_uring_enabled)
+		return;
+
+	while (ring.cancels && event_uring_queue_cancel(ring.cancels))
+		ring.cancels = ring.cancels->cancelnext;
+
+	pending = ring.sq_local_tail - *ring.sq_tail;
+	if (!pending)
+		return;
+
+	__atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+	do {
+		n = event_uring_enter(ring.fd, pending, 0, 0);
+	} while ((n == -1) && (errno == EINTR));
+	ring.enters++;
+	if (n == -1)
+		debug_log(DEBUG_ERROR, "event_uring_submit(): io_uring_enter failed (%s)\n", strerror(errno));
+}
+
+// Returns a cleared submission entry, submitting the queue when it is full:
+static struct io_uring_sqe *event_uring_get_sqe() {
+	struct io_uring_sqe *sqe;
+
+	sqe = event_uring_sqe();
+	if (!sqe) {
+		event_uring_submit();
+		sqe = event_uring_sqe();
+	}
+	return sqe;
+}
+
+// Gives a buffer back to the kernel:
+static void event_uring_buffer_put(unsigned short bid) {
+	struct io_uring_buf *buf = &ring.buf_ring->bufs[ring.buf_tail & (EVENT_URING_BUFFERS - 1)];
+
+	buf->addr = (uint64_t) (uintptr_t) (ring.buffers + bid * ring.buffersize);
+	buf->len = ring.buffersize;
+	buf->bid = bid;
+	ring.buf_tail++;
+	__atomic_store_n(&ring.buf_ring->tail, ring.buf_tail, __ATOMIC_RELEASE);
+}
+
+static int event_uring_recv(int fd, void *data, int tag) {
+	struct io_uring_sqe *sqe;
+
+	sqe = event_uring_get_sqe();
+	if (!sqe) {
+		debug_log(DEBUG_ERROR, "event_uring_recv(): submission queue is full\n");
+		return 0;
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) &ring.recvmsg;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = EVENT_URING_BGID;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = (uint64_t) (uintptr_t) data | tag;
+
+	return 1;
+}
+
+int event_uring_recv_ext(struct ip_socket_t *sock) {
+	if (!event_uring_enabled)
+		return 0;
+	return event_uring_recv(sock->fd, sock, EVENT_URING_EXT);
+}
+
+int event_uring_recv_int(struct event_udp_int_socket *intsock) {
+	if (!event_uring_enabled)
+		return 0;
+	return event_uring_recv(intsock->watcher.fd, intsock, EVENT_URING_INT);
+}
+
+// Asks the kernel to stop the receive on a retired socket, its final
+// completion then closes it (see event_uring_complete_recv()). When the
+// queue is full, the cancellation is queued by the next submit, the socket
+// must stay until then anyway, as the receive is still armed:
+int event_uring_cancel_int(struct event_udp_int_socket *intsock) {
+	if (!event_uring_queue_cancel(intsock)) {
+		event_uring_submit();
+		if (!event_uring_queue_cancel(intsock)) {
+			debug_log(DEBUG_WARN, "event_uring_cancel_int(): submission queue is full, cancelling the receive later on\n");
+			intsock->cancelnext = ring.cancels;
+			ring.cancels = intsock;
+		}
+	}
+
+	return 1;
+}
+
+int event_uring_send(event_entry_t *general_entry) {
+	struct io_uring_sqe *sqe;
+
+	sqe = event_uring_get_sqe();
+	if (!sqe)
+		return 0;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = general_entry->udp.sock->fd;
+	sqe->addr = (uint64_t) (uintptr_t) &general_entry->udp.msg;
+	sqe->len = 1;
+	sqe->user_data = (uint64_t) (uintptr_t) general_entry | EVENT_URING_SEND;
+
+	return 1;
+}
+
+static void event_uring_complete_recv(struct ev_loop *loop, struct io_uring_cqe *cqe, void *data, int tag) {
+	struct event_udp_int_socket **intsock;
+	struct io_uring_recvmsg_out *out;
+	uint8_t *buffer, *payload;
+	unsigned short bid;
+	size_t len;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		buffer = ring.buffers + bid * ring.buffersize;
+		out = (struct io_uring_recvmsg_out *) buffer;
+
+		if ((cqe->res > 0) && (out->namelen <= ring.recvmsg.msg_namelen)) {
+			// The name comes first, followed by the payload (truncated when too big):
+			payload = buffer + sizeof(struct io_uring_recvmsg_out) + ring.recvmsg.msg_namelen;
+			len = out->payloadlen;
+			if (len > (size_t) (buffer + cqe->res - payload))
+				len = buffer + cqe->res - payload;
+
+			if (tag == EVENT_URING_EXT)
+				event_udp_ext_datagram(loop, (struct ip_socket_t *) data, payload, len,
+						(anysin_t *) (buffer + sizeof(struct io_uring_recvmsg_out)), out->namelen);
+			else
+				event_udp_int_datagram(loop, (struct event_udp_int_socket *) data, payload, len,
+						(anysin_t *) (buffer + sizeof(struct io_uring_recvmsg_out)));
+		}
+		event_uring_buffer_put(bid);
+	} else if (cqe->res == -ENOBUFS) {
+		ring.nobufs++;
+	} else if ((cqe->res < 0) && (cqe->res != -ECANCELED)) {
+		debug_log(DEBUG_WARN, "event_uring_complete_recv(): receive failed (%s)\n", strerror(-cqe->res));
+	}
+
+	// The receive stays armed as long as the kernel says so:
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return;
+
+	// The receive ended (cancelled or not), so it will not be cancelled anymore:
+	if ((tag == EVENT_URING_INT) && ((struct event_udp_int_socket *) data)->closing) {
+		for (intsock = &ring.cancels; *intsock; intsock = &(*intsock)->cancelnext) {
+			if (*intsock == data) {
+				*intsock = (*intsock)->cancelnext;
+				break;
+			}
+		}
+		event_udp_int_closed(loop, (struct event_udp_int_socket *) data);
+		return;
+	}
+
+	ring.rearms++;
+	if (!event_uring_recv((tag == EVENT_URING_EXT) ? ((struct ip_socket_t *) data)->fd :
+			((struct event_udp_int_socket *) data)->watcher.fd, data, tag))
+		debug_log(DEBUG_ERROR, "event_uring_complete_recv(): unable to rearm the receive\n");
+}
+
+static void event_uring_cb(struct ev_loop *loop, ev_io *w, int revent) {
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	void *data;
+	int tag;
+
+	if (!(revent & EV_READ))
+		return;
+
+	head = *ring.cq_head;
+	for (;;) {
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		while (head != tail) {
+			cqe = &ring.cqes[head & *ring.cq_mask];
+			data = (void *) (uintptr_t) (cqe->user_data & ~((uint64_t) EVENT_URING_TAGMASK));
+			tag = (int) (cqe->user_data & EVENT_URING_TAGMASK);
+			ring.cqes_seen++;
+
+			switch (tag) {
+				case EVENT_URING_EXT:
+				case EVENT_URING_INT:
+					event_uring_complete_recv(loop, cqe, data, tag);
+					break;
+				case EVENT_URING_SEND:
+					ring.sends++;
+					if (cqe->res < 0)
+						debug_log(DEBUG_ERROR, "event_uring_cb(): unable to send the response to the client (%s)\n", strerror(-cqe->res));
+					event_cleanup_entry(loop, (event_entry_t *) data);
+					break;
+				default:
+					break;
+			}
+
+			head++;
+		}
+
+		// Free the slots before handling more, so the kernel never has to drop any:
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	// Replies and rearms queued above go out in one go:
+	event_uring_submit();
+}
+
+static void event_uring_prepare_cb(struct ev_loop *loop, ev_prepare *w, int revent) {
+	event_uring_submit();
+}
+
+int event_uring_init(struct ev_loop *loop) {
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	uint8_t *sq, *cq;
+	int i;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = -1;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = EVENT_URING_CQ_ENTRIES;
+	ring.fd = event_uring_setup(EVENT_URING_ENTRIES, &params);
+	if (ring.fd == -1) {
+		debug_log(DEBUG_WARN, "event_uring_init(): io_uring_setup failed (%s)\n", strerror(errno));
+		goto wrong;
+	}
+
+	// Map the rings (in one go, when the kernel supports that):
+	ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_ring_size > ring.sq_ring_size)
+			ring.sq_ring_size = ring.cq_ring_size;
+		ring.cq_ring_size = 0;
+	}
+	ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ring == MAP_FAILED)
+		goto wrongmap;
+	if (ring.cq_ring_size) {
+		ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cq_ring == MAP_FAILED)
+			goto wrongmap;
+	} else {
+		ring.cq_ring = ring.sq_ring;
+	}
+	ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = (struct io_uring_sqe *) mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto wrongmap;
+
+	sq = (uint8_t *) ring.sq_ring;
+	ring.sq_head = (unsigned *) (sq + params.sq_off.head);
+	ring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) (sq + params.sq_off.array);
+	ring.sq_local_tail = *ring.sq_tail;
+
+	cq = (uint8_t *) ring.cq_ring;
+	ring.cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	// Every buffer holds the header, the sender's address and the datagram itself:
+	ring.recvmsg.msg_namelen = sizeof(anysin_t);
+	ring.buffersize = (sizeof(struct io_uring_recvmsg_out) + sizeof(anysin_t) + global_ip_udp_buffersize + 15) & ~((size_t) 15);
+	ring.buffers = (uint8_t *) malloc(ring.buffersize * EVENT_URING_BUFFERS);
+	if (!ring.buffers) {
+		debug_log(DEBUG_ERROR, "event_uring_init(): unable to allocate memory for the buffers\n");
+		goto wrong;
+	}
+
+	ring.buf_ring_size = EVENT_URING_BUFFERS * sizeof(struct io_uring_buf);
+	ring.buf_ring = (struct io_uring_buf_ring *) mmap(NULL, ring.buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring.buf_ring == MAP_FAILED) {
+		ring.buf_ring = NULL;
+		goto wrongmap;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) ring.buf_ring;
+	reg.ring_entries = EVENT_URING_BUFFERS;
+	reg.bgid = EVENT_URING_BGID;
+	if (event_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		debug_log(DEBUG_WARN, "event_uring_init(): unable to register the buffer ring (%s)\n", strerror(errno));
+		goto wrong;
+	}
+	for (i = 0; i < EVENT_URING_BUFFERS; i++)
+		event_uring_buffer_put(i);
+
+	ev_io_init(&ring.watcher, event_uring_cb, ring.fd, EV_READ);
+	ev_io_start(loop, &ring.watcher);
+	ev_prepare_init(&ring.submit_watcher, event_uring_prepare_cb);
+	ev_prepare_start(loop, &ring.submit_watcher);
+
+	event_uring_enabled = 1;
+	return 1;
+
+wrongmap:
+	debug_log(DEBUG_WARN, "event_uring_init(): unable to map the rings (%s)\n", strerror(errno));
+wrong:
+	if (ring.buf_ring)
+		munmap(ring.buf_ring, ring.buf_ring_size);
+	if (ring.buffers)
+		free(ring.buffers);
+	if (ring.sqes && (ring.sqes != MAP_FAILED))
+		munmap(ring.sqes, ring.sqes_size);
+	if (ring.cq_ring && (ring.cq_ring != MAP_FAILED) && (ring.cq_ring != ring.sq_ring))
+		munmap(ring.cq_ring, ring.cq_ring_size);
+	if (ring.sq_ring && (ring.sq_ring != MAP_FAILED))
+		munmap(ring.sq_ring, ring.sq_ring_size);
+	if (ring.fd != -1)
+		close(ring.fd);
+	memset(&ring, 0, sizeof(ring));
+	return 0;
+}
+
+void event_uring_stats(int worker) {
+	if (!event_uring_enabled)
+		return;
+	debug_log(DEBUG_FATAL, "event_uring_stats(): worker %d: %lu completions, %lu sends in %lu submit calls, %lu rearms, %lu times out of buffers\n",
+			worker, ring.cqes_seen, ring.sends, ring.enters, ring.rearms, ring.nobufs);
+}
+
+#else
+
+// Without io_uring support, the libev engine is the only one there is:
+int event_uring_init(struct ev_loop *loop) {
+	debug_log(DEBUG_WARN, "event_uring_init(): io_uring is not supported by this build\n");
+	return 0;
+}
+
+int event_uring_recv_ext(struct ip_socket_t *sock) {
+	return 0;
+}
+
+int event_uring_recv_int(struct event_udp_int_socket *intsock) {
+	return 0;
+}
+
+int event_uring_cancel_int(struct event_udp_int_socket *intsock) {
+	return 0;
+}
+
+int event_uring_send(event_entry_t *general_entry) {
+	return 0;
+}
+
+void event_uring_submit() {
+}
+
+void event_uring_stats(int worker) {
+}
+
+#endif
@@ -95,6 +95,19 @@ int ip_reuse(int sock) {
 	return 1;
 }
 
+// Allows several sockets (one per worker) to be bound to the same address:
+int ip_reuseport(int sock) {
+#ifdef SO_REUSEPORT
+	int n = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &n, sizeof(n)) == -1)
+		return 0;
+	return 1;
+#else
+	errno = ENOPROTOOPT;
+	return 0;
+#endif
+}
+
 int ip_tcp_open(int *sock, anysin_t *address) {
 	*sock = ip_socket(address, IP_PROTOCOL_TCP);
 	if (*sock < 0)
@@ -122,44 +135,56 @@ wrong:
 	return 0;
 }
 
-int ip_init(anysin_t *addresses, int addresses_count) {
+// Opens a UDP and TCP socket for every address, and that for every set (one set
+// per worker). With more than one set the sockets share the addresses through
+// SO_REUSEPORT, so the kernel spreads the load among them.
+int ip_init(anysin_t *addresses, int addresses_count, int sets) {
 	int i;
 
-	global_ip_sockets = (struct ip_socket_t *) calloc(addresses_count * 2, sizeof(struct ip_socket_t));
+	global_ip_sockets = (struct ip_socket_t *) calloc(addresses_count * 2 * sets, sizeof(struct ip_socket_t));
 	if (!global_ip_sockets)
 		goto wrong;
-	global_ip_sockets_count = addresses_count * 2;
+	global_ip_sockets_count = addresses_count * 2 * sets;
 
 	for (i = 0; i < global_ip_sockets_count; i++)
 		global_ip_sockets[i].fd = -1;
 
-	for (i = 0; i < addresses_count; i++) {
+	for (i = 0; i < addresses_count * sets; i++) {
 		int sid = i * 2;
+		anysin_t *address = &addresses[i % addresses_count];
 
 		// Do UDP bindings:
-		global_ip_sockets[sid].address = &addresses[i];
+		global_ip_sockets[sid].address = address;
 		global_ip_sockets[sid].protocol = IP_PROTOCOL_UDP;
-		if (!ip_udp_open(&global_ip_sockets[sid].fd, &addresses[i])) {
+		if (!ip_udp_open(&global_ip_sockets[sid].fd, address)) {
 			debug_log(DEBUG_FATAL, "ip_init(): unable to open UDP socket (%s)\n", strerror(errno));
 			goto wrong;
 		}
 		if (!ip_reuse(global_ip_sockets[sid].fd)) 
 			debug_log(DEBUG_WARN, "ip_init(): unable to set UDP socket to reuse address (%s)\n", strerror(errno));
-		if (!ip_bind(global_ip_sockets[sid].fd, &addresses[i])) {
+		if ((sets > 1) && !ip_reuseport(global_ip_sockets[sid].fd)) {
+			debug_log(DEBUG_FATAL, "ip_init(): unable to set UDP socket to reuse port (%s)\n", strerror(errno));
+			goto wrong;
+		}
+		if (!ip_bind(global_ip_sockets[sid].fd, address)) {
 			debug_log(DEBUG_FATAL, "ip_init(): unable to bind UDP socket (%s)\n", strerror(errno));
 			goto wrong;
 		}
 
 		// Do TCP bindings:
-		global_ip_sockets[sid+1].address = &addresses[i];
+		global_ip_sockets[sid+1].address = address;
 		global_ip_sockets[sid+1].protocol = IP_PROTOCOL_TCP;
-		if (!ip_tcp_open(&global_ip_sockets[sid+1].fd, &addresses[i])) {
+		if (!ip_tcp_open(&global_ip_sockets[sid+1].fd, address)) {
 			debug_log(DEBUG_FATAL, "ip_init(): unable to open TCP socket (%s)\n", strerror(errno));
 			goto wrong;
 		}
 		if (!ip_reuse(global_ip_sockets[sid+1].fd)) 
 			debug_log(DEBUG_WARN, "ip_init(): unable to set TCP socket to reuse address (%s)\n", strerror(errno));
-		if (!ip_bind(global_ip_sockets[sid+1].fd, &addresses[i])) {
+		if ((sets > 1) && !ip_reuseport(global_ip_sockets[sid+1].fd)) {
+			debug_log(DEBUG_FATAL, "ip_init(): unable to set TCP socket to reuse port (%s)\n", strerror(errno));
+			goto wrong;
+		}
+		if (!ip_bind(global_ip_sockets[sid+1].fd, address)) {
 			debug_log(DEBUG_FATAL, "ip_init(): unable to bind TCP socket (%s)\n", strerror(errno));
 			goto wrong;
 		}
@@ -83,13 +83,14 @@ extern size_t global_ip_udp_buffersize;
 extern uint8_t global_ip_udp_retries;
 
 /* IP main functions */
-extern int ip_init(anysin_t *, int);
+extern int ip_init(anysin_t *, int, int);
 extern void ip_close();
 extern int ip_bind_random(int);
 extern int ip_bind(int, anysin_t *);
 extern int ip_connect(int, anysin_t *);
 extern int ip_nonblock(int);
 extern int ip_reuse(int);
+extern int ip_reuseport(int);
 extern int ip_udp_open(int *, anysin_t *);
 extern int ip_tcp_open(int *, anysin_t *);
 extern int ip_tcp_close(int);
@@ -155,11 +155,11 @@ int misc_hex_encode(const uint8_t *src, int srclen, char *dst, int dstlen) {
 	return 1;
 }
 
-/* All needed for cryptography random functions, taken from djbdns */
-static uint32_t seed[32];
-static uint32_t in[12];
-static uint32_t out[8];
-static int outleft = 0;
+/* All needed for cryptography random functions, taken from djbdns (kept per thread) */
+static __thread uint32_t seed[32];
+static __thread uint32_t in[12];
+static __thread uint32_t out[8];
+static __thread int outleft = 0;
 
 #define ROTATE(x,b) (((x) << (b)) | ((x) >> (32 - (b))))
 #define MUSH(i,b) x = t[i] += (((x ^ seed[i]) + sum) ^ ROTATE(x,b));
@@ -199,8 +199,10 @@ void misc_randombytes(uint8_t *x, unsigned long long xlen) {
 	}
 }
 
+// Seeds the random state of the calling thread (opens /dev/urandom on first call):
 int misc_crypto_random_init() {
-	global_urandom_fd = open("/dev/urandom", O_RDONLY);
+	if (global_urandom_fd < 0)
+		global_urandom_fd = open("/dev/urandom", O_RDONLY);
 	if (global_urandom_fd < 0) {
 		perror("opening /dev/urandom failed");
 		return 0;
@@ -237,6 +239,37 @@ void misc_crypto_nonce(uint8_t *nonce, void *time, int len) {
 		nonce[len] = misc_crypto_random(256);
 }
 
+#define SIPROTATE(x,b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPLOAD(p) ((uint64_t) (p)[0] | ((uint64_t) (p)[1] << 8) | ((uint64_t) (p)[2] << 16) | ((uint64_t) (p)[3] << 24) | \
+		((uint64_t) (p)[4] << 32) | ((uint64_t) (p)[5] << 40) | ((uint64_t) (p)[6] << 48) | ((uint64_t) (p)[7] << 56))
+#define SIPROUND \
+	v0 += v1; v1 = SIPROTATE(v1,13); v1 ^= v0; v0 = SIPROTATE(v0,32); \
+	v2 += v3; v3 = SIPROTATE(v3,16); v3 ^= v2; \
+	v0 += v3; v3 = SIPROTATE(v3,21); v3 ^= v0; \
+	v2 += v1; v1 = SIPROTATE(v1,17); v1 ^= v2; v2 = SIPROTATE(v2,32);
+
+// SipHash-1-3 of 32 bytes (such as a public key) under a 128-bit key, so
+// hashtables indexed by data of clients cannot be flooded:
+uint64_t misc_siphash(const uint64_t *key, const uint8_t *x) {
+	uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+	uint64_t m;
+	int i;
+
+	for (i = 0; i < 32; i += 8) {
+		m = SIPLOAD(x + i);
+		v3 ^= m; SIPROUND; v0 ^= m;
+	}
+	m = (uint64_t) 32 << 56;
+	v3 ^= m; SIPROUND; v0 ^= m;
+
+	v2 ^= 0xff;
+	SIPROUND; SIPROUND; SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
 static const uint8_t kValues[] = {
     99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,
     99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,0,1,
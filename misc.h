@@ -66,5 +66,6 @@ extern void misc_randombytes(uint8_t *, unsigned long long);
 extern int misc_crypto_random_init();
 extern unsigned int misc_crypto_random(unsigned int);
 extern void misc_crypto_nonce(uint8_t *, void *, int);
+extern uint64_t misc_siphash(const uint64_t *, const uint8_t *);
 
 #endif /* MISC_H_ */
@@ -0,0 +1,81 @@
+/*
+cpufeatures.h
+CurveDNS Project
+Public domain.
+
+Run-time counterpart of x86.c: the instruction set extensions of the CPU we
+are running on, as far as the operating system saves their registers. Used by
+the dispatchers configure.nacl generates for the primitives marked dispatch.
+*/
+
+#ifndef CPUFEATURES_H
+#define CPUFEATURES_H
+
+#define CPUFEATURES_SSE2 0x0001
+#define CPUFEATURES_SSSE3 0x0002
+#define CPUFEATURES_AVX 0x0004
+#define CPUFEATURES_AVX2 0x0008
+#define CPUFEATURES_BMI2 0x0010
+#define CPUFEATURES_ADX 0x0020
+#define CPUFEATURES_AVX512F 0x0040
+#define CPUFEATURES_AVX512VL 0x0080
+#define CPUFEATURES_AVX512BW 0x0100
+#define CPUFEATURES_AVX512IFMA 0x0200
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static void cpufeatures_cpuid(unsigned int *x,unsigned int leaf)
+{
+  asm volatile(".byte 15;.byte 162" : "=a"(x[0]),"=b"(x[1]),"=c"(x[2]),"=d"(x[3]) : "0"(leaf),"2"(0) );
+}
+
+static unsigned int cpufeatures(void)
+{
+  unsigned int x[4];
+  unsigned int y[4];
+  unsigned int xcr0 = 0;
+  unsigned int result = 0;
+  unsigned int d;
+
+  cpufeatures_cpuid(x,0);
+  if (!x[0]) return 0;
+  cpufeatures_cpuid(y,1);
+
+  if (y[3] & (1 << 26)) result |= CPUFEATURES_SSE2;
+  if (y[2] & (1 << 9)) result |= CPUFEATURES_SSSE3;
+
+  /* OSXSAVE: only then may we ask which register state the OS saves */
+  if (y[2] & (1 << 27))
+    asm volatile(".byte 15;.byte 1;.byte 208" : "=a"(xcr0),"=d"(d) : "c"(0) );
+
+  if ((y[2] & (1 << 28)) && ((xcr0 & 6) == 6)) result |= CPUFEATURES_AVX;
+
+  if (x[0] < 7) return result;
+  cpufeatures_cpuid(y,7);
+
+  if (y[1] & (1 << 8)) result |= CPUFEATURES_BMI2;
+  if (y[1] & (1 << 19)) result |= CPUFEATURES_ADX;
+  if (!(result & CPUFEATURES_AVX)) return result;
+  if (y[1] & (1 << 5)) result |= CPUFEATURES_AVX2;
+
+  /* opmask, upper ZMM and ZMM16-31 state */
+  if ((xcr0 & 0xe0) != 0xe0) return result;
+  if (y[1] & (1 << 16)) result |= CPUFEATURES_AVX512F;
+  if (!(result & CPUFEATURES_AVX512F)) return result;
+  if (y[1] & 0x80000000) result |= CPUFEATURES_AVX512VL;
+  if (y[1] & (1 << 30)) result |= CPUFEATURES_AVX512BW;
+  if (y[1] & (1 << 21)) result |= CPUFEATURES_AVX512IFMA;
+
+  return result;
+}
+
+#else
+
+static unsigned int cpufeatures(void)
+{
+  return 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,330 @@
+/*
+crypto_onetimeauth/poly1305/amd64_avx512
+CurveDNS Project
+Public domain.
+
+amd64_avx2 with eight blocks at a time in 512-bit registers: every 64-bit
+lane accumulates every eighth block, multiplied by r^8 per step, and the
+lanes are multiplied by r^8 ... r and added up at the end. Messages of at
+least MINVECTOR8 bytes go that way, what is left of them (or shorter ones)
+four blocks at a time as in amd64_avx2 when there are at least MINVECTOR
+bytes, then one block at a time. Needs a CPU with AVX2 and AVX-512F.
+*/
+
+#include <immintrin.h>
+#include "crypto_onetimeauth.h"
+
+#define AVX2 __attribute__((target("avx2")))
+#define AVX512 __attribute__((target("avx2,avx512f")))
+
+#define MINVECTOR 128
+#define MINVECTOR8 1024
+
+typedef unsigned int uint32;
+typedef unsigned long long uint64;
+
+static uint32 load32(const unsigned char *x)
+{
+  return (uint32) x[0] | ((uint32) x[1] << 8) | ((uint32) x[2] << 16) | ((uint32) x[3] << 24);
+}
+
+static void store32(unsigned char *x,uint32 u)
+{
+  x[0] = u; x[1] = u >> 8; x[2] = u >> 16; x[3] = u >> 24;
+}
+
+/* h = h * r, partly reduced: limbs below 2^26, h[1] a little above */
+static void mul(uint64 h[5],const uint64 r[5])
+{
+  uint64 s1 = r[1] * 5, s2 = r[2] * 5, s3 = r[3] * 5, s4 = r[4] * 5;
+  uint64 d0, d1, d2, d3, d4, c;
+
+  d0 = h[0] * r[0] + h[1] * s4 + h[2] * s3 + h[3] * s2 + h[4] * s1;
+  d1 = h[0] * r[1] + h[1] * r[0] + h[2] * s4 + h[3] * s3 + h[4] * s2;
+  d2 = h[0] * r[2] + h[1] * r[1] + h[2] * r[0] + h[3] * s4 + h[4] * s3;
+  d3 = h[0] * r[3] + h[1] * r[2] + h[2] * r[1] + h[3] * r[0] + h[4] * s4;
+  d4 = h[0] * r[4] + h[1] * r[3] + h[2] * r[2] + h[3] * r[1] + h[4] * r[0];
+
+  c = d0 >> 26; h[0] = d0 & 0x3ffffff; d1 += c;
+  c = d1 >> 26; h[1] = d1 & 0x3ffffff; d2 += c;
+  c = d2 >> 26; h[2] = d2 & 0x3ffffff; d3 += c;
+  c = d3 >> 26; h[3] = d3 & 0x3ffffff; d4 += c;
+  c = d4 >> 26; h[4] = d4 & 0x3ffffff; h[0] += c * 5;
+  c = h[0] >> 26; h[0] &= 0x3ffffff; h[1] += c;
+}
+
+/* h = (h + m) * r for every (full) block of m */
+static void blocks(uint64 h[5],const uint64 r[5],const unsigned char *m,unsigned long long mlen,uint64 hibit)
+{
+  while (mlen >= 16) {
+    h[0] += load32(m) & 0x3ffffff;
+    h[1] += (load32(m + 3) >> 2) & 0x3ffffff;
+    h[2] += (load32(m + 6) >> 4) & 0x3ffffff;
+    h[3] += (load32(m + 9) >> 6) & 0x3ffffff;
+    h[4] += (load32(m + 12) >> 8) | hibit;
+    mul(h,r);
+    m += 16;
+    mlen -= 16;
+  }
+}
+
+/* lanes = lanes * (r, s = 5r), partly reduced */
+#define VMUL(h,r,s) \
+  do { \
+    __m256i d0, d1, d2, d3, d4, c; \
+    __m256i mask26 = _mm256_set1_epi64x(0x3ffffff); \
+    d0 = _mm256_mul_epu32(h[0],r[0]); \
+    d1 = _mm256_mul_epu32(h[0],r[1]); \
+    d2 = _mm256_mul_epu32(h[0],r[2]); \
+    d3 = _mm256_mul_epu32(h[0],r[3]); \
+    d4 = _mm256_mul_epu32(h[0],r[4]); \
+    d0 = _mm256_add_epi64(d0,_mm256_mul_epu32(h[1],s[4])); \
+    d1 = _mm256_add_epi64(d1,_mm256_mul_epu32(h[1],r[0])); \
+    d2 = _mm256_add_epi64(d2,_mm256_mul_epu32(h[1],r[1])); \
+    d3 = _mm256_add_epi64(d3,_mm256_mul_epu32(h[1],r[2])); \
+    d4 = _mm256_add_epi64(d4,_mm256_mul_epu32(h[1],r[3])); \
+    d0 = _mm256_add_epi64(d0,_mm256_mul_epu32(h[2],s[3])); \
+    d1 = _mm256_add_epi64(d1,_mm256_mul_epu32(h[2],s[4])); \
+    d2 = _mm256_add_epi64(d2,_mm256_mul_epu32(h[2],r[0])); \
+    d3 = _mm256_add_epi64(d3,_mm256_mul_epu32(h[2],r[1])); \
+    d4 = _mm256_add_epi64(d4,_mm256_mul_epu32(h[2],r[2])); \
+    d0 = _mm256_add_epi64(d0,_mm256_mul_epu32(h[3],s[2])); \
+    d1 = _mm256_add_epi64(d1,_mm256_mul_epu32(h[3],s[3])); \
+    d2 = _mm256_add_epi64(d2,_mm256_mul_epu32(h[3],s[4])); \
+    d3 = _mm256_add_epi64(d3,_mm256_mul_epu32(h[3],r[0])); \
+    d4 = _mm256_add_epi64(d4,_mm256_mul_epu32(h[3],r[1])); \
+    d0 = _mm256_add_epi64(d0,_mm256_mul_epu32(h[4],s[1])); \
+    d1 = _mm256_add_epi64(d1,_mm256_mul_epu32(h[4],s[2])); \
+    d2 = _mm256_add_epi64(d2,_mm256_mul_epu32(h[4],s[3])); \
+    d3 = _mm256_add_epi64(d3,_mm256_mul_epu32(h[4],s[4])); \
+    d4 = _mm256_add_epi64(d4,_mm256_mul_epu32(h[4],r[0])); \
+    /* two carry chains at once, d0 -> d1 and d3 -> d4 -> d0 */ \
+    c = _mm256_srli_epi64(d0,26); d0 = _mm256_and_si256(d0,mask26); d1 = _mm256_add_epi64(d1,c); \
+    c = _mm256_srli_epi64(d3,26); d3 = _mm256_and_si256(d3,mask26); d4 = _mm256_add_epi64(d4,c); \
+    c = _mm256_srli_epi64(d1,26); d1 = _mm256_and_si256(d1,mask26); d2 = _mm256_add_epi64(d2,c); \
+    c = _mm256_srli_epi64(d4,26); d4 = _mm256_and_si256(d4,mask26); \
+    d0 = _mm256_add_epi64(d0,_mm256_add_epi64(c,_mm256_slli_epi64(c,2))); \
+    c = _mm256_srli_epi64(d2,26); d2 = _mm256_and_si256(d2,mask26); d3 = _mm256_add_epi64(d3,c); \
+    c = _mm256_srli_epi64(d0,26); d0 = _mm256_and_si256(d0,mask26); d1 = _mm256_add_epi64(d1,c); \
+    c = _mm256_srli_epi64(d3,26); d3 = _mm256_and_si256(d3,mask26); d4 = _mm256_add_epi64(d4,c); \
+    h[0] = d0; h[1] = d1; h[2] = d2; h[3] = d3; h[4] = d4; \
+  } while (0)
+
+/* the limbs of four blocks: lanes hold blocks 0, 2, 1 and 3 */
+#define VLOAD(t,m) \
+  do { \
+    __m256i x = _mm256_loadu_si256((const __m256i *) (m)); \
+    __m256i y = _mm256_loadu_si256((const __m256i *) ((m) + 32)); \
+    __m256i lo = _mm256_unpacklo_epi64(x,y); \
+    __m256i hi = _mm256_unpackhi_epi64(x,y); \
+    __m256i mask26 = _mm256_set1_epi64x(0x3ffffff); \
+    t[0] = _mm256_and_si256(lo,mask26); \
+    t[1] = _mm256_and_si256(_mm256_srli_epi64(lo,26),mask26); \
+    t[2] = _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo,52),_mm256_slli_epi64(hi,12)),mask26); \
+    t[3] = _mm256_and_si256(_mm256_srli_epi64(hi,14),mask26); \
+    t[4] = _mm256_or_si256(_mm256_srli_epi64(hi,40),_mm256_set1_epi64x(1 << 24)); \
+  } while (0)
+
+/* VMUL and VLOAD eight lanes wide: lanes hold blocks 0, 4, 1, 5, 2, 6, 3 and 7 */
+#define VMUL8(h,r,s) \
+  do { \
+    __m512i d0, d1, d2, d3, d4, c; \
+    __m512i mask26 = _mm512_set1_epi64(0x3ffffff); \
+    d0 = _mm512_mul_epu32(h[0],r[0]); \
+    d1 = _mm512_mul_epu32(h[0],r[1]); \
+    d2 = _mm512_mul_epu32(h[0],r[2]); \
+    d3 = _mm512_mul_epu32(h[0],r[3]); \
+    d4 = _mm512_mul_epu32(h[0],r[4]); \
+    d0 = _mm512_add_epi64(d0,_mm512_mul_epu32(h[1],s[4])); \
+    d1 = _mm512_add_epi64(d1,_mm512_mul_epu32(h[1],r[0])); \
+    d2 = _mm512_add_epi64(d2,_mm512_mul_epu32(h[1],r[1])); \
+    d3 = _mm512_add_epi64(d3,_mm512_mul_epu32(h[1],r[2])); \
+    d4 = _mm512_add_epi64(d4,_mm512_mul_epu32(h[1],r[3])); \
+    d0 = _mm512_add_epi64(d0,_mm512_mul_epu32(h[2],s[3])); \
+    d1 = _mm512_add_epi64(d1,_mm512_mul_epu32(h[2],s[4])); \
+    d2 = _mm512_add_epi64(d2,_mm512_mul_epu32(h[2],r[0])); \
+    d3 = _mm512_add_epi64(d3,_mm512_mul_epu32(h[2],r[1])); \
+    d4 = _mm512_add_epi64(d4,_mm512_mul_epu32(h[2],r[2])); \
+    d0 = _mm512_add_epi64(d0,_mm512_mul_epu32(h[3],s[2])); \
+    d1 = _mm512_add_epi64(d1,_mm512_mul_epu32(h[3],s[3])); \
+    d2 = _mm512_add_epi64(d2,_mm512_mul_epu32(h[3],s[4])); \
+    d3 = _mm512_add_epi64(d3,_mm512_mul_epu32(h[3],r[0])); \
+    d4 = _mm512_add_epi64(d4,_mm512_mul_epu32(h[3],r[1])); \
+    d0 = _mm512_add_epi64(d0,_mm512_mul_epu32(h[4],s[1])); \
+    d1 = _mm512_add_epi64(d1,_mm512_mul_epu32(h[4],s[2])); \
+    d2 = _mm512_add_epi64(d2,_mm512_mul_epu32(h[4],s[3])); \
+    d3 = _mm512_add_epi64(d3,_mm512_mul_epu32(h[4],s[4])); \
+    d4 = _mm512_add_epi64(d4,_mm512_mul_epu32(h[4],r[0])); \
+    c = _mm512_srli_epi64(d0,26); d0 = _mm512_and_si512(d0,mask26); d1 = _mm512_add_epi64(d1,c); \
+    c = _mm512_srli_epi64(d3,26); d3 = _mm512_and_si512(d3,mask26); d4 = _mm512_add_epi64(d4,c); \
+    c = _mm512_srli_epi64(d1,26); d1 = _mm512_and_si512(d1,mask26); d2 = _mm512_add_epi64(d2,c); \
+    c = _mm512_srli_epi64(d4,26); d4 = _mm512_and_si512(d4,mask26); \
+    d0 = _mm512_add_epi64(d0,_mm512_add_epi64(c,_mm512_slli_epi64(c,2))); \
+    c = _mm512_srli_epi64(d2,26); d2 = _mm512_and_si512(d2,mask26); d3 = _mm512_add_epi64(d3,c); \
+    c = _mm512_srli_epi64(d0,26); d0 = _mm512_and_si512(d0,mask26); d1 = _mm512_add_epi64(d1,c); \
+    c = _mm512_srli_epi64(d3,26); d3 = _mm512_and_si512(d3,mask26); d4 = _mm512_add_epi64(d4,c); \
+    h[0] = d0; h[1] = d1; h[2] = d2; h[3] = d3; h[4] = d4; \
+  } while (0)
+
+#define VLOAD8(t,m) \
+  do { \
+    __m512i x = _mm512_loadu_si512((const void *) (m)); \
+    __m512i y = _mm512_loadu_si512((const void *) ((m) + 64)); \
+    __m512i lo = _mm512_unpacklo_epi64(x,y); \
+    __m512i hi = _mm512_unpackhi_epi64(x,y); \
+    __m512i mask26 = _mm512_set1_epi64(0x3ffffff); \
+    t[0] = _mm512_and_si512(lo,mask26); \
+    t[1] = _mm512_and_si512(_mm512_srli_epi64(lo,26),mask26); \
+    t[2] = _mm512_and_si512(_mm512_or_si512(_mm512_srli_epi64(lo,52),_mm512_slli_epi64(hi,12)),mask26); \
+    t[3] = _mm512_and_si512(_mm512_srli_epi64(hi,14),mask26); \
+    t[4] = _mm512_or_si512(_mm512_srli_epi64(hi,40),_mm512_set1_epi64(1 << 24)); \
+  } while (0)
+
+/* h = (h + m) * r for the first mlen / 128 groups of eight blocks of m, p[j] = r^j */
+static AVX512 unsigned long long vblocks8(uint64 h[5],uint64 p[][5],const unsigned char *m,unsigned long long mlen)
+{
+  __m512i H[5], M[5], R[5], S[5];
+  uint64 sum[8];
+  unsigned long long done = 0;
+  int i;
+
+  VLOAD8(H,m);
+  for (i = 0;i < 5;++i) H[i] = _mm512_add_epi64(H[i],_mm512_setr_epi64(h[i],0,0,0,0,0,0,0));
+  m += 128; mlen -= 128; done += 128;
+
+  for (i = 0;i < 5;++i) {
+    R[i] = _mm512_set1_epi64(p[8][i]);
+    S[i] = _mm512_set1_epi64(p[8][i] * 5);
+  }
+  while (mlen >= 128) {
+    VMUL8(H,R,S);
+    VLOAD8(M,m);
+    for (i = 0;i < 5;++i) H[i] = _mm512_add_epi64(H[i],M[i]);
+    m += 128; mlen -= 128; done += 128;
+  }
+
+  for (i = 0;i < 5;++i) {
+    R[i] = _mm512_setr_epi64(p[8][i],p[4][i],p[7][i],p[3][i],p[6][i],p[2][i],p[5][i],p[1][i]);
+    S[i] = _mm512_setr_epi64(p[8][i] * 5,p[4][i] * 5,p[7][i] * 5,p[3][i] * 5,
+                             p[6][i] * 5,p[2][i] * 5,p[5][i] * 5,p[1][i] * 5);
+  }
+  VMUL8(H,R,S);
+
+  for (i = 0;i < 5;++i) {
+    _mm512_storeu_si512((void *) sum,H[i]);
+    h[i] = sum[0] + sum[1] + sum[2] + sum[3] + sum[4] + sum[5] + sum[6] + sum[7];
+  }
+  return done;
+}
+
+/* h = (h + m) * r for the first mlen / 64 groups of four blocks of m, p[j] = r^j */
+static AVX2 unsigned long long vblocks(uint64 h[5],uint64 p[][5],const unsigned char *m,unsigned long long mlen)
+{
+  __m256i H[5], M[5], R[5], S[5];
+  uint64 sum[4];
+  unsigned long long done = 0;
+  int i;
+
+  VLOAD(H,m);
+  for (i = 0;i < 5;++i) H[i] = _mm256_add_epi64(H[i],_mm256_setr_epi64x(h[i],0,0,0));
+  m += 64; mlen -= 64; done += 64;
+
+  for (i = 0;i < 5;++i) {
+    R[i] = _mm256_set1_epi64x(p[4][i]);
+    S[i] = _mm256_set1_epi64x(p[4][i] * 5);
+  }
+  while (mlen >= 64) {
+    VMUL(H,R,S);
+    VLOAD(M,m);
+    for (i = 0;i < 5;++i) H[i] = _mm256_add_epi64(H[i],M[i]);
+    m += 64; mlen -= 64; done += 64;
+  }
+
+  for (i = 0;i < 5;++i) {
+    R[i] = _mm256_setr_epi64x(p[4][i],p[2][i],p[3][i],p[1][i]);
+    S[i] = _mm256_setr_epi64x(p[4][i] * 5,p[2][i] * 5,p[3][i] * 5,p[1][i] * 5);
+  }
+  VMUL(H,R,S);
+
+  for (i = 0;i < 5;++i) {
+    _mm256_storeu_si256((__m256i *) sum,H[i]);
+    h[i] = sum[0] + sum[1] + sum[2] + sum[3];
+  }
+  return done;
+}
+
+int crypto_onetimeauth(unsigned char *out,const unsigned char *m,unsigned long long inlen,const unsigned char *k)
+{
+  uint64 r[5], h[5] = {0,0,0,0,0}, g[5];
+  uint64 p[9][5];
+  uint64 c, mask, f;
+  unsigned char last[16];
+  unsigned long long done, i;
+  int j, n;
+
+  r[0] = load32(k) & 0x3ffffff;
+  r[1] = (load32(k + 3) >> 2) & 0x3ffff03;
+  r[2] = (load32(k + 6) >> 4) & 0x3ffc0ff;
+  r[3] = (load32(k + 9) >> 6) & 0x3f03fff;
+  r[4] = (load32(k + 12) >> 8) & 0x00fffff;
+
+  if (inlen >= MINVECTOR) {
+    /* r, r^2, ..., as far as needed */
+    n = (inlen >= MINVECTOR8) ? 8 : 4;
+    for (i = 0;i < 5;++i) p[1][i] = r[i];
+    for (j = 2;j <= n;++j) {
+      for (i = 0;i < 5;++i) p[j][i] = p[j - 1][i];
+      mul(p[j],r);
+    }
+
+    if (inlen >= MINVECTOR8) {
+      done = vblocks8(h,p,m,inlen);
+      m += done;
+      inlen -= done;
+    }
+    if (inlen >= MINVECTOR) {
+      done = vblocks(h,p,m,inlen);
+      m += done;
+      inlen -= done;
+    }
+  }
+  blocks(h,r,m,inlen,1 << 24);
+  m += inlen & ~15ULL;
+  inlen &= 15;
+  if (inlen) {
+    for (i = 0;i < inlen;++i) last[i] = m[i];
+    last[i++] = 1;
+    for (;i < 16;++i) last[i] = 0;
+    blocks(h,r,last,16,0);
+  }
+
+  /* fully carry h */
+  c = h[0] >> 26; h[0] &= 0x3ffffff; h[1] += c;
+  c = h[1] >> 26; h[1] &= 0x3ffffff; h[2] += c;
+  c = h[2] >> 26; h[2] &= 0x3ffffff; h[3] += c;
+  c = h[3] >> 26; h[3] &= 0x3ffffff; h[4] += c;
+  c = h[4] >> 26; h[4] &= 0x3ffffff; h[0] += c * 5;
+  c = h[0] >> 26; h[0] &= 0x3ffffff; h[1] += c;
+  c = h[1] >> 26; h[1] &= 0x3ffffff; h[2] += c;
+
+  /* h - p = h + 5 - 2^130, taken when it does not borrow */
+  g[0] = h[0] + 5; c = g[0] >> 26; g[0] &= 0x3ffffff;
+  g[1] = h[1] + c; c = g[1] >> 26; g[1] &= 0x3ffffff;
+  g[2] = h[2] + c; c = g[2] >> 26; g[2] &= 0x3ffffff;
+  g[3] = h[3] + c; c = g[3] >> 26; g[3] &= 0x3ffffff;
+  g[4] = h[4] + c - (1 << 26);
+  mask = (g[4] >> 63) - 1;
+  for (i = 0;i < 5;++i) h[i] = (h[i] & ~mask) | (g[i] & mask);
+
+  /* h + s mod 2^128 */
+  f = (h[0] | (h[1] << 26)) & 0xffffffff;
+  f += load32(k + 16);
+  store32(out,f);
+  f = (f >> 32) + (((h[1] >> 6) | (h[2] << 20)) & 0xffffffff) + load32(k + 20);
+  store32(out + 4,f);
+  f = (f >> 32) + (((h[2] >> 12) | (h[3] << 14)) & 0xffffffff) + load32(k + 24);
+  store32(out + 8,f);
+  f = (f >> 32) + (((h[3] >> 18) | (h[4] << 8)) & 0xffffffff) + load32(k + 28);
+  store32(out + 12,f);
+  return 0;
+}
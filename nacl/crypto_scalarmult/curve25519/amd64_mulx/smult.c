@@ -0,0 +1,454 @@
+/*
+crypto_scalarmult/curve25519/amd64_mulx
+CurveDNS Project
+Public domain.
+
+Curve25519 with four 64-bit limbs, multiplied with MULX and added up along
+two carry chains at once with ADCX (carry flag) and ADOX (overflow flag),
+which needs a CPU with BMI2 and ADX (Intel Broadwell, AMD Zen and later).
+Elements are kept below 2^256 and only reduced modulo 2^255 - 19 at the
+end. Nothing branches on, or indexes memory with, secret data.
+*/
+
+#include <stdint.h>
+#include "crypto_scalarmult.h"
+
+typedef uint64_t fe[4];
+typedef unsigned __int128 uint128;
+
+/* r = a * b, 2^256 = 38 */
+static void fe_mul(fe r,const fe a,const fe b)
+{
+  uint64_t t[4];
+
+  __asm__ __volatile__(
+    "xorl %%r13d, %%r13d\n\t"
+    "movq 0(%[b]), %%rdx\n\t"
+    "mulx 0(%[a]), %%r8, %%r9\n\t"
+    "mulx 8(%[a]), %%r13, %%r10\n\t"
+    "adcx %%r13, %%r9\n\t"
+    "mulx 16(%[a]), %%r13, %%r11\n\t"
+    "adcx %%r13, %%r10\n\t"
+    "mulx 24(%[a]), %%r13, %%r12\n\t"
+    "adcx %%r13, %%r11\n\t"
+    "movq $0, %%r13\n\t"
+    "adcx %%r13, %%r12\n\t"
+    "movq %%r8, 0(%[t])\n\t"
+    "xorl %%r8d, %%r8d\n\t"
+    "movq 8(%[b]), %%rdx\n\t"
+    "mulx 0(%[a]), %%r14, %%r15\n\t"
+    "adcx %%r14, %%r9\n\t"
+    "adox %%r15, %%r10\n\t"
+    "mulx 8(%[a]), %%r14, %%r15\n\t"
+    "adcx %%r14, %%r10\n\t"
+    "adox %%r15, %%r11\n\t"
+    "mulx 16(%[a]), %%r14, %%r15\n\t"
+    "adcx %%r14, %%r11\n\t"
+    "adox %%r15, %%r12\n\t"
+    "mulx 24(%[a]), %%r14, %%r13\n\t"
+    "adcx %%r14, %%r12\n\t"
+    "adox %%r8, %%r13\n\t"
+    "adcx %%r8, %%r13\n\t"
+    "movq %%r9, 8(%[t])\n\t"
+    "xorl %%r9d, %%r9d\n\t"
+    "movq 16(%[b]), %%rdx\n\t"
+    "mulx 0(%[a]), %%r14, %%r15\n\t"
+    "adcx %%r14, %%r10\n\t"
+    "adox %%r15, %%r11\n\t"
+    "mulx 8(%[a]), %%r14, %%r15\n\t"
+    "adcx %%r14, %%r11\n\t"
+    "adox %%r15, %%r12\n\t"
+    "mulx 16(%[a]), %%r14, %%r15\n\t"
+    "adcx %%r14, %%r12\n\t"
+    "adox %%r15, %%r13\n\t"
+    "mulx 24(%[a]), %%r14, %%r8\n\t"
+    "adcx %%r14, %%r13\n\t"
+    "adox %%r9, %%r8\n\t"
+    "adcx %%r9, %%r8\n\t"
+    "movq %%r10, 16(%[t])\n\t"
+    "xorl %%r10d, %%r10d\n\t"
+    "movq 24(%[b]), %%rdx\n\t"
+    "mulx 0(%[a]), %%r14, %%r15\n\t"
+    "adcx %%r14, %%r11\n\t"
+    "adox %%r15, %%r12\n\t"
+    "mulx 8(%[a]), %%r14, %%r15\n\t"
+    "adcx %%r14, %%r12\n\t"
+    "adox %%r15, %%r13\n\t"
+    "mulx 16(%[a]), %%r14, %%r15\n\t"
+    "adcx %%r14, %%r13\n\t"
+    "adox %%r15, %%r8\n\t"
+    "mulx 24(%[a]), %%r14, %%r9\n\t"
+    "adcx %%r14, %%r8\n\t"
+    "adox %%r10, %%r9\n\t"
+    "adcx %%r10, %%r9\n\t"
+    "movq %%r11, 24(%[t])\n\t"
+    "xorl %%r11d, %%r11d\n\t"
+    "movq $38, %%rdx\n\t"
+    "mulx %%r12, %%r12, %%r14\n\t"
+    "adcx 0(%[t]), %%r12\n\t"
+    "mulx %%r13, %%r13, %%r15\n\t"
+    "adox %%r14, %%r13\n\t"
+    "adcx 8(%[t]), %%r13\n\t"
+    "mulx %%r8, %%r8, %%r14\n\t"
+    "adox %%r15, %%r8\n\t"
+    "adcx 16(%[t]), %%r8\n\t"
+    "mulx %%r9, %%r9, %%r15\n\t"
+    "adox %%r14, %%r9\n\t"
+    "adcx 24(%[t]), %%r9\n\t"
+    "adox %%r11, %%r15\n\t"
+    "adcx %%r11, %%r15\n\t"
+    "imulq $38, %%r15, %%r15\n\t"
+    "addq %%r15, %%r12\n\t"
+    "adcq %%r11, %%r13\n\t"
+    "adcq %%r11, %%r8\n\t"
+    "adcq %%r11, %%r9\n\t"
+    "sbbq %%r15, %%r15\n\t"
+    "andq $38, %%r15\n\t"
+    "addq %%r15, %%r12\n\t"
+    "movq %%r12, 0(%[r])\n\t"
+    "movq %%r13, 8(%[r])\n\t"
+    "movq %%r8, 16(%[r])\n\t"
+    "movq %%r9, 24(%[r])\n\t"
+    :
+    : [r] "r" (r), [a] "r" (a), [b] "r" (b), [t] "r" (t)
+    : "rdx", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "cc", "memory"
+  );
+}
+
+/* r = a^2: the products of two different limbs once, doubled, plus the squares */
+static void fe_sq(fe r,const fe a)
+{
+  uint64_t t[4];
+
+  __asm__ __volatile__(
+    "xorl %%eax, %%eax\n\t"
+    "movq 0(%[a]), %%rdx\n\t"
+    "mulx 8(%[a]), %%r9, %%r10\n\t"
+    "mulx 16(%[a]), %%rcx, %%r11\n\t"
+    "adcx %%rcx, %%r10\n\t"
+    "mulx 24(%[a]), %%rcx, %%r12\n\t"
+    "adcx %%rcx, %%r11\n\t"
+    "movq 8(%[a]), %%rdx\n\t"
+    "mulx 16(%[a]), %%rcx, %%r8\n\t"
+    "adox %%rcx, %%r11\n\t"
+    "adcx %%r8, %%r12\n\t"
+    "mulx 24(%[a]), %%rcx, %%r13\n\t"
+    "adox %%rcx, %%r12\n\t"
+    "adcx %%rax, %%r13\n\t"
+    "movq 16(%[a]), %%rdx\n\t"
+    "mulx 24(%[a]), %%rcx, %%r14\n\t"
+    "adox %%rcx, %%r13\n\t"
+    "adcx %%rax, %%r14\n\t"
+    "adox %%rax, %%r14\n\t"
+    "xorl %%r15d, %%r15d\n\t"
+    "addq %%r9, %%r9\n\t"
+    "adcq %%r10, %%r10\n\t"
+    "adcq %%r11, %%r11\n\t"
+    "adcq %%r12, %%r12\n\t"
+    "adcq %%r13, %%r13\n\t"
+    "adcq %%r14, %%r14\n\t"
+    "adcq %%r15, %%r15\n\t"
+    "movq 0(%[a]), %%rdx\n\t"
+    "mulx %%rdx, %%r8, %%rcx\n\t"
+    "addq %%rcx, %%r9\n\t"
+    "movq 8(%[a]), %%rdx\n\t"
+    "mulx %%rdx, %%rax, %%rcx\n\t"
+    "adcq %%rax, %%r10\n\t"
+    "adcq %%rcx, %%r11\n\t"
+    "movq 16(%[a]), %%rdx\n\t"
+    "mulx %%rdx, %%rax, %%rcx\n\t"
+    "adcq %%rax, %%r12\n\t"
+    "adcq %%rcx, %%r13\n\t"
+    "movq 24(%[a]), %%rdx\n\t"
+    "mulx %%rdx, %%rax, %%rcx\n\t"
+    "adcq %%rax, %%r14\n\t"
+    "adcq %%rcx, %%r15\n\t"
+    "movq %%r8, 0(%[t])\n\t"
+    "movq %%r9, 8(%[t])\n\t"
+    "movq %%r10, 16(%[t])\n\t"
+    "movq %%r11, 24(%[t])\n\t"
+    "xorl %%r11d, %%r11d\n\t"
+    "movq $38, %%rdx\n\t"
+    "mulx %%r12, %%r12, %%r9\n\t"
+    "adcx 0(%[t]), %%r12\n\t"
+    "mulx %%r13, %%r13, %%r10\n\t"
+    "adox %%r9, %%r13\n\t"
+    "adcx 8(%[t]), %%r13\n\t"
+    "mulx %%r14, %%r14, %%r9\n\t"
+    "adox %%r10, %%r14\n\t"
+    "adcx 16(%[t]), %%r14\n\t"
+    "mulx %%r15, %%r15, %%r10\n\t"
+    "adox %%r9, %%r15\n\t"
+    "adcx 24(%[t]), %%r15\n\t"
+    "adox %%r11, %%r10\n\t"
+    "adcx %%r11, %%r10\n\t"
+    "imulq $38, %%r10, %%r10\n\t"
+    "addq %%r10, %%r12\n\t"
+    "adcq %%r11, %%r13\n\t"
+    "adcq %%r11, %%r14\n\t"
+    "adcq %%r11, %%r15\n\t"
+    "sbbq %%r10, %%r10\n\t"
+    "andq $38, %%r10\n\t"
+    "addq %%r10, %%r12\n\t"
+    "movq %%r12, 0(%[r])\n\t"
+    "movq %%r13, 8(%[r])\n\t"
+    "movq %%r14, 16(%[r])\n\t"
+    "movq %%r15, 24(%[r])\n\t"
+    :
+    : [r] "r" (r), [a] "r" (a), [t] "r" (t)
+    : "rax", "rcx", "rdx", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "cc", "memory"
+  );
+}
+
+/* r = a + b, adding 38 for a carry out of the top limb (twice, as that can carry again) */
+static void fe_add(fe r,const fe a,const fe b)
+{
+  __asm__ __volatile__(
+    "movq 0(%[a]), %%r8\n\t"
+    "movq 8(%[a]), %%r9\n\t"
+    "movq 16(%[a]), %%r10\n\t"
+    "movq 24(%[a]), %%r11\n\t"
+    "addq 0(%[b]), %%r8\n\t"
+    "adcq 8(%[b]), %%r9\n\t"
+    "adcq 16(%[b]), %%r10\n\t"
+    "adcq 24(%[b]), %%r11\n\t"
+    "sbbq %%rdx, %%rdx\n\t"
+    "andq $38, %%rdx\n\t"
+    "addq %%rdx, %%r8\n\t"
+    "adcq $0, %%r9\n\t"
+    "adcq $0, %%r10\n\t"
+    "adcq $0, %%r11\n\t"
+    "sbbq %%rdx, %%rdx\n\t"
+    "andq $38, %%rdx\n\t"
+    "addq %%rdx, %%r8\n\t"
+    "movq %%r8, 0(%[r])\n\t"
+    "movq %%r9, 8(%[r])\n\t"
+    "movq %%r10, 16(%[r])\n\t"
+    "movq %%r11, 24(%[r])\n\t"
+    :
+    : [r] "r" (r), [a] "r" (a), [b] "r" (b)
+    : "rdx", "r8", "r9", "r10", "r11", "cc", "memory"
+  );
+}
+
+/* r = a - b, subtracting 38 for a borrow */
+static void fe_sub(fe r,const fe a,const fe b)
+{
+  __asm__ __volatile__(
+    "movq 0(%[a]), %%r8\n\t"
+    "movq 8(%[a]), %%r9\n\t"
+    "movq 16(%[a]), %%r10\n\t"
+    "movq 24(%[a]), %%r11\n\t"
+    "subq 0(%[b]), %%r8\n\t"
+    "sbbq 8(%[b]), %%r9\n\t"
+    "sbbq 16(%[b]), %%r10\n\t"
+    "sbbq 24(%[b]), %%r11\n\t"
+    "sbbq %%rdx, %%rdx\n\t"
+    "andq $38, %%rdx\n\t"
+    "subq %%rdx, %%r8\n\t"
+    "sbbq $0, %%r9\n\t"
+    "sbbq $0, %%r10\n\t"
+    "sbbq $0, %%r11\n\t"
+    "sbbq %%rdx, %%rdx\n\t"
+    "andq $38, %%rdx\n\t"
+    "subq %%rdx, %%r8\n\t"
+    "movq %%r8, 0(%[r])\n\t"
+    "movq %%r9, 8(%[r])\n\t"
+    "movq %%r10, 16(%[r])\n\t"
+    "movq %%r11, 24(%[r])\n\t"
+    :
+    : [r] "r" (r), [a] "r" (a), [b] "r" (b)
+    : "rdx", "r8", "r9", "r10", "r11", "cc", "memory"
+  );
+}
+
+/* r = 121665 * a */
+static void fe_mul121665(fe r,const fe a)
+{
+  __asm__ __volatile__(
+    "movq $121665, %%rdx\n\t"
+    "mulx 0(%[a]), %%r8, %%r12\n\t"
+    "mulx 8(%[a]), %%r9, %%r13\n\t"
+    "mulx 16(%[a]), %%r10, %%r14\n\t"
+    "mulx 24(%[a]), %%r11, %%r15\n\t"
+    "addq %%r12, %%r9\n\t"
+    "adcq %%r13, %%r10\n\t"
+    "adcq %%r14, %%r11\n\t"
+    "adcq $0, %%r15\n\t"
+    "imulq $38, %%r15, %%r15\n\t"
+    "addq %%r15, %%r8\n\t"
+    "adcq $0, %%r9\n\t"
+    "adcq $0, %%r10\n\t"
+    "adcq $0, %%r11\n\t"
+    "sbbq %%rdx, %%rdx\n\t"
+    "andq $38, %%rdx\n\t"
+    "addq %%rdx, %%r8\n\t"
+    "movq %%r8, 0(%[r])\n\t"
+    "movq %%r9, 8(%[r])\n\t"
+    "movq %%r10, 16(%[r])\n\t"
+    "movq %%r11, 24(%[r])\n\t"
+    :
+    : [r] "r" (r), [a] "r" (a)
+    : "rdx", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "cc", "memory"
+  );
+}
+
+static void fe_cswap(fe a,fe b,uint64_t swap)
+{
+  uint64_t mask = 0 - swap;
+  uint64_t t;
+  int i;
+
+  for (i = 0;i < 4;++i) {
+    t = mask & (a[i] ^ b[i]);
+    a[i] ^= t;
+    b[i] ^= t;
+  }
+}
+
+static void fe_sqn(fe r,const fe a,int n)
+{
+  fe_sq(r,a);
+  while (--n > 0) fe_sq(r,r);
+}
+
+/* z^(p - 2) */
+static void fe_invert(fe r,const fe z)
+{
+  fe t0;
+  fe t1;
+  fe t2;
+  fe t3;
+
+  fe_sqn(t0,z,1);
+  fe_sqn(t1,t0,2);
+  fe_mul(t1,z,t1);
+  fe_mul(t0,t0,t1);
+  fe_sqn(t2,t0,1);
+  fe_mul(t1,t1,t2);
+  fe_sqn(t2,t1,5);
+  fe_mul(t1,t2,t1);
+  fe_sqn(t2,t1,10);
+  fe_mul(t2,t2,t1);
+  fe_sqn(t3,t2,20);
+  fe_mul(t2,t3,t2);
+  fe_sqn(t2,t2,10);
+  fe_mul(t1,t2,t1);
+  fe_sqn(t2,t1,50);
+  fe_mul(t2,t2,t1);
+  fe_sqn(t3,t2,100);
+  fe_mul(t2,t3,t2);
+  fe_sqn(t2,t2,50);
+  fe_mul(t1,t2,t1);
+  fe_sqn(t1,t1,5);
+  fe_mul(r,t1,t0);
+}
+
+static void fe_frombytes(fe r,const unsigned char *s)
+{
+  int i;
+  int j;
+
+  for (i = 0;i < 4;++i) {
+    r[i] = 0;
+    for (j = 7;j >= 0;--j) r[i] = (r[i] << 8) | s[8 * i + j];
+  }
+  r[3] &= 0x7fffffffffffffffULL;
+}
+
+/* reduces below 2^255 - 19: fold bit 255 in, then subtract p if adding 19 reaches 2^255 */
+static void fe_tobytes(unsigned char *s,const fe a)
+{
+  fe r;
+  fe t;
+  uint128 c;
+  uint64_t mask;
+  int i;
+
+  c = (uint128) (a[3] >> 63) * 19;
+  for (i = 0;i < 4;++i) {
+    c += (i == 3) ? (a[3] & 0x7fffffffffffffffULL) : a[i];
+    r[i] = (uint64_t) c;
+    c >>= 64;
+  }
+  c = 19;
+  for (i = 0;i < 4;++i) {
+    c += r[i];
+    t[i] = (uint64_t) c;
+    c >>= 64;
+  }
+  mask = 0 - (t[3] >> 63);
+  t[3] &= 0x7fffffffffffffffULL;
+  for (i = 0;i < 4;++i) r[i] = (t[i] & mask) | (r[i] & ~mask);
+
+  for (i = 0;i < 32;++i) s[i] = (unsigned char) (r[i / 8] >> (8 * (i % 8)));
+}
+
+int crypto_scalarmult(unsigned char *q,const unsigned char *n,const unsigned char *p)
+{
+  unsigned char e[32];
+  fe x1;
+  fe x2;
+  fe z2;
+  fe x3;
+  fe z3;
+  fe a;
+  fe aa;
+  fe b;
+  fe bb;
+  fe c;
+  fe d;
+  fe da;
+  fe cb;
+  uint64_t swap = 0;
+  uint64_t bit;
+  int i;
+  int pos;
+
+  for (i = 0;i < 32;++i) e[i] = n[i];
+  e[0] &= 248;
+  e[31] &= 127;
+  e[31] |= 64;
+
+  fe_frombytes(x1,p);
+  for (i = 0;i < 4;++i) {
+    x2[i] = (i == 0);
+    z2[i] = 0;
+    x3[i] = x1[i];
+    z3[i] = (i == 0);
+  }
+
+  for (pos = 254;pos >= 0;--pos) {
+    bit = (e[pos >> 3] >> (pos & 7)) & 1;
+    swap ^= bit;
+    fe_cswap(x2,x3,swap);
+    fe_cswap(z2,z3,swap);
+    swap = bit;
+
+    fe_add(a,x2,z2);
+    fe_sq(aa,a);
+    fe_sub(b,x2,z2);
+    fe_sq(bb,b);
+    fe_sub(x2,aa,bb);
+    fe_add(c,x3,z3);
+    fe_sub(d,x3,z3);
+    fe_mul(da,d,a);
+    fe_mul(cb,c,b);
+    fe_add(x3,da,cb);
+    fe_sq(x3,x3);
+    fe_sub(z3,da,cb);
+    fe_sq(z3,z3);
+    fe_mul(z3,z3,x1);
+    fe_mul121665(z2,x2);
+    fe_add(z2,z2,aa);
+    fe_mul(z2,z2,x2);
+    fe_mul(x2,aa,bb);
+  }
+  fe_cswap(x2,x3,swap);
+  fe_cswap(z2,z3,swap);
+
+  fe_invert(z2,z2);
+  fe_mul(x2,x2,z2);
+  fe_tobytes(q,x2);
+  return 0;
+}
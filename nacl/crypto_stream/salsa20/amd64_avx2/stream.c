@@ -0,0 +1,163 @@
+/*
+crypto_stream/salsa20/amd64_avx2
+CurveDNS Project
+Public domain.
+
+Salsa20 with two blocks in each 256-bit register, one in each half, the
+state kept as its four diagonals so that the rounds need no transposes:
+a = (x0,x5,x10,x15), b = (x4,x9,x14,x3), c = (x8,x13,x2,x7) and
+d = (x12,x1,x6,x11). Four such pairs (512 bytes) are computed at once to
+hide the latency of the rounds, the tail of the stream with as few pairs
+as it needs. Needs a CPU with AVX2.
+*/
+
+#include <immintrin.h>
+#include "crypto_stream.h"
+
+#define AVX2 __attribute__((target("avx2")))
+
+typedef unsigned int uint32;
+typedef unsigned long long uint64;
+
+#define ROTATE(x,n) _mm256_or_si256(_mm256_slli_epi32(x,n),_mm256_srli_epi32(x,32 - (n)))
+
+/* a column round, and with b and d swapped (and rotated) a row round */
+#define QUARTERROUND(a,b,c,d) \
+  b = _mm256_xor_si256(b,ROTATE(_mm256_add_epi32(a,d),7)); \
+  c = _mm256_xor_si256(c,ROTATE(_mm256_add_epi32(b,a),9)); \
+  d = _mm256_xor_si256(d,ROTATE(_mm256_add_epi32(c,b),13)); \
+  a = _mm256_xor_si256(a,ROTATE(_mm256_add_epi32(d,c),18));
+
+static uint32 load32(const unsigned char *x)
+{
+  return (uint32) x[0] | ((uint32) x[1] << 8) | ((uint32) x[2] << 16) | ((uint32) x[3] << 24);
+}
+
+/* c = m ^ (the 64 bytes of lo, hi), of which only the first len */
+static inline AVX2 void store64(unsigned char *c,const unsigned char *m,unsigned long long len,__m256i lo,__m256i hi)
+{
+  unsigned char block[64];
+  unsigned long long i;
+
+  if (len >= 64) {
+    if (m) {
+      lo = _mm256_xor_si256(lo,_mm256_loadu_si256((const __m256i *) m));
+      hi = _mm256_xor_si256(hi,_mm256_loadu_si256((const __m256i *) (m + 32)));
+    }
+    _mm256_storeu_si256((__m256i *) c,lo);
+    _mm256_storeu_si256((__m256i *) (c + 32),hi);
+    return;
+  }
+
+  _mm256_storeu_si256((__m256i *) block,lo);
+  _mm256_storeu_si256((__m256i *) (block + 32),hi);
+  if (m)
+    for (i = 0;i < len;++i) c[i] = m[i] ^ block[i];
+  else
+    for (i = 0;i < len;++i) c[i] = block[i];
+}
+
+/* the first len (at most 128 * pairs) bytes of blocks counter, counter + 1, ... */
+static inline __attribute__((always_inline)) AVX2 void blocks(unsigned char *c,const unsigned char *m,unsigned long long len,uint64 counter,const uint32 *x,int pairs)
+{
+  __m256i a[4], b[4], cc[4], d[4];
+  __m256i b0[4], c0[4];
+  __m256i a0 = _mm256_setr_epi32(x[0],x[5],x[10],x[15],x[0],x[5],x[10],x[15]);
+  __m256i d0 = _mm256_setr_epi32(x[12],x[1],x[6],x[11],x[12],x[1],x[6],x[11]);
+  __m256i ad, cb, ba, dc, r0, r1, r2, r3;
+  uint64 u, v;
+  int i, j;
+
+  for (j = 0;j < pairs;++j) {
+    u = counter + 2 * j;
+    v = u + 1;
+    b0[j] = _mm256_setr_epi32(x[4],u >> 32,x[14],x[3],x[4],v >> 32,x[14],x[3]);
+    c0[j] = _mm256_setr_epi32(u,x[13],x[2],x[7],v,x[13],x[2],x[7]);
+    a[j] = a0; b[j] = b0[j]; cc[j] = c0[j]; d[j] = d0;
+  }
+
+  for (i = 0;i < 20;i += 2)
+    for (j = 0;j < pairs;++j) {
+      QUARTERROUND(a[j],b[j],cc[j],d[j])
+      b[j] = _mm256_shuffle_epi32(b[j],0x93);
+      cc[j] = _mm256_shuffle_epi32(cc[j],0x4e);
+      d[j] = _mm256_shuffle_epi32(d[j],0x39);
+      QUARTERROUND(a[j],d[j],cc[j],b[j])
+      b[j] = _mm256_shuffle_epi32(b[j],0x39);
+      cc[j] = _mm256_shuffle_epi32(cc[j],0x4e);
+      d[j] = _mm256_shuffle_epi32(d[j],0x93);
+    }
+
+  for (j = 0;j < pairs;++j) {
+    a[j] = _mm256_add_epi32(a[j],a0);
+    b[j] = _mm256_add_epi32(b[j],b0[j]);
+    cc[j] = _mm256_add_epi32(cc[j],c0[j]);
+    d[j] = _mm256_add_epi32(d[j],d0);
+
+    /* back from diagonals to the rows x0..x3, x4..x7, x8..x11, x12..x15 */
+    ad = _mm256_blend_epi32(a[j],d[j],0xaa);
+    cb = _mm256_blend_epi32(cc[j],b[j],0xaa);
+    ba = _mm256_blend_epi32(b[j],a[j],0xaa);
+    dc = _mm256_blend_epi32(d[j],cc[j],0xaa);
+    r0 = _mm256_blend_epi32(ad,cb,0xcc);
+    r1 = _mm256_blend_epi32(ba,dc,0xcc);
+    r2 = _mm256_blend_epi32(cb,ad,0xcc);
+    r3 = _mm256_blend_epi32(dc,ba,0xcc);
+
+    store64(c,m,len,_mm256_permute2x128_si256(r0,r1,0x20),_mm256_permute2x128_si256(r2,r3,0x20));
+    if (len <= 64) return;
+    c += 64; if (m) m += 64; len -= 64;
+    store64(c,m,len,_mm256_permute2x128_si256(r0,r1,0x31),_mm256_permute2x128_si256(r2,r3,0x31));
+    if (len <= 64) return;
+    c += 64; if (m) m += 64; len -= 64;
+  }
+}
+
+static AVX2 void salsa20(unsigned char *c,const unsigned char *m,unsigned long long len,const unsigned char *n,const unsigned char *k)
+{
+  static const unsigned char sigma[16] = "expand 32-byte k";
+  uint32 x[16];
+  uint64 counter = 0;
+  int i;
+
+  x[0] = load32(sigma);
+  x[5] = load32(sigma + 4);
+  x[10] = load32(sigma + 8);
+  x[15] = load32(sigma + 12);
+  for (i = 0;i < 4;++i) x[1 + i] = load32(k + 4 * i);
+  for (i = 0;i < 4;++i) x[11 + i] = load32(k + 16 + 4 * i);
+  x[6] = load32(n);
+  x[7] = load32(n + 4);
+
+  while (len >= 512) {
+    blocks(c,m,512,counter,x,4);
+    c += 512; if (m) m += 512; len -= 512;
+    counter += 8;
+  }
+
+  if (len > 384) blocks(c,m,len,counter,x,4);
+  else if (len > 256) blocks(c,m,len,counter,x,3);
+  else if (len > 128) blocks(c,m,len,counter,x,2);
+  else if (len) blocks(c,m,len,counter,x,1);
+}
+
+int crypto_stream(
+        unsigned char *c,unsigned long long clen,
+  const unsigned char *n,
+  const unsigned char *k
+)
+{
+  salsa20(c,0,clen,n,k);
+  return 0;
+}
+
+int crypto_stream_xor(
+        unsigned char *c,
+  const unsigned char *m,unsigned long long mlen,
+  const unsigned char *n,
+  const unsigned char *k
+)
+{
+  salsa20(c,m,mlen,n,k);
+  return 0;
+}
@@ -0,0 +1,170 @@
+/*
+crypto_stream/salsa20/amd64_avx512
+CurveDNS Project
+Public domain.
+
+Salsa20 with four blocks in each 512-bit register, one in each 128-bit
+lane, the state kept as its four diagonals so that the rounds need no
+transposes: a = (x0,x5,x10,x15), b = (x4,x9,x14,x3), c = (x8,x13,x2,x7)
+and d = (x12,x1,x6,x11). The rotations are single instructions. Four such
+quads (1024 bytes) are computed at once to hide the latency of the rounds,
+the tail of the stream with as few quads as it needs. Needs a CPU with
+AVX-512F.
+*/
+
+#include <immintrin.h>
+#include "crypto_stream.h"
+
+#define AVX512 __attribute__((target("avx512f")))
+
+typedef unsigned int uint32;
+typedef unsigned long long uint64;
+
+/* a column round, and with b and d swapped (and rotated) a row round */
+#define QUARTERROUND(a,b,c,d) \
+  b = _mm512_xor_si512(b,_mm512_rol_epi32(_mm512_add_epi32(a,d),7)); \
+  c = _mm512_xor_si512(c,_mm512_rol_epi32(_mm512_add_epi32(b,a),9)); \
+  d = _mm512_xor_si512(d,_mm512_rol_epi32(_mm512_add_epi32(c,b),13)); \
+  a = _mm512_xor_si512(a,_mm512_rol_epi32(_mm512_add_epi32(d,c),18));
+
+static uint32 load32(const unsigned char *x)
+{
+  return (uint32) x[0] | ((uint32) x[1] << 8) | ((uint32) x[2] << 16) | ((uint32) x[3] << 24);
+}
+
+/* c = m ^ block, of which only the first len bytes */
+static inline AVX512 void store64(unsigned char *c,const unsigned char *m,unsigned long long len,__m512i block)
+{
+  unsigned char b[64];
+  unsigned long long i;
+
+  if (len >= 64) {
+    if (m) block = _mm512_xor_si512(block,_mm512_loadu_si512((const void *) m));
+    _mm512_storeu_si512((void *) c,block);
+    return;
+  }
+
+  _mm512_storeu_si512((void *) b,block);
+  if (m)
+    for (i = 0;i < len;++i) c[i] = m[i] ^ b[i];
+  else
+    for (i = 0;i < len;++i) c[i] = b[i];
+}
+
+/* the first len (at most 256 * quads) bytes of blocks counter, counter + 1, ... */
+static inline __attribute__((always_inline)) AVX512 void blocks(unsigned char *c,const unsigned char *m,unsigned long long len,uint64 counter,const uint32 *x,int quads)
+{
+  __m512i a[4], b[4], cc[4], d[4];
+  __m512i b0[4], c0[4];
+  __m512i a0 = _mm512_setr_epi32(x[0],x[5],x[10],x[15],x[0],x[5],x[10],x[15],x[0],x[5],x[10],x[15],x[0],x[5],x[10],x[15]);
+  __m512i d0 = _mm512_setr_epi32(x[12],x[1],x[6],x[11],x[12],x[1],x[6],x[11],x[12],x[1],x[6],x[11],x[12],x[1],x[6],x[11]);
+  __m512i ad, cb, ba, dc, r0, r1, r2, r3, t0, t1, t2, t3;
+  uint64 u;
+  int i, j;
+
+  for (j = 0;j < quads;++j) {
+    u = counter + 4 * j;
+    b0[j] = _mm512_setr_epi32(x[4],u >> 32,x[14],x[3],x[4],(u + 1) >> 32,x[14],x[3],
+                              x[4],(u + 2) >> 32,x[14],x[3],x[4],(u + 3) >> 32,x[14],x[3]);
+    c0[j] = _mm512_setr_epi32(u,x[13],x[2],x[7],u + 1,x[13],x[2],x[7],
+                              u + 2,x[13],x[2],x[7],u + 3,x[13],x[2],x[7]);
+    a[j] = a0; b[j] = b0[j]; cc[j] = c0[j]; d[j] = d0;
+  }
+
+  for (i = 0;i < 20;i += 2)
+    for (j = 0;j < quads;++j) {
+      QUARTERROUND(a[j],b[j],cc[j],d[j])
+      b[j] = _mm512_shuffle_epi32(b[j],(_MM_PERM_ENUM) 0x93);
+      cc[j] = _mm512_shuffle_epi32(cc[j],(_MM_PERM_ENUM) 0x4e);
+      d[j] = _mm512_shuffle_epi32(d[j],(_MM_PERM_ENUM) 0x39);
+      QUARTERROUND(a[j],d[j],cc[j],b[j])
+      b[j] = _mm512_shuffle_epi32(b[j],(_MM_PERM_ENUM) 0x39);
+      cc[j] = _mm512_shuffle_epi32(cc[j],(_MM_PERM_ENUM) 0x4e);
+      d[j] = _mm512_shuffle_epi32(d[j],(_MM_PERM_ENUM) 0x93);
+    }
+
+  for (j = 0;j < quads;++j) {
+    a[j] = _mm512_add_epi32(a[j],a0);
+    b[j] = _mm512_add_epi32(b[j],b0[j]);
+    cc[j] = _mm512_add_epi32(cc[j],c0[j]);
+    d[j] = _mm512_add_epi32(d[j],d0);
+
+    /* back from diagonals to the rows x0..x3, x4..x7, x8..x11, x12..x15 */
+    ad = _mm512_mask_blend_epi32(0xaaaa,a[j],d[j]);
+    cb = _mm512_mask_blend_epi32(0xaaaa,cc[j],b[j]);
+    ba = _mm512_mask_blend_epi32(0xaaaa,b[j],a[j]);
+    dc = _mm512_mask_blend_epi32(0xaaaa,d[j],cc[j]);
+    r0 = _mm512_mask_blend_epi32(0xcccc,ad,cb);
+    r1 = _mm512_mask_blend_epi32(0xcccc,ba,dc);
+    r2 = _mm512_mask_blend_epi32(0xcccc,cb,ad);
+    r3 = _mm512_mask_blend_epi32(0xcccc,dc,ba);
+
+    /* and from rows of four blocks to four blocks of rows */
+    t0 = _mm512_shuffle_i32x4(r0,r1,0x44);
+    t1 = _mm512_shuffle_i32x4(r0,r1,0xee);
+    t2 = _mm512_shuffle_i32x4(r2,r3,0x44);
+    t3 = _mm512_shuffle_i32x4(r2,r3,0xee);
+
+    store64(c,m,len,_mm512_shuffle_i32x4(t0,t2,0x88));
+    if (len <= 64) return;
+    c += 64; if (m) m += 64; len -= 64;
+    store64(c,m,len,_mm512_shuffle_i32x4(t0,t2,0xdd));
+    if (len <= 64) return;
+    c += 64; if (m) m += 64; len -= 64;
+    store64(c,m,len,_mm512_shuffle_i32x4(t1,t3,0x88));
+    if (len <= 64) return;
+    c += 64; if (m) m += 64; len -= 64;
+    store64(c,m,len,_mm512_shuffle_i32x4(t1,t3,0xdd));
+    if (len <= 64) return;
+    c += 64; if (m) m += 64; len -= 64;
+  }
+}
+
+static AVX512 void salsa20(unsigned char *c,const unsigned char *m,unsigned long long len,const unsigned char *n,const unsigned char *k)
+{
+  static const unsigned char sigma[16] = "expand 32-byte k";
+  uint32 x[16];
+  uint64 counter = 0;
+  int i;
+
+  x[0] = load32(sigma);
+  x[5] = load32(sigma + 4);
+  x[10] = load32(sigma + 8);
+  x[15] = load32(sigma + 12);
+  for (i = 0;i < 4;++i) x[1 + i] = load32(k + 4 * i);
+  for (i = 0;i < 4;++i) x[11 + i] = load32(k + 16 + 4 * i);
+  x[6] = load32(n);
+  x[7] = load32(n + 4);
+
+  while (len >= 1024) {
+    blocks(c,m,1024,counter,x,4);
+    c += 1024; if (m) m += 1024; len -= 1024;
+    counter += 16;
+  }
+
+  if (len > 768) blocks(c,m,len,counter,x,4);
+  else if (len > 512) blocks(c,m,len,counter,x,3);
+  else if (len > 256) blocks(c,m,len,counter,x,2);
+  else if (len) blocks(c,m,len,counter,x,1);
+}
+
+int crypto_stream(
+        unsigned char *c,unsigned long long clen,
+  const unsigned char *n,
+  const unsigned char *k
+)
+{
+  salsa20(c,0,clen,n,k);
+  return 0;
+}
+
+int crypto_stream_xor(
+        unsigned char *c,
+  const unsigned char *m,unsigned long long mlen,
+  const unsigned char *n,
+  const unsigned char *k
+)
+{
+  salsa20(c,m,mlen,n,k);
+  return 0;
+}
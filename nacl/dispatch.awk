@@ -0,0 +1,90 @@
+# nacl/dispatch.awk
+# CurveDNS Project
+# Public domain.
+#
+# Writes the dispatcher of a primitive marked dispatch. Input: the prototypes
+# of the operation this primitive implements. The file impls lists the
+# implementations that passed, fastest first: one per line, its name, its
+# directory and the CPU features (nacl/cpuid/cpufeatures.h) it needs.
+
+BEGIN {
+  while ((getline line < "impls") > 0) {
+    k = split(line, w, " ")
+    ++n
+    impl[n] = w[1]
+    dir[n] = w[2]
+    need[n] = ""
+    for (j = 3; j <= k; ++j)
+      need[n] = need[n] (j > 3 ? "|" : "") "CPUFEATURES_" toupper(w[j])
+  }
+}
+
+{
+  line = $0
+  sub(/^extern /, "", line)
+  sub(/\);.*$/, "", line)
+  i = index(line, "(")
+  head = substr(line, 1, i - 1)
+  k = split(head, w, " ")
+  ++f
+  args[f] = substr(line, i + 1)
+  type[f] = substr(head, 1, length(head) - length(w[k]) - 1)
+  suffix[f] = substr(w[k], length(o) + 1)
+}
+
+END {
+  # until the constructor ran: the fastest one that needs nothing special
+  initial = n
+  for (i = n; i >= 1; --i)
+    if (need[i] == "") initial = i
+
+  print "#include \"cpufeatures.h\""
+  print ""
+  for (i = 1; i <= n; ++i)
+    for (j = 1; j <= f; ++j)
+      print "extern " type[j] " " impl[i] suffix[j] "(" args[j] ");"
+
+  for (j = 1; j <= f; ++j) {
+    k = split(args[j], a, ",")
+    params = ""
+    call = ""
+    for (i = 1; i <= k; ++i) {
+      params = params (i > 1 ? "," : "") a[i] " a" i
+      call = call (i > 1 ? "," : "") "a" i
+    }
+    print ""
+    print "static " type[j] " (*" opi suffix[j] "_pointer)(" args[j] ") = " impl[initial] suffix[j] ";"
+    print ""
+    print type[j] " " opi suffix[j] "(" params ")"
+    print "{"
+    print "  return " opi suffix[j] "_pointer(" call ");"
+    print "}"
+  }
+
+  print ""
+  print "const char *" opi "_selected = \"" dir[initial] "\";"
+  print ""
+  print "#ifdef __GNUC__"
+  print "static void " opi "_init(void) __attribute__((constructor));"
+  print "#endif"
+  print ""
+  print "static void " opi "_init(void)"
+  print "{"
+  print "  unsigned int features = cpufeatures();"
+  for (i = 1; i <= n; ++i) {
+    print ""
+    if (need[i] == "") {
+      for (j = 1; j <= f; ++j)
+        print "  " opi suffix[j] "_pointer = " impl[i] suffix[j] ";"
+      print "  " opi "_selected = \"" dir[i] "\";"
+      break
+    }
+    print "  if ((features & (" need[i] ")) == (" need[i] ")) {"
+    for (j = 1; j <= f; ++j)
+      print "    " opi suffix[j] "_pointer = " impl[i] suffix[j] ";"
+    print "    " opi "_selected = \"" dir[i] "\";"
+    print "    return;"
+    print "  }"
+  }
+  print "}"
+}
@@ -0,0 +1,107 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#include "pool.h"
+
+int pool_init(struct pool *pool, size_t size, int count) {
+	int i;
+
+	memset(pool, 0, sizeof(struct pool));
+
+	// Keep every object aligned:
+	pool->size = (size + 15) & ~((size_t) 15);
+	pool->count = count;
+
+	if (count > 0) {
+		pool->slab = (uint8_t *) malloc(pool->size * count);
+		if (!pool->slab) {
+			debug_log(DEBUG_ERROR, "pool_init(): unable to allocate %zu bytes\n", pool->size * count);
+			return 0;
+		}
+	}
+	pool->slabend = pool->slab + pool->size * count;
+
+	// Link all objects, the first one ends up in front (this touches every
+	// page, so they are really there when we need them):
+	for (i = count - 1; i >= 0; i--) {
+		*((void **) (pool->slab + i * pool->size)) = pool->free;
+		pool->free = pool->slab + i * pool->size;
+	}
+
+	debug_log(DEBUG_DEBUG, "pool_init(): allocated %d objects of %zu bytes\n", count, pool->size);
+
+	return 1;
+}
+
+void *pool_get(struct pool *pool) {
+	void *object = pool->free;
+
+	if (!object) {
+		pool->fallbacks++;
+		return malloc(pool->size);
+	}
+
+	pool->free = *((void **) object);
+	if (++pool->used > pool->peak)
+		pool->peak = pool->used;
+
+	return object;
+}
+
+void pool_put(struct pool *pool, void *object) {
+	if (!object)
+		return;
+
+	if (((uint8_t *) object < pool->slab) || ((uint8_t *) object >= pool->slabend)) {
+		free(object);
+		return;
+	}
+
+	*((void **) object) = pool->free;
+	pool->free = object;
+	pool->used--;
+}
+
+void pool_stats(struct pool *pool, const char *name, int worker) {
+	debug_log(DEBUG_FATAL, "pool_stats(): worker %d: %s: %d of %d in use (peak %d), %lu allocated outside of pool\n",
+			worker, name, pool->used, pool->count, pool->peak, pool->fallbacks);
+}
+
+void pool_destroy(struct pool *pool) {
+	if (pool->slab)
+		free(pool->slab);
+	memset(pool, 0, sizeof(struct pool));
+}
@@ -0,0 +1,97 @@
+/* 
+ * Copyright 2010 CurveDNS Project. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice, this list of
+ *      conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *       of conditions and the following disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY CurveDNS Project ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL CurveDNS Project OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * The views and conclusions contained in the software and documentation are those of the
+ * authors and should not be interpreted as representing official policies, either expressed
+ * or implied, of CurveDNS Project.
+ * 
+ */
+
+/*
+ * $Id$ 
+ * $Author$
+ * $Date$
+ * $Revision$
+ */
+
+#include "ring.h"
+
+// Sets up a ring of at least size slots (rounded up to a power of 2):
+int ring_init(struct ring *ring, unsigned int size) {
+	unsigned int slots = 2;
+
+	memset(ring, 0, sizeof(struct ring));
+	while (slots < size)
+		slots <<= 1;
+
+	ring->slots = (void **) calloc(slots, sizeof(void *));
+	if (!ring->slots) {
+		debug_log(DEBUG_ERROR, "ring_init(): unable to allocate %u slots\n", slots);
+		return 0;
+	}
+	ring->mask = slots - 1;
+
+	return 1;
+}
+
+// Producer: returns 0 when the ring is full
+int ring_push(struct ring *ring, void *ptr) {
+	unsigned int tail = ring->tail;
+
+	if (tail - ring->head_cache > ring->mask) {
+		ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (tail - ring->head_cache > ring->mask)
+			return 0;
+	}
+
+	ring->slots[tail & ring->mask] = ptr;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+// Consumer: returns NULL when the ring is empty
+void *ring_pop(struct ring *ring) {
+	unsigned int head = ring->head;
+	void *ptr;
+
+	if (head == ring->tail_cache) {
+		ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head == ring->tail_cache)
+			return NULL;
+	}
+
+	ptr = ring->slots[head & ring->mask];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return ptr;
+}
+
+// Either side, only a hint for the other one:
+int ring_empty(struct ring *ring) {
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+unsigned int ring_size(struct ring *ring) {
+	return ring->mask + 1;
+}